@@ -657,4 +657,10 @@ void bind_alert()
 		 .add_property("routing_table", &dht_stats_routing_table)
         ;
 
+    class_<deadline_miss_alert, bases<torrent_alert>, noncopyable>(
+       "deadline_miss_alert", no_init)
+        .def_readonly("piece_index", &deadline_miss_alert::piece_index)
+        .def_readonly("late_by", &deadline_miss_alert::late_by)
+        ;
+
 }
@@ -106,6 +106,7 @@ void bind_peer_info()
         .def_readonly("send_quota", &peer_info::send_quota)
         .def_readonly("receive_quota", &peer_info::receive_quota)
         .def_readonly("rtt", &peer_info::rtt)
+        .def_readonly("estimated_bdp", &peer_info::estimated_bdp)
         .def_readonly("num_pieces", &peer_info::num_pieces)
         .def_readonly("download_rate_peak", &peer_info::download_rate_peak)
         .def_readonly("upload_rate_peak", &peer_info::upload_rate_peak)
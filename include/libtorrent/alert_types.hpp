@@ -2277,12 +2277,37 @@ namespace libtorrent
 	};
 
 
+	// posted when a piece with a deadline (see torrent_handle::set_piece_deadline())
+	// is not expected to be downloaded in time. The prediction is based on
+	// the queue depth and download rate of the peers its blocks are requested
+	// from. It's posted at most once per piece and deadline, and only while
+	// the torrent is picking time critical pieces (once per second).
+	struct TORRENT_EXPORT deadline_miss_alert: torrent_alert
+	{
+		// internal
+		deadline_miss_alert(aux::stack_allocator& alloc, torrent_handle const& h
+			, int index, int late);
+
+		TORRENT_DEFINE_ALERT(deadline_miss_alert, 84);
+
+		static const int static_category = alert::status_notification;
+		virtual std::string message() const;
+
+		// the piece whose deadline is expected to be missed
+		int piece_index;
+
+		// the number of milliseconds past the deadline the piece is expected
+		// to complete. If the deadline has already passed, this is how late
+		// the piece is so far
+		int late_by;
+	};
+
 #undef TORRENT_DEFINE_ALERT_IMPL
 #undef TORRENT_DEFINE_ALERT
 #undef TORRENT_DEFINE_ALERT_PRIO
 #undef TORRENT_CLONE
 
-	enum { num_alert_types = 84 };
+	enum { num_alert_types = 85 };
 }
 
 #endif
@@ -163,10 +163,13 @@ namespace libtorrent
 
 #if !defined(TORRENT_DISABLE_ENCRYPTION) && !defined(TORRENT_DISABLE_EXTENSIONS)
 		virtual int hit_send_barrier(std::vector<asio::mutable_buffer>& iovec);
+		virtual void attach_send_crypto(socket_job& j);
+		virtual bool attach_recv_crypto(socket_job& j);
 #endif
 		
 		virtual void get_specific_peer_info(peer_info& p) const;
 		virtual bool in_handshake() const;
+		virtual bool supports_fast() const { return m_supports_fast; }
 		bool packet_finished() const { return m_recv_buffer.packet_finished(); }
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
@@ -294,8 +297,17 @@ namespace libtorrent
 
 		// helper to cut down on boilerplate
 		void rc4_decrypt(char* pos, int len);
+
+		// returns true if the negotiated stream cipher may be run on the
+		// network thread pool for this connection
+		bool can_offload_crypto() const;
 #endif
 
+		// sets up the receive buffer for the next message, once the
+		// current one has been handled
+		void start_next_packet();
+		void on_have_run(buffer::const_interval recv_buffer);
+
 public:
 
 		// these functions encrypt the send buffer if m_rc4_encrypted
@@ -328,7 +340,11 @@ private:
 
 			// handshake complete
 			read_packet_size,
-			read_packet
+			read_packet,
+
+			// the current packet is a run of complete HAVE messages
+			// (see start_next_packet())
+			read_have_run
 		};
 		
 #if !defined(TORRENT_DISABLE_ENCRYPTION) && !defined(TORRENT_DISABLE_EXTENSIONS)
@@ -411,6 +427,23 @@ private:
 		// encryption/decryption during the entire session.
 		encryption_handler m_enc_handler;
 
+		// these are set while the negotiated RC4 handler is installed in
+		// m_enc_handler for the respective direction. RC4 transforms the
+		// stream in-place, without any framing, so in that state it may be
+		// run on the network threads instead (see can_offload_crypto())
+		bool m_rc4_send;
+		bool m_rc4_recv;
+
+		// buffers that have passed the send barrier, but are still to be
+		// encrypted by m_send_crypto. They are encrypted by the network
+		// thread as part of the next write job
+		boost::shared_ptr<crypto_plugin> m_send_crypto;
+		std::vector<asio::mutable_buffer> m_send_crypto_vec;
+
+		// the number of bytes at the front of the unprocessed receive data
+		// that have already been decrypted by the network thread
+		int m_predecrypted_bytes;
+
 		// (outgoing only) synchronize verification constant with
 		// remote peer, this will hold rc4_decrypt(vc). Destroyed
 		// after the sync step.
@@ -219,6 +219,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_USE_IFADDRS 1
 #define TORRENT_USE_POSIX_MEMALIGN 1
 #define TORRENT_HAVE_FDATASYNC 1
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0)
+# define TORRENT_USE_MMSG 1
+#endif
 #endif // ANDROID
 
 #if __amd64__ || __i386__
@@ -506,6 +509,11 @@ int snprintf(char* buf, int len, char const* fmt, ...)
 #define TORRENT_USE_MLOCK 1
 #endif
 
+// if recvmmsg() exists, we assume sendmmsg() does as well
+#ifndef TORRENT_USE_MMSG
+#define TORRENT_USE_MMSG 0
+#endif
+
 // if preadv() exists, we assume pwritev() does as well
 #ifndef TORRENT_USE_PREADV
 #define TORRENT_USE_PREADV 0
@@ -92,6 +92,11 @@ namespace libtorrent
 		kind_t kind;
 
 		bool need_readback;
+
+		// true if this is a read cache piece that has been requested again
+		// since it was first read in, i.e. it's in the list of frequently
+		// used pieces (and less likely to be evicted)
+		bool frequently_used;
 	};
 	
 	// this struct holds a number of statistics counters
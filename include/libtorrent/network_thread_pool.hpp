@@ -42,6 +42,7 @@ namespace libtorrent
 
 	class peer_connection;
 	class buffer;
+	struct crypto_plugin;
 
 	struct socket_job
 	{
@@ -50,7 +51,8 @@ namespace libtorrent
 		enum job_type_t
 		{
 			read_job = 0,
-			write_job
+			write_job,
+			decrypt_job
 		};
 
 		job_type_t type;
@@ -62,6 +64,14 @@ namespace libtorrent
 		int buf_size;
 		boost::array<asio::mutable_buffer, 2> read_vec;
 
+		// used for write and decrypt jobs. If set, the buffers in
+		// crypto_vec are transformed in-place by this plugin on the network
+		// thread. For write jobs this happens before the data is handed to
+		// the socket. For decrypt jobs, buf_size is the number of bytes that
+		// were received and the peer is notified once they're decrypted
+		boost::shared_ptr<crypto_plugin> crypto;
+		std::vector<asio::mutable_buffer> crypto_vec;
+
 		boost::shared_ptr<peer_connection> peer;
 		// defined in session_impl.cpp
 		~socket_job();
@@ -36,11 +36,14 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_PE_CRYPTO_HPP_INCLUDED
 
 #include "libtorrent/config.hpp"
+#include <boost/cstdint.hpp>
 
-// RC4 state from libtomcrypt
+// RC4 state from libtomcrypt. The permutation is stored as 32 bit words
+// rather than bytes, since that's significantly faster to index and
+// swap on most CPUs
 struct rc4 {
 	int x, y;
-	unsigned char buf[256];
+	boost::uint32_t buf[256];
 };
 
 void TORRENT_EXTRA_EXPORT rc4_init(const unsigned char* in, unsigned long len, rc4 *state);
@@ -105,6 +108,19 @@ namespace libtorrent
 			return m_dec_handler.get() == NULL;
 		}
 
+		// if all outgoing data currently passes through a single plugin,
+		// with no pending switch, returns it. Otherwise returns NULL
+		boost::shared_ptr<crypto_plugin> steady_send_crypto() const
+		{
+			if (m_send_barriers.size() != 1
+				|| m_send_barriers.front().next != INT_MAX)
+				return boost::shared_ptr<crypto_plugin>();
+			return m_send_barriers.front().enc_handler;
+		}
+
+		boost::shared_ptr<crypto_plugin> const& recv_crypto() const
+		{ return m_dec_handler; }
+
 	private:
 		struct barrier
 		{
@@ -116,6 +132,10 @@ namespace libtorrent
 		};
 		std::list<barrier> m_send_barriers;
 		boost::shared_ptr<crypto_plugin> m_dec_handler;
+
+		// scratch iovec for decrypt(). It's kept around to avoid a heap
+		// allocation for every chunk received on an encrypted connection
+		std::vector<asio::mutable_buffer> m_recv_iovec;
 	};
 
 	struct TORRENT_EXTRA_EXPORT rc4_handler : crypto_plugin
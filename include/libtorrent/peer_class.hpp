@@ -80,6 +80,13 @@ namespace libtorrent
 		// exceed 255.
 		int upload_priority;
 		int download_priority;
+
+		// the congestion controller to use for uTP connections to peers in
+		// this class, one of settings_pack::utp_congestion_control_t. -1 means
+		// the ``utp_congestion_control`` setting applies. If a peer belongs to
+		// more than one class that sets a controller, the first class it was
+		// added to wins.
+		int utp_congestion_control;
 	};
 
 	struct TORRENT_EXTRA_EXPORT peer_class : boost::enable_shared_from_this<peer_class>
@@ -89,6 +96,7 @@ namespace libtorrent
 		peer_class(std::string const& label)
 			: ignore_unchoke_slots(false)
 			, connection_limit_factor(100)
+			, utp_congestion_control(-1)
 			, label(label)
 			, references(1)
 		{
@@ -109,6 +117,9 @@ namespace libtorrent
 		bool ignore_unchoke_slots;
 		int connection_limit_factor;
 
+		// the uTP congestion controller for peers in this class, or -1
+		int utp_congestion_control;
+
 		// priority for bandwidth allocation
 		// in rate limiter. One for upload and one
 		// for download
@@ -93,6 +93,7 @@ namespace libtorrent
 	struct disk_io_job;
 	struct disk_interface;
 	struct torrent_peer;
+	struct socket_job;
 
 #ifndef TORRENT_DISABLE_EXTENSIONS
 	struct peer_plugin;
@@ -106,12 +107,23 @@ namespace libtorrent
 	struct pending_block
 	{
 		pending_block(piece_block const& b)
-			: block(b), send_buffer_offset(not_in_buffer), not_wanted(false)
-			, timed_out(false), busy(false)
+			: block(b), request_time(min_time()), queued_ahead(0)
+			, send_buffer_offset(not_in_buffer)
+			, not_wanted(false), timed_out(false), busy(false)
 		{}
 
 		piece_block block;
 
+		// the time the request for this block left the send buffer, or
+		// min_time() if it hasn't yet. Used to time the block round-trip
+		time_point request_time;
+
+		// the number of our requests to this peer that were still
+		// outstanding ahead of this one when it left the send buffer. The
+		// peer has to send those blocks first, so only blocks with none
+		// ahead of them are used as round-trip samples
+		int queued_ahead;
+
 		enum { not_in_buffer = 0x1fffffff };
 
 		// the number of bytes into the send buffer this request is. Every time
@@ -327,6 +339,15 @@ namespace libtorrent
 
 		void send_allowed_set();
 
+		// adds a piece to the allowed fast set of this peer, on top of the
+		// ones from send_allowed_set(). Used to offer pieces that are in our
+		// read cache. The set is capped at twice allowed_fast_set_size
+		void send_allowed_fast(int piece);
+
+		// drops the pieces added by send_allowed_fast() that are no longer
+		// in the read cache. ``cached`` is sorted
+		void withdraw_allowed_fast(std::vector<int> const& cached);
+
 #ifndef TORRENT_DISABLE_EXTENSIONS
 		void add_extension(boost::shared_ptr<peer_plugin>);
 		peer_plugin const* find_plugin(char const* type);
@@ -387,6 +408,14 @@ namespace libtorrent
 		// this adds an announcement in the announcement queue
 		// it will let the peer know that we have the given piece
 		void announce_piece(int index);
+
+		// writes the HAVE messages held back by announce_piece(), if
+		// batch_have_messages is enabled
+		void send_pending_haves();
+
+		// drops a HAVE for the piece that's still held back. Returns true if
+		// there was one, i.e. the peer hasn't been told we have the piece
+		bool cancel_pending_have(int index);
 		
 		// this will tell the peer to announce the given piece
 		// and only allow it to request that piece
@@ -438,6 +467,9 @@ namespace libtorrent
 		// bytes as if they've been requested
 		time_duration download_queue_time(int extra_bytes = 0) const;
 
+		// the highest download payload rate we've seen from this peer
+		int download_rate_peak() const { return m_download_rate_peak; }
+
 		bool is_interesting() const { return m_interesting; }
 		bool is_choked() const { return m_choked; }
 
@@ -524,6 +556,11 @@ namespace libtorrent
 
 		bool failed() const { return m_failed; }
 
+		// the estimated bandwidth-delay product of the connection, in bytes.
+		// i.e. the number of bytes we need to have requested to keep the peer
+		// busy sending to us. 0 until we have round-trip samples
+		int estimated_bdp() const;
+
 		int desired_queue_size() const
 		{
 			// this peer is in end-game mode we only want
@@ -574,6 +611,10 @@ namespace libtorrent
 		void incoming_interested();
 		void incoming_not_interested();
 		void incoming_have(int piece_index);
+		// a run of HAVE messages received together. The piece picker is
+		// updated once for all of them. The new pieces are collected on the
+		// stack, so runs should be kept short (a few hundred)
+		void incoming_haves(int const* indices, int num);
 		void incoming_dont_have(int piece_index);
 		void incoming_bitfield(bitfield const& bits);
 		void incoming_request(peer_request const& r);
@@ -642,6 +683,10 @@ namespace libtorrent
 		// speaks our protocol (be it bittorrent or http).
 		virtual bool in_handshake() const = 0;
 
+		// true if the peer speaks the fast extension (BEP 6), i.e. it
+		// understands ALLOWED_FAST, SUGGEST and REJECT messages
+		virtual bool supports_fast() const { return false; }
+
 		// returns the block currently being
 		// downloaded. And the progress of that
 		// block. If the peer isn't downloading
@@ -770,6 +815,16 @@ namespace libtorrent
 
 		virtual int hit_send_barrier(std::vector<asio::mutable_buffer>& iovec) { return INT_MAX; }
 
+		// these are called right before a write job is posted to the
+		// network thread pool, and when a read job has completed,
+		// respectively. They let a connection have its stream cipher applied
+		// to the job's buffers on the network thread rather than on the main
+		// thread. attach_recv_crypto() is passed a decrypt job whose buffers
+		// hold the received bytes. If it returns true, the job is posted and
+		// the data is processed once on_receive_data_decrypted() is called
+		virtual void attach_send_crypto(socket_job&) {}
+		virtual bool attach_recv_crypto(socket_job&) { return false; }
+
 		bool allocate_disk_receive_buffer(int disk_buffer_size);
 
 		// if allow_encrypted is false, and the torrent 'ih' turns out
@@ -782,6 +837,9 @@ namespace libtorrent
 
 		void update_desired_queue_size();
 
+		// records the round-trip time for a block that was just received
+		void sample_block_rtt(pending_block const& b, time_point now);
+
 		// called from the main loop when this connection has any
 		// work to do.
 		void on_send_data(error_code const& error
@@ -794,6 +852,10 @@ namespace libtorrent
 		void on_receive_data_nb(error_code const& error
 			, std::size_t bytes_transferred);
 
+		// called once a decrypt job posted to the network thread pool has
+		// completed. See attach_recv_crypto()
+		void on_receive_data_decrypted(std::size_t bytes_transferred);
+
 		void receive_data_impl(error_code const& error
 			, std::size_t bytes_transferred, int read_loops);
 
@@ -907,6 +969,14 @@ namespace libtorrent
 		// receive a payload message after it has been requested.
 		sliding_average<20> m_request_time;
 
+		// the time from a request leaving our send buffer until its block
+		// arrives, in milliseconds, for requests that had none of our other
+		// requests to this peer ahead of them. Unlike m_request_time, this
+		// excludes the time requests spend queued up behind our own requests
+		// at the peer. Samples taken while we stopped reading from the
+		// socket (because the disk couldn't keep up) are not included
+		sliding_average<20> m_block_rtt;
+
 		// keep the io_service running as long as we
 		// have peer connections
 		io_service::work m_work;
@@ -946,6 +1016,15 @@ namespace libtorrent
 		// http://blog.libtorrent.org/2011/11/block-request-time-outs/
 		time_point m_requested;
 
+		// the time m_min_block_rtt was last set. After min_rtt_window seconds
+		// the next sample replaces it, to follow route changes
+		time_point m_min_block_rtt_time;
+
+		// the last time the download channel stopped waiting for the disk.
+		// Blocks requested before this have been held up by us, and are not
+		// used as round-trip samples
+		time_point m_disk_unblocked;
+
 		// a timestamp when the remote download rate
 		// was last updated
 		time_point m_remote_dl_update;
@@ -1017,6 +1096,10 @@ namespace libtorrent
 		// for one of the pieces from the allowed-fast set
 		std::vector<boost::uint16_t> m_accept_fast_piece_cnt;
 
+		// the pieces in m_accept_fast that were added by send_allowed_fast()
+		// because they were in the read cache
+		std::vector<int> m_cached_accept_fast;
+
 		// the pieces the peer will send us if
 		// requested (regardless of choke state)
 		std::vector<int> m_allowed_fast;
@@ -1025,6 +1108,10 @@ namespace libtorrent
 		// downloaded from this peer
 		std::vector<int> m_suggested_pieces;
 
+		// pieces we have announced, but not yet sent HAVE messages
+		// for. See send_pending_haves()
+		std::vector<int> m_pending_haves;
+
 		// the time when this peer last saw a complete copy
 		// of this torrent
 		time_t m_last_seen_complete;
@@ -1122,6 +1209,12 @@ namespace libtorrent
 		// stop sending data after this many bytes, INT_MAX = inf
 		int m_send_barrier;
 
+		// the smallest block round-trip time seen recently, in milliseconds,
+		// or -1 if we haven't timed any block yet. This is the latency to the
+		// peer without our own requests queued up there, and is what the
+		// request pipeline is sized by. See estimated_bdp()
+		int m_min_block_rtt;
+
 		// the number of request we should queue up
 		// at the remote end.
 		boost::uint16_t m_desired_queue_size;
@@ -1240,6 +1333,11 @@ namespace libtorrent
 		// other peers to compare it to.
 		bool m_exceeded_limit:1;
 
+		// this is true while a decrypt job for this connection is
+		// outstanding in the network thread pool. The receive buffer must
+		// not be freed until it has completed
+		bool m_decrypting:1;
+
 		template <class Handler, std::size_t Size>
 		struct allocating_handler
 		{
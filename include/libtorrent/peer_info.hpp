@@ -278,6 +278,14 @@ namespace libtorrent
 		// typically a function of download speed)
 		int target_dl_queue_length;
 
+		// the estimated bandwidth-delay product of the connection, in bytes.
+		// This is the download rate times the shortest recent round-trip time
+		// for a block request (plus its jitter). When
+		// ``settings_pack::bdp_request_queue`` is enabled, the request queue
+		// (target_dl_queue_length) is sized to twice this. 0 until a few
+		// blocks have been received.
+		int estimated_bdp;
+
 		// the number of piece-requests we have received from this peer
 		// that we haven't answered with a piece yet.
 		int upload_queue_length;
@@ -86,6 +86,12 @@ namespace libtorrent
 			interesting_piece_picks,
 			hash_fail_piece_picks,
 
+			// redundant requests for busy blocks made in end-game mode, and
+			// the times we didn't make one because the peers already
+			// downloading the blocks were expected to deliver them sooner
+			end_game_duplicate_requests,
+			end_game_duplicates_declined,
+
 			// these counters indicate which parts
 			// of the piece picker CPU is spent in
 			piece_picker_partial_loops,
@@ -97,6 +103,11 @@ namespace libtorrent
 			piece_picker_rand_loops,
 			piece_picker_busy_loops,
 
+			// the number of pieces picked because they are adjacent to a
+			// downloading piece, rather than in plain rarest first order
+			// (prefer_adjacent_pieces)
+			piece_picker_adjacent_picks,
+
 			// reasons to disconnect peers
 			connect_timeouts,
 			uninteresting_peers,
@@ -172,6 +183,9 @@ namespace libtorrent
 			num_outgoing_metadata,
 			num_outgoing_extended,
 
+			num_outgoing_have_coalesced,
+			num_outgoing_have_suppressed,
+
 			num_piece_passed,
 			num_piece_failed,
 
@@ -197,6 +211,7 @@ namespace libtorrent
 			waste_piece_seed,
 			waste_piece_end_game,
 			waste_piece_closing,
+			cancelled_duplicate_bytes,
 
 			sent_payload_bytes,
 			sent_bytes,
@@ -247,6 +262,11 @@ namespace libtorrent
 			utp_payload_pkts_out,
 			utp_invalid_pkts_in,
 			utp_redundant_pkts_in,
+			utp_packet_pool_hits,
+			utp_packet_pool_misses,
+			utp_pmtu_cache_hits,
+			utp_pmtu_probe_failures,
+			utp_zero_copy_packets_in,
 
 			// the buffer sizes accepted by
 			// socket send calls. The larger
@@ -327,6 +347,9 @@ namespace libtorrent
 			num_loaded_torrents,
 			num_pinned_torrents,
 
+			// the number of bytes used by the piece pickers of all torrents
+			piece_picker_memory,
+
 			// these counter indices deliberatly
 			// match the order of socket type IDs
 			// defined in socket_type.hpp.
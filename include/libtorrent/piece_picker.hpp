@@ -44,6 +44,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <boost/static_assert.hpp>
 #include <boost/cstdint.hpp>
 #include <boost/tuple/tuple.hpp>
+#include <boost/unordered_map.hpp>
 
 #ifdef _MSC_VER
 #pragma warning(pop)
@@ -53,6 +54,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/config.hpp"
 #include "libtorrent/assert.hpp"
 #include "libtorrent/time.hpp"
+#include "libtorrent/bitfield.hpp"
 
 // this is really only useful for debugging unit tests
 //#define TORRENT_PICKER_LOG
@@ -73,7 +75,6 @@ namespace libtorrent
 
 	class torrent;
 	class peer_connection;
-	struct bitfield;
 	struct counters;
 
 	struct TORRENT_EXTRA_EXPORT piece_block
@@ -156,7 +157,10 @@ namespace libtorrent
 			// only expands pieces (when prefer contiguous blocks is set)
 			// within properly aligned ranges, not the largest possible
 			// range of pieces.
-			align_expanded_pieces = 64
+			align_expanded_pieces = 64,
+			// among equally rare pieces, prefer the ones adjacent to
+			// pieces being downloaded, to improve disk locality
+			prefer_adjacent = 128
 		};
 
 		struct downloading_piece
@@ -222,6 +226,10 @@ namespace libtorrent
 		void inc_refcount(int index, const void* peer);
 		void dec_refcount(int index, const void* peer);
 
+		// increases the peer count for the given pieces
+		// (is used when a run of HAVE messages is received)
+		void inc_refcount(std::vector<int> const& indices, const void* peer);
+
 		// increases the peer count for the given piece
 		// (is used when a BITFIELD message is received)
 		void inc_refcount(bitfield const& bitmask, const void* peer);
@@ -252,14 +260,16 @@ namespace libtorrent
 
 		// sets all pieces to dont-have
 		void init(int blocks_per_piece, int blocks_in_last_piece, int total_num_pieces);
-		int num_pieces() const { return int(m_piece_map.size()); }
+		int num_pieces() const
+		{ return m_compact_have.empty() ? int(m_piece_map.size()) : m_compact_have.size(); }
 
 		bool have_piece(int index) const;
 
 		bool is_downloading(int index) const
 		{
 			TORRENT_ASSERT(index >= 0);
-			TORRENT_ASSERT(index < int(m_piece_map.size()));
+			TORRENT_ASSERT(index < num_pieces());
+			if (is_compact()) return false;
 
 			piece_pos const& p = m_piece_map[index];
 			return p.downloading();
@@ -440,13 +450,35 @@ namespace libtorrent
 		int num_passed() const { return m_num_passed; }
 
 		// return true if we have all the pieces we wanted
-		bool is_finished() const { return m_num_have - m_num_have_filtered == int(m_piece_map.size()) - m_num_filtered; }
+		bool is_finished() const { return m_num_have - m_num_have_filtered == num_pieces() - m_num_filtered; }
 
-		bool is_seeding() const { return m_num_have == int(m_piece_map.size()); }
+		bool is_seeding() const { return m_num_have == num_pieces(); }
 
 		// the number of pieces we want and don't have
 		int num_want_left() const { return num_pieces() - m_num_have - m_num_filtered + m_num_have_filtered; }
 
+		// returns the number of bytes allocated by this piece picker
+		int memory_usage() const;
+
+		// frees the memory that's only used while downloading, as long as
+		// nothing is being downloaded. This is meant to be called once the
+		// torrent is finished, it grows back if it starts downloading again.
+		// Unless keep_availability is set, a finished picker is reduced
+		// to one bit per piece, whether we have it. This only works when
+		// the pieces we don't have are filtered and the ones we have are
+		// at the default priority. Availability isn't tracked in that
+		// mode, apart from the number of seeds.
+		void compact(bool keep_availability = false);
+
+		// true if compact() reduced the picker to a bitfield. The full
+		// state is rebuilt by expand(), or by any call that changes what
+		// we have or want (we_have(), we_dont_have(), set_piece_priority(),
+		// mark_as_downloading(), mark_as_finished()). Piece availability
+		// starts over from zero then, the owner is expected to add its
+		// peers back.
+		bool is_compact() const { return !m_compact_have.empty(); }
+		void expand();
+
 #if TORRENT_USE_INVARIANT_CHECKS
 		void check_piece_state() const;
 		// used in debug mode
@@ -492,6 +524,20 @@ namespace libtorrent
 
 		bool can_pick(int piece, bitfield const& bitmask) const;
 		bool is_piece_free(int piece, bitfield const& bitmask) const;
+
+		// returns true if one of the pieces next to 'piece' is being
+		// downloaded, or is in 'picked'
+		bool next_to_downloading(int piece, std::vector<int> const& picked) const;
+
+		// fills in 'positions' with the indices into m_pieces, in the range
+		// [begin, end), of the free pieces in 'bitmask', in m_pieces order.
+		// Returns false (leaving num_positions alone) if 'bitmask' has more
+		// than max_scan_pieces free pieces
+		bool free_piece_positions(bitfield const& bitmask, int begin, int end
+			, int* positions, int& num_positions) const;
+
+		// updates the bit for 'index' in m_want_mask
+		void update_want_mask(int index);
 		std::pair<int, int> expand_piece(int piece, int whole_pieces
 			, bitfield const& have, int options) const;
 
@@ -501,7 +547,7 @@ namespace libtorrent
 			piece_pos(int peer_count_, int index_)
 				: peer_count(peer_count_)
 				, download_state(piece_pos::piece_open)
-				, piece_priority(4)
+				, piece_priority(default_priority)
 				, index(index_)
 			{
 				TORRENT_ASSERT(peer_count_ >= 0);
@@ -613,7 +659,9 @@ namespace libtorrent
 			// 7 is high priority
 			boost::uint32_t piece_priority : 3;
 
-			// index in to the piece_info vector
+			// index in to the piece_info vector. When optimizing for memory
+			// usage, this is what limits the number of pieces, to make
+			// piece_pos fit in 32 bits
 #if TORRENT_OPTIMIZE_MEMORY_USAGE
 			boost::uint32_t index : 17;
 #else
@@ -631,12 +679,14 @@ namespace libtorrent
 				// piece. There is no entry for the piece in the
 				// buckets if this is the case.
 #if TORRENT_OPTIMIZE_MEMORY_USAGE
-				we_have_index = 0x3ffff,
+				we_have_index = 0x1ffff,
 #else
 				we_have_index = 0xffffffff,
 #endif
 				// the priority value that means the piece is filtered
 				filter_priority = 0,
+				// the priority pieces start out with
+				default_priority = 4,
 				// the max number the peer count can hold
 #if TORRENT_OPTIMIZE_MEMORY_USAGE
 				max_peer_count = 0x1ff
@@ -724,6 +774,23 @@ namespace libtorrent
 
 		void update_pieces() const;
 
+		// brings m_pieces up to date by only moving the pieces in
+		// m_dirty_pieces. Returns false if there are too many of them, and
+		// m_pieces should be rebuilt instead
+		bool move_dirty_pieces() const;
+
+		// if m_pieces is dirty, this records that the position of 'index'
+		// in it may be stale and returns true. The caller must then leave
+		// m_pieces alone, it's fixed up by the next update_pieces()
+		bool defer_update(int index) const;
+
+		// marks m_pieces as dirty, where only the pieces in 'pieces' may be
+		// out of place
+		void set_dirty(bitfield const& pieces);
+
+		// marks m_pieces as dirty, where any piece may be out of place
+		void set_all_dirty();
+
 		// fills in the range [start, end) of pieces in
 		// m_pieces that have priority 'prio'
 		void priority_range(int prio, int* start, int* end);
@@ -743,6 +810,11 @@ namespace libtorrent
 		dlpiece_iter add_download_piece(int index);
 		void erase_download_piece(dlpiece_iter i);
 
+		// removes i from the m_downloads list for queue, by moving the last
+		// entry of the list into its place. The index entry for the removed
+		// piece is left for the caller to erase or update
+		void unlink_download_piece(int queue, dlpiece_iter i);
+
 		std::vector<downloading_piece>::const_iterator find_dl_piece(int queue, int index) const;
 		std::vector<downloading_piece>::iterator find_dl_piece(int queue, int index);
 
@@ -765,6 +837,11 @@ namespace libtorrent
 		// TODO: should this be allocated lazily?
 		mutable std::vector<piece_pos> m_piece_map;
 
+		// when compact() has reduced the picker to a bitfield, this has one
+		// bit per piece, set for the pieces we have. It's empty otherwise,
+		// and so are m_piece_map, m_pieces and the other per-piece vectors
+		bitfield m_compact_have;
+
 		// the number of seeds. These are not added to
 		// the availability counters of the pieces
 		int m_seeds;
@@ -782,16 +859,34 @@ namespace libtorrent
 		// 0, priority 1 starts at m_priority_boundries[0] etc.
 		mutable std::vector<int> m_priority_boundries;
 
+		// one bit per piece, set for pieces we don't have and that aren't
+		// filtered. The words have the same layout as the ones in a
+		// bitfield, to be able to intersect it with a peer's bitfield
+		// 32 pieces at a time.
+		std::vector<boost::uint32_t> m_want_mask;
+
+		// one bit per piece (with the same layout as m_want_mask), set for
+		// the pieces whose priority may have changed since m_pieces became
+		// dirty. Unless m_all_dirty is set, all other pieces are still in
+		// the right place and update_pieces() only needs to move these.
+		mutable std::vector<boost::uint32_t> m_dirty_pieces;
+
 		// each piece that's currently being downloaded has an entry in this list
 		// with block allocations. i.e. it says wich parts of the piece that is
-		// being downloaded. This list is ordered by piece index to make lookups
-		// efficient there are as many buckets as there are piece states. See
+		// being downloaded. The lists are not ordered, lookups go through
+		// m_dl_index. There are as many buckets as there are piece states. See
 		// piece_pos::state_t. The only download state that does not have a
 		// corresponding downloading_piece vector is piece_open and
 		// piece_downloading_reverse (the latter uses the same as
 		// piece_downloading).
 		std::vector<downloading_piece> m_downloads[piece_pos::num_download_categories];
 
+		// maps the index of every downloading piece to its position in the
+		// m_downloads list for its download_queue(). Pieces are appended to
+		// the lists and removed by moving the last entry into their slot, so
+		// finding a piece and moving it between states are both constant time
+		boost::unordered_map<int, int> m_dl_index;
+
 		// this holds the information of the blocks in partially downloaded
 		// pieces. the downloading_piece::info index point into this vector for
 		// its storage
@@ -841,6 +936,10 @@ namespace libtorrent
 		// if this is set to true, it means update_pieces()
 		// has to be called before accessing m_pieces.
 		mutable bool m_dirty;
+
+		// if this is set, m_dirty_pieces is not enough to bring m_pieces up
+		// to date, and update_pieces() has to rebuild it from scratch
+		mutable bool m_all_dirty;
 	public:
 
 #if TORRENT_OPTIMIZE_MEMORY_USAGE
@@ -96,6 +96,11 @@ struct receive_buffer
 
 	buffer::const_interval get() const;
 
+	// returns the bytes that have been received but not yet passed on to
+	// the upper layer, i.e. the ones following pos(). This is empty while
+	// receiving into a disk buffer
+	buffer::const_interval peek() const;
+
 #if !defined(TORRENT_DISABLE_ENCRYPTION) && !defined(TORRENT_DISABLE_EXTENSIONS)
 	// returns the entire regular buffer
 	// should only be used during the handshake
@@ -104,6 +109,10 @@ struct receive_buffer
 	void mutable_buffers(std::vector<boost::asio::mutable_buffer>& vec, int bytes);
 #endif
 
+	// returns the buffers holding the next 'bytes' read from the socket,
+	// i.e. the ones handed out by reserve(), before received() is called
+	void pending_buffers(std::vector<boost::asio::mutable_buffer>& vec, int bytes);
+
 	void free_disk_buffer()
 	{
 		m_disk_recv_buffer.reset();
@@ -250,6 +259,10 @@ struct crypto_receive_buffer
 
 	buffer::const_interval get() const;
 
+	// only forwards to the connection buffer when there's no crypto
+	// framing, otherwise returns an empty interval
+	buffer::const_interval peek() const;
+
 	bool can_recv_contiguous(int /*size*/) const
 	{
 		// TODO: Detect when the start of the next crpyto packet is aligned
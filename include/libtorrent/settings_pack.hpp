@@ -650,6 +650,39 @@ namespace libtorrent
 			// unlikely to matter anyway
 			auto_sequential,
 
+			// if true, HAVE messages for pieces we complete are not written to
+			// peers right away. They are held per peer and go out along with
+			// the next message written to it, or on its next second tick at
+			// the latest. When downloading quickly from many peers, this turns
+			// a burst of 9 byte writes per peer into a single one. HAVEs for
+			// pieces the peer has received in the meantime are dropped (unless
+			// send_redundant_have is set).
+			batch_have_messages,
+
+			// when true, the number of outstanding block requests to a peer is
+			// sized by the bandwidth-delay product of the connection, estimated
+			// from the download rate and the shortest recent round-trip time of
+			// a block request that wasn't queued behind our other requests to
+			// the same peer. This lets the queue grow as long as
+			// the peer keeps up and stop growing once its upload capacity is
+			// saturated, regardless of the latency. It also stops growing while
+			// the disk write queue is above ``max_queued_disk_bytes``.
+			// ``request_queue_time`` is only used until the first block has
+			// been timed. When false (the default), the queue is always
+			// ``request_queue_time`` seconds worth of the download rate.
+			bdp_request_queue,
+
+			// when true, the piece picker prefers, among the rarest pieces
+			// a peer has, the ones adjacent to pieces that are already being
+			// downloaded (and whose blocks may still be in the write cache)
+			// or were just picked for the same peer. Rarity always comes
+			// first, this only breaks ties between equally rare pieces. On
+			// spinning disks this turns scattered writes into runs that
+			// can be coalesced by the disk cache. It has no effect in
+			// sequential mode, or for peers where whole pieces are preferred,
+			// which already pick contiguous ranges of pieces.
+			prefer_adjacent_pieces,
+
 			max_bool_setting_internal,
 			num_bool_settings = max_bool_setting_internal - bool_type_base
 		};
@@ -810,7 +843,12 @@ namespace libtorrent
 			// * ``no_piece_suggestsions`` which is the default and will not send
 			//   out suggest messages.
 			// * ``suggest_read_cache`` which will send out suggest messages for
-			//   the most recent pieces that are in the read cache.
+			//   the hottest half of the pieces in the read cache. Pieces that
+			//   have been read more than once since they were cached rank
+			//   first, then the ones with the most blocks in the cache, then
+			//   the most recently used. Up to ``allowed_fast_set_size`` of the
+			//   hottest pieces are also added to the allowed fast set of choked
+			//   peers, so they can be served from the cache.
 			suggest_mode,
 
 			// ``max_queued_disk_bytes`` is the number maximum number of bytes, to
@@ -1512,6 +1550,21 @@ namespace libtorrent
 			// .. _i2p: http://www.i2p2.de
 			i2p_port,
 
+			// the congestion controller used by uTP connections, one of
+			// utp_congestion_control_t. This is the default for peers whose
+			// peer classes don't set one (see peer_class_info). It applies to
+			// new connections.
+			utp_congestion_control,
+
+			// the number of seconds a path MTU learned by a uTP connection is
+			// remembered for its destination network (a /24 for IPv4 and a /48
+			// for IPv6). New uTP connections to the same network start out with
+			// the cached MTU range instead of searching for it from scratch. The
+			// timeout starts when a connection raises the cached floor or lowers
+			// the cached ceiling, seeing the same sizes again doesn't extend it.
+			// Set to 0 to disable the cache.
+			utp_pmtu_cache_expiry,
+
 			max_int_setting_internal,
 
 			num_int_settings = max_int_setting_internal - int_type_base
@@ -1544,6 +1597,26 @@ namespace libtorrent
 			disable_os_cache = 2
 		};
 
+		// the congestion controllers available for uTP connections, for use
+		// with settings_pack::utp_congestion_control and peer classes
+		enum utp_congestion_control_t
+		{
+			// the delay based LEDBAT controller from BEP 29. It keeps the
+			// queuing delay at ``utp_target_delay`` and yields to other
+			// traffic. This is the default.
+			utp_ledbat = 0,
+
+			// a loss based controller following CUBIC. It fills links with a
+			// high bandwidth-delay product quickly, but competes with TCP on
+			// equal terms rather than yielding to it.
+			utp_cubic = 1,
+
+			// a rate based controller modeled after BBR. It sizes the
+			// congestion window to the estimated bottleneck bandwidth times the
+			// minimum round-trip time, and does not back off on random loss.
+			utp_bbr = 2
+		};
+
 		enum bandwidth_mixed_algo_t
 		{
 			// disables the mixed mode bandwidth balancing
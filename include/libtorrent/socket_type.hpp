@@ -206,6 +206,7 @@ namespace libtorrent
 		// this is only relevant for uTP connections
 		void set_close_reason(boost::uint16_t code);
 		boost::uint16_t get_close_reason();
+		void set_congestion_control(int type);
 
 		endpoint_type local_endpoint(error_code& ec) const;
 		endpoint_type remote_endpoint(error_code& ec) const;
@@ -101,12 +101,20 @@ namespace libtorrent
 	struct storage_interface;
 	class bt_peer_connection;
 	struct listen_socket_t;
+	struct cached_piece_info;
 
 
 	TORRENT_EXTRA_EXPORT void initialize_file_progress(
 		std::vector<boost::uint64_t>& file_progress
 		, piece_picker const& picker, file_storage const& fs);
 
+	// returns the hottest half (rounded up) of the cached pieces, the ones
+	// most likely to still be in the cache once a peer requests them. Pieces
+	// that have been read again since they were cached come first, then the
+	// ones with the most blocks in the cache, then the most recently used
+	TORRENT_EXTRA_EXPORT std::vector<int> hottest_cached_pieces(
+		std::vector<cached_piece_info> const& pieces);
+
 	namespace aux
 	{
 		struct piece_checker_data;
@@ -132,6 +140,9 @@ namespace libtorrent
 		int peers;
 		// the piece index
 		int piece;
+		// set once a deadline_miss_alert has been posted for the current
+		// deadline
+		bool miss_posted;
 #if TORRENT_DEBUG_STREAMING > 0
 		// the number of multiple requests are allowed
 		// to blocks still not downloaded (debugging only)
@@ -529,6 +540,10 @@ namespace libtorrent
 		// ============ end deprecation =============
 
 		void piece_availability(std::vector<int>& avail) const;
+
+		// the number of peers that have the piece. Like the function above,
+		// this doesn't count the virtual peers from the resume data
+		int real_availability(int index) const;
 		
 		void set_piece_priority(int index, int priority);
 		int piece_priority(int index) const;
@@ -654,6 +669,15 @@ namespace libtorrent
 		void update_want_scrape();
 		void update_gauge();
 
+		// updates the piece_picker_memory gauge with the memory used by
+		// this torrent's piece picker
+		void update_picker_memory();
+
+		// frees what the piece picker only needs while downloading. Unless
+		// piece availability is still needed (share mode and suggesting
+		// read cache pieces), this reduces it to a bitfield
+		void compact_picker();
+
 		bool try_connect_peer();
 		torrent_peer* add_peer(tcp::endpoint const& adr, int source, int flags = 0);
 		bool ban_peer(torrent_peer* tp);
@@ -831,6 +855,10 @@ namespace libtorrent
 		// when we get a have message, this is called for that piece
 		void peer_has(int index, peer_connection const* peer);
 
+		// when we get a run of have messages, this is called for the new
+		// pieces in it
+		void peer_has(std::vector<int> const& pieces, peer_connection const* peer);
+
 		// when we get a bitfield message, this is called for that piece
 		void peer_has(bitfield const& bits, peer_connection const* peer);
 
@@ -1172,6 +1200,15 @@ namespace libtorrent
 
 		void refresh_explicit_cache_impl(disk_io_job const* j, int cache_size);
 
+		// the availability loaded from resume data is represented in the
+		// piece picker by a number of virtual peers. These functions
+		// add them, remove the most recent one as real peers tell us
+		// what they have, and drop all of them when the picker is reset
+		void load_availability_prior(bdecode_node const& e);
+		bitfield availability_prior_bitfield(int level) const;
+		void decay_availability_prior();
+		void clear_availability_prior();
+
 		int prioritize_tracker(int tracker_index);
 		int deprioritize_tracker(int tracker_index);
 
@@ -1198,6 +1235,13 @@ namespace libtorrent
 		void remove_time_critical_pieces(std::vector<int> const& priority);
 		void request_time_critical_pieces();
 
+		// when the blocks of the piece that are requested are expected to
+		// have arrived, given where they are in the request queues of the
+		// peers they're requested from. Blocks that aren't requested yet,
+		// or are requested from peers we don't know the download rate of,
+		// count as arriving now
+		time_point predicted_completion(int piece, time_point now) const;
+
 		void need_policy();
 
 		// all time totals of uploaded and downloaded payload
@@ -1278,7 +1322,9 @@ namespace libtorrent
 		std::vector<announce_entry> m_trackers;
 		// this is an index into m_trackers
 
-		// this list is sorted by time_critical_piece::deadline
+		// this list is sorted by time_critical_piece::deadline before each
+		// round of request_time_critical_pieces(). set_piece_deadline() just
+		// appends or updates entries, the list may be out of order in between
 		std::vector<time_critical_piece> m_time_critical_pieces;
 
 		std::string m_trackerid;
@@ -1312,6 +1358,19 @@ namespace libtorrent
 		// peers. This vector is ordered, to make lookups fast.
 		std::vector<int> m_predictive_pieces;
 
+		// the number of virtual peers each piece is seeded with, based on
+		// the availability saved in the resume data. Virtual peer ``j``
+		// has every piece whose entry is greater than ``j``. Empty once
+		// all virtual peers have been removed. They only steer the piece
+		// picker. Anything reported to the client or used to pick pieces
+		// to suggest or cache goes through piece_availability() or
+		// real_availability(), which leave them out. Super seeding counts
+		// the peers' bitfields, and a seed never has virtual peers
+		std::vector<boost::uint8_t> m_availability_prior;
+
+		// the number of virtual peers still counted by the piece picker
+		int m_prior_peers;
+
 		// the performance counters of this session
 		counters& m_stats_counters;
 
@@ -1410,6 +1469,10 @@ namespace libtorrent
 		// set_error()
 		int m_error_file;
 
+		// the number of bytes this torrent's piece picker counts against
+		// the piece_picker_memory gauge
+		int m_picker_memory;
+
 		// the average time it takes to download one time critical piece
 		boost::uint32_t m_average_piece_time;
 
@@ -69,7 +69,13 @@ namespace libtorrent
 		udp_socket(io_service& ios);
 		~udp_socket();
 
-		enum flags_t { dont_drop = 1, peer_connection = 2, dont_queue = 4 };
+		// dont_batch sends the packet right away, even if the socket is
+		// corked. This is required for packets that depend on socket
+		// options set around the send() call. It doesn't overtake packets
+		// already waiting in the send batch, those are flushed first. If
+		// that would block, the packet fails with would_block too
+		enum flags_t { dont_drop = 1, peer_connection = 2, dont_queue = 4
+			, dont_batch = 8 };
 
 		bool is_open() const
 		{
@@ -90,6 +96,17 @@ namespace libtorrent
 
 		void send(udp::endpoint const& ep, char const* p, int len
 			, error_code& ec, int flags = 0);
+
+		// while corked, outgoing packets are held back and sent in
+		// batches once the last cork is released. This is a no-op on
+		// platforms without sendmmsg()
+		void cork_send();
+		void uncork_send();
+
+		// sends the packets waiting in the send batch right away. Returns
+		// false if the socket would block before all of them were sent
+		bool flush_send();
+
 		void bind(udp::endpoint const& ep, error_code& ec);
 		void close();
 		int local_port() const { return m_bind_port; }
@@ -107,6 +124,25 @@ namespace libtorrent
 
 		void set_buf_size(int s);
 
+		// reserve this many bytes in front of every packet received in a
+		// batch. An observer that takes over the buffer of a packet (see
+		// swap_receive_buffer()) may use them for its own bookkeeping
+		void set_receive_headroom(int n) { m_rx_headroom = n; }
+
+		// the size of the buffers packets are received into, including the
+		// headroom. 0 if packets aren't received into buffers of their own
+		int receive_buffer_size() const;
+
+		// may only be called from an observer's incoming_packet(). If the
+		// packet buf was received into a buffer of its own, that buffer is
+		// handed over to the caller in exchange for replacement, to receive
+		// subsequent packets into. The returned pointer is the start of the
+		// buffer, the headroom in front of buf. Both buffers are
+		// receive_buffer_size() bytes, allocated with malloc(). If the
+		// packet can't be handed over, NULL is returned and the caller
+		// keeps replacement
+		char* swap_receive_buffer(char const* buf, char* replacement);
+
 		template <class SocketOption>
 		void get_option(SocketOption const& opt, error_code& ec)
 		{
@@ -184,7 +220,19 @@ namespace libtorrent
 		void setup_read(udp::socket* s);
 		void on_read(error_code const& ec, udp::socket* s);
 		void on_read_impl(udp::socket* sock, udp::endpoint const& ep
-			, error_code const& e, std::size_t bytes_transferred);
+			, error_code const& e, char const* buf, std::size_t bytes_transferred);
+		void subscribe_writable(udp::socket* s);
+#if TORRENT_USE_MMSG
+		// gives the unit test control over GRO
+		friend struct udp_socket_test;
+
+		bool read_batch(udp::socket* s);
+		void flush_send_batch();
+		void enable_offload(udp::socket* s);
+		void disable_gro();
+		void free_receive_ring();
+		bool& gso_enabled(udp::socket* s);
+#endif
 		void on_name_lookup(error_code const& e, tcp::resolver::iterator i);
 		void on_connect_timeout(error_code const& ec);
 		void on_connected(error_code const& ec);
@@ -215,6 +263,76 @@ namespace libtorrent
 		int m_new_buf_size;
 		char* m_buf;
 
+#if TORRENT_USE_MMSG
+		// the max number of datagrams received or sent by a
+		// single recvmmsg() or sendmmsg() call
+		enum { mmsg_batch = 32 };
+
+		// the receive ring used by recvmmsg(). It's made up of
+		// m_mmsg_slots buffers, each with m_mmsg_headroom bytes reserved
+		// in front of m_mmsg_slot_size bytes of packet. The slot size
+		// follows m_buf_size, but the ring is only reallocated between
+		// batches, since observers may resize the buffer while we're
+		// dispatching packets out of it. The buffers are allocated
+		// separately, to allow observers to take them over
+		std::vector<char*> m_mmsg_bufs;
+		int m_mmsg_slot_size;
+		int m_mmsg_headroom;
+		int m_mmsg_slots;
+
+		// with GRO enabled, every slot is followed by a spill buffer for
+		// the part of a coalesced packet that doesn't fit in the slot. The
+		// slots themselves stay sized for a single packet, to be worth
+		// taking over. Each spill buffer has m_mmsg_slot_size bytes in
+		// front of the m_mmsg_spill_size bytes received into, to move the
+		// start of the packet to
+		std::vector<char*> m_mmsg_spill;
+		int m_mmsg_spill_size;
+
+		// while dispatching a packet that occupies a slot of its own, this
+		// is the packet and the index of its slot. Otherwise it's NULL
+		char const* m_dispatch_buf;
+		int m_dispatch_slot;
+
+		// outgoing packets sent while the socket is corked are held
+		// back here and sent with sendmmsg() once the last cork is
+		// released. The payloads are stored back-to-back in
+		// m_send_batch_buf
+		struct batched_packet
+		{
+			udp::socket* sock;
+			udp::endpoint ep;
+			int offset;
+			int len;
+		};
+		std::vector<batched_packet> m_send_batch;
+		std::vector<char> m_send_batch_buf;
+
+		// the number of outstanding cork_send() calls. on_read() corks
+		// the socket while dispatching received packets
+		int m_send_cork;
+
+		// true if the kernel supports UDP_SEGMENT on the IPv4 and IPv6
+		// socket respectively. Runs of equally sized packets to the same
+		// endpoint in the send batch are then handed to the kernel as a
+		// single super-packet to be segmented
+		bool m_v4_gso;
+#if TORRENT_USE_IPV6
+		bool m_v6_gso;
+#endif
+
+		// true if UDP_GRO is enabled on one of the sockets. The kernel may
+		// then coalesce received packets, which read_batch() splits up again
+		// before dispatching them. It requires larger receive slots
+		bool m_gro;
+
+		// set once recvmmsg() or sendmmsg() has turned out not to be
+		// supported. From then on packets are received one at a time into
+		// m_buf and sent right away. GRO is kept off, since those reads
+		// can't split coalesced packets
+		bool m_mmsg_unsupported;
+#endif
+
 #if TORRENT_USE_IPV6
 		udp::socket m_ipv6_sock;
 #endif
@@ -229,6 +347,7 @@ namespace libtorrent
 		proxy_settings m_proxy_settings;
 		tcp::resolver m_resolver;
 		char m_tmp_buf[270];
+		int m_rx_headroom;
 		bool m_queue_packets;
 		bool m_tunnel_packets;
 		bool m_force_proxy;
@@ -0,0 +1,131 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_UTP_CONGESTION_CONTROL_HPP_INCLUDED
+#define TORRENT_UTP_CONGESTION_CONTROL_HPP_INCLUDED
+
+#include "libtorrent/config.hpp"
+#include "libtorrent/time.hpp"
+#include <boost/cstdint.hpp>
+
+namespace libtorrent
+{
+	// the congestion window of a uTP socket, which is what the congestion
+	// controllers adjust. ``cwnd`` is a fixed point number with 16 bits
+	// fraction portion.
+	struct utp_cc_window
+	{
+		boost::int64_t cwnd;
+
+		// the slow-start threshold, in bytes. 0 means there is none yet
+		boost::int32_t ssthres;
+		bool slow_start;
+	};
+
+	// describes an incoming ACK that acknowledged new data
+	struct utp_cc_ack
+	{
+		time_point now;
+
+		// the number of payload bytes acknowledged by this ACK
+		int acked_bytes;
+
+		// the number of bytes in flight before this ACK was received
+		// and the number still in flight after it
+		int in_flight;
+		int bytes_in_flight;
+
+		// our one-way queuing delay, as measured by the delay base, and the
+		// round-trip time of the newest packet acknowledged. Both are in
+		// microseconds. ``rtt`` is 0 if there was no RTT sample
+		int delay;
+		int rtt;
+
+		int mtu;
+
+		// the utp_target_delay (in microseconds) and utp_gain_factor settings
+		int target_delay;
+		int gain_factor;
+	};
+
+	// the internal state of a controller, as recorded in the uTP log. Fields
+	// that don't apply to a controller are 0
+	struct utp_cc_status
+	{
+		// controller specific mode, e.g. BBR's startup, drain and probe
+		int mode;
+
+		// CUBIC's window size before the last loss event (bytes)
+		int w_max;
+
+		// BBR's estimated bottleneck bandwidth (bytes per second), minimum
+		// round-trip time (microseconds) and bandwidth-delay product (bytes)
+		int btl_bw;
+		int min_rtt;
+		int bdp;
+	};
+
+	// the interface for uTP congestion controllers. Each uTP socket owns one
+	// controller, which is one of settings_pack::utp_congestion_control_t.
+	// The socket keeps the window and calls into the controller to grow or
+	// shrink it.
+	struct TORRENT_EXTRA_EXPORT utp_congestion_control
+	{
+		virtual ~utp_congestion_control() {}
+
+		// one of settings_pack::utp_congestion_control_t
+		virtual int type() const = 0;
+
+		// called for every ACK that acknowledges new data
+		virtual void on_ack(utp_cc_window& w, utp_cc_ack const& ack) = 0;
+
+		// called when packet loss is detected. This is called at most once
+		// per round-trip. ``loss_multiplier`` is the utp_loss_multiplier
+		// setting
+		virtual void on_loss(utp_cc_window& w, int mtu, int loss_multiplier
+			, time_point now) = 0;
+
+		// called when the socket times out, after its window has been reset
+		virtual void on_timeout(utp_cc_window&, time_point) {}
+
+		virtual void status(utp_cc_status& st) const;
+	};
+
+	// returns a new controller of the specified type, one of
+	// settings_pack::utp_congestion_control_t. Unknown types fall back to
+	// LEDBAT. The caller owns the returned object
+	TORRENT_EXTRA_EXPORT utp_congestion_control* create_utp_congestion_control(
+		int type);
+}
+
+#endif
+
@@ -0,0 +1,135 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_UTP_SCOREBOARD_HPP_INCLUDED
+#define TORRENT_UTP_SCOREBOARD_HPP_INCLUDED
+
+#include "libtorrent/config.hpp"
+#include "libtorrent/assert.hpp"
+#include <boost/cstdint.hpp>
+#include <vector>
+
+namespace libtorrent
+{
+	// the send side scoreboard of a uTP socket. It has two bits per sequence
+	// number: whether the packet is in flight (sent and not acked yet) and
+	// whether it needs to be resent. This lets SACK processing, fast
+	// retransmits and resends skip over the sequence numbers they don't
+	// care about a word at a time, rather than looking up every packet in
+	// the send buffer.
+
+	// It's a circular bitmap indexed by the low bits of the sequence number.
+	// It grows to cover every sequence number that's in flight. Sequence
+	// numbers are 16 bits and wrap around.
+	class TORRENT_EXTRA_EXPORT utp_scoreboard
+	{
+	public:
+		enum bit_t { in_flight = 0, need_resend = 1 };
+
+		utp_scoreboard() : m_mask(-1) {}
+
+		// marks seq as in flight, and not needing a resend. ``first`` is the
+		// lowest sequence number that may still be in flight. The bitmap is
+		// grown to cover [first, seq] if necessary
+		void insert(int seq, int first);
+
+		// clears both bits of seq. It has been acked
+		void remove(int seq)
+		{
+			if (m_mask < 0) return;
+			int const idx = seq & m_mask;
+			boost::uint32_t const mask = ~(boost::uint32_t(1) << (idx & 31));
+			m_bits[(idx >> 5) * 2 + in_flight] &= mask;
+			m_bits[(idx >> 5) * 2 + need_resend] &= mask;
+		}
+
+		void set(bit_t b, int seq)
+		{
+			TORRENT_ASSERT(m_mask >= 0);
+			int const idx = seq & m_mask;
+			m_bits[(idx >> 5) * 2 + b] |= boost::uint32_t(1) << (idx & 31);
+		}
+
+		void clear(bit_t b, int seq)
+		{
+			if (m_mask < 0) return;
+			int const idx = seq & m_mask;
+			m_bits[(idx >> 5) * 2 + b] &= ~(boost::uint32_t(1) << (idx & 31));
+		}
+
+		bool test(bit_t b, int seq) const
+		{
+			if (m_mask < 0) return false;
+			int const idx = seq & m_mask;
+			return (m_bits[(idx >> 5) * 2 + b] & (boost::uint32_t(1) << (idx & 31))) != 0;
+		}
+
+		// returns the first sequence number in [first, last) (wrapping
+		// around at 16 bits) that has bit b set, or last if there is none.
+		// The range may not be larger than what the bitmap covers
+		int find_next(bit_t b, int first, int last) const;
+
+		// the number of sequence numbers the bitmap covers
+		int capacity() const { return m_mask + 1; }
+
+		// returns the index of the lowest set bit in v, which must not be 0
+		static int lowest_bit(boost::uint32_t v)
+		{
+			TORRENT_ASSERT(v != 0);
+#if defined __GNUC__
+			return __builtin_ctz(v);
+#else
+			int ret = 0;
+			if ((v & 0xffff) == 0) { v >>= 16; ret += 16; }
+			if ((v & 0xff) == 0) { v >>= 8; ret += 8; }
+			if ((v & 0xf) == 0) { v >>= 4; ret += 4; }
+			if ((v & 0x3) == 0) { v >>= 2; ret += 2; }
+			if ((v & 0x1) == 0) ret += 1;
+			return ret;
+#endif
+		}
+
+	private:
+
+		// the two bits of each group of 32 sequence numbers are stored next
+		// to each other. m_bits[n * 2 + b] holds bit b for sequence numbers
+		// n * 32 to n * 32 + 31 (modulo the capacity)
+		std::vector<boost::uint32_t> m_bits;
+
+		// the capacity minus one. The capacity is a power of 2. -1 means
+		// nothing has been allocated yet
+		int m_mask;
+	};
+}
+
+#endif
+
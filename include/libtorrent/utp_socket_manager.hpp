@@ -36,6 +36,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <map>
 
 #include "libtorrent/socket_type.hpp"
+#include "libtorrent/utp_socket_map.hpp"
 #include "libtorrent/session_status.hpp"
 #include "libtorrent/enum_net.hpp"
 #include "libtorrent/aux_/session_settings.hpp"
@@ -75,8 +76,22 @@ namespace libtorrent
 			, error_code& ec, int flags = 0);
 		void subscribe_writable(utp_socket_impl* s);
 
+		// make sure the socket is ticked no later than at time t. A socket
+		// that's already due earlier is left alone
+		void schedule_tick(utp_socket_impl* s, time_point t);
+
+		// hold back packets sent by a socket's send loop, to let the
+		// udp socket send them in a single batch
+		void cork_send() { m_sock.cork_send(); }
+		void uncork_send() { m_sock.uncork_send(); }
+
 		// internal, used by utp_stream
-		void remove_socket(boost::uint16_t id);
+		void remove_socket(utp_socket_impl* s);
+
+		// called by a socket when its remote endpoint is set, to file it
+		// under its new key
+		void socket_endpoint_changed(utp_socket_impl* s
+			, udp::endpoint const& old_ep);
 
 		utp_socket_impl* new_utp_socket(utp_stream* str);
 		int gain_factor() const { return m_sett.get_int(settings_pack::utp_gain_factor); }
@@ -87,12 +102,38 @@ namespace libtorrent
 		int connect_timeout() const { return m_sett.get_int(settings_pack::utp_connect_timeout); }
 		int min_timeout() const { return m_sett.get_int(settings_pack::utp_min_timeout); }
 		int loss_multiplier() const { return m_sett.get_int(settings_pack::utp_loss_multiplier); }
+		int congestion_control() const { return m_sett.get_int(settings_pack::utp_congestion_control); }
 		bool allow_dynamic_sock_buf() const { return m_sett.get_bool(settings_pack::utp_dynamic_sock_buf); }
 
 		void mtu_for_dest(address const& addr, int& link_mtu, int& utp_mtu);
+
+		// the path MTU cache. It remembers the largest packet size (uTP
+		// floor) sockets have had acked by a destination network, and the
+		// smallest one they've seen fail (ceiling). Each bound expires on its
+		// own and is only refreshed when a socket improves on it, so a
+		// lowered ceiling decays even while the network is in use. lookup
+		// returns false if there's no fresh entry for the network addr
+		// belongs to, and otherwise only sets the bounds that are fresh
+		bool pmtu_lookup(address const& addr, int& floor, int& ceiling);
+		void pmtu_confirm_floor(address const& addr, int floor);
+		void pmtu_lower_ceiling(address const& addr, int ceiling);
 		void set_sock_buf(int size);
 		int num_sockets() const { return m_utp_sockets.size(); }
 
+		// packet buffers are recycled across all uTP sockets, to avoid a
+		// malloc() and free() for every packet sent and received. The
+		// size passed to release_packet() must be the same as the one
+		// the buffer was allocated with
+		void* allocate_packet(int size);
+		void release_packet(void* p, int size);
+
+		// takes over the buffer the udp socket received the packet buf (of
+		// len bytes) into, instead of copying the packet out of it. The
+		// buffer starts the socket's receive headroom in front of buf, and
+		// is to be released with release_packet() with the size returned in
+		// size. Returns NULL if the buffer can't be taken over
+		void* adopt_receive_buffer(char const* buf, int len, int& size);
+
 		void defer_ack(utp_socket_impl* s);
 		void subscribe_drained(utp_socket_impl* s);
 
@@ -101,12 +142,31 @@ namespace libtorrent
 		void inc_stats_counter(int counter, int delta = 1);
 
 	private:
+		// gives the unit test access to the timer wheel
+		friend struct utp_socket_manager_test;
+
 		udp_socket& m_sock;
 		incoming_utp_callback_t m_cb;
 
-		// replace with a hash-map
-		typedef std::multimap<boost::uint16_t, utp_socket_impl*> socket_map_t;
-		socket_map_t m_utp_sockets;
+		// all uTP sockets, indexed by remote endpoint and receive
+		// connection ID
+		utp_socket_map m_utp_sockets;
+
+		void unschedule_tick(utp_socket_impl* s);
+
+		// sockets only need to be ticked when their timeout expires, or when
+		// they may have become ready to be deleted. Instead of visiting every
+		// socket on every tick, they're filed in this timer wheel by the time
+		// they're due. Each slot covers timer_wheel_resolution of time, and
+		// slot i holds the sockets due at wheel ticks congruent to i. Sockets
+		// due further out than one revolution are filed in the last slot of
+		// the wheel, and re-filed when it expires
+		std::vector<std::vector<utp_socket_impl*> > m_timer_wheel;
+
+		// the wheel tick of the next slot to expire. Wheel ticks count
+		// timer_wheel_resolution periods since m_wheel_epoch
+		boost::int64_t m_wheel_tick;
+		time_point m_wheel_epoch;
 
 		// this is a list of sockets that needs to send an ack.
 		// once the UDP socket is drained, all of these will
@@ -149,9 +209,38 @@ namespace libtorrent
 		// to now lower the buffer size
 		int m_sock_buf_size;
 
+		// a floor or ceiling of 0 means the bound isn't known
+		struct pmtu_entry
+		{
+			boost::uint16_t floor;
+			boost::uint16_t ceiling;
+			time_point floor_expires;
+			time_point ceiling_expires;
+		};
+
+		// returns the cache entry for the network addr belongs to, with its
+		// expired bounds cleared, or 0 if the cache is full
+		pmtu_entry* pmtu_entry_for(address const& addr, time_point now);
+
+		// path MTU cache, keyed by the destination network address (the
+		// remote address with its host bits cleared)
+		std::map<address, pmtu_entry> m_pmtu_cache;
+
 		// stats counters
 		counters& m_counters;
 
+		// free lists of packet buffers, one per size class. Small buffers
+		// hold headers and small payloads, the others are large enough
+		// for an MTU sized packet
+		std::vector<void*> m_small_packet_pool;
+		std::vector<void*> m_mtu_packet_pool;
+
+		// free list of buffers of the udp socket's receive buffer size,
+		// used to replace the receive buffers taken over by
+		// adopt_receive_buffer()
+		std::vector<void*> m_rx_packet_pool;
+		int m_rx_packet_size;
+
 		// this is  passed on to the instantiate connection
 		// if this is non-null it will create SSL connections over uTP
 		void* m_ssl_context;
@@ -0,0 +1,110 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_UTP_SOCKET_MAP_HPP_INCLUDED
+#define TORRENT_UTP_SOCKET_MAP_HPP_INCLUDED
+
+#include "libtorrent/config.hpp"
+#include "libtorrent/socket.hpp"
+#include "libtorrent/address.hpp"
+#include <boost/cstdint.hpp>
+#include <vector>
+
+namespace libtorrent
+{
+	struct utp_socket_impl;
+
+	// maps (remote endpoint, receive connection ID) to uTP sockets. This is
+	// an open addressing hash table with linear probing, used to find the
+	// socket an incoming packet belongs to in constant time regardless of
+	// how many sockets there are, and how many of them share the 16 bit
+	// connection ID.
+
+	// a key may map to more than one socket (sockets that haven't connected
+	// yet all have an unspecified endpoint), find() returns any one of them.
+	// Erased slots are left as tombstones, which makes it safe to erase
+	// slots while iterating over them by index.
+	class TORRENT_EXTRA_EXPORT utp_socket_map
+	{
+	public:
+		utp_socket_map();
+
+		utp_socket_impl* find(udp::endpoint const& ep, boost::uint16_t id) const;
+
+		void insert(udp::endpoint const& ep, boost::uint16_t id
+			, utp_socket_impl* s);
+
+		// removes the slot for s, which must have been inserted under
+		// this key. Returns false if it wasn't found
+		bool erase(udp::endpoint const& ep, boost::uint16_t id
+			, utp_socket_impl* s);
+
+		int size() const { return m_size; }
+		bool empty() const { return m_size == 0; }
+
+		// iterate over all slots. slot() returns NULL for empty slots.
+		// erase_slot() may be called on the current slot while iterating
+		int num_slots() const { return int(m_slots.size()); }
+		utp_socket_impl* slot(int i) const { return m_slots[i].sock; }
+		void erase_slot(int i);
+
+		void clear();
+
+	private:
+
+		static boost::uint32_t hash(udp::endpoint const& ep, boost::uint16_t id);
+		void rehash(int capacity);
+
+		struct slot_t
+		{
+			slot_t(): sock(NULL), hash(0), id(0), state(empty_slot) {}
+			udp::endpoint ep;
+			utp_socket_impl* sock;
+			boost::uint32_t hash;
+			boost::uint16_t id;
+			enum state_t { empty_slot, used_slot, erased_slot };
+			boost::uint8_t state;
+		};
+
+		// the number of slots is always a power of 2
+		std::vector<slot_t> m_slots;
+
+		// the number of used slots
+		int m_size;
+
+		// the number of tombstones
+		int m_erased;
+	};
+}
+
+#endif // TORRENT_UTP_SOCKET_MAP_HPP_INCLUDED
+
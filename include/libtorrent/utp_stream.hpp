@@ -143,6 +143,22 @@ struct utp_header
 
 struct utp_socket_impl;
 
+// where a socket is filed in the socket manager's timer wheel. This is
+// owned by the socket but only touched by utp_socket_manager
+struct utp_timer_pos
+{
+	utp_timer_pos(): slot(-1), index(0), tick(0) {}
+
+	// the wheel slot the socket is in, or -1 if it's not scheduled
+	int slot;
+
+	// the socket's index within that slot
+	int index;
+
+	// the absolute wheel tick the socket is due at
+	boost::int64_t tick;
+};
+
 utp_socket_impl* construct_utp_impl(boost::uint16_t recv_id
 	, boost::uint16_t send_id, void* userdata
 	, utp_socket_manager* sm);
@@ -150,13 +166,17 @@ void detach_utp_impl(utp_socket_impl* s);
 void delete_utp_impl(utp_socket_impl* s);
 bool should_delete(utp_socket_impl* s);
 void tick_utp_impl(utp_socket_impl* s, time_point now);
-void utp_init_mtu(utp_socket_impl* s, int link_mtu, int utp_mtu);
+utp_timer_pos& utp_timer(utp_socket_impl* s);
+time_point utp_next_tick(utp_socket_impl* s);
+void utp_init_mtu(utp_socket_impl* s, address const& remote
+	, int link_mtu, int utp_mtu);
 bool utp_incoming_packet(utp_socket_impl* s, char const* p
 	, int size, udp::endpoint const& ep, time_point receive_time);
 bool utp_match(utp_socket_impl* s, udp::endpoint const& ep, boost::uint16_t id);
 udp::endpoint utp_remote_endpoint(utp_socket_impl* s);
 boost::uint16_t utp_receive_id(utp_socket_impl* s);
 int utp_socket_state(utp_socket_impl const* s);
+int utp_packet_headroom();
 void utp_send_ack(utp_socket_impl* s);
 void utp_socket_drained(utp_socket_impl* s);
 void utp_writable(utp_socket_impl* s);
@@ -235,6 +255,9 @@ public:
 	void set_close_reason(boost::uint16_t code);
 	boost::uint16_t get_close_reason();
 
+	// one of settings_pack::utp_congestion_control_t
+	void set_congestion_control(int type);
+
 	bool is_open() const { return m_open; }
 
 	int read_buffer_size() const;
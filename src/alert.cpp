@@ -1573,6 +1573,23 @@ namespace libtorrent {
 		return buf;
 	}
 
+	deadline_miss_alert::deadline_miss_alert(aux::stack_allocator& alloc
+		, torrent_handle const& h, int index, int late)
+		: torrent_alert(alloc, h)
+		, piece_index(index)
+		, late_by(late)
+	{
+		TORRENT_ASSERT(index >= 0);
+	}
+
+	std::string deadline_miss_alert::message() const
+	{
+		char ret[400];
+		snprintf(ret, sizeof(ret), "%s piece %d expected to miss its deadline by %d ms"
+			, torrent_alert::message().c_str(), piece_index, late_by);
+		return ret;
+	}
+
 	url_seed_alert::url_seed_alert(aux::stack_allocator& alloc, torrent_handle const& h
 		, std::string const& u, error_code const& e)
 		: torrent_alert(alloc, h)
@@ -62,6 +62,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #if !defined(TORRENT_DISABLE_ENCRYPTION) && !defined(TORRENT_DISABLE_EXTENSIONS)
 #include "libtorrent/pe_crypto.hpp"
 #include "libtorrent/hasher.hpp"
+#include "libtorrent/network_thread_pool.hpp"
 #endif
 
 using boost::shared_ptr;
@@ -111,6 +112,9 @@ namespace libtorrent
 #endif
 		, m_our_peer_id(pid)
 #if !defined(TORRENT_DISABLE_ENCRYPTION) && !defined(TORRENT_DISABLE_EXTENSIONS)
+		, m_rc4_send(false)
+		, m_rc4_recv(false)
+		, m_predecrypted_bytes(0)
 		, m_sync_bytes_read(0)
 #endif
 #ifndef TORRENT_DISABLE_EXTENSIONS
@@ -154,12 +158,14 @@ namespace libtorrent
 #if !defined(TORRENT_DISABLE_ENCRYPTION) && !defined(TORRENT_DISABLE_EXTENSIONS)
 	void bt_peer_connection::switch_send_crypto(boost::shared_ptr<crypto_plugin> crypto)
 	{
+		m_rc4_send = crypto && crypto == m_rc4;
 		if (m_enc_handler.switch_send_crypto(crypto, send_buffer_size() - get_send_barrier()))
 			set_send_barrier(send_buffer_size());
 	}
 
 	void bt_peer_connection::switch_recv_crypto(boost::shared_ptr<crypto_plugin> crypto)
 	{
+		m_rc4_recv = crypto && crypto == m_rc4;
 		m_enc_handler.switch_recv_crypto(crypto, m_recv_buffer);
 	}
 #endif
@@ -381,7 +387,7 @@ namespace libtorrent
 
 #ifdef TORRENT_LOGGING
 		peer_log("==> SUGGEST [ piece: %d num_peers: %d ]", piece
-			, t->has_picker() ? t->picker().get_availability(piece) : -1);
+			, t->has_picker() ? t->real_availability(piece) : -1);
 #endif
 
 		char msg[] = {0,0,0,5, msg_suggest_piece, 0, 0, 0, 0};
@@ -713,6 +719,14 @@ namespace libtorrent
 		int packet_size = 0;
 		m_rc4->decrypt(vec, consume, produce, packet_size);
 	}
+
+	bool bt_peer_connection::can_offload_crypto() const
+	{
+		// uTP sockets are driven from the main thread, never by the
+		// network thread pool
+		return m_settings.get_int(settings_pack::network_threads) > 0
+			&& !is_utp(*get_socket());
+	}
 #endif // #if !defined(TORRENT_DISABLE_ENCRYPTION) && !defined(TORRENT_DISABLE_EXTENSIONS)
 
 	void regular_c_free(char* buf, void* /* userdata */
@@ -2537,7 +2551,17 @@ namespace libtorrent
 #if !defined(TORRENT_DISABLE_ENCRYPTION) && !defined(TORRENT_DISABLE_EXTENSIONS)
 		if (!m_enc_handler.is_recv_plaintext())
 		{
-			int consumed = m_enc_handler.decrypt(m_recv_buffer, bytes_transferred);
+			int consumed = 0;
+			if (m_predecrypted_bytes > 0)
+			{
+				// this was already decrypted by the network thread
+				TORRENT_ASSERT(int(bytes_transferred) <= m_predecrypted_bytes);
+				m_predecrypted_bytes -= bytes_transferred;
+			}
+			else
+			{
+				consumed = m_enc_handler.decrypt(m_recv_buffer, bytes_transferred);
+			}
 	#ifdef TORRENT_LOGGING
 			if (consumed + bytes_transferred > 0)
 				peer_log("<== decrypted block [ s = %d ]", consumed + bytes_transferred);
@@ -3486,10 +3510,7 @@ namespace libtorrent
 			boost::int64_t cur_protocol_dl = statistics().last_protocol_downloaded();
 #endif
 			if (dispatch_message(bytes_transferred))
-			{
-				m_state = read_packet_size;
-				m_recv_buffer.reset(5);
-			}
+				start_next_packet();
 #ifdef TORRENT_DEBUG
 			TORRENT_ASSERT(statistics().last_payload_downloaded() - cur_payload_dl >= 0);
 			TORRENT_ASSERT(statistics().last_protocol_downloaded() - cur_protocol_dl >= 0);
@@ -3501,12 +3522,105 @@ namespace libtorrent
 			return;
 		}
 
+		if (m_state == read_have_run)
+		{
+			TORRENT_ASSERT(recv_buffer == m_recv_buffer.get());
+			received_bytes(0, bytes_transferred);
+			if (!t)
+			{
+				disconnect(errors::torrent_removed, op_bittorrent, 1);
+				return;
+			}
+			if (!m_recv_buffer.packet_finished()) return;
+
+			on_have_run(recv_buffer);
+			if (is_disconnecting()) return;
+
+			start_next_packet();
+			TORRENT_ASSERT(!m_recv_buffer.packet_finished());
+			return;
+		}
+
 		TORRENT_ASSERT(!m_recv_buffer.packet_finished());
 	}
 
+	void bt_peer_connection::start_next_packet()
+	{
+		// peers announce every piece they complete with a HAVE message, so
+		// in large swarms these tend to arrive back to back. If there are
+		// several complete ones buffered already, receive all of them as a
+		// single packet instead of framing and dispatching them one by one
+		buffer::const_interval ahead = m_recv_buffer.peek();
+		int left = ahead.left();
+#if !defined(TORRENT_DISABLE_ENCRYPTION) && !defined(TORRENT_DISABLE_EXTENSIONS)
+		// past the current message, the receive buffer only holds plaintext
+		// if it was decrypted ahead of time by the network thread
+		if (!m_enc_handler.is_recv_plaintext())
+			left = (std::min)(left, m_predecrypted_bytes);
+#endif
+
+		// the run's piece indices are kept on the stack while they're
+		// processed, so don't make it too long
+		static const int max_have_run = 512;
+		static const char have_header[] = { 0, 0, 0, 5, msg_have };
+		int num_haves = 0;
+		for (char const* ptr = ahead.begin; left >= 9 && num_haves < max_have_run
+			&& std::memcmp(ptr, have_header, 5) == 0; ptr += 9, left -= 9)
+			++num_haves;
+
+		if (num_haves > 1)
+		{
+			m_state = read_have_run;
+			m_recv_buffer.reset(num_haves * 9);
+			return;
+		}
+
+		m_state = read_packet_size;
+		m_recv_buffer.reset(5);
+	}
+
+	void bt_peer_connection::on_have_run(buffer::const_interval recv_buffer)
+	{
+		INVARIANT_CHECK;
+
+		TORRENT_ASSERT(recv_buffer.left() % 9 == 0);
+		int num_haves = recv_buffer.left() / 9;
+		stats_counters().inc_stats_counter(counters::num_incoming_have, num_haves);
+
+		int* indices = TORRENT_ALLOCA(int, num_haves);
+		const char* ptr = recv_buffer.begin;
+		for (int i = 0; i < num_haves; ++i)
+		{
+			TORRENT_ASSERT(ptr[4] == msg_have);
+			ptr += 5;
+			indices[i] = detail::read_int32(ptr);
+		}
+		incoming_haves(indices, num_haves);
+	}
+
 #if !defined(TORRENT_DISABLE_ENCRYPTION) && !defined(TORRENT_DISABLE_EXTENSIONS)
 	int bt_peer_connection::hit_send_barrier(std::vector<asio::mutable_buffer>& iovec)
 	{
+		if (m_rc4_send && can_offload_crypto())
+		{
+			boost::shared_ptr<crypto_plugin> crypto = m_enc_handler.steady_send_crypto();
+			if (crypto && (!m_send_crypto || m_send_crypto == crypto))
+			{
+				// don't encrypt these buffers here. They're encrypted by the
+				// network thread right before they're written to the socket
+				// (see attach_send_crypto())
+				int next_barrier = 0;
+				for (std::vector<asio::mutable_buffer>::iterator i = iovec.begin();
+					i != iovec.end(); ++i)
+					next_barrier += asio::buffer_size(*i);
+				m_send_crypto = crypto;
+				m_send_crypto_vec.insert(m_send_crypto_vec.end()
+					, iovec.begin(), iovec.end());
+				iovec.clear();
+				return next_barrier;
+			}
+		}
+
 		int next_barrier = m_enc_handler.encrypt(iovec);
 #ifdef TORRENT_LOGGING
 		if (next_barrier != 0)
@@ -3514,6 +3628,23 @@ namespace libtorrent
 #endif
 		return next_barrier;
 	}
+
+	void bt_peer_connection::attach_send_crypto(socket_job& j)
+	{
+		if (m_send_crypto_vec.empty()) return;
+		j.crypto.swap(m_send_crypto);
+		j.crypto_vec.swap(m_send_crypto_vec);
+	}
+
+	bool bt_peer_connection::attach_recv_crypto(socket_job& j)
+	{
+		if (!m_rc4_recv || !can_offload_crypto()) return false;
+
+		TORRENT_ASSERT(m_predecrypted_bytes == 0);
+		j.crypto = m_enc_handler.recv_crypto();
+		m_predecrypted_bytes = j.buf_size;
+		return true;
+	}
 #endif
 
 	// --------------------------
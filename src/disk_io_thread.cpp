@@ -2782,6 +2782,7 @@ namespace libtorrent
 			: i->cache_state == cached_piece_entry::volatile_read_lru
 			? cached_piece_info::volatile_read_cache
 			: cached_piece_info::read_cache;
+		info.frequently_used = i->cache_state == cached_piece_entry::read_lru2;
 		int blocks_in_piece = i->blocks_in_piece;
 		info.blocks.resize(blocks_in_piece);
 		for (int b = 0; b < blocks_in_piece; ++b)
@@ -3301,13 +3302,16 @@ namespace libtorrent
 			= m_disk_cache.all_pieces();
 		TORRENT_ASSERT(pieces.first == pieces.second);
 #endif
+		TORRENT_ASSERT(m_magic == 0x1337);
+
 		// release the io_service to allow the run() call to return
 		// we do this once we stop posting new callbacks to it.
+		// once run() returns, the session may destruct this object, don't
+		// touch any members after this
 #if defined TORRENT_ASIO_DEBUGGING
 		complete_async("disk_io_thread::work");
 #endif
 		m_work.reset();
-		TORRENT_ASSERT(m_magic == 0x1337);
 	}
 
 	// this is a callback called by the block_cache when
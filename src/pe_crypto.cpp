@@ -34,6 +34,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <boost/cstdint.hpp>
 #include <algorithm>
+#include <cstring>
 
 extern "C" {
 #include "libtorrent/tommath.h"
@@ -208,11 +209,11 @@ namespace libtorrent
 		int consume = 0;
 		if (recv_buffer.crypto_packet_finished())
 		{
-			std::vector<asio::mutable_buffer> wr_buf;
-			recv_buffer.mutable_buffers(wr_buf, bytes_transferred);
+			m_recv_iovec.clear();
+			recv_buffer.mutable_buffers(m_recv_iovec, bytes_transferred);
 			int packet_size = 0;
 			int produce = bytes_transferred;
-			m_dec_handler->decrypt(wr_buf, consume, produce, packet_size);
+			m_dec_handler->decrypt(m_recv_iovec, consume, produce, packet_size);
 			TORRENT_ASSERT(packet_size || produce);
 			TORRENT_ASSERT(packet_size >= 0);
 			bytes_transferred = produce;
@@ -287,26 +288,36 @@ namespace libtorrent
 		encrypt(vec);
 	}
 
-	int rc4_handler::encrypt(std::vector<boost::asio::mutable_buffer>& buf)
+	namespace
 	{
-		if (!m_encrypt) return 0;
-		if (buf.empty()) return 0;
-
-		int bytes_processed = 0;
-		for (std::vector<boost::asio::mutable_buffer>::iterator i = buf.begin();
-			i != buf.end(); ++i)
+		// run the RC4 keystream over every buffer in the iovec, in-place.
+		// Returns the total number of bytes transformed
+		int rc4_process(std::vector<boost::asio::mutable_buffer>& buf, rc4* state)
 		{
-			char* pos = boost::asio::buffer_cast<char*>(*i);
-			int len = boost::asio::buffer_size(*i);
+			int bytes_processed = 0;
+			for (std::vector<boost::asio::mutable_buffer>::iterator i = buf.begin();
+				i != buf.end(); ++i)
+			{
+				unsigned char* pos = boost::asio::buffer_cast<unsigned char*>(*i);
+				int len = boost::asio::buffer_size(*i);
 
-			TORRENT_ASSERT(len >= 0);
-			TORRENT_ASSERT(pos);
+				TORRENT_ASSERT(len >= 0);
+				TORRENT_ASSERT(pos);
 
-			bytes_processed += len;
-			rc4_encrypt((unsigned char*)pos, len, &m_rc4_outgoing);
+				bytes_processed += len;
+				rc4_encrypt(pos, len, state);
+			}
+			buf.clear();
+			return bytes_processed;
 		}
-		buf.clear();
-		return bytes_processed;
+	}
+
+	int rc4_handler::encrypt(std::vector<boost::asio::mutable_buffer>& buf)
+	{
+		if (!m_encrypt) return 0;
+		if (buf.empty()) return 0;
+
+		return rc4_process(buf, &m_rc4_outgoing);
 	}
 
 	void rc4_handler::decrypt(std::vector<boost::asio::mutable_buffer>& buf
@@ -316,21 +327,7 @@ namespace libtorrent
 	{
 		if (!m_decrypt) return;
 
-		int bytes_processed = 0;
-		for (std::vector<boost::asio::mutable_buffer>::iterator i = buf.begin();
-			i != buf.end(); ++i)
-		{
-			char* pos = boost::asio::buffer_cast<char*>(*i);
-			int len = boost::asio::buffer_size(*i);
-
-			TORRENT_ASSERT(len >= 0);
-			TORRENT_ASSERT(pos);
-
-			bytes_processed += len;
-			rc4_encrypt((unsigned char*)pos, len, &m_rc4_incoming);
-		}
-		buf.clear();
-		produce = bytes_processed;
+		produce = rc4_process(buf, &m_rc4_incoming);
 	}
 
 } // namespace libtorrent
@@ -341,29 +338,25 @@ namespace libtorrent
 
 void rc4_init(const unsigned char* in, unsigned long len, rc4 *state)
 {
-	unsigned char key[256], tmp, *s;
+	unsigned char key[256];
+	boost::uint32_t tmp, *s;
 	int keylen, x, y, j;
 
 	TORRENT_ASSERT(state != 0);
 	TORRENT_ASSERT(len <= 256);
 
-	state->x = 0;
-	while (len--) {
-		state->buf[state->x++] = *in++;
-	}
-
 	/* extract the key */
-	s = state->buf;
-	memcpy(key, s, 256);
-	keylen = state->x;
+	keylen = len;
+	memcpy(key, in, len);
 
 	/* make RC4 perm and shuffle */
+	s = state->buf;
 	for (x = 0; x < 256; x++) {
 		s[x] = x;
 	}
 
 	for (j = x = y = 0; x < 256; x++) {
-		y = (y + state->buf[x] + key[j++]) & 255;
+		y = (y + s[x] + key[j++]) & 255;
 		if (j == keylen) {
 			j = 0; 
 		}
@@ -375,7 +368,8 @@ void rc4_init(const unsigned char* in, unsigned long len, rc4 *state)
 
 unsigned long rc4_encrypt(unsigned char *out, unsigned long outlen, rc4 *state)
 {
-	unsigned char x, y, *s, tmp;
+	unsigned int x, y, tx, ty;
+	boost::uint32_t *s;
 	unsigned long n;
 
 	TORRENT_ASSERT(out != 0);
@@ -385,13 +379,46 @@ unsigned long rc4_encrypt(unsigned char *out, unsigned long outlen, rc4 *state)
 	x = state->x;
 	y = state->y;
 	s = state->buf;
+
+#define RC4_STEP(ks) \
+	x = (x + 1) & 255; \
+	tx = s[x]; \
+	y = (y + tx) & 255; \
+	ty = s[y]; \
+	s[x] = ty; s[y] = tx; \
+	ks = s[(tx + ty) & 255]
+
+	/* generate 8 bytes of keystream per iteration and apply it with a
+	   single 64 bit xor. Together with the swapped values being kept in
+	   registers (tx, ty), this avoids re-loading the state after every
+	   swap and replaces eight read-modify-write cycles on the buffer
+	   with one */
+	while (outlen >= 8) {
+		unsigned char ks[8];
+		boost::uint64_t block, key;
+		RC4_STEP(ks[0]);
+		RC4_STEP(ks[1]);
+		RC4_STEP(ks[2]);
+		RC4_STEP(ks[3]);
+		RC4_STEP(ks[4]);
+		RC4_STEP(ks[5]);
+		RC4_STEP(ks[6]);
+		RC4_STEP(ks[7]);
+		std::memcpy(&block, out, 8);
+		std::memcpy(&key, ks, 8);
+		block ^= key;
+		std::memcpy(out, &block, 8);
+		out += 8;
+		outlen -= 8;
+	}
+
 	while (outlen--) {
-		x = (x + 1) & 255;
-		y = (y + s[x]) & 255;
-		tmp = s[x]; s[x] = s[y]; s[y] = tmp;
-		tmp = (s[x] + s[y]) & 255;
-		*out++ ^= s[tmp];
+		unsigned int k;
+		RC4_STEP(k);
+		*out++ ^= k;
 	}
+#undef RC4_STEP
+
 	state->x = x;
 	state->y = y;
 	return n;
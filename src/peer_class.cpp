@@ -64,6 +64,7 @@ namespace libtorrent
 		pci->download_limit = channel[peer_connection::download_channel].throttle();
 		pci->upload_priority = priority[peer_connection::upload_channel];
 		pci->download_priority = priority[peer_connection::download_channel];
+		pci->utp_congestion_control = utp_congestion_control;
 	}
 
 	void peer_class::set_info(peer_class_info const* pci)
@@ -75,6 +76,7 @@ namespace libtorrent
 		set_download_limit(pci->download_limit);
 		priority[peer_connection::upload_channel] = (std::max)(1, (std::min)(255, pci->upload_priority));
 		priority[peer_connection::download_channel] = (std::max)(1, (std::min)(255, pci->download_priority));
+		utp_congestion_control = pci->utp_congestion_control;
 	}
 
 	peer_class_t peer_class_pool::new_peer_class(std::string const& label)
@@ -91,6 +91,10 @@ namespace libtorrent
 	{
 		// the limits of the download queue size
 		min_request_queue = 2,
+
+		// the number of seconds the smallest block round-trip time is
+		// remembered for
+		min_rtt_window = 10
 	};
 
 	bool pending_block_in_buffer(pending_block const& pb)
@@ -160,6 +164,8 @@ namespace libtorrent
 		, m_last_receive(aux::time_now())
 		, m_last_sent(aux::time_now())
 		, m_requested(min_time())
+		, m_min_block_rtt_time(min_time())
+		, m_disk_unblocked(min_time())
 		, m_remote_dl_update(aux::time_now())
 		, m_connect(aux::time_now())
 		, m_became_uninterested(aux::time_now())
@@ -181,6 +187,7 @@ namespace libtorrent
 		, m_download_rate_peak(0)
 		, m_upload_rate_peak(0)
 		, m_send_barrier(INT_MAX)
+		, m_min_block_rtt(-1)
 		, m_desired_queue_size(2)
 		, m_prefer_contiguous_blocks(0)
 		, m_disk_read_failures(0)
@@ -203,6 +210,7 @@ namespace libtorrent
 		, m_need_interest_update(false)
 		, m_has_metadata(true)
 		, m_exceeded_limit(false)
+		, m_decrypting(false)
 #if TORRENT_USE_ASSERTS
 		, m_in_constructor(true)
 		, m_disconnect_started(false)
@@ -371,6 +379,23 @@ namespace libtorrent
 		}
 #endif
 
+		// uTP connections use the congestion controller set by their peer
+		// class, if any
+		if (is_utp(*m_socket))
+		{
+			for (int i = 0; i < num_classes(); ++i)
+			{
+				peer_class const* pc = m_ses.peer_classes().at(class_at(i));
+				if (pc == 0 || pc->utp_congestion_control < 0) continue;
+#if defined TORRENT_LOGGING
+				peer_log("*** UTP_CONGESTION_CONTROL [ %d class: %s ]"
+					, pc->utp_congestion_control, pc->label.c_str());
+#endif
+				m_socket->set_congestion_control(pc->utp_congestion_control);
+				break;
+			}
+		}
+
 		if (t && t->ready_for_connections())
 		{
 			init();
@@ -652,6 +677,72 @@ namespace libtorrent
 		}
 	}
 
+	void peer_connection::send_allowed_fast(int piece)
+	{
+		TORRENT_ASSERT(is_single_thread());
+		if (m_connecting) return;
+		if (in_handshake()) return;
+
+		// without the fast extension the peer can't be told about the
+		// piece, so it must not count as allowed either
+		if (!supports_fast()) return;
+
+		boost::shared_ptr<torrent> t = m_torrent.lock();
+		TORRENT_ASSERT(t);
+		TORRENT_ASSERT(t->has_piece_passed(piece));
+
+		if (t->super_seeding() || upload_only()) return;
+
+		// there's no point in offering fast pieces
+		// that the peer already has
+		if (has_piece(piece)) return;
+
+		if (int(m_accept_fast.size()) >= 2 * m_settings.get_int(
+			settings_pack::allowed_fast_set_size)) return;
+
+		if (std::find(m_accept_fast.begin(), m_accept_fast.end(), piece)
+			!= m_accept_fast.end()) return;
+
+#if defined TORRENT_LOGGING
+		peer_log("==> ALLOWED_FAST [ %d ] (cached)", piece);
+#endif
+		write_allow_fast(piece);
+		m_accept_fast.push_back(piece);
+		m_accept_fast_piece_cnt.push_back(0);
+		m_cached_accept_fast.push_back(piece);
+	}
+
+	void peer_connection::withdraw_allowed_fast(std::vector<int> const& cached)
+	{
+		TORRENT_ASSERT(is_single_thread());
+
+		// there's no message to revoke an allowed fast piece. Requests for
+		// it are rejected again once the peer is choked, which BEP 6 permits
+		for (std::vector<int>::iterator i = m_cached_accept_fast.begin();
+			i != m_cached_accept_fast.end();)
+		{
+			if (std::binary_search(cached.begin(), cached.end(), *i))
+			{
+				++i;
+				continue;
+			}
+
+#if defined TORRENT_LOGGING
+			peer_log("*** WITHDRAW_ALLOWED_FAST [ %d ] (evicted)", *i);
+#endif
+			std::vector<int>::iterator j = std::find(m_accept_fast.begin()
+				, m_accept_fast.end(), *i);
+			TORRENT_ASSERT(j != m_accept_fast.end());
+			if (j != m_accept_fast.end())
+			{
+				m_accept_fast_piece_cnt.erase(m_accept_fast_piece_cnt.begin()
+					+ (j - m_accept_fast.begin()));
+				m_accept_fast.erase(j);
+			}
+			i = m_cached_accept_fast.erase(i);
+		}
+	}
+
 	void peer_connection::on_metadata_impl()
 	{
 		TORRENT_ASSERT(is_single_thread());
@@ -871,6 +962,9 @@ namespace libtorrent
 		if (on_parole()) ret |= piece_picker::on_parole
 			| piece_picker::prioritize_partials;
 
+		if (m_settings.get_bool(settings_pack::prefer_adjacent_pieces))
+			ret |= piece_picker::prefer_adjacent;
+
 		// only one of rarest_first and sequential can be set.
 		TORRENT_ASSERT((ret & piece_picker::rarest_first) ? 1 : 0
 			+ (ret & piece_picker::sequential) ? 1 : 0 <= 1);
@@ -951,6 +1045,12 @@ namespace libtorrent
 
 		if (disconnect_if_redundant()) return;
 
+		if (m_settings.get_bool(settings_pack::batch_have_messages))
+		{
+			m_pending_haves.push_back(index);
+			return;
+		}
+
 #if defined TORRENT_LOGGING
 		peer_log("==> HAVE    [ piece: %d ]", index);
 #endif
@@ -961,6 +1061,55 @@ namespace libtorrent
 #endif
 	}
 
+	bool peer_connection::cancel_pending_have(int index)
+	{
+		TORRENT_ASSERT(is_single_thread());
+		std::vector<int>::iterator i = std::find(m_pending_haves.begin()
+			, m_pending_haves.end(), index);
+		if (i == m_pending_haves.end()) return false;
+		m_pending_haves.erase(i);
+		return true;
+	}
+
+	void peer_connection::send_pending_haves()
+	{
+		TORRENT_ASSERT(is_single_thread());
+		if (m_pending_haves.empty() || m_disconnecting) return;
+
+		std::vector<int> haves;
+		haves.swap(m_pending_haves);
+
+		// all of them are written to the socket at once, when the cork is
+		// released
+		cork c(*this);
+
+		bool const send_redundant = m_settings.get_bool(settings_pack::send_redundant_have);
+		int num_sent = 0;
+		for (std::vector<int>::iterator i = haves.begin(), end(haves.end());
+			i != end; ++i)
+		{
+			// the peer may have received this piece while we held on to
+			// the HAVE message
+			if (!send_redundant && has_piece(*i))
+			{
+#if defined TORRENT_LOGGING
+				peer_log("==> HAVE    [ piece: %d ] SUPRESSED", *i);
+#endif
+				m_counters.inc_stats_counter(counters::num_outgoing_have_suppressed);
+				continue;
+			}
+
+#if defined TORRENT_LOGGING
+			peer_log("==> HAVE    [ piece: %d ]", *i);
+#endif
+			write_have(*i);
+			++num_sent;
+		}
+
+		if (num_sent > 1)
+			m_counters.inc_stats_counter(counters::num_outgoing_have_coalesced, num_sent - 1);
+	}
+
 	bool peer_connection::has_piece(int i) const
 	{
 		TORRENT_ASSERT(is_single_thread());
@@ -1030,8 +1179,8 @@ namespace libtorrent
 		// average of current rate and peak
 //		rate = (rate + m_download_rate_peak) / 2;
 
-		return milliseconds((m_outstanding_bytes
-			+ m_queued_time_critical * t->block_size() * 1000) / rate);
+		return milliseconds((boost::int64_t(m_outstanding_bytes)
+			+ m_queued_time_critical * t->block_size() + extra_bytes) * 1000 / rate);
 	}
 
 	void peer_connection::add_stat(boost::int64_t downloaded, boost::int64_t uploaded)
@@ -1761,6 +1910,11 @@ namespace libtorrent
 	// -----------------------------
 
 	void peer_connection::incoming_have(int index)
+	{
+		incoming_haves(&index, 1);
+	}
+
+	void peer_connection::incoming_haves(int const* indices, int num)
 	{
 		TORRENT_ASSERT(is_single_thread());
 		INVARIANT_CHECK;
@@ -1768,78 +1922,103 @@ namespace libtorrent
 		boost::shared_ptr<torrent> t = m_torrent.lock();
 		TORRENT_ASSERT(t);
 
-#ifndef TORRENT_DISABLE_EXTENSIONS
-		for (extension_list_t::iterator i = m_extensions.begin()
-			, end(m_extensions.end()); i != end; ++i)
+		// the pieces are validated first, and only then recorded in
+		// m_have_piece and the piece picker, together. That way a disconnect
+		// half way through the run can't leave the two out of sync
+		int* new_pieces = TORRENT_ALLOCA(int, num);
+		int num_new = 0;
+
+		for (int k = 0; k < num; ++k)
 		{
-			if ((*i)->on_have(index)) return;
-		}
+			int const index = indices[k];
+
+#ifndef TORRENT_DISABLE_EXTENSIONS
+			bool handled = false;
+			for (extension_list_t::iterator i = m_extensions.begin()
+				, end(m_extensions.end()); i != end; ++i)
+			{
+				if ((*i)->on_have(index)) { handled = true; break; }
+			}
+			if (handled) continue;
 #endif
 
-		if (is_disconnecting()) return;
+			if (is_disconnecting()) return;
 
-		// if we haven't received a bitfield, it was
-		// probably omitted, which is the same as 'have_none'
-		if (!m_bitfield_received) incoming_have_none();
+			// if we haven't received a bitfield, it was
+			// probably omitted, which is the same as 'have_none'
+			if (!m_bitfield_received) incoming_have_none();
 
 #if defined TORRENT_LOGGING
-		peer_log("<== HAVE    [ piece: %d ]", index);
+			peer_log("<== HAVE    [ piece: %d ]", index);
 #endif
 
-		if (is_disconnecting()) return;
+			if (is_disconnecting()) return;
 
-		if (!t->valid_metadata() && index >= int(m_have_piece.size()))
-		{
-			if (index < 131072)
+			if (!t->valid_metadata() && index >= int(m_have_piece.size()))
 			{
-				// if we don't have metadata
-				// and we might not have received a bitfield
-				// extend the bitmask to fit the new
-				// have message
-				m_have_piece.resize(index + 1, false);
-			}
-			else
-			{
-				// unless the index > 64k, in which case
-				// we just ignore it
-				return;
+				if (index < 131072)
+				{
+					// if we don't have metadata
+					// and we might not have received a bitfield
+					// extend the bitmask to fit the new
+					// have message
+					m_have_piece.resize(index + 1, false);
+				}
+				else
+				{
+					// unless the index > 64k, in which case
+					// we just ignore it
+					continue;
+				}
 			}
-		}
 
-		// if we got an invalid message, abort
-		if (index >= int(m_have_piece.size()) || index < 0)
-		{
+			// if we got an invalid message, abort
+			if (index >= int(m_have_piece.size()) || index < 0)
+			{
 #if defined TORRENT_LOGGING
-			peer_log("*** ERROR: [ have-metadata have_piece.size: %d ]", index, int(m_have_piece.size()));
+				peer_log("*** ERROR: [ have-metadata have_piece.size: %d ]", index, int(m_have_piece.size()));
 #endif
-			disconnect(errors::invalid_have, op_bittorrent, 2);
-			return;
-		}
+				disconnect(errors::invalid_have, op_bittorrent, 2);
+				return;
+			}
 
-		if (t->super_seeding() && !m_settings.get_bool(settings_pack::strict_super_seeding))
-		{
-			// if we're superseeding and the peer just told
-			// us that it completed the piece we're superseeding
-			// to it, change the superseeding piece for this peer
-			// if the peer optimizes out redundant have messages
-			// this will be handled when the peer sends not-interested
-			// instead.
-			if (super_seeded_piece(index))
+			if (t->super_seeding() && !m_settings.get_bool(settings_pack::strict_super_seeding))
 			{
-				superseed_piece(index, t->get_piece_to_super_seed(m_have_piece));
+				// if we're superseeding and the peer just told
+				// us that it completed the piece we're superseeding
+				// to it, change the superseeding piece for this peer
+				// if the peer optimizes out redundant have messages
+				// this will be handled when the peer sends not-interested
+				// instead.
+				if (super_seeded_piece(index))
+				{
+					superseed_piece(index, t->get_piece_to_super_seed(m_have_piece));
+				}
 			}
-		}
 
-		if (m_have_piece[index])
-		{
+			if (m_have_piece[index])
+			{
 #if defined TORRENT_LOGGING
-			peer_log("   got redundant HAVE message for index: %d", index);
+				peer_log("   got redundant HAVE message for index: %d", index);
 #endif
-			return;
+				continue;
+			}
+
+			new_pieces[num_new++] = index;
 		}
 
-		m_have_piece.set_bit(index);
-		++m_num_pieces;
+		// a piece may be announced more than once in the same run
+		int num_recorded = 0;
+		for (int k = 0; k < num_new; ++k)
+		{
+			int const index = new_pieces[k];
+			if (m_have_piece[index]) continue;
+			m_have_piece.set_bit(index);
+			++m_num_pieces;
+			new_pieces[num_recorded++] = index;
+		}
+		num_new = num_recorded;
+		if (num_new == 0) return;
 
 		// if the peer is downloading stuff, it must have metadata		
 		m_has_metadata = true;
@@ -1850,7 +2029,15 @@ namespace libtorrent
 		// we won't have a piece picker)
 		if (!t->valid_metadata()) return;
 
-		t->peer_has(index, this);
+		if (num_new == 1)
+		{
+			t->peer_has(new_pieces[0], this);
+		}
+		else
+		{
+			std::vector<int> pieces(new_pieces, new_pieces + num_new);
+			t->peer_has(pieces, this);
+		}
 
 		// this will disregard all have messages we get within
 		// the first two seconds. Since some clients implements
@@ -1860,7 +2047,7 @@ namespace libtorrent
 			|| m_ses.session_time() - peer_info_struct()->last_connected > 2)
 		{
 			// update bytes downloaded since last timer
-			++m_remote_pieces_dled;
+			m_remote_pieces_dled += num_new;
 		}
 
 		// it's important to not disconnect before we have
@@ -1889,11 +2076,14 @@ namespace libtorrent
 		// it's important to update whether we're intersted in this peer before
 		// calling disconnect_if_redundant, otherwise we may disconnect even if
 		// we are interested
-		if (!t->has_piece_passed(index)
-			&& !t->is_seed()
-			&& !is_interesting()
-			&& (!t->has_picker() || t->picker().piece_priority(index) != 0))
-			t->peer_is_interesting(*this);
+		for (int k = 0; k < num_new && !is_interesting(); ++k)
+		{
+			int const index = new_pieces[k];
+			if (!t->has_piece_passed(index)
+				&& !t->is_seed()
+				&& (!t->has_picker() || t->picker().piece_priority(index) != 0))
+				t->peer_is_interesting(*this);
+		}
 
 		disconnect_if_redundant();
 		if (is_disconnecting()) return;
@@ -1901,10 +2091,14 @@ namespace libtorrent
 		// if we're super seeding, this might mean that somebody
 		// forwarded this piece. In which case we need to give
 		// a new piece to that peer
-		if (t->super_seeding()
-			&& m_settings.get_bool(settings_pack::strict_super_seeding)
-			&& (!super_seeded_piece(index) || t->num_peers() == 1))
+		if (!t->super_seeding()
+			|| !m_settings.get_bool(settings_pack::strict_super_seeding))
+			return;
+
+		for (int k = 0; k < num_new; ++k)
 		{
+			int const index = new_pieces[k];
+			if (super_seeded_piece(index) && t->num_peers() != 1) continue;
 			for (torrent::peer_iterator i = t->begin()
 				, end(t->end()); i != end; ++i)
 			{
@@ -2687,6 +2881,7 @@ namespace libtorrent
 
 			t->add_redundant_bytes(p.length, reason);
 
+			sample_block_rtt(*b, now);
 			m_download_queue.erase(b);
 			if (m_download_queue.empty())
 				m_counters.inc_stats_counter(counters::num_peers_down_requests, -1);
@@ -2732,6 +2927,7 @@ namespace libtorrent
 		peer_log("*** FILE ASYNC WRITE [ piece: %d | s: %x | l: %x ]"
 			, p.piece, p.start, p.length);
 #endif
+		sample_block_rtt(*b, now);
 		m_download_queue.erase(b);
 		if (m_download_queue.empty())
 			m_counters.inc_stats_counter(counters::num_peers_down_requests, -1);
@@ -2795,12 +2991,16 @@ namespace libtorrent
 			int num_blocks = t->picker().blocks_in_piece(piece);
 			if (st.requested > 0 && st.writing + st.finished + st.requested == num_blocks)
 			{
+				// get_downloaders() returns one entry per block. Only make
+				// predictions if all remaining blocks are requested from the
+				// same peer
 				std::vector<void*> d;
 				t->picker().get_downloaders(d, piece);
+				d.erase(std::remove(d.begin(), d.end(), static_cast<void*>(0)), d.end());
+				std::sort(d.begin(), d.end());
+				d.erase(std::unique(d.begin(), d.end()), d.end());
 				if (d.size() == 1)
 				{
-					// only make predictions if all remaining
-					// blocks are requested from the same peer
 					torrent_peer* p = (torrent_peer*)d[0];
 					if (p->connection)
 					{
@@ -3450,8 +3650,11 @@ namespace libtorrent
 		TORRENT_ASSERT(int(block.block_index) < t->torrent_file().piece_size(block.piece_index));
 
 		// if all the peers that requested this block has been
-		// cancelled, then just ignore the cancel.
-		if (!t->picker().is_requested(block)) return;
+		// cancelled, then just ignore the cancel. Blocks we've already
+		// received from another peer are still cancelled, to avoid
+		// downloading them again
+		if (!t->picker().is_requested(block)
+			&& !t->picker().is_downloaded(block)) return;
 
 		std::vector<pending_block>::iterator it
 			= std::find_if(m_download_queue.begin(), m_download_queue.end(), has_block(block));
@@ -3498,6 +3701,11 @@ namespace libtorrent
 				, block.piece_index, block_offset, block_size, block.block_index);
 #endif
 		write_cancel(r);
+
+		// we already have the block. Unless the peer has sent it by now,
+		// this is a redundant download we just avoided
+		if (t->picker().is_downloaded(block))
+			m_counters.inc_stats_counter(counters::cancelled_duplicate_bytes, block_size);
 	}
 
 	bool peer_connection::send_choke()
@@ -3949,7 +4157,9 @@ namespace libtorrent
 			// make sure we free up all send buffers that are owned
 			// by the disk thread
 			m_send_buffer.clear();
-			m_recv_buffer.free_disk_buffer();
+			// if the network thread is still decrypting into the receive
+			// buffer, it's freed in on_receive_data_decrypted() instead
+			if (!m_decrypting) m_recv_buffer.free_disk_buffer();
 		}
 
 		// we cannot do this in a constructor
@@ -4269,6 +4479,7 @@ namespace libtorrent
 			, &pending_block_in_buffer));
 
 		p.target_dl_queue_length = int(desired_queue_size());
+		p.estimated_bdp = estimated_bdp();
 		p.upload_queue_length = int(upload_queue().size());
 		p.timed_out_requests = 0;
 		p.busy_requests = 0;
@@ -4450,6 +4661,53 @@ namespace libtorrent
 		m_superseed_piece[0] = new_piece;
 	}
 
+	void peer_connection::sample_block_rtt(pending_block const& b, time_point now)
+	{
+		TORRENT_ASSERT(is_single_thread());
+		// blocks that timed out or were requested before we last stalled on
+		// the disk don't say anything about the link
+		if (b.request_time == min_time()
+			|| b.timed_out
+			|| b.request_time <= m_disk_unblocked
+			|| (m_channel_state[download_channel] & peer_info::bw_disk))
+			return;
+
+		// the peer sends the blocks we requested ahead of this one first.
+		// How long that takes depends on its upload capacity, which we don't
+		// know. While the download is limited by latency, it's a lot less
+		// than the time those blocks take at our download rate, and taking
+		// that out of the sample makes the round-trip look shorter than it
+		// is. The queue sized by it is then too short to ever raise the
+		// rate. Only blocks that were first in line time the link itself
+		if (b.queued_ahead > 0) return;
+
+		int const rtt = int(total_milliseconds(now - b.request_time));
+
+		m_block_rtt.add_sample(rtt);
+
+		// a sample newer than the window replaces the minimum even if it's
+		// larger. Without new samples, the old minimum is kept
+		if (m_min_block_rtt < 0
+			|| rtt <= m_min_block_rtt
+			|| now - m_min_block_rtt_time > seconds(min_rtt_window))
+		{
+			m_min_block_rtt = rtt;
+			m_min_block_rtt_time = now;
+		}
+	}
+
+	int peer_connection::estimated_bdp() const
+	{
+		TORRENT_ASSERT(is_single_thread());
+		if (m_min_block_rtt < 0) return 0;
+
+		// allow for the jitter on top of the shortest round-trip
+		const boost::int64_t delay = m_min_block_rtt + m_block_rtt.avg_deviation();
+		const boost::int64_t bdp = delay
+			* statistics().download_payload_rate() / 1000;
+		return int((std::min)(bdp, boost::int64_t(INT_MAX)));
+	}
+
 	void peer_connection::update_desired_queue_size()
 	{
 		TORRENT_ASSERT(is_single_thread());
@@ -4461,25 +4719,50 @@ namespace libtorrent
 	
 		int download_rate = statistics().download_payload_rate();
 
-		// calculate the desired download queue size
-		const int queue_time = m_settings.get_int(settings_pack::request_queue_time);
-		// (if the latency is more than this, the download will stall)
-		// so, the queue size is queue_time * down_rate / 16 kiB
-		// (16 kB is the size of each request)
-		// the minimum number of requests is 2 and the maximum is 48
 		// the block size doesn't have to be 16. So we first query the
 		// torrent for it
 		boost::shared_ptr<torrent> t = m_torrent.lock();
 		const int block_size = t->block_size();
 
 		TORRENT_ASSERT(block_size > 0);
-		
-		m_desired_queue_size = queue_time * download_rate / block_size;
 
-		if (m_desired_queue_size > m_max_out_request_queue)
-			m_desired_queue_size = m_max_out_request_queue;
-		if (m_desired_queue_size < min_request_queue)
-			m_desired_queue_size = min_request_queue;
+		boost::int64_t queue_size;
+		if (m_settings.get_bool(settings_pack::bdp_request_queue)
+			&& m_min_block_rtt >= 0)
+		{
+			// keep twice the bandwidth-delay product outstanding. Since the
+			// round-trip excludes the time requests are queued up behind our
+			// other requests at the peer, this doubles the queue for as long
+			// as the download is limited by latency, and settles once the
+			// peer's upload capacity is saturated
+			queue_size = boost::int64_t(estimated_bdp()) * 2 / block_size;
+
+			// as long as the disk is behind, we won't read the blocks any
+			// faster by asking for more of them. Don't grow the queue
+			if (m_counters[counters::queued_write_bytes]
+				> m_settings.get_int(settings_pack::max_queued_disk_bytes))
+			{
+				queue_size = (std::min)(queue_size
+					, boost::int64_t(m_desired_queue_size));
+			}
+		}
+		else
+		{
+			// calculate the desired download queue size
+			const int queue_time = m_settings.get_int(settings_pack::request_queue_time);
+			// (if the latency is more than this, the download will stall)
+			// so, the queue size is queue_time * down_rate / 16 kiB
+			// (16 kB is the size of each request)
+			queue_size = boost::int64_t(queue_time) * download_rate / block_size;
+		}
+
+		// the minimum number of requests is 2 and the maximum is
+		// max_out_request_queue
+		if (queue_size > m_max_out_request_queue)
+			queue_size = m_max_out_request_queue;
+		if (queue_size < min_request_queue)
+			queue_size = min_request_queue;
+		m_desired_queue_size = boost::uint16_t(queue_size);
 	}
 
 	void peer_connection::second_tick(int tick_interval_ms)
@@ -4529,6 +4812,10 @@ namespace libtorrent
 			return;
 		}
 
+		// don't hold on to HAVE messages for more than a tick
+		send_pending_haves();
+		if (m_disconnecting) return;
+
 		if (m_endgame_mode
 			&& m_interesting
 			&& m_download_queue.empty()
@@ -5284,6 +5571,11 @@ namespace libtorrent
 		TORRENT_ASSERT(is_single_thread());
 		if (m_disconnecting) return;
 
+		// held back HAVE messages go out along with whatever else is about
+		// to be written
+		if (!m_pending_haves.empty() && !m_send_buffer.empty())
+			send_pending_haves();
+
 		// we may want to request more quota at this point
 		request_bandwidth(upload_channel);
 
@@ -5422,6 +5714,7 @@ namespace libtorrent
 			j.type = socket_job::write_job;
 			j.vec = &vec;
 			j.peer = self();
+			attach_send_crypto(j);
 			m_ses.post_socket_job(j);
 		}
 
@@ -5439,6 +5732,7 @@ namespace libtorrent
 #endif
 		m_counters.inc_stats_counter(counters::num_peers_down_disk, -1);
 		m_channel_state[download_channel] &= ~peer_info::bw_disk;
+		m_disk_unblocked = clock_type::now();
 		setup_receive(read_async);
 	}
 
@@ -5453,6 +5747,7 @@ namespace libtorrent
 
 		m_counters.inc_stats_counter(counters::num_peers_down_disk, -1);
 		m_channel_state[download_channel] &= ~peer_info::bw_disk;
+		m_disk_unblocked = clock_type::now();
 
 		setup_receive(read_async);
 	}
@@ -5836,9 +6131,47 @@ namespace libtorrent
 
 		TORRENT_ASSERT(bytes_transferred > 0 || error);
 
+		socket_job j;
+		j.type = socket_job::decrypt_job;
+		j.buf_size = bytes_transferred;
+		if (!error && attach_recv_crypto(j))
+		{
+			m_recv_buffer.pending_buffers(j.crypto_vec, bytes_transferred);
+#if defined TORRENT_ASIO_DEBUGGING
+			add_outstanding_async("peer_connection::on_receive_data_decrypted");
+#endif
+			j.peer = self();
+			m_decrypting = true;
+			m_ses.post_socket_job(j);
+			return;
+		}
+
 		receive_data_impl(error, bytes_transferred, 10);
 	}
 
+	void peer_connection::on_receive_data_decrypted(std::size_t bytes_transferred)
+	{
+		TORRENT_ASSERT(is_single_thread());
+#if defined TORRENT_ASIO_DEBUGGING
+		complete_async("peer_connection::on_receive_data_decrypted");
+#endif
+		TORRENT_ASSERT(m_decrypting);
+		m_decrypting = false;
+
+		TORRENT_ASSERT(m_channel_state[download_channel] & peer_info::bw_network);
+
+		if (m_disconnecting)
+		{
+			m_recv_buffer.free_disk_buffer();
+			return;
+		}
+
+		// don't read any more from the socket synchronously (read_loops = -1)
+		// that data would have to be decrypted on this thread. Leave it to
+		// the next async read, which goes via the network thread again
+		receive_data_impl(error_code(), bytes_transferred, -1);
+	}
+
 	void peer_connection::receive_data_impl(const error_code& error
 		, std::size_t bytes_transferred, int read_loops)
 	{
@@ -6227,7 +6560,14 @@ namespace libtorrent
 			boost::int32_t offset = i->send_buffer_offset;
 			offset -= bytes_transferred;
 			if (offset < 0)
+			{
 				i->send_buffer_offset = pending_block::not_in_buffer;
+				// the peer will send the blocks we requested earlier before
+				// this one. Remember how many, to not count the time they
+				// take as part of the round-trip
+				i->request_time = now;
+				i->queued_ahead = int(i - m_download_queue.begin());
+			}
 			else
 				i->send_buffer_offset = offset;
 		}
@@ -6259,7 +6599,7 @@ namespace libtorrent
 			// make sure we free up all send buffers that are owned
 			// by the disk thread
 			m_send_buffer.clear();
-			m_recv_buffer.free_disk_buffer();
+			if (!m_decrypting) m_recv_buffer.free_disk_buffer();
 			return;
 		}
 
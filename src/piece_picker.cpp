@@ -80,6 +80,7 @@ namespace libtorrent
 		, m_num_have(0)
 		, m_num_pad_files(0)
 		, m_dirty(false)
+		, m_all_dirty(false)
 	{
 #ifdef TORRENT_PICKER_LOG
 		std::cerr << "[" << this << "] " << "new piece_picker" << std::endl;
@@ -100,18 +101,21 @@ namespace libtorrent
 		// allocate the piece_map to cover all pieces
 		// and make them invalid (as if we don't have a single piece)
 		m_piece_map.resize(total_num_pieces, piece_pos(0, 0));
+		m_want_mask.assign((total_num_pieces + 31) / 32, 0);
+		m_dirty_pieces.assign((total_num_pieces + 31) / 32, 0);
 		m_reverse_cursor = int(m_piece_map.size());
 		m_cursor = 0;
 
 		for (int i = 0; i < piece_pos::num_download_categories; ++i)
 			m_downloads[i].clear();
+		m_dl_index.clear();
 		m_block_info.clear();
 
 		m_num_filtered += m_num_have_filtered;
 		m_num_have_filtered = 0;
 		m_num_have = 0;
 		m_num_passed = 0;
-		m_dirty = true;
+		set_all_dirty();
 		for (std::vector<piece_pos>::iterator i = m_piece_map.begin()
 			, end(m_piece_map.end()); i != end; ++i)
 		{
@@ -121,6 +125,7 @@ namespace libtorrent
 #ifdef TORRENT_DEBUG_REFCOUNTS
 			i->have_peers.clear();
 #endif
+			update_want_mask(int(i - m_piece_map.begin()));
 		}
 
 		for (std::vector<piece_pos>::iterator i = m_piece_map.begin() + m_cursor
@@ -148,9 +153,10 @@ namespace libtorrent
 #endif
 		
 		TORRENT_ASSERT(index >= 0);
-		TORRENT_ASSERT(index < int(m_piece_map.size()));
+		TORRENT_ASSERT(index < num_pieces());
 
-		int state = m_piece_map[index].download_queue();
+		int state = is_compact() ? int(piece_pos::piece_open)
+			: m_piece_map[index].download_queue();
 		if (state != piece_pos::piece_open)
 		{
 			std::vector<downloading_piece>::const_iterator piece = find_dl_piece(state, index);
@@ -162,7 +168,7 @@ namespace libtorrent
 		st.index = index;
 		st.writing = 0;
 		st.requested = 0;
-		if (m_piece_map[index].have())
+		if (have_piece(index))
 		{
 			st.finished = blocks_in_piece(index);
 			return;
@@ -172,7 +178,12 @@ namespace libtorrent
 
 	piece_picker::piece_stats_t piece_picker::piece_stats(int index) const
 	{
-		TORRENT_ASSERT(index >= 0 && index < int(m_piece_map.size()));
+		TORRENT_ASSERT(index >= 0 && index < num_pieces());
+		if (is_compact())
+		{
+			piece_stats_t ret = { m_seeds, -1, m_compact_have[index], false };
+			return ret;
+		}
 		piece_pos const& pp = m_piece_map[index];
 		piece_stats_t ret = {
 			pp.peer_count + m_seeds,
@@ -211,10 +222,7 @@ namespace libtorrent
 		downloading_piece ret;
 		ret.index = piece;
 		int download_state = piece_pos::piece_downloading;
-		std::vector<downloading_piece>::iterator i
-			= std::lower_bound(m_downloads[download_state].begin()
-			, m_downloads[download_state].end(), ret);
-		TORRENT_ASSERT(i == m_downloads[download_state].end() || i->index != piece);
+		TORRENT_ASSERT(m_dl_index.count(piece) == 0);
 		TORRENT_ASSERT(block_index >= 0);
 		TORRENT_ASSERT(block_index < (std::numeric_limits<boost::uint16_t>::max)());
 		ret.info_idx = block_index;
@@ -243,12 +251,13 @@ namespace libtorrent
 		VALGRIND_CHECK_VALUE_IS_DEFINED(ret.info_idx);
 		VALGRIND_CHECK_VALUE_IS_DEFINED(ret.index);
 #endif
-		i = m_downloads[download_state].insert(i, ret);
+		m_dl_index[piece] = int(m_downloads[download_state].size());
+		m_downloads[download_state].push_back(ret);
 
 #if TORRENT_USE_INVARIANT_CHECKS
 		check_piece_state();
 #endif
-		return i;
+		return m_downloads[download_state].end() - 1;
 	}
 
 	void piece_picker::erase_download_piece(std::vector<downloading_piece>::iterator i)
@@ -270,7 +279,8 @@ namespace libtorrent
 		
 		TORRENT_ASSERT(find_dl_piece(download_state, i->index) == i);
 		m_piece_map[i->index].download_state = piece_pos::piece_open;
-		m_downloads[download_state].erase(i);
+		m_dl_index.erase(i->index);
+		unlink_download_piece(download_state, i);
 
 		TORRENT_ASSERT(prev_size == m_downloads[download_state].size() + 1);
 
@@ -279,15 +289,34 @@ namespace libtorrent
 #endif
 	}
 
+	void piece_picker::unlink_download_piece(int queue, dlpiece_iter i)
+	{
+		std::vector<downloading_piece>& q = m_downloads[queue];
+		TORRENT_ASSERT(i >= q.begin() && i < q.end());
+		if (i != q.end() - 1)
+		{
+			*i = q.back();
+			m_dl_index[i->index] = int(i - q.begin());
+		}
+		q.pop_back();
+	}
+
 	std::vector<piece_picker::downloading_piece> piece_picker::get_download_queue() const
 	{
 #if TORRENT_USE_INVARIANT_CHECKS
 		check_piece_state();
 #endif
 
+		// the lists are kept in no particular order (see m_dl_index). Sort
+		// each of them, so that callers, like the unfinished pieces saved in
+		// resume data, still see them in piece order
 		std::vector<downloading_piece> ret;
 		for (int k = 0; k < piece_pos::num_download_categories; ++k)
+		{
+			int const start = int(ret.size());
 			ret.insert(ret.end(), m_downloads[k].begin(), m_downloads[k].end());
+			std::sort(ret.begin() + start, ret.end());
+		}
 		return ret;
 	}
 
@@ -332,12 +361,10 @@ namespace libtorrent
 			if (!m_downloads[k].empty())
 			{
 				for (std::vector<downloading_piece>::const_iterator i = m_downloads[k].begin();
-						i != m_downloads[k].end() - 1; ++i)
+						i != m_downloads[k].end(); ++i)
 				{
 					downloading_piece const& dp = *i;
-					downloading_piece const& next = *(i + 1);
-//					TORRENT_ASSERT(dp.finished + dp.writing >= next.finished + next.writing);
-					TORRENT_ASSERT(dp.index < next.index);
+					TORRENT_ASSERT(find_dl_piece(k, dp.index) == i);
 					TORRENT_ASSERT(int(dp.info_idx) * m_blocks_per_piece
 						+ m_blocks_per_piece <= m_block_info.size());
 					block_info const* info = blocks_for_piece(dp);
@@ -445,6 +472,18 @@ namespace libtorrent
 
 	void piece_picker::check_invariant(torrent const* t) const
 	{
+		if (is_compact())
+		{
+			TORRENT_ASSERT(m_piece_map.empty());
+			TORRENT_ASSERT(m_want_mask.empty());
+			TORRENT_ASSERT(m_num_have == m_compact_have.count());
+			TORRENT_ASSERT(m_num_filtered == num_pieces() - m_num_have);
+			TORRENT_ASSERT(m_num_have_filtered == 0);
+			for (int k = 0; k < piece_pos::num_download_categories; ++k)
+				TORRENT_ASSERT(m_downloads[k].empty());
+			return;
+		}
+
 #ifndef TORRENT_DEBUG_REFCOUNTS
 #if TORRENT_OPTIMIZE_MEMORY_USAGE
 		TORRENT_ASSERT(sizeof(piece_pos) == 4);
@@ -462,12 +501,10 @@ namespace libtorrent
 			if (!m_downloads[k].empty())
 			{
 				for (std::vector<downloading_piece>::const_iterator i = m_downloads[k].begin();
-						i != m_downloads[k].end() - 1; ++i)
+						i != m_downloads[k].end(); ++i)
 				{
 					downloading_piece const& dp = *i;
-					downloading_piece const& next = *(i + 1);
-//					TORRENT_ASSERT(dp.finished + dp.writing >= next.finished + next.writing);
-					TORRENT_ASSERT(dp.index < next.index);
+					TORRENT_ASSERT(find_dl_piece(k, dp.index) == i);
 					TORRENT_ASSERT(int(dp.info_idx) * m_blocks_per_piece
 						+ m_blocks_per_piece <= m_block_info.size());
 #if TORRENT_USE_ASSERTS
@@ -485,6 +522,11 @@ namespace libtorrent
 			}
 		}
 
+		int num_downloading = 0;
+		for (int k = 0; k < piece_pos::num_download_categories; ++k)
+			num_downloading += int(m_downloads[k].size());
+		TORRENT_ASSERT(num_downloading == int(m_dl_index.size()));
+
 		if (t != 0)
 			TORRENT_ASSERT((int)m_piece_map.size() == t->torrent_file().num_pieces());
 
@@ -583,6 +625,9 @@ namespace libtorrent
 				start = *i;
 			}
 			TORRENT_ASSERT(m_priority_boundries.back() == int(m_pieces.size()));
+			TORRENT_ASSERT(!m_all_dirty);
+			for (int i = 0; i < int(m_dirty_pieces.size()); ++i)
+				TORRENT_ASSERT(m_dirty_pieces[i] == 0);
 		}
 
 #ifdef TORRENT_NO_EXPENSIVE_INVARIANT_CHECK
@@ -632,6 +677,10 @@ namespace libtorrent
 			if (p.index == piece_pos::we_have_index)
 				++num_have;
 
+			TORRENT_ASSERT(((m_want_mask[index / 32]
+				& htonl(0x80000000 >> (index & 31))) != 0)
+				== (!p.have() && !p.filtered()));
+
 #if 0
 			if (t != 0)
 			{
@@ -710,6 +759,14 @@ namespace libtorrent
 						== m_pieces.end());
 				}
 			}
+			else if (!m_all_dirty && prio >= 0
+				&& (m_dirty_pieces[index / 32] & htonl(0x80000000 >> (index & 31))) == 0)
+			{
+				// pieces that haven't been marked as dirty are still expected
+				// to be in the right place
+				TORRENT_ASSERT(p.index < m_pieces.size());
+				TORRENT_ASSERT(m_pieces[p.index] == index);
+			}
 
 			int count_downloading = std::count_if(
 				m_downloads[piece_pos::piece_downloading].begin()
@@ -770,9 +827,106 @@ namespace libtorrent
 	}
 #endif
 
+	int piece_picker::memory_usage() const
+	{
+		int ret = sizeof(*this);
+		ret += m_piece_map.capacity() * sizeof(piece_pos);
+		ret += m_pieces.capacity() * sizeof(int);
+		ret += m_priority_boundries.capacity() * sizeof(int);
+		ret += m_want_mask.capacity() * sizeof(boost::uint32_t);
+		ret += m_dirty_pieces.capacity() * sizeof(boost::uint32_t);
+		for (int k = 0; k < piece_pos::num_download_categories; ++k)
+			ret += m_downloads[k].capacity() * sizeof(downloading_piece);
+		// roughly one node per entry plus the bucket array
+		ret += m_dl_index.size() * (sizeof(std::pair<const int, int>) + sizeof(void*))
+			+ m_dl_index.bucket_count() * sizeof(void*);
+		ret += m_block_info.capacity() * sizeof(block_info);
+		ret += m_free_block_infos.capacity() * sizeof(boost::uint16_t);
+		if (is_compact())
+			ret += (m_compact_have.num_words() + 1) * sizeof(boost::uint32_t);
+		return ret;
+	}
+
+	void piece_picker::compact(bool keep_availability)
+	{
+		TORRENT_PIECE_PICKER_INVARIANT_CHECK;
+
+		if (is_compact()) return;
+
+		for (int k = 0; k < piece_pos::num_download_categories; ++k)
+			if (!m_downloads[k].empty()) return;
+
+		if (m_dirty) update_pieces();
+
+		// there's nothing left to pick once we have all the pieces we want
+		if (m_pieces.empty())
+		{
+			std::vector<int>().swap(m_pieces);
+			std::vector<int>(1, 0).swap(m_priority_boundries);
+		}
+
+		for (int k = 0; k < piece_pos::num_download_categories; ++k)
+			std::vector<downloading_piece>().swap(m_downloads[k]);
+		boost::unordered_map<int, int>().swap(m_dl_index);
+		std::vector<block_info>().swap(m_block_info);
+		std::vector<boost::uint16_t>().swap(m_free_block_infos);
+
+		if (keep_availability || m_piece_map.empty()
+			|| m_num_have_filtered > 0) return;
+
+		// the bitfield can only tell which pieces we have. That's all there
+		// is to know as long as the rest are filtered and the ones we have
+		// are at the default priority
+		for (std::vector<piece_pos>::const_iterator i = m_piece_map.begin()
+			, end(m_piece_map.end()); i != end; ++i)
+		{
+			if (i->have() ? i->piece_priority != piece_pos::default_priority
+				: !i->filtered()) return;
+		}
+
+		m_compact_have.resize(int(m_piece_map.size()), false);
+		for (int i = 0; i < int(m_piece_map.size()); ++i)
+			if (m_piece_map[i].have()) m_compact_have.set_bit(i);
+
+		std::vector<piece_pos>().swap(m_piece_map);
+		std::vector<int>().swap(m_pieces);
+		std::vector<int>().swap(m_priority_boundries);
+		std::vector<boost::uint32_t>().swap(m_want_mask);
+		std::vector<boost::uint32_t>().swap(m_dirty_pieces);
+		m_dirty = false;
+		m_all_dirty = false;
+	}
+
+	void piece_picker::expand()
+	{
+		if (!is_compact()) return;
+
+		int const num = m_compact_have.size();
+		m_piece_map.resize(num, piece_pos(0, 0));
+		for (int i = 0; i < num; ++i)
+		{
+			piece_pos& p = m_piece_map[i];
+			if (m_compact_have[i]) p.set_have();
+			else p.piece_priority = piece_pos::filter_priority;
+		}
+		m_compact_have.clear();
+
+		// availability wasn't tracked while compact, the owner adds its
+		// peers back
+		m_seeds = 0;
+
+		m_want_mask.assign((num + 31) / 32, 0);
+		m_dirty_pieces.assign((num + 31) / 32, 0);
+		m_priority_boundries.assign(1, 0);
+		set_all_dirty();
+
+		TORRENT_PIECE_PICKER_INVARIANT_CHECK;
+	}
+
 	std::pair<int, int> piece_picker::distributed_copies() const
 	{
 		TORRENT_ASSERT(m_seeds >= 0);
+		if (is_compact()) return std::make_pair(m_seeds + (is_seeding() ? 1 : 0), 0);
 		const int num_pieces = m_piece_map.size();
 
 		if (num_pieces == 0) return std::make_pair(1, 0);
@@ -1094,7 +1248,11 @@ namespace libtorrent
 		std::cerr << "[" << this << "] " << "restore_piece(" << index << ")" << std::endl;
 #endif
 		TORRENT_ASSERT(index >= 0);
-		TORRENT_ASSERT(index < (int)m_piece_map.size());
+		TORRENT_ASSERT(index < num_pieces());
+
+		// nothing is downloading in a compact picker
+		TORRENT_ASSERT(!is_compact());
+		if (is_compact()) return;
 
 		int download_state = m_piece_map[index].download_queue();
 		TORRENT_ASSERT(download_state != piece_pos::piece_open);
@@ -1118,7 +1276,7 @@ namespace libtorrent
 #endif
 
 		if (new_priority == prev_priority) return;
-		if (m_dirty) return;
+		if (defer_update(index)) return;
 		if (prev_priority == -1) add(index);
 		else update(prev_priority, p.index);
 
@@ -1134,12 +1292,13 @@ namespace libtorrent
 #endif
 
 		++m_seeds;
+		if (is_compact()) return;
 		if (m_seeds == 1)
 		{
 			// when m_seeds is increased from 0 to 1
 			// we may have to add pieces that previously
 			// didn't have any peers
-			m_dirty = true;
+			set_all_dirty();
 		}
 #ifdef TORRENT_DEBUG_REFCOUNTS
 		for (std::vector<piece_pos>::iterator i = m_piece_map.begin()
@@ -1157,15 +1316,16 @@ namespace libtorrent
 		TORRENT_PIECE_PICKER_INVARIANT_CHECK;
 #endif
 
-		if (m_seeds > 0)
+		if (m_seeds > 0 || is_compact())
 		{
-			--m_seeds;
+			if (m_seeds > 0) --m_seeds;
+			if (is_compact()) return;
 			if (m_seeds == 0)
 			{
 				// when m_seeds is decreased from 1 to 0
 				// we may have to remove pieces that previously
 				// didn't have any peers
-				m_dirty = true;
+				set_all_dirty();
 			}
 #ifdef TORRENT_DEBUG_REFCOUNTS
 			for (std::vector<piece_pos>::iterator i = m_piece_map.begin()
@@ -1191,7 +1351,7 @@ namespace libtorrent
 			--i->peer_count;
 		}
 
-		m_dirty = true;
+		set_all_dirty();
 	}
 
 	void piece_picker::inc_refcount(int index, const void* peer)
@@ -1203,6 +1363,9 @@ namespace libtorrent
 #ifdef TORRENT_PICKER_LOG
 		std::cerr << "[" << this << "] " << "inc_refcount(" << index << ")" << std::endl;
 #endif
+		// per piece availability isn't tracked while compact
+		if (is_compact()) return;
+
 		piece_pos& p = m_piece_map[index];
 	
 #ifdef TORRENT_DEBUG_REFCOUNTS
@@ -1212,7 +1375,7 @@ namespace libtorrent
 
 		int prev_priority = p.priority(this);
 		++p.peer_count;
-		if (m_dirty) return;
+		if (defer_update(index)) return;
 		int new_priority = p.priority(this);
 		if (prev_priority == new_priority) return;
 		if (prev_priority == -1)
@@ -1221,6 +1384,46 @@ namespace libtorrent
 			update(prev_priority, p.index);
 	}
 
+	void piece_picker::inc_refcount(std::vector<int> const& indices, const void* peer)
+	{
+#ifdef TORRENT_EXPENSIVE_INVARIANT_CHECKS
+		TORRENT_PIECE_PICKER_INVARIANT_CHECK;
+#endif
+
+#ifdef TORRENT_PICKER_LOG
+		std::cerr << "[" << this << "] " << "inc_refcount(" << indices.size()
+			<< " pieces)" << std::endl;
+#endif
+
+		if (is_compact()) return;
+
+		// just like for a bitfield, if only a few pieces change, move them in
+		// m_pieces one at a time. Otherwise just update the counters, and
+		// let update_pieces() move all of them in one go
+		if (!m_dirty && int(indices.size()) < (std::min)(50, int(m_piece_map.size() / 2)))
+		{
+			for (std::vector<int>::const_iterator i = indices.begin()
+				, end(indices.end()); i != end; ++i)
+				inc_refcount(*i, peer);
+			return;
+		}
+
+		if (indices.empty()) return;
+
+		m_dirty = true;
+		for (std::vector<int>::const_iterator i = indices.begin()
+			, end(indices.end()); i != end; ++i)
+		{
+			piece_pos& p = m_piece_map[*i];
+#ifdef TORRENT_DEBUG_REFCOUNTS
+			TORRENT_ASSERT(p.have_peers.count(peer) == 0);
+			p.have_peers.insert(peer);
+#endif
+			++p.peer_count;
+			defer_update(*i);
+		}
+	}
+
 	// this function decrements the m_seeds counter
 	// and increments the peer counter on every piece
 	// instead. Sometimes of we connect to a seed that
@@ -1240,7 +1443,7 @@ namespace libtorrent
 			++i->peer_count;
 		}
 
-		m_dirty = true;
+		set_all_dirty();
 	}
 
 	void piece_picker::dec_refcount(int index, const void* peer)
@@ -1253,6 +1456,8 @@ namespace libtorrent
 		std::cerr << "[" << this << "] " << "dec_refcount(" << index << ")" << std::endl;
 #endif
 
+		if (is_compact()) return;
+
 		piece_pos& p = m_piece_map[index];
 
 		if (p.peer_count == 0)
@@ -1274,7 +1479,7 @@ namespace libtorrent
 
 		TORRENT_ASSERT(p.peer_count > 0);
 		--p.peer_count;
-		if (m_dirty) return;
+		if (defer_update(index)) return;
 		if (prev_priority >= 0) update(prev_priority, p.index);
 	}
 
@@ -1291,12 +1496,14 @@ namespace libtorrent
 		// nothing set, nothing to do here
 		if (bitmask.none_set()) return;
 
-		if (bitmask.all_set() && bitmask.size() == m_piece_map.size())
+		if (bitmask.all_set() && bitmask.size() == num_pieces())
 		{
 			inc_refcount_all(peer);
 			return;
 		}
 
+		if (is_compact()) return;
+
 		const int size = (std::min)(50, int(bitmask.size()/2));
 
 		// this is an optimization where if just a few
@@ -1364,10 +1571,9 @@ namespace libtorrent
 			}
 		}
 
-		// if we're already dirty, no point in doing anything more
-		if (m_dirty) return;
-
-		if (updated) m_dirty = true;
+		// the pieces in the bitfield are the only ones whose position in
+		// m_pieces may have changed
+		if (updated) set_dirty(bitmask);
 	}
 
 	void piece_picker::dec_refcount(bitfield const& bitmask, const void* peer)
@@ -1375,7 +1581,7 @@ namespace libtorrent
 #ifdef TORRENT_EXPENSIVE_INVARIANT_CHECKS
 		TORRENT_PIECE_PICKER_INVARIANT_CHECK;
 #endif
-		TORRENT_ASSERT(bitmask.size() <= m_piece_map.size());
+		TORRENT_ASSERT(bitmask.size() <= num_pieces());
 
 #ifdef TORRENT_PICKER_LOG
 		std::cerr << "[" << this << "] " << "dec_refcount(bitfield)" << std::endl;
@@ -1384,12 +1590,14 @@ namespace libtorrent
 		// nothing set, nothing to do here
 		if (bitmask.none_set()) return;
 
-		if (bitmask.all_set() && bitmask.size() == m_piece_map.size())
+		if (bitmask.all_set() && bitmask.size() == num_pieces())
 		{
 			dec_refcount_all(peer);
 			return;
 		}
 
+		if (is_compact()) return;
+
 		const int size = (std::min)(50, int(bitmask.size()/2));
 
 		// this is an optimization where if just a few
@@ -1443,7 +1651,8 @@ namespace libtorrent
 #endif
 					TORRENT_ASSERT(p.peer_count > 0);
 					--p.peer_count;
-					if (!m_dirty && prev_priority >= 0) update(prev_priority, p.index);
+					if (!defer_update(piece) && prev_priority >= 0)
+						update(prev_priority, p.index);
 				}
 				return;
 			}
@@ -1478,10 +1687,57 @@ namespace libtorrent
 			}
 		}
 
-		// if we're already dirty, no point in doing anything more
-		if (m_dirty) return;
+		// the pieces in the bitfield are the only ones whose position in
+		// m_pieces may have changed
+		if (updated) set_dirty(bitmask);
+	}
+
+	namespace
+	{
+		// if more than 1 / dirty_fraction of the pieces may have changed
+		// priority since m_pieces became dirty, update_pieces() rebuilds it
+		// from scratch rather than moving just those pieces
+		enum { dirty_fraction = 8 };
 
-		if (updated) m_dirty = true;
+		// returns the number of leading zero bits in v, which must not be 0
+		int leading_zeros(boost::uint32_t v)
+		{
+			TORRENT_ASSERT(v != 0);
+#if defined __GNUC__
+			return __builtin_clz(v);
+#else
+			int ret = 0;
+			if ((v & 0xffff0000) == 0) { v <<= 16; ret += 16; }
+			if ((v & 0xff000000) == 0) { v <<= 8; ret += 8; }
+			if ((v & 0xf0000000) == 0) { v <<= 4; ret += 4; }
+			if ((v & 0xc0000000) == 0) { v <<= 2; ret += 2; }
+			if ((v & 0x80000000) == 0) ret += 1;
+			return ret;
+#endif
+		}
+	}
+
+	bool piece_picker::defer_update(int index) const
+	{
+		if (!m_dirty) return false;
+		m_dirty_pieces[index / 32] |= htonl(0x80000000 >> (index & 31));
+		return true;
+	}
+
+	void piece_picker::set_dirty(bitfield const& pieces)
+	{
+		TORRENT_ASSERT(pieces.num_words() <= int(m_dirty_pieces.size()));
+		boost::uint32_t const* bits
+			= reinterpret_cast<boost::uint32_t const*>(pieces.bytes());
+		for (int i = 0; i < pieces.num_words(); ++i)
+			m_dirty_pieces[i] |= bits[i];
+		m_dirty = true;
+	}
+
+	void piece_picker::set_all_dirty()
+	{
+		m_dirty = true;
+		m_all_dirty = true;
 	}
 
 	void piece_picker::update_pieces() const
@@ -1491,6 +1747,17 @@ namespace libtorrent
 #ifdef TORRENT_PICKER_LOG
 		std::cerr << "[" << this << "] " << "update_pieces" << std::endl;
 #endif
+
+		if (!m_all_dirty && move_dirty_pieces())
+		{
+			std::fill(m_dirty_pieces.begin(), m_dirty_pieces.end(), 0);
+			m_dirty = false;
+#ifdef TORRENT_PICKER_LOG
+			print_pieces();
+#endif
+			return;
+		}
+
 		std::fill(m_priority_boundries.begin(), m_priority_boundries.end(), 0);
 		for (std::vector<piece_pos>::iterator i = m_piece_map.begin()
 			, end(m_piece_map.end()); i != end; ++i)
@@ -1548,12 +1815,136 @@ namespace libtorrent
 			m_piece_map[*i].index = index;
 		}
 
+		std::fill(m_dirty_pieces.begin(), m_dirty_pieces.end(), 0);
 		m_dirty = false;
+		m_all_dirty = false;
 #ifdef TORRENT_PICKER_LOG
 		print_pieces();
 #endif
 	}
 
+	bool piece_picker::move_dirty_pieces() const
+	{
+		TORRENT_ASSERT(m_dirty);
+		TORRENT_ASSERT(!m_all_dirty);
+
+		// when a large portion of the pieces may have moved, it's cheaper to
+		// rebuild m_pieces from scratch
+		int const max_dirty = int(m_piece_map.size()) / dirty_fraction;
+		int num_dirty = 0;
+		for (int w = 0; w < int(m_dirty_pieces.size()); ++w)
+		{
+			for (boost::uint32_t bits = m_dirty_pieces[w]; bits != 0; bits &= bits - 1)
+				++num_dirty;
+			if (num_dirty > max_dirty) return false;
+		}
+
+		// the dirty pieces that are still pickable, paired with their new
+		// priority
+		std::vector<std::pair<int, int> > moved;
+		moved.reserve(num_dirty);
+		int num_buckets = int(m_priority_boundries.size());
+		for (int w = 0; w < int(m_dirty_pieces.size()); ++w)
+		{
+			boost::uint32_t bits = ntohl(m_dirty_pieces[w]);
+			while (bits != 0)
+			{
+				int const bit = leading_zeros(bits);
+				bits &= ~(0x80000000 >> bit);
+				int const piece = w * 32 + bit;
+				int const prio = m_piece_map[piece].priority(this);
+				if (prio < 0) continue;
+				if (prio >= num_buckets) num_buckets = prio + 1;
+				moved.push_back(std::make_pair(prio, piece));
+			}
+		}
+
+		// the number of pieces left in each bucket once the dirty ones
+		// have been taken out, and the number of dirty pieces going into it
+		std::vector<int> kept(num_buckets, 0);
+		std::vector<int> added(num_buckets, 0);
+		for (std::vector<std::pair<int, int> >::const_iterator i = moved.begin()
+			, end(moved.end()); i != end; ++i)
+			++added[i->first];
+
+		// the first position in m_pieces whose piece changes. The index
+		// of every piece from here on needs to be updated
+		int first_changed = int(m_pieces.size());
+
+		// take the dirty pieces out of m_pieces, keeping the order of the
+		// remaining ones. Their priority hasn't changed, they just need to
+		// be shifted down
+		int dst = 0;
+		int start = 0;
+		for (int b = 0; b < int(m_priority_boundries.size()); ++b)
+		{
+			int const end = m_priority_boundries[b];
+			for (int i = start; i < end; ++i)
+			{
+				int const piece = m_pieces[i];
+				if (m_dirty_pieces[piece / 32] & htonl(0x80000000 >> (piece & 31)))
+				{
+					if (first_changed > i) first_changed = i;
+					continue;
+				}
+				TORRENT_ASSERT(m_piece_map[piece].priority(this) == b);
+				m_pieces[dst++] = piece;
+				++kept[b];
+			}
+			start = end;
+		}
+
+		// compute the new boundaries
+		int const num_pieces = dst + int(moved.size());
+		m_pieces.resize(num_pieces);
+		m_priority_boundries.resize(num_buckets, 0);
+		int end = 0;
+		for (int b = 0; b < num_buckets; ++b)
+		{
+			end += kept[b] + added[b];
+			m_priority_boundries[b] = end;
+		}
+		TORRENT_ASSERT(end == num_pieces);
+
+		// now spread the buckets out to make room for the dirty pieces,
+		// starting from the back to not overwrite any pieces that haven't
+		// been moved yet
+		for (int b = num_buckets - 1; b >= 0; --b)
+		{
+			dst -= kept[b];
+			int const bucket_start = m_priority_boundries[b] - kept[b] - added[b];
+			TORRENT_ASSERT(bucket_start >= dst);
+			if (bucket_start == dst) break;
+			std::copy_backward(m_pieces.begin() + dst
+				, m_pieces.begin() + dst + kept[b]
+				, m_pieces.begin() + bucket_start + kept[b]);
+		}
+
+		// then insert each dirty piece at a random position in its bucket,
+		// to keep the order of pieces with the same priority random. The
+		// free slots at the end of each bucket are used in turn (added[]
+		// counts down)
+		for (std::vector<std::pair<int, int> >::const_iterator i = moved.begin()
+			, end(moved.end()); i != end; ++i)
+		{
+			int const b = i->first;
+			int const bucket_start = b == 0 ? 0 : m_priority_boundries[b - 1];
+			int const pos = m_priority_boundries[b] - added[b];
+			--added[b];
+			if (first_changed > bucket_start) first_changed = bucket_start;
+			int const other = bucket_start + random() % (pos - bucket_start + 1);
+			m_pieces[pos] = m_pieces[other];
+			m_pieces[other] = i->second;
+		}
+
+		for (int i = first_changed; i < num_pieces; ++i)
+		{
+			TORRENT_ASSERT(m_pieces[i] >= 0 && m_pieces[i] < int(m_piece_map.size()));
+			m_piece_map[m_pieces[i]].index = i;
+		}
+		return true;
+	}
+
 	void piece_picker::piece_passed(int index)
 	{
 		piece_pos& p = m_piece_map[index];
@@ -1582,7 +1973,13 @@ namespace libtorrent
 	{
 		TORRENT_PIECE_PICKER_INVARIANT_CHECK;
 		TORRENT_ASSERT(index >= 0);
-		TORRENT_ASSERT(index < (int)m_piece_map.size());
+		TORRENT_ASSERT(index < num_pieces());
+
+		if (is_compact())
+		{
+			if (!m_compact_have[index]) return;
+			expand();
+		}
 
 		piece_pos& p = m_piece_map[index];
 
@@ -1631,8 +2028,9 @@ namespace libtorrent
 
 		--m_num_have;
 		p.set_not_have();
+		update_want_mask(index);
 
-		if (m_dirty) return;
+		if (defer_update(index)) return;
 		if (p.priority(this) >= 0) add(index);
 	}
 
@@ -1646,11 +2044,17 @@ namespace libtorrent
 		TORRENT_PIECE_PICKER_INVARIANT_CHECK;
 #endif
 		TORRENT_ASSERT(index >= 0);
-		TORRENT_ASSERT(index < (int)m_piece_map.size());
+		TORRENT_ASSERT(index < num_pieces());
 
 #ifdef TORRENT_PICKER_LOG
 		std::cerr << "[" << this << "] " << "piece_picker::we_have(" << index << ")" << std::endl;
 #endif
+		if (is_compact())
+		{
+			if (m_compact_have[index]) return;
+			expand();
+		}
+
 		piece_pos& p = m_piece_map[index];
 		int info_index = p.index;
 		int priority = p.priority(this);
@@ -1699,6 +2103,7 @@ namespace libtorrent
 		++m_num_have;
 		++m_num_passed;
 		p.set_have();
+		update_want_mask(index);
 		if (m_cursor == m_reverse_cursor - 1 &&
 			m_cursor == index)
 		{
@@ -1727,7 +2132,7 @@ namespace libtorrent
 		TORRENT_ASSERT(m_reverse_cursor > m_cursor
 			|| (m_cursor == num_pieces() && m_reverse_cursor == 0));
 		if (priority == -1) return;
-		if (m_dirty) return;
+		if (defer_update(index)) return;
 		remove(priority, info_index);
 		TORRENT_ASSERT(p.priority(this) == -1);
 	}
@@ -1745,8 +2150,14 @@ namespace libtorrent
 		TORRENT_ASSERT(new_piece_priority >= 0);
 		TORRENT_ASSERT(new_piece_priority < priority_levels);
 		TORRENT_ASSERT(index >= 0);
-		TORRENT_ASSERT(index < (int)m_piece_map.size());
-		
+		TORRENT_ASSERT(index < num_pieces());
+
+		if (is_compact())
+		{
+			if (new_piece_priority == piece_priority(index)) return false;
+			expand();
+		}
+
 		piece_pos& p = m_piece_map[index];
 
 		// if the priority isn't changed, don't do anything
@@ -1821,6 +2232,7 @@ namespace libtorrent
 		TORRENT_ASSERT(m_num_have_filtered >= 0);
 		
 		p.piece_priority = new_piece_priority;
+		update_want_mask(index);
 		int new_priority = p.priority(this);
 
 		if (p.downloading())
@@ -1833,7 +2245,7 @@ namespace libtorrent
 
 		if (prev_priority == new_priority) return ret;
 
-		if (m_dirty) return ret;
+		if (defer_update(index)) return ret;
 		if (prev_priority == -1)
 		{
 			add(index);
@@ -1848,13 +2260,24 @@ namespace libtorrent
 	int piece_picker::piece_priority(int index) const
 	{
 		TORRENT_ASSERT(index >= 0);
-		TORRENT_ASSERT(index < (int)m_piece_map.size());
+		TORRENT_ASSERT(index < num_pieces());
 
+		if (is_compact())
+			return m_compact_have[index] ? int(piece_pos::default_priority)
+				: int(piece_pos::filter_priority);
 		return m_piece_map[index].piece_priority;
 	}
 
 	void piece_picker::piece_priorities(std::vector<int>& pieces) const
 	{
+		if (is_compact())
+		{
+			pieces.resize(num_pieces());
+			for (int i = 0; i < num_pieces(); ++i)
+				pieces[i] = piece_priority(i);
+			return;
+		}
+
 		pieces.resize(m_piece_map.size());
 		std::vector<int>::iterator j = pieces.begin();
 		for (std::vector<piece_pos>::const_iterator i = m_piece_map.begin(),
@@ -1868,6 +2291,14 @@ namespace libtorrent
 
 	void piece_picker::filtered_pieces(std::vector<bool>& mask) const
 	{
+		if (is_compact())
+		{
+			mask.resize(num_pieces());
+			for (int i = 0; i < num_pieces(); ++i)
+				mask[i] = !m_compact_have[i];
+			return;
+		}
+
 		mask.resize(m_piece_map.size());
 		std::vector<bool>::iterator j = mask.begin();
 		for (std::vector<piece_pos>::const_iterator i = m_piece_map.begin(),
@@ -1897,6 +2328,94 @@ namespace libtorrent
 			return num_blocks - to_copy;
 		}
 
+		enum
+		{
+			// torrents with fewer pickable pieces than this always walk
+			// m_pieces when picking rarest first
+			min_scan_pieces = 4096,
+
+			// when picking rarest first on larger torrents, this is the
+			// portion of m_pieces (1 / scan_fraction) to walk before giving
+			// up on it and intersecting the peer's bitfield with m_want_mask
+			// instead. Looking up a piece in m_pieces costs about as much as
+			// that for a hundred or so pieces
+			scan_fraction = 128,
+
+			// the max number of pieces to collect by intersecting the
+			// peer's bitfield with m_want_mask. If the peer has more pieces
+			// we want than this, it's cheaper to keep walking m_pieces
+			max_scan_pieces = 128
+		};
+	}
+
+	bool piece_picker::free_piece_positions(bitfield const& bitmask
+		, int begin, int end, int* positions, int& num_positions) const
+	{
+		TORRENT_ASSERT(!m_dirty);
+		TORRENT_ASSERT(bitmask.num_words() == int(m_want_mask.size()));
+
+		boost::uint32_t const* have
+			= reinterpret_cast<boost::uint32_t const*>(bitmask.bytes());
+		boost::uint32_t const* want = &m_want_mask[0];
+		int const num_words = int(m_want_mask.size());
+
+		int num = 0;
+		for (int w = 0; w < num_words;)
+		{
+			// skip the words without any pieces we're interested in, 256
+			// pieces at a time. Peers that only have a few pieces we want
+			// (which is when walking m_pieces is expensive) mostly have words
+			// like that
+			int const block = (std::min)(8, num_words - w);
+			if (block == 8)
+			{
+				boost::uint32_t any = 0;
+				for (int k = 0; k < 8; ++k)
+					any |= have[w + k] & want[w + k];
+				if (any == 0)
+				{
+					w += 8;
+					continue;
+				}
+			}
+
+			for (int const last = w + block; w < last; ++w)
+			{
+				boost::uint32_t bits = ntohl(have[w] & want[w]);
+				while (bits != 0)
+				{
+					if (num == max_scan_pieces) return false;
+					int const bit = leading_zeros(bits);
+					bits &= ~(0x80000000 >> bit);
+					positions[num++] = w * 32 + bit;
+				}
+			}
+		}
+
+		// now turn the piece indices into positions in m_pieces. Pieces
+		// that aren't in m_pieces, such as the ones where all blocks have
+		// been requested, aren't picked from there
+		num_positions = 0;
+		for (int i = 0; i < num; ++i)
+		{
+			piece_pos const& p = m_piece_map[positions[i]];
+			if (p.priority(this) < 0) continue;
+			if (int(p.index) < begin || int(p.index) >= end) continue;
+			positions[num_positions++] = p.index;
+		}
+
+		std::sort(positions, positions + num_positions);
+		return true;
+	}
+
+	void piece_picker::update_want_mask(int index)
+	{
+		piece_pos const& p = m_piece_map[index];
+		boost::uint32_t const bit = htonl(0x80000000 >> (index & 31));
+		if (p.have() || p.filtered())
+			m_want_mask[index / 32] &= ~bit;
+		else
+			m_want_mask[index / 32] |= bit;
 	}
 
 	// lower availability comes first. This is a less-than comparison, it returns
@@ -1917,7 +2436,18 @@ namespace libtorrent
 		int rhs_blocks_left = m_blocks_per_piece - rhs->finished - rhs->writing
 			- rhs->requested;
 		TORRENT_ASSERT(rhs_blocks_left > 0);
-		return lhs_blocks_left < rhs_blocks_left;
+		if (lhs_blocks_left != rhs_blocks_left)
+			return lhs_blocks_left < rhs_blocks_left;
+		return lhs->index < rhs->index;
+	}
+
+	namespace
+	{
+		bool partial_compare_index(piece_picker::downloading_piece const* lhs
+			, piece_picker::downloading_piece const* rhs)
+		{
+			return lhs->index < rhs->index;
+		}
 	}
 
 	// pieces describes which pieces the peer we're requesting from has.
@@ -1956,6 +2486,9 @@ namespace libtorrent
 	{
 		TORRENT_ASSERT(peer == 0 || static_cast<torrent_peer*>(peer)->in_use);
 
+		// a compact picker has nothing left to pick
+		if (is_compact()) return;
+
 		// prevent the number of partial pieces to grow indefinitely
 		// make this scale by the number of peers we have. For large
 		// scale clients, we would have more peers, and allow a higher
@@ -2004,11 +2537,9 @@ namespace libtorrent
 		{
 			// first, allocate a small array on the stack of all the partial
 			// pieces (downloading_piece). We'll then sort this list by
-			// availability or by some other condition. The list of partial pieces
-			// in m_downloads is ordered by piece index, this is to have O(log n)
-			// lookups when finding a downloading_piece for a specific piece index.
-			// this is important and needs to stay sorted that way, that's why
-			// we're copying it here
+			// availability or by piece index. The list of partial pieces in
+			// m_downloads is not ordered (lookups go through m_dl_index), and
+			// we can't reorder it in-place, that's why we're copying it here
 			downloading_piece const** ordered_partials = TORRENT_ALLOCA(
 				downloading_piece const*, m_downloads[piece_pos::piece_downloading].size());
 			int num_ordered_partials = 0;
@@ -2047,6 +2578,11 @@ namespace libtorrent
 					, boost::bind(&piece_picker::partial_compare_rarest_first, this
 						, _1, _2));
 			}
+			else
+			{
+				std::sort(ordered_partials, ordered_partials + num_ordered_partials
+					, &partial_compare_index);
+			}
 
 			for (int i = 0; i < num_ordered_partials; ++i)
 			{
@@ -2148,51 +2684,146 @@ namespace libtorrent
 			if (m_dirty) update_pieces();
 			TORRENT_ASSERT(!m_dirty);
 
+			// on large torrents, if walking m_pieces doesn't find enough
+			// pieces the peer has fairly quickly, it probably has few pieces
+			// we want. Then intersect its bitfield with the pieces we want, a
+			// word at a time, and only visit the pieces that leaves (in
+			// m_pieces order) for the remainder of m_pieces
+			int const num_pieces = int(m_pieces.size());
+			int* positions = NULL;
+			if (num_pieces >= min_scan_pieces)
+				positions = TORRENT_ALLOCA(int, max_scan_pieces);
+			int const walk = num_pieces / scan_fraction;
+			bool scanned = false;
+
 			// in time critical mode, we're only allowed to pick high priority
 			// pieces. This is why reverse mode is disabled when we're in
 			// time-critical mode, because all high priority pieces are at the
 			// front of the list
 			if ((options & reverse) && (options & time_critical_mode) == 0)
 			{
-				for (int i = m_priority_boundries.size() - 1; i >= 0; --i)
+				for (int i = num_pieces - 1; i >= 0; --i)
 				{
-					int start = (i == 0) ? 0 : m_priority_boundries[i - 1];
-					int end = m_priority_boundries[i];
-					for (int p = end - 1; p >= start; --p)
+					int num_free;
+					if (positions && !scanned && i == num_pieces - 1 - walk
+						&& free_piece_positions(pieces, 0, i + 1, positions, num_free))
 					{
-						pc.inc_stats_counter(counters::piece_picker_reverse_rare_loops);
-
-						if (!is_piece_free(m_pieces[p], pieces)) continue;
-						num_blocks = add_blocks(m_pieces[p], pieces
-							, interesting_blocks, backup_blocks
-							, backup_blocks2, num_blocks
-							, prefer_contiguous_blocks, peer, suggested_pieces
-							, options);
-						if (num_blocks <= 0) return;
+						if (num_free == 0) break;
+						scanned = true;
+						i = num_free - 1;
 					}
+
+					pc.inc_stats_counter(counters::piece_picker_reverse_rare_loops);
+
+					int const piece = m_pieces[scanned ? positions[i] : i];
+					if (!is_piece_free(piece, pieces)) continue;
+					num_blocks = add_blocks(piece, pieces
+						, interesting_blocks, backup_blocks
+						, backup_blocks2, num_blocks
+						, prefer_contiguous_blocks, peer, suggested_pieces
+						, options);
+					if (num_blocks <= 0) return;
 				}
 			}
 			else
 			{
-				for (std::vector<int>::const_iterator i = m_pieces.begin();
-					i != m_pieces.end(); ++i)
+				// in locality mode, the pieces we've picked are recorded here,
+				// along with the suggested pieces we've already picked, so we
+				// don't pick them twice. Free pieces that aren't next to a
+				// downloading or picked piece are set aside in 'deferred' and
+				// only picked once the walk leaves their priority bucket. It's
+				// not used when picking contiguous ranges of pieces, since
+				// expand_piece() already picks runs of adjacent pieces
+				bool const adjacent = (options & prefer_adjacent)
+					&& prefer_contiguous_blocks == 0;
+				std::vector<int> picked;
+				std::vector<int> deferred;
+				int deferred_prio = -1;
+				if (adjacent) picked = suggested_pieces;
+
+				int num_positions = num_pieces;
+				for (int i = 0; i < num_positions; ++i)
 				{
+					if (positions && !scanned && i == walk
+						&& free_piece_positions(pieces, i, num_pieces, positions
+							, num_positions))
+					{
+						if (num_positions == 0) break;
+						scanned = true;
+						i = 0;
+					}
+
 					pc.inc_stats_counter(counters::piece_picker_rare_loops);
 
+					int const piece = m_pieces[scanned ? positions[i] : i];
+
 					// in time critical mode, only pick high priority pieces
 					// it's safe to break here because in this mode we
 					// pick pieces in priority order. Once we hit a lower priority
 					// piece, we won't encounter any more high priority ones
 					if ((options & time_critical_mode)
-						&& piece_priority(*i) != priority_levels - 1)
+						&& piece_priority(piece) != priority_levels - 1)
 						break;
 
-					if (!is_piece_free(*i, pieces)) continue;
+					if (!is_piece_free(piece, pieces)) continue;
+
+					if (adjacent)
+					{
+						if (std::find(picked.begin(), picked.end(), piece)
+							!= picked.end()) continue;
+
+						// we've moved on to a less rare bucket. Pick the pieces
+						// we set aside in the previous one first
+						int const prio = m_piece_map[piece].priority(this);
+						if (prio != deferred_prio)
+						{
+							for (std::vector<int>::iterator k = deferred.begin()
+								, end(deferred.end()); k != end; ++k)
+							{
+								num_blocks = add_blocks(*k, pieces
+									, interesting_blocks, backup_blocks
+									, backup_blocks2, num_blocks
+									, prefer_contiguous_blocks, peer, empty_vector
+									, options);
+								if (num_blocks <= 0) return;
+								picked.push_back(*k);
+							}
+							deferred.clear();
+							deferred_prio = prio;
+						}
+
+						// partial pieces and the ones next to a piece we're
+						// downloading are picked right away, ahead of the equally
+						// rare pieces we've set aside
+						if (!m_piece_map[piece].downloading())
+						{
+							if (!next_to_downloading(piece, picked))
+							{
+								deferred.push_back(piece);
+								continue;
+							}
+							pc.inc_stats_counter(counters::piece_picker_adjacent_picks);
+						}
+						picked.push_back(piece);
+					}
+
+					num_blocks = add_blocks(piece, pieces
+						, interesting_blocks, backup_blocks
+						, backup_blocks2, num_blocks
+						, prefer_contiguous_blocks, peer
+						, adjacent ? empty_vector : suggested_pieces
+						, options);
+					if (num_blocks <= 0) return;
+				}
 
-					num_blocks = add_blocks(*i, pieces
+				// the last bucket we walked
+				for (std::vector<int>::iterator k = deferred.begin()
+					, end(deferred.end()); k != end; ++k)
+				{
+					num_blocks = add_blocks(*k, pieces
 						, interesting_blocks, backup_blocks
 						, backup_blocks2, num_blocks
-						, prefer_contiguous_blocks, peer, suggested_pieces
+						, prefer_contiguous_blocks, peer, empty_vector
 						, options);
 					if (num_blocks <= 0) return;
 				}
@@ -2515,7 +3146,8 @@ get_out:
 	bool piece_picker::have_piece(int index) const
 	{
 		TORRENT_ASSERT(index >= 0);
-		TORRENT_ASSERT(index < int(m_piece_map.size()));
+		TORRENT_ASSERT(index < num_pieces());
+		if (is_compact()) return m_compact_have[index];
 		piece_pos const& p = m_piece_map[index];
 		return p.index == piece_pos::we_have_index;
 	}
@@ -2523,8 +3155,8 @@ get_out:
 	int piece_picker::blocks_in_piece(int index) const
 	{
 		TORRENT_ASSERT(index >= 0);
-		TORRENT_ASSERT(index < (int)m_piece_map.size() || m_piece_map.empty());
-		if (index+1 == (int)m_piece_map.size())
+		TORRENT_ASSERT(index < num_pieces() || num_pieces() == 0);
+		if (index + 1 == num_pieces())
 			return m_blocks_in_last_piece;
 		else
 			return m_blocks_per_piece;
@@ -2538,6 +3170,20 @@ get_out:
 			&& !m_piece_map[piece].filtered();
 	}
 
+	bool piece_picker::next_to_downloading(int piece
+		, std::vector<int> const& picked) const
+	{
+		int const num_pieces = int(m_piece_map.size());
+		for (int n = piece - 1; n <= piece + 1; n += 2)
+		{
+			if (n < 0 || n >= num_pieces) continue;
+			if (m_piece_map[n].downloading()) return true;
+		}
+		// picked only holds the pieces picked in this call
+		return std::find(picked.begin(), picked.end(), piece - 1) != picked.end()
+			|| std::find(picked.begin(), picked.end(), piece + 1) != picked.end();
+	}
+
 	bool piece_picker::can_pick(int piece, bitfield const& bitmask) const
 	{
 		TORRENT_ASSERT(piece >= 0 && piece < int(m_piece_map.size()));
@@ -2846,8 +3492,9 @@ get_out:
 
 	bool piece_picker::is_piece_finished(int index) const
 	{
-		TORRENT_ASSERT(index < (int)m_piece_map.size());
+		TORRENT_ASSERT(index < num_pieces());
 		TORRENT_ASSERT(index >= 0);
+		if (is_compact()) return m_compact_have[index];
 
 		piece_pos const& p = m_piece_map[index];
 		if (p.index == piece_pos::we_have_index) return true;
@@ -2881,8 +3528,9 @@ get_out:
 
 	bool piece_picker::has_piece_passed(int index) const
 	{
-		TORRENT_ASSERT(index < (int)m_piece_map.size());
+		TORRENT_ASSERT(index < num_pieces());
 		TORRENT_ASSERT(index >= 0);
+		if (is_compact()) return m_compact_have[index];
 
 		piece_pos const& p = m_piece_map[index];
 		if (p.index == piece_pos::we_have_index) return true;
@@ -2903,13 +3551,13 @@ get_out:
 		int queue, int index)
 	{
 		TORRENT_ASSERT(queue >= 0 && queue < piece_pos::num_download_categories);
-		downloading_piece cmp;
-		cmp.index = index;
-		std::vector<piece_picker::downloading_piece>::iterator i = std::lower_bound(
-			m_downloads[queue].begin(), m_downloads[queue].end(), cmp);
-		if (i == m_downloads[queue].end()) return i;
-		if (i->index == index) return i;
-		return m_downloads[queue].end();
+		boost::unordered_map<int, int>::const_iterator i = m_dl_index.find(index);
+		if (i == m_dl_index.end()
+			|| m_piece_map[index].download_queue() != queue)
+			return m_downloads[queue].end();
+		TORRENT_ASSERT(i->second >= 0 && i->second < int(m_downloads[queue].size()));
+		TORRENT_ASSERT(int(m_downloads[queue][i->second].index) == index);
+		return m_downloads[queue].begin() + i->second;
 	}
 
 	std::vector<piece_picker::downloading_piece>::const_iterator piece_picker::find_dl_piece(
@@ -2975,7 +3623,7 @@ get_out:
 		// remove the downloading_piece from the list corresponding
 		// to the old state
 		downloading_piece dp_info = *dp;
-		m_downloads[p.download_queue()].erase(dp);
+		unlink_download_piece(p.download_queue(), dp);
 
 		int prio = p.priority(this);
 		p.download_state = new_state;
@@ -2983,18 +3631,14 @@ get_out:
 		std::cerr << "[" << this << "] " << " " << dp_info.index << " state (" << current_state << " -> " << new_state << ")" << std::endl;
 #endif
 
-		// insert the downloading_piece in the list corresponding to
+		// append the downloading_piece to the list corresponding to
 		// the new state
-		downloading_piece cmp;
-		cmp.index = dp_info.index;
-		std::vector<downloading_piece>::iterator i = std::lower_bound(
-			m_downloads[p.download_queue()].begin()
-			, m_downloads[p.download_queue()].end(), cmp);
-		TORRENT_ASSERT(i == m_downloads[p.download_queue()].end()
-			|| i->index != dp_info.index);
-		i = m_downloads[p.download_queue()].insert(i, dp_info);
+		std::vector<downloading_piece>& q = m_downloads[p.download_queue()];
+		m_dl_index[dp_info.index] = int(q.size());
+		q.push_back(dp_info);
+		std::vector<downloading_piece>::iterator i = q.end() - 1;
 
-		if (!m_dirty)
+		if (!defer_update(dp_info.index))
 		{
 			if (prio == -1 && p.priority(this) != -1) add(dp_info.index);
 			else if (prio != -1) update(prio, p.index);
@@ -3032,8 +3676,9 @@ get_out:
 #endif
 		TORRENT_ASSERT(block.block_index != piece_block::invalid.block_index);
 		TORRENT_ASSERT(block.piece_index != piece_block::invalid.piece_index);
-		TORRENT_ASSERT(block.piece_index < m_piece_map.size());
+		TORRENT_ASSERT(int(block.piece_index) < num_pieces());
 
+		if (is_compact()) return false;
 		int state = m_piece_map[block.piece_index].download_queue();
 		if (state == piece_pos::piece_open) return false;
 		std::vector<downloading_piece>::const_iterator i = find_dl_piece(state
@@ -3053,8 +3698,9 @@ get_out:
 #endif
 		TORRENT_ASSERT(block.block_index != piece_block::invalid.block_index);
 		TORRENT_ASSERT(block.piece_index != piece_block::invalid.piece_index);
-		TORRENT_ASSERT(block.piece_index < m_piece_map.size());
+		TORRENT_ASSERT(int(block.piece_index) < num_pieces());
 
+		if (is_compact()) return m_compact_have[block.piece_index];
 		if (m_piece_map[block.piece_index].index == piece_pos::we_have_index) return true;
 		int state = m_piece_map[block.piece_index].download_queue();
 		if (state == piece_pos::piece_open) return false;
@@ -3075,8 +3721,9 @@ get_out:
 #endif
 		TORRENT_ASSERT(block.block_index != piece_block::invalid.block_index);
 		TORRENT_ASSERT(block.piece_index != piece_block::invalid.piece_index);
-		TORRENT_ASSERT(block.piece_index < m_piece_map.size());
+		TORRENT_ASSERT(int(block.piece_index) < num_pieces());
 
+		if (is_compact()) return m_compact_have[block.piece_index];
 		piece_pos const& p = m_piece_map[block.piece_index];
 		if (p.index == piece_pos::we_have_index) return true;
 		if (p.download_queue() == piece_pos::piece_open) return false;
@@ -3101,9 +3748,11 @@ get_out:
 		TORRENT_ASSERT(peer == 0 || static_cast<torrent_peer*>(peer)->in_use);
 		TORRENT_ASSERT(block.block_index != piece_block::invalid.block_index);
 		TORRENT_ASSERT(block.piece_index != piece_block::invalid.piece_index);
-		TORRENT_ASSERT(block.piece_index < m_piece_map.size());
+		TORRENT_ASSERT(int(block.piece_index) < num_pieces());
 		TORRENT_ASSERT(int(block.block_index) < blocks_in_piece(block.piece_index));
-		TORRENT_ASSERT(!m_piece_map[block.piece_index].have());
+		TORRENT_ASSERT(!have_piece(block.piece_index));
+
+		expand();
 
 		piece_pos& p = m_piece_map[block.piece_index];
 		if (p.download_queue() == piece_pos::piece_open)
@@ -3119,7 +3768,7 @@ get_out:
 				? piece_pos::piece_downloading_reverse
 				: piece_pos::piece_downloading;
 
-			if (prio >= 0 && !m_dirty) update(prio, p.index);
+			if (prio >= 0 && !defer_update(block.piece_index)) update(prio, p.index);
 
 			dlpiece_iter dp = add_download_piece(block.piece_index);
 			block_info* binfo = blocks_for_piece(*dp);
@@ -3162,7 +3811,7 @@ get_out:
 				// reverse peer. Make it reverse
 				int prio = p.priority(this);
 				p.make_reverse();
-				if (prio >= 0 && !m_dirty) update(prio, p.index);
+				if (prio >= 0 && !defer_update(block.piece_index)) update(prio, p.index);
 			}
 
 			TORRENT_ASSERT(info.state == block_info::state_none
@@ -3184,7 +3833,7 @@ get_out:
 				int prio = p.priority(this);
 				// make it non-reverse
 				p.unreverse();
-				if (prio >= 0 && !m_dirty) update(prio, p.index);
+				if (prio >= 0 && !defer_update(block.piece_index)) update(prio, p.index);
 			}
 
 #if TORRENT_USE_ASSERTS
@@ -3202,6 +3851,7 @@ get_out:
 		TORRENT_ASSERT(block.piece_index < m_piece_map.size());
 		TORRENT_ASSERT(int(block.block_index) < blocks_in_piece(block.piece_index));
 
+		if (is_compact()) return 0;
 		piece_pos const& p = m_piece_map[block.piece_index];
 		if (!p.downloading()) return 0;
 
@@ -3221,7 +3871,13 @@ get_out:
 	{
 		TORRENT_ASSERT(m_seeds >= 0);
 		TORRENT_PIECE_PICKER_INVARIANT_CHECK;
-	
+
+		if (is_compact())
+		{
+			avail.assign(num_pieces(), m_seeds);
+			return;
+		}
+
 		avail.resize(m_piece_map.size());
 		std::vector<int>::iterator j = avail.begin();
 		for (std::vector<piece_pos>::const_iterator i = m_piece_map.begin()
@@ -3231,7 +3887,8 @@ get_out:
 
 	int piece_picker::get_availability(int piece) const
 	{
-		TORRENT_ASSERT(piece >= 0 && piece < int(m_piece_map.size()));
+		TORRENT_ASSERT(piece >= 0 && piece < num_pieces());
+		if (is_compact()) return m_seeds;
 		return m_piece_map[piece].peer_count + m_seeds;
 	}
 
@@ -3269,7 +3926,7 @@ get_out:
 			p.download_state = piece_pos::piece_downloading;
 			// prio being -1 can happen if a block is requested before
 			// the piece priority was set to 0
-			if (prio >= 0 && !m_dirty) update(prio, p.index);
+			if (prio >= 0 && !defer_update(block.piece_index)) update(prio, p.index);
 
 			dlpiece_iter dp = add_download_piece(block.piece_index);
 			block_info* binfo = blocks_for_piece(*dp);
@@ -3420,8 +4077,8 @@ get_out:
 			erase_download_piece(i);
 			int new_priority = p.priority(this);
 
-			if (m_dirty) return;
 			if (new_priority == prev_priority) return;
+			if (defer_update(block.piece_index)) return;
 			if (prev_priority == -1) add(block.piece_index);
 			else update(prev_priority, p.index);
 		}
@@ -3476,8 +4133,8 @@ get_out:
 				erase_download_piece(i);
 				int new_priority = p.priority(this);
 
-				if (m_dirty) return;
 				if (new_priority == prev_priority) return;
+				if (defer_update(block.piece_index)) return;
 				if (prev_priority == -1) add(block.piece_index);
 				else update(prev_priority, p.index);
 			}
@@ -3506,16 +4163,17 @@ get_out:
 		TORRENT_ASSERT(peer == 0 || static_cast<torrent_peer*>(peer)->in_use);
 		TORRENT_ASSERT(block.piece_index >= 0);
 		TORRENT_ASSERT(block.block_index >= 0);
-		TORRENT_ASSERT(block.piece_index < m_piece_map.size());
+		TORRENT_ASSERT(int(block.piece_index) < num_pieces());
 		TORRENT_ASSERT(int(block.block_index) < blocks_in_piece(block.piece_index));
 
+		// if we already have this piece, just ignore this
+		if (have_piece(block.piece_index)) return;
+		expand();
+
 		piece_pos& p = m_piece_map[block.piece_index];
 
 		if (p.download_queue() == piece_pos::piece_open)
 		{
-			// if we already have this piece, just ignore this
-			if (have_piece(block.piece_index)) return;
-
 #ifdef TORRENT_EXPENSIVE_INVARIANT_CHECKS
 			TORRENT_PIECE_PICKER_INVARIANT_CHECK;
 #endif
@@ -3524,7 +4182,7 @@ get_out:
 			TORRENT_ASSERT(prio < int(m_priority_boundries.size())
 				|| m_dirty);
 			p.download_state = piece_pos::piece_downloading;
-			if (prio >= 0 && !m_dirty) update(prio, p.index);
+			if (prio >= 0 && !defer_update(block.piece_index)) update(prio, p.index);
 
 			dlpiece_iter dp = add_download_piece(block.piece_index);
 			block_info* binfo = blocks_for_piece(*dp);
@@ -3615,10 +4273,11 @@ get_out:
 
 	void piece_picker::get_downloaders(std::vector<void*>& d, int index) const
 	{
-		TORRENT_ASSERT(index >= 0 && index <= (int)m_piece_map.size());
+		TORRENT_ASSERT(index >= 0 && index <= num_pieces());
 
 		d.clear();
-		int state = m_piece_map[index].download_queue();
+		int state = is_compact() ? int(piece_pos::piece_open)
+			: m_piece_map[index].download_queue();
 		int num_blocks = blocks_in_piece(index);
 		d.reserve(num_blocks);
 
@@ -3642,6 +4301,7 @@ get_out:
 
 	void* piece_picker::get_downloader(piece_block block) const
 	{
+		if (is_compact()) return 0;
 		int state = m_piece_map[block.piece_index].download_queue();
 		if (state == piece_pos::piece_open) return 0;
 
@@ -3726,7 +4386,7 @@ get_out:
 				|| m_dirty);
 			erase_download_piece(i);
 			int prio = p.priority(this);
-			if (!m_dirty)
+			if (!defer_update(block.piece_index))
 			{
 				if (prev_prio == -1 && prio >= 0) add(block.piece_index);
 				else if (prev_prio >= 0) update(prev_prio, p.index);
@@ -105,6 +105,36 @@ int receive_buffer::reserve(boost::array<boost::asio::mutable_buffer, 2>& vec, i
 	return num_bufs;
 }
 
+void receive_buffer::pending_buffers(std::vector<boost::asio::mutable_buffer>& vec
+	, int bytes)
+{
+	TORRENT_ASSERT(bytes > 0);
+	TORRENT_ASSERT(m_recv_start == 0);
+	TORRENT_ASSERT(m_recv_pos == m_recv_end);
+
+	int regular_buf_size = regular_buffer_size();
+
+	// this mirrors the layout reserve() hands out
+	if (!m_disk_recv_buffer || regular_buf_size >= m_recv_pos + bytes)
+	{
+		TORRENT_ASSERT(m_recv_pos + bytes <= int(m_recv_buffer.size()));
+		vec.push_back(boost::asio::buffer(&m_recv_buffer[m_recv_pos], bytes));
+	}
+	else if (m_recv_pos >= regular_buf_size)
+	{
+		TORRENT_ASSERT(m_recv_pos - regular_buf_size + bytes <= m_disk_recv_buffer_size);
+		vec.push_back(boost::asio::buffer(m_disk_recv_buffer.get()
+			+ m_recv_pos - regular_buf_size, bytes));
+	}
+	else
+	{
+		vec.push_back(boost::asio::buffer(&m_recv_buffer[m_recv_pos]
+			, regular_buf_size - m_recv_pos));
+		vec.push_back(boost::asio::buffer(m_disk_recv_buffer.get()
+			, bytes - regular_buf_size + m_recv_pos));
+	}
+}
+
 int receive_buffer::advance_pos(int bytes)
 {
 	int packet_size = m_soft_packet_size ? m_soft_packet_size : m_packet_size;
@@ -177,6 +207,16 @@ buffer::const_interval receive_buffer::get() const
 		, &m_recv_buffer[0] + m_recv_start + rcv_pos);
 }
 
+buffer::const_interval receive_buffer::peek() const
+{
+	if (m_recv_buffer.empty() || m_disk_recv_buffer
+		|| m_recv_start + m_recv_pos >= m_recv_end)
+		return buffer::const_interval(0, 0);
+
+	return buffer::const_interval(&m_recv_buffer[0] + m_recv_start + m_recv_pos
+		, &m_recv_buffer[0] + m_recv_end);
+}
+
 #if !defined(TORRENT_DISABLE_ENCRYPTION) && !defined(TORRENT_DISABLE_EXTENSIONS)
 buffer::interval receive_buffer::mutable_buffer()
 {
@@ -389,6 +429,12 @@ buffer::const_interval crypto_receive_buffer::get() const
 	return recv_buffer;
 }
 
+buffer::const_interval crypto_receive_buffer::peek() const
+{
+	if (m_recv_pos != INT_MAX) return buffer::const_interval(0, 0);
+	return m_connection_buffer.peek();
+}
+
 void crypto_receive_buffer::mutable_buffers(
 	std::vector<boost::asio::mutable_buffer>& vec
 	, std::size_t bytes_transfered)
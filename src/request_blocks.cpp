@@ -36,8 +36,10 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/socket_type.hpp"
 #include "libtorrent/peer_info.hpp" // for peer_info flags
 #include "libtorrent/performance_counters.hpp" // for counters
+#include "libtorrent/torrent_peer.hpp"
 
 #include <vector>
+#include <climits> // for INT_MAX
 
 namespace libtorrent
 {
@@ -55,6 +57,18 @@ namespace libtorrent
 		return ret;
 	}
 
+	// returns the number of milliseconds until we expect the block to arrive
+	// from the peer we most recently requested it from. If we don't know who
+	// that is, or if it's no longer connected, the block won't arrive until
+	// it times out
+	int busy_block_time(piece_picker const& p, piece_block const& b)
+	{
+		torrent_peer* tp = static_cast<torrent_peer*>(p.get_downloader(b));
+		if (tp == NULL || tp->connection == NULL) return INT_MAX;
+		peer_connection const* pc = static_cast<peer_connection const*>(tp->connection);
+		return int(total_milliseconds(pc->download_queue_time()));
+	}
+
 	// the case where ignore_peer is motivated is if two peers
 	// have only one piece that we don't have, and it's the
 	// same piece for both peers. Then they might get into an
@@ -184,6 +198,16 @@ namespace libtorrent
 		// that some other peer is currently downloading
 		piece_block busy_block = piece_block::invalid;
 
+		// the time we expect busy_block to arrive from the peer currently
+		// downloading it, and the time we expect a block requested from this
+		// peer to arrive. -1 means not computed yet
+		int busy_time = -1;
+		int our_time = -1;
+
+		// set when there were busy blocks, but this peer isn't expected to
+		// deliver any of them before the peers already downloading them
+		bool busy_declined = false;
+
 		for (std::vector<piece_block>::iterator i = interesting_pieces.begin();
 			i != interesting_pieces.end(); ++i)
 		{
@@ -208,7 +232,27 @@ namespace libtorrent
 				if (dont_pick_busy_blocks) break;
 
 				TORRENT_ASSERT(p.num_peers(*i) > 0);
+
+				// we only request a busy block when we don't have any other
+				// outstanding requests (see below)
+				if (dq.size() + rq.size() > 0) continue;
+
+				// limit the number of redundant requests for a block by only
+				// requesting it if this peer is expected to deliver it sooner
+				// than the peer we already requested it from. Among those, pick
+				// the block whose current downloader is the furthest from
+				// delivering it
+				if (our_time < 0)
+					our_time = int(total_milliseconds(c.download_queue_time(t.block_size())));
+				int const holder_time = busy_block_time(p, *i);
+				if (holder_time <= our_time)
+				{
+					busy_declined = true;
+					continue;
+				}
+				if (holder_time <= busy_time) continue;
 				busy_block = *i;
+				busy_time = holder_time;
 				continue;
 			}
 
@@ -269,6 +313,8 @@ namespace libtorrent
 		if (busy_block == piece_block::invalid
 			|| dq.size() + rq.size() > 0)
 		{
+			if (busy_declined && dq.size() + rq.size() == 0)
+				ses.stats_counters().inc_stats_counter(counters::end_game_duplicates_declined);
 			return true;
 		}
 
@@ -283,7 +329,8 @@ namespace libtorrent
 		TORRENT_ASSERT(!p.is_finished(busy_block));
 		TORRENT_ASSERT(p.num_peers(busy_block) > 0);
 
-		c.add_request(busy_block, peer_connection::req_busy);
+		if (c.add_request(busy_block, peer_connection::req_busy))
+			ses.stats_counters().inc_stats_counter(counters::end_game_duplicate_requests);
 		return true;
 	}
 
@@ -192,10 +192,34 @@ void network_thread_pool::process_job(socket_job const& j, bool post)
 	if (j.type == socket_job::write_job)
 	{
 		TORRENT_ASSERT(j.peer->m_socket_is_writing);
+#if !defined(TORRENT_DISABLE_ENCRYPTION) && !defined(TORRENT_DISABLE_EXTENSIONS)
+		if (j.crypto)
+		{
+			std::vector<asio::mutable_buffer> vec(j.crypto_vec);
+			j.crypto->encrypt(vec);
+			TORRENT_ASSERT(vec.empty());
+		}
+#endif
 		j.peer->get_socket()->async_write_some(
 			*j.vec, j.peer->make_write_handler(boost::bind(
 				&peer_connection::on_send_data, j.peer, _1, _2)));
 	}
+#if !defined(TORRENT_DISABLE_ENCRYPTION) && !defined(TORRENT_DISABLE_EXTENSIONS)
+	else if (j.type == socket_job::decrypt_job)
+	{
+		TORRENT_ASSERT(j.crypto);
+		std::vector<asio::mutable_buffer> vec(j.crypto_vec);
+		int consume = 0;
+		int produce = j.buf_size;
+		int packet_size = 0;
+		j.crypto->decrypt(vec, consume, produce, packet_size);
+		TORRENT_ASSERT(consume == 0);
+		TORRENT_ASSERT(produce == j.buf_size);
+		TORRENT_ASSERT(packet_size == 0);
+		j.peer->m_ios.post(boost::bind(
+			&peer_connection::on_receive_data_decrypted, j.peer, j.buf_size));
+	}
+#endif
 	else
 	{
 		if (j.recv_buf)
@@ -1080,6 +1104,13 @@ namespace aux {
 
 		m_undead_peers.clear();
 
+		// the network threads are joined here. Any socket jobs still queued
+		// are run first, their completion handlers are posted to the main
+		// thread, which is still running
+		for (std::vector<boost::shared_ptr<network_thread_pool> >::iterator i
+			= m_net_thread_pool.begin(), end(m_net_thread_pool.end()); i != end; ++i)
+			(*i)->stop();
+
 		// it's OK to detach the threads here. The disk_io_thread
 		// has an internal counter and won't release the network
 		// thread until they're all dead (via m_work).
@@ -5861,6 +5892,7 @@ retry:
 
 		while (num_pools < m_net_thread_pool.size())
 		{
+			m_net_thread_pool.back()->stop();
 			m_net_thread_pool.erase(m_net_thread_pool.end() - 1);
 		}
 
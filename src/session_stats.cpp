@@ -281,6 +281,14 @@ namespace libtorrent
 		METRIC(ses, num_outgoing_metadata)
 		METRIC(ses, num_outgoing_extended)
 
+		// the number of HAVE messages that were held back (see
+		// settings_pack::batch_have_messages) and then written together with
+		// at least one other HAVE, i.e. the number of writes saved. And the
+		// number of held back HAVE messages that were dropped, because the
+		// peer had the piece by the time they were sent
+		METRIC(ses, num_outgoing_have_coalesced)
+		METRIC(ses, num_outgoing_have_suppressed)
+
 		// the number of wasted downloaded bytes by reason of the bytes being
 		// wasted.
 		METRIC(ses, waste_piece_timed_out)
@@ -290,6 +298,12 @@ namespace libtorrent
 		METRIC(ses, waste_piece_end_game)
 		METRIC(ses, waste_piece_closing)
 
+		// the number of bytes we sent CANCEL messages for to other peers, when
+		// a block we had requested from more than one peer arrived. This is
+		// the redundant download saved by sending the cancels right away. Any
+		// of it the peers had already sent shows up in waste_piece_cancelled
+		METRIC(ses, cancelled_duplicate_bytes)
+
 		// the number of pieces considered while picking pieces
 		METRIC(picker, piece_picker_partial_loops)
 		METRIC(picker, piece_picker_suggest_loops)
@@ -300,6 +314,11 @@ namespace libtorrent
 		METRIC(picker, piece_picker_rand_loops)
 		METRIC(picker, piece_picker_busy_loops)
 
+		// the number of pieces picked ahead of equally rare ones because
+		// they're adjacent to a piece being downloaded. See
+		// settings_pack::prefer_adjacent_pieces
+		METRIC(picker, piece_picker_adjacent_picks)
+
 		// This breaks down the piece picks into the event that
 		// triggered it
 		METRIC(picker, reject_piece_picks)
@@ -311,6 +330,17 @@ namespace libtorrent
 		METRIC(picker, interesting_piece_picks)
 		METRIC(picker, hash_fail_piece_picks)
 
+		// the number of redundant requests made for blocks already being
+		// downloaded from another peer, in end-game mode. And the number of
+		// times we didn't make one, because the peer already downloading it
+		// was expected to deliver it sooner than this one
+		METRIC(picker, end_game_duplicate_requests)
+		METRIC(picker, end_game_duplicates_declined)
+
+		// the number of bytes allocated by the piece pickers of all
+		// torrents. Torrents that are seeding normally don't have one
+		METRIC(picker, piece_picker_memory)
+
 		METRIC(disk, write_cache_blocks)
 		METRIC(disk, read_cache_blocks)
 
@@ -460,6 +490,11 @@ namespace libtorrent
 		METRIC(utp, utp_payload_pkts_out)
 		METRIC(utp, utp_invalid_pkts_in)
 		METRIC(utp, utp_redundant_pkts_in)
+		METRIC(utp, utp_packet_pool_hits)
+		METRIC(utp, utp_packet_pool_misses)
+		METRIC(utp, utp_pmtu_cache_hits)
+		METRIC(utp, utp_pmtu_probe_failures)
+		METRIC(utp, utp_zero_copy_packets_in)
 
 		// the number of uTP sockets in each respective state
 		METRIC(utp, num_utp_idle)
@@ -210,6 +210,9 @@ namespace libtorrent
 		SET_NOPREV(proxy_hostnames, true, 0),
 		SET_NOPREV(proxy_peer_connections, true, 0),
 		SET_NOPREV(auto_sequential, true, &session_impl::update_auto_sequential),
+		SET_NOPREV(batch_have_messages, false, 0),
+		SET_NOPREV(bdp_request_queue, false, 0),
+		SET_NOPREV(prefer_adjacent_pieces, false, 0),
 	};
 
 	int_setting_entry_t int_settings[settings_pack::num_int_settings] =
@@ -343,7 +346,9 @@ namespace libtorrent
 		SET(inactive_up_rate, 2048, 0),
 		SET_NOPREV(proxy_type, settings_pack::none, &session_impl::update_proxy),
 		SET_NOPREV(proxy_port, 0, &session_impl::update_proxy),
-		SET_NOPREV(i2p_port, 0, &session_impl::update_i2p_bridge)
+		SET_NOPREV(i2p_port, 0, &session_impl::update_i2p_bridge),
+		SET_NOPREV(utp_congestion_control, settings_pack::utp_ledbat, 0),
+		SET_NOPREV(utp_pmtu_cache_expiry, 600, 0)
 	};
 
 #undef SET
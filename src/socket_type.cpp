@@ -317,6 +317,22 @@ namespace libtorrent
 		}
 	}
 
+	void socket_type::set_congestion_control(int type)
+	{
+		switch (m_type)
+		{
+			case socket_type_int_impl<utp_stream>::value:
+				get<utp_stream>()->set_congestion_control(type);
+				break;
+#ifdef TORRENT_USE_OPENSSL
+			case socket_type_int_impl<ssl_stream<utp_stream> >::value:
+				get<ssl_stream<utp_stream> >()->lowest_layer().set_congestion_control(type);
+				break;
+#endif
+			default: break;
+		}
+	}
+
 	boost::uint16_t socket_type::get_close_reason()
 	{
 		switch (m_type)
@@ -187,6 +187,7 @@ namespace libtorrent
 		, m_url(p.url)
 		, m_uuid(p.uuid)
 		, m_source_feed_url(p.source_feed_url)
+		, m_prior_peers(0)
 		, m_stats_counters(ses.stats_counters())
 		, m_storage_constructor(p.storage)
 		, m_added_time(time(0))
@@ -203,6 +204,7 @@ namespace libtorrent
 		, m_num_checked_pieces(0)
 		, m_refcount(0)
 		, m_error_file(error_file_none)
+		, m_picker_memory(0)
 		, m_average_piece_time(0)
 		, m_piece_time_deviation(0)
 		, m_total_failed_bytes(0)
@@ -597,6 +599,28 @@ namespace libtorrent
 		m_current_gauge_state = new_gauge_state;
 	}
 
+	void torrent::update_picker_memory()
+	{
+		int const mem = (m_picker && !m_abort) ? m_picker->memory_usage() : 0;
+		if (mem == m_picker_memory) return;
+		inc_stats_counter(counters::piece_picker_memory, mem - m_picker_memory);
+		m_picker_memory = mem;
+	}
+
+	void torrent::compact_picker()
+	{
+		TORRENT_ASSERT(has_picker());
+		bool const keep_availability = m_share_mode
+			|| settings().get_int(settings_pack::suggest_mode)
+			== settings_pack::suggest_read_cache;
+		m_picker->compact(keep_availability);
+
+		// the virtual peers can't be removed from a compact picker, and
+		// the prior is stale by the time we download again anyway
+		if (m_picker->is_compact()) clear_availability_prior();
+		update_picker_memory();
+	}
+
 	void torrent::on_torrent_download(error_code const& ec
 		, http_parser const& parser, char const* data, int size)
 	{
@@ -1234,7 +1258,21 @@ namespace libtorrent
 
 	void torrent::need_picker()
 	{
-		if (m_picker) return;
+		if (m_picker)
+		{
+			if (!m_picker->is_compact()) return;
+
+			// the picker of a finished torrent may have been reduced to a
+			// bitfield, without piece availability. Count our peers again
+			m_picker->expand();
+			update_picker_memory();
+			for (peer_iterator i = m_connections.begin()
+				, end(m_connections.end()); i != end; ++i)
+			{
+				peer_has((*i)->get_bitfield(), *i);
+			}
+			return;
+		}
 
 		INVARIANT_CHECK;
 
@@ -1248,6 +1286,7 @@ namespace libtorrent
 		m_picker->init(blocks_per_piece, blocks_in_last_piece, m_torrent_file->num_pieces());
 
 		update_gauge();
+		update_picker_memory();
 
 		for (peer_iterator i = m_connections.begin()
 			, end(m_connections.end()); i != end; ++i)
@@ -2330,6 +2369,15 @@ namespace libtorrent
 #endif
 #endif
 
+		// seed the picker with the availability from last session until our
+		// peers have told us what they have. This doesn't depend on the files
+		// so it's used even if the rest of the resume data is rejected
+		if (m_resume_data && m_resume_data->node.type() == bdecode_node::dict_t)
+		{
+			if (bdecode_node avail = m_resume_data->node.dict_find_string("availability"))
+				load_availability_prior(avail);
+		}
+
 		// if ret != 0, it means we need a full check. We don't necessarily need
 		// that when the resume data check fails. For instance, if the resume data
 		// is incorrect, but we don't have any files, we skip the check and initialize
@@ -2396,6 +2444,7 @@ namespace libtorrent
 
 						if (has_picker() && m_picker->have_piece(piece))
 						{
+							need_picker();
 							m_picker->we_dont_have(piece);
 							update_gauge();
 						}
@@ -2482,6 +2531,7 @@ namespace libtorrent
 			int blocks_in_last_piece = ((m_torrent_file->total_size() % m_torrent_file->piece_length())
 				+ block_size() - 1) / block_size();
 			m_picker->init(blocks_per_piece, blocks_in_last_piece, m_torrent_file->num_pieces());
+			clear_availability_prior();
 		}
 
 		// file progress is allocated lazily, the first time the client
@@ -4300,8 +4350,12 @@ namespace libtorrent
 				// potential outstanding requests to this piece
 				(*p)->reject_piece(index);
 				// let peers that support the dont-have message
-				// know that we don't actually have this piece
-				(*p)->write_dont_have(index);
+				// know that we don't actually have this piece. If the
+				// HAVE is still held back by batch_have_messages, the
+				// peer was never told, so just drop it. Sending the
+				// DONT_HAVE would make it go out before the HAVE
+				if (!(*p)->cancel_pending_have(index))
+					(*p)->write_dont_have(index);
 			}
 			m_predictive_pieces.erase(i);
 		}
@@ -4534,12 +4588,33 @@ namespace libtorrent
 #endif
 	}
 		
+	void torrent::peer_has(std::vector<int> const& pieces, peer_connection const* peer)
+	{
+		if (has_picker())
+		{
+			m_picker->inc_refcount(pieces, peer);
+			for (std::vector<int>::const_iterator i = pieces.begin()
+				, end(pieces.end()); i != end; ++i)
+				update_suggest_piece(*i, 1);
+		}
+#ifdef TORRENT_DEBUG
+		else
+		{
+			TORRENT_ASSERT(is_seed() || !m_have_all);
+		}
+#endif
+	}
+
 	// when we get a bitfield message, this is called for that piece
 	void torrent::peer_has(bitfield const& bits, peer_connection const* peer)
 	{
 		if (has_picker())
 		{
 			m_picker->inc_refcount(bits, peer);
+			// peers are attached with an empty bitfield, before they've told
+			// us anything. A peer without any pieces doesn't tell us which
+			// ones are rare either
+			if (!bits.none_set()) decay_availability_prior();
 			refresh_suggest_pieces();
 		}
 #ifdef TORRENT_DEBUG
@@ -4555,6 +4630,7 @@ namespace libtorrent
 		if (has_picker())
 		{
 			m_picker->inc_refcount_all(peer);
+			decay_availability_prior();
 		}
 #ifdef TORRENT_DEBUG
 		else
@@ -4601,7 +4677,7 @@ namespace libtorrent
 		// the suggest piece feature
 		if (!has_picker()) return;
 
-		int num_peers = m_picker->get_availability(index);
+		int num_peers = real_availability(index);
 
 		TORRENT_ASSERT(has_piece_passed(index));
 
@@ -4670,6 +4746,59 @@ namespace libtorrent
 		m_need_suggest_pieces_refresh = true;
 	}
 
+	namespace
+	{
+		// a piece in the read cache, and how likely it is to stay there
+		struct cache_rank
+		{
+			int piece;
+
+			// the piece has been read more than once since it was cached
+			bool frequently_used;
+
+			// the number of blocks of this piece in the cache
+			int num_blocks;
+
+			time_point last_use;
+
+			// the hottest pieces sort first: the frequently used ones, then
+			// the ones with the most blocks cached, then most recently used
+			bool operator<(cache_rank const& rhs) const
+			{
+				if (frequently_used != rhs.frequently_used) return frequently_used;
+				if (num_blocks != rhs.num_blocks) return num_blocks > rhs.num_blocks;
+				return last_use > rhs.last_use;
+			}
+		};
+	}
+
+	std::vector<int> hottest_cached_pieces(std::vector<cached_piece_info> const& pieces)
+	{
+		std::vector<cache_rank> rank;
+		rank.reserve(pieces.size());
+		for (std::vector<cached_piece_info>::const_iterator i = pieces.begin()
+			, end(pieces.end()); i != end; ++i)
+		{
+			cache_rank r;
+			r.piece = i->piece;
+			r.frequently_used = i->frequently_used;
+			r.num_blocks = int(std::count(i->blocks.begin(), i->blocks.end(), true));
+			r.last_use = i->last_use;
+			rank.push_back(r);
+		}
+		std::sort(rank.begin(), rank.end());
+
+		// only keep the hottest half of the pieces (but at least one)
+		rank.resize((rank.size() + 1) / 2);
+
+		std::vector<int> ret;
+		ret.reserve(rank.size());
+		for (std::vector<cache_rank>::iterator i = rank.begin()
+			, end(rank.end()); i != end; ++i)
+			ret.push_back(i->piece);
+		return ret;
+	}
+
 	void torrent::do_refresh_suggest_pieces()
 	{
 		m_need_suggest_pieces_refresh = false;
@@ -4690,25 +4819,28 @@ namespace libtorrent
 			, boost::bind(&cached_piece_info::kind, _1) == cached_piece_info::write_cache)
 			, cs.pieces.end());
 
+		// and the ones we can't suggest
+		cs.pieces.erase(std::remove_if(cs.pieces.begin(), cs.pieces.end()
+			, !boost::bind(&torrent::has_piece_passed, this
+				, boost::bind(&cached_piece_info::piece, _1)))
+			, cs.pieces.end());
+
+		// rank the pieces by how likely they are to still be in the cache
+		// once a peer gets around to request them
+		std::vector<int> const rank = hottest_cached_pieces(cs.pieces);
+
 		std::vector<suggest_piece_t>& pieces = m_suggested_pieces;
 		pieces.clear();
-		pieces.reserve(cs.pieces.size());
+		pieces.reserve(rank.size());
 
-		// sort in ascending order, to get most recently used first
-		std::sort(cs.pieces.begin(), cs.pieces.end()
-			, boost::bind(&cached_piece_info::last_use, _1)
-			> boost::bind(&cached_piece_info::last_use, _2));
-
-		for (std::vector<cached_piece_info>::iterator i = cs.pieces.begin()
-			, end(cs.pieces.end()); i != end; ++i)
+		for (std::vector<int>::const_iterator i = rank.begin()
+			, end(rank.end()); i != end; ++i)
 		{
-			TORRENT_ASSERT(i->storage == m_storage.get());
-			if (!has_piece_passed(i->piece)) continue;
 			suggest_piece_t p;
-			p.piece_index = i->piece;
+			p.piece_index = *i;
 			if (has_picker())
 			{
-				p.num_peers = m_picker->get_availability(i->piece);
+				p.num_peers = real_availability(*i);
 			}
 			else
 			{
@@ -4726,12 +4858,9 @@ namespace libtorrent
 		}
 
 		// sort by rarity (stable, to maintain sort
-		// by last use)
+		// by cache heat)
 		std::stable_sort(pieces.begin(), pieces.end());
 
-		// only suggest half of the pieces
-		pieces.resize(pieces.size() / 2);
-
 		// send new suggests to peers
 		// the peers will filter out pieces we've
 		// already suggested to them
@@ -4742,6 +4871,29 @@ namespace libtorrent
 				p != m_connections.end(); ++p)
 				(*p)->send_suggest(i->piece_index);
 		}
+
+		// the peers we've choked can't request the pieces we suggest. Let
+		// them request the hottest ones anyway, since serving those from the
+		// cache is cheap. The peers cap the number of pieces we allow this
+		// way. Pieces allowed at an earlier refresh that have since been
+		// evicted are taken back first, which also makes room for new ones
+		int const num_fast = (std::min)(int(rank.size())
+			, settings().get_int(settings_pack::allowed_fast_set_size));
+		std::vector<int> cached;
+		cached.reserve(cs.pieces.size());
+		for (std::vector<cached_piece_info>::const_iterator i = cs.pieces.begin()
+			, end(cs.pieces.end()); i != end; ++i)
+			cached.push_back(i->piece);
+		std::sort(cached.begin(), cached.end());
+		for (peer_iterator p = m_connections.begin();
+			p != m_connections.end(); ++p)
+		{
+			peer_connection* peer = *p;
+			peer->withdraw_allowed_fast(cached);
+			if (!peer->is_choked() || !peer->is_peer_interested()) continue;
+			for (int i = 0; i < num_fast; ++i)
+				peer->send_allowed_fast(rank[i]);
+		}
 	}
 
 	void torrent::abort()
@@ -4755,6 +4907,7 @@ namespace libtorrent
 		update_want_peers();
 		update_want_tick();
 		update_gauge();
+		update_picker_memory();
 
 		// if the torrent is paused, it doesn't need
 		// to announce with even=stopped again.
@@ -5030,19 +5183,15 @@ namespace libtorrent
 			if (i->piece != piece) continue;
 			i->deadline = deadline;
 			i->flags = flags;
+			i->miss_posted = false;
+
+			// the list is put back in order by the next
+			// request_time_critical_pieces(). Clients streaming a file tend to
+			// update many deadlines at a time, there's no need to re-sort for
+			// each one of them
 
-			// resort i since deadline might have changed
-			while (boost::next(i) != m_time_critical_pieces.end() && i->deadline > boost::next(i)->deadline)
-			{
-				std::iter_swap(i, boost::next(i));
-				++i;
-			}
-			while (i != m_time_critical_pieces.begin() && i->deadline < boost::prior(i)->deadline)
-			{
-				std::iter_swap(i, boost::prior(i));
-				--i;
-			}
 			// just in case this piece had priority 0
+			need_picker();
 			int prev_prio = m_picker->piece_priority(piece);
 			m_picker->set_piece_priority(piece, 7);
 			if (prev_prio == 0) update_gauge();
@@ -5058,9 +5207,8 @@ namespace libtorrent
 		p.deadline = deadline;
 		p.peers = 0;
 		p.piece = piece;
-		std::vector<time_critical_piece>::iterator i = std::upper_bound(m_time_critical_pieces.begin()
-			, m_time_critical_pieces.end(), p);
-		m_time_critical_pieces.insert(i, p);
+		p.miss_posted = false;
+		m_time_critical_pieces.push_back(p);
 
 		// just in case this piece had priority 0
 		int prev_prio = m_picker->piece_priority(piece);
@@ -5134,7 +5282,11 @@ namespace libtorrent
 				alerts().emplace_alert<read_piece_alert>(
 					get_handle(), piece, error_code(boost::system::errc::operation_canceled, system_category()));
 			}
-			if (has_picker()) m_picker->set_piece_priority(piece, 1);
+			if (has_picker())
+			{
+				need_picker();
+				m_picker->set_piece_priority(piece, 1);
+			}
 			m_time_critical_pieces.erase(i);
 			return;
 		}
@@ -5151,7 +5303,11 @@ namespace libtorrent
 				m_ses.alerts().emplace_alert<read_piece_alert>(
 					get_handle(), i->piece, error_code(boost::system::errc::operation_canceled, system_category()));
 			}
-			if (has_picker()) m_picker->set_piece_priority(i->piece, 1);
+			if (has_picker())
+			{
+				need_picker();
+				m_picker->set_piece_priority(i->piece, 1);
+			}
 			i = m_time_critical_pieces.erase(i);
 		}
 	}
@@ -5189,6 +5345,85 @@ namespace libtorrent
 		}
 
 		m_picker->get_availability(avail);
+
+		// don't report the virtual peers from the resume data
+		for (int i = 0; i < int(m_availability_prior.size()); ++i)
+			avail[i] -= (std::min)(int(m_availability_prior[i]), m_prior_peers);
+	}
+
+	int torrent::real_availability(int index) const
+	{
+		TORRENT_ASSERT(has_picker());
+		int ret = m_picker->get_availability(index);
+		if (index < int(m_availability_prior.size()))
+			ret -= (std::min)(int(m_availability_prior[index]), m_prior_peers);
+		return ret;
+	}
+
+	bitfield torrent::availability_prior_bitfield(int level) const
+	{
+		bitfield ret(int(m_availability_prior.size()), false);
+		for (int i = 0; i < int(m_availability_prior.size()); ++i)
+			if (m_availability_prior[i] > level) ret.set_bit(i);
+		return ret;
+	}
+
+	void torrent::load_availability_prior(bdecode_node const& e)
+	{
+		if (is_seed()) return;
+		if (e.string_length() != m_torrent_file->num_pieces()) return;
+		if (!m_availability_prior.empty()) return;
+
+		// the number of virtual peers is capped, it only needs to be
+		// enough to tell rare pieces from common ones
+		const int max_prior_peers = 10;
+
+		boost::uint8_t const* avail
+			= reinterpret_cast<boost::uint8_t const*>(e.string_ptr());
+		const int num_pieces = e.string_length();
+		const int max_avail = *std::max_element(avail, avail + num_pieces);
+		if (max_avail == 0) return;
+
+		const int levels = (std::min)(max_avail, max_prior_peers);
+		m_availability_prior.resize(num_pieces);
+		for (int i = 0; i < num_pieces; ++i)
+			m_availability_prior[i] = (avail[i] * levels + max_avail - 1) / max_avail;
+
+		need_picker();
+		for (m_prior_peers = 0; m_prior_peers < levels; ++m_prior_peers)
+		{
+			// the torrent pointer offset by the level is a unique key
+			// for each virtual peer
+			m_picker->inc_refcount(availability_prior_bitfield(m_prior_peers)
+				, reinterpret_cast<char const*>(this) + m_prior_peers);
+		}
+
+#ifndef TORRENT_DISABLE_LOGGING
+		debug_log("loaded availability from resume data (%d virtual peers)"
+			, m_prior_peers);
+#endif
+	}
+
+	void torrent::decay_availability_prior()
+	{
+		if (m_prior_peers == 0) return;
+		TORRENT_ASSERT(has_picker());
+
+		--m_prior_peers;
+		m_picker->dec_refcount(availability_prior_bitfield(m_prior_peers)
+			, reinterpret_cast<char const*>(this) + m_prior_peers);
+
+#ifndef TORRENT_DISABLE_LOGGING
+		debug_log("removed a virtual peer from resume data (%d left)"
+			, m_prior_peers);
+#endif
+		if (m_prior_peers == 0) clear_availability_prior();
+	}
+
+	void torrent::clear_availability_prior()
+	{
+		std::vector<boost::uint8_t>().swap(m_availability_prior);
+		m_prior_peers = 0;
 	}
 
 	void torrent::set_piece_priority(int index, int priority)
@@ -6982,6 +7217,25 @@ namespace libtorrent
 				pieces[i] = m_picker->have_piece(i) ? 1 : 0;
 		}
 
+		// write the number of peers we know have each piece, capped at
+		// 255. This lets the picker tell rare pieces from common ones
+		// right after a restart, before any peer has sent its bitfield.
+		// Virtual peers that are still left from the last resume data are
+		// included, to not lose the estimate if we're restarted again
+		// before hearing from enough peers
+		if (has_picker() && !is_seed() && !m_picker->is_compact())
+		{
+			std::vector<int> avail;
+			m_picker->get_availability(avail);
+			if (!avail.empty() && *std::max_element(avail.begin(), avail.end()) > 0)
+			{
+				entry::string_type& av = ret["availability"].string();
+				av.resize(avail.size());
+				for (int i = 0; i < int(avail.size()); ++i)
+					av[i] = char((std::min)(avail[i], 255));
+			}
+		}
+
 		if (m_seed_mode)
 		{
 			TORRENT_ASSERT(m_verified.size() == pieces.size());
@@ -8017,6 +8271,9 @@ namespace libtorrent
 		// to make sure we're cleared the piece picker
 		if (is_seed()) completed();
 
+		// we won't download anything more unless piece priorities change
+		if (has_picker()) compact_picker();
+
 		send_upload_only();
 
 		state_updated();
@@ -8111,9 +8368,15 @@ namespace libtorrent
 		{
 			// no need for the piece picker anymore
 			m_picker.reset();
+			clear_availability_prior();
 			m_have_all = true;
 			update_gauge();
 		}
+		else
+		{
+			compact_picker();
+		}
+		update_picker_memory();
 	}
 
 	// called when torrent is complete. i.e. all pieces downloaded
@@ -9634,6 +9897,9 @@ namespace libtorrent
 		{
 			m_time_scaler = 10;
 
+			// the picker grows as more pieces are being downloaded at once
+			update_picker_memory();
+
 			if (settings().get_int(settings_pack::max_sparse_regions) > 0
 				&& has_picker()
 				&& m_picker->sparse_regions() > settings().get_int(settings_pack::max_sparse_regions))
@@ -9993,7 +10259,7 @@ namespace libtorrent
 		std::vector<int> avail_vec;
 		if (has_picker())
 		{
-			m_picker->get_availability(avail_vec);
+			piece_availability(avail_vec);
 		}
 		else
 		{
@@ -10260,8 +10526,31 @@ namespace libtorrent
 		}
 	}
 
-	void pick_time_critical_block(std::vector<peer_connection*>& peers
-		, std::vector<peer_connection*>& ignore_peers
+	// a peer we may request time critical blocks from, along with a
+	// prediction of when it will have delivered the blocks we've requested
+	// from it. The prediction is made once per round, and then advanced by
+	// the expected transfer time of each block we add to the peer's queue
+	struct deadline_peer
+	{
+		peer_connection* peer;
+
+		// milliseconds until this peer is expected to have sent us all the
+		// blocks we've requested from it (based on its download rate)
+		int queue_time;
+
+		// the number of milliseconds one more block adds to queue_time
+		int block_time;
+
+		// the time a block requested from this peer now is expected to
+		// arrive, relative to now
+		int next_block() const { return queue_time + block_time; }
+
+		bool operator<(deadline_peer const& rhs) const
+		{ return next_block() < rhs.next_block(); }
+	};
+
+	void pick_time_critical_block(std::vector<deadline_peer>& peers
+		, std::vector<deadline_peer>& ignore_peers
 		, std::set<peer_connection*>& peers_with_requests
 		, piece_picker::downloading_piece const& pi
 		, time_critical_piece* i
@@ -10281,18 +10570,19 @@ namespace libtorrent
 		{
 			// if this peer's download time exceeds 2 seconds, we're done.
 			// We don't want to build unreasonably long request queues
-			if (!peers.empty() && peers[0]->download_queue_time() > milliseconds(2000))
+			if (!peers.empty() && peers[0].queue_time > 2000)
 			{
 #if TORRENT_DEBUG_STREAMING > 1
-				printf("queue time: %d ms, done\n"
-					, int(total_milliseconds(peers[0]->download_queue_time())));
+				printf("queue time: %d ms, done\n", peers[0].queue_time);
 #endif
 				break;
 			}
 
-			// pick the peer with the lowest download_queue_time that has i->piece
-			std::vector<peer_connection*>::iterator p = std::find_if(peers.begin(), peers.end()
-				, boost::bind(&peer_connection::has_piece, _1, i->piece));
+			// pick the peer with the earliest expected block arrival that has
+			// i->piece
+			std::vector<deadline_peer>::iterator p = std::find_if(peers.begin(), peers.end()
+				, boost::bind(&peer_connection::has_piece
+					, boost::bind(&deadline_peer::peer, _1), i->piece));
 
 			// obviously we'll have to skip it if we don't have a peer that has
 			// this piece
@@ -10303,7 +10593,7 @@ namespace libtorrent
 #endif
 				break;
 			}
-			peer_connection& c = **p;
+			peer_connection& c = *p->peer;
 
 			interesting_blocks.clear();
 			backup1.clear();
@@ -10426,6 +10716,9 @@ namespace libtorrent
 					, b.piece_index, b.block_index);
 #endif
 				peers_with_requests.insert(peers_with_requests.begin(), &c);
+
+				// the block was added to this peer's queue
+				p->queue_time += p->block_time;
 			}
 
 			if (!busy_mode) i->last_requested = now;
@@ -10442,9 +10735,8 @@ namespace libtorrent
 				continue;
 			}
 
-			// resort p, since it will have a higher download_queue_time now
-			while (p != peers.end()-1 && (*p)->download_queue_time()
-				> (*(p+1))->download_queue_time())
+			// move p back, since its next block will arrive later now
+			while (p != peers.end()-1 && *(p+1) < *p)
 			{
 				std::iter_swap(p, p+1);
 				++p;
@@ -10457,26 +10749,42 @@ namespace libtorrent
 		TORRENT_ASSERT(is_single_thread());
 		TORRENT_ASSERT(!upload_mode());
 
-		// build a list of peers and sort it by download_queue_time
-		// we use this sorted list to determine which peer we should
-		// request a block from. The earlier a peer is in the list,
-		// the sooner we will fully download the block we request.
-		std::vector<peer_connection*> peers;
+		// set_piece_deadline() doesn't keep the list in order. Sort it once
+		// here instead
+		if (std::adjacent_find(m_time_critical_pieces.begin(), m_time_critical_pieces.end()
+			, boost::bind(&time_critical_piece::deadline, _1)
+			> boost::bind(&time_critical_piece::deadline, _2))
+			!= m_time_critical_pieces.end())
+		{
+			std::stable_sort(m_time_critical_pieces.begin(), m_time_critical_pieces.end());
+		}
+
+		// build a list of peers along with the time we expect a block
+		// requested from them to arrive, and sort it by that. We use this
+		// sorted list to determine which peer we should request a block from.
+		// The earlier a peer is in the list, the sooner we will fully download
+		// the block we request.
+		std::vector<deadline_peer> peers;
 		peers.reserve(m_connections.size());
 
-		// some peers are marked as not being able to request time critical
-		// blocks from. For instance, peers that have choked us, peers that are
-		// on parole (i.e. they are believed to have sent us bad data), peers
-		// that are being disconnected, in upload mode etc.
-		std::remove_copy_if(m_connections.begin(), m_connections.end()
-			, std::back_inserter(peers), !boost::bind(&peer_connection::can_request_time_critical, _1));
+		const int bs = block_size();
+		for (std::vector<peer_connection*>::const_iterator i = m_connections.begin()
+			, end(m_connections.end()); i != end; ++i)
+		{
+			// some peers are marked as not being able to request time critical
+			// blocks from. For instance, peers that have choked us, peers that
+			// are on parole (i.e. they are believed to have sent us bad data),
+			// peers that are being disconnected, in upload mode etc.
+			if (!(*i)->can_request_time_critical()) continue;
+			deadline_peer dp;
+			dp.peer = *i;
+			dp.queue_time = int(total_milliseconds((*i)->download_queue_time()));
+			dp.block_time = (std::max)(int(total_milliseconds(
+				(*i)->download_queue_time(bs))) - dp.queue_time, 1);
+			peers.push_back(dp);
+		}
 
-		// sort by the time we believe it will take this peer to send us all
-		// blocks we've requested from it. The shorter time, the better candidate
-		// it is to request a time critical block from.
-		std::sort(peers.begin(), peers.end()
-			, boost::bind(&peer_connection::download_queue_time, _1, 16*1024)
-			< boost::bind(&peer_connection::download_queue_time, _2, 16*1024));
+		std::sort(peers.begin(), peers.end());
 
 		// remove the bottom 10% of peers from the candidate set.
 		// this is just to remove outliers that might stall downloads
@@ -10495,7 +10803,7 @@ namespace libtorrent
 		// in order to give priority to other peers. They should be used for
 		// subsequent pieces, so they are stored in this vector until the
 		// piece is done
-		std::vector<peer_connection*> ignore_peers;
+		std::vector<deadline_peer> ignore_peers;
 
 		time_point now = clock_type::now();
 
@@ -10607,14 +10915,12 @@ namespace libtorrent
 
 				// TODO: instead of resorting the whole list, insert the peers
 				// directly into the right place
-				std::sort(peers.begin(), peers.end()
-					, boost::bind(&peer_connection::download_queue_time, _1, 16*1024)
-					< boost::bind(&peer_connection::download_queue_time, _2, 16*1024));
+				std::sort(peers.begin(), peers.end());
 			}
 
 			// if this peer's download time exceeds 2 seconds, we're done.
 			// We don't want to build unreasonably long request queues
-			if (!peers.empty() && peers[0]->download_queue_time() > milliseconds(2000))
+			if (!peers.empty() && peers[0].queue_time > 2000)
 				break;
 		}
 
@@ -10624,6 +10930,88 @@ namespace libtorrent
 		{
 			(*i)->send_block_requests();
 		}
+
+		if (!alerts().should_post<deadline_miss_alert>()) return;
+
+		// let the client know about pieces we don't expect to make it in
+		// time, based on the predicted arrival of their last requested block.
+		// The prediction is made from scratch every time, since requests
+		// may have been cancelled, timed out or sped up since the last one.
+		// Pieces we haven't been able to request yet are late once their
+		// deadline has passed.
+		// Only pieces within the deadline horizon of the loop above can have
+		// had their requests re-planned, and the prediction walks the request
+		// queues of every downloader of the piece. So stop at the horizon,
+		// and bound the number of predictions per call. The pieces are
+		// sorted by deadline, the ones left out are the least urgent and are
+		// checked once the pieces ahead of them are done or reported
+		const int max_predictions = 16;
+		int predictions = 0;
+		for (std::vector<time_critical_piece>::iterator i = m_time_critical_pieces.begin()
+			, end(m_time_critical_pieces.end()); i != end; ++i)
+		{
+			if (i->miss_posted) continue;
+
+			if (predictions == max_predictions) break;
+			if (i->deadline > now + milliseconds(m_average_piece_time
+				+ m_piece_time_deviation * 4 + 1000))
+				break;
+			++predictions;
+
+			time_point const completion = predicted_completion(i->piece, now);
+			if (completion <= i->deadline) continue;
+
+			i->miss_posted = true;
+			alerts().emplace_alert<deadline_miss_alert>(get_handle(), i->piece
+				, int(total_milliseconds(completion - i->deadline)));
+		}
+	}
+
+	time_point torrent::predicted_completion(int const piece, time_point const now) const
+	{
+		TORRENT_ASSERT(is_single_thread());
+		time_point ret = now;
+		if (!has_picker()) return ret;
+
+		std::vector<void*> downloaders;
+		m_picker->get_downloaders(downloaders, piece);
+		const int bs = block_size();
+		for (int j = 0; j < int(downloaders.size()); ++j)
+		{
+			torrent_peer* tp = static_cast<torrent_peer*>(downloaders[j]);
+			if (tp == 0 || tp->connection == 0) continue;
+
+			piece_block const b(piece, j);
+			if (m_picker->is_downloaded(b)) continue;
+
+			peer_connection* c = static_cast<peer_connection*>(tp->connection);
+
+			// time critical blocks are requested just in time, so the
+			// current rate of a peer mostly reflects how much we've asked
+			// of it. The peak rate is closer to what it can deliver. Peers
+			// that haven't sent us anything yet aren't used to predict a miss
+			int const rate = (std::max)(c->statistics().download_payload_rate()
+				, c->download_rate_peak());
+			if (rate <= 0) continue;
+
+			// the peer sends the blocks we requested ahead of this one first
+			std::vector<pending_block> const& dq = c->download_queue();
+			std::vector<pending_block>::const_iterator k
+				= std::find_if(dq.begin(), dq.end(), has_block(b));
+			int ahead = int(k - dq.begin());
+			if (k == dq.end())
+			{
+				std::vector<pending_block> const& rq = c->request_queue();
+				k = std::find_if(rq.begin(), rq.end(), has_block(b));
+				if (k == rq.end()) continue;
+				ahead = int(dq.size() + (k - rq.begin()));
+			}
+
+			time_point const arrival = now
+				+ milliseconds(boost::int64_t(ahead + 1) * bs * 1000 / rate);
+			if (arrival > ret) ret = arrival;
+		}
+		return ret;
 	}
 
 	std::set<std::string> torrent::web_seeds(web_seed_entry::type_t type) const
@@ -11510,7 +11898,40 @@ namespace libtorrent
 		}
 		st->num_pieces = num_have();
 		st->num_seeds = num_seeds();
-		if ((flags & torrent_handle::query_distributed_copies) && m_picker.get())
+		if ((flags & torrent_handle::query_distributed_copies) && m_picker.get()
+			&& m_prior_peers > 0)
+		{
+			// the picker counts the virtual peers from the resume data. Work
+			// it out from the real availability instead, counting ourself
+			// as one more copy of the pieces we have
+			std::vector<int> avail;
+			piece_availability(avail);
+			int min_availability = INT_MAX;
+			int num_min = 0;
+			for (int i = 0; i < int(avail.size()); ++i)
+			{
+				int const copies = avail[i] + (m_picker->have_piece(i) ? 1 : 0);
+				if (copies < min_availability)
+				{
+					min_availability = copies;
+					num_min = 1;
+				}
+				else if (copies == min_availability)
+				{
+					++num_min;
+				}
+			}
+			st->distributed_full_copies = min_availability;
+			st->distributed_fraction = (int(avail.size()) - num_min) * 1000
+				/ int(avail.size());
+#if TORRENT_NO_FPU
+			st->distributed_copies = -1.f;
+#else
+			st->distributed_copies = st->distributed_full_copies
+				+ float(st->distributed_fraction) / 1000;
+#endif
+		}
+		else if ((flags & torrent_handle::query_distributed_copies) && m_picker.get())
 		{
 			boost::tie(st->distributed_full_copies, st->distributed_fraction) =
 				m_picker->distributed_copies();
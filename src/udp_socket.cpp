@@ -55,6 +55,26 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/debug.hpp"
 #endif
 
+#if TORRENT_USE_MMSG
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <cstring> // for memcpy
+
+// these were added in linux 4.18 and 5.0 respectively. If we're built
+// against older headers, enable_offload() will still find out at run
+// time whether the kernel supports them
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#endif
+
 using namespace libtorrent;
 
 udp_socket::udp_socket(asio::io_service& ios)
@@ -64,6 +84,21 @@ udp_socket::udp_socket(asio::io_service& ios)
 	, m_buf_size(0)
 	, m_new_buf_size(0)
 	, m_buf(0)
+#if TORRENT_USE_MMSG
+	, m_mmsg_slot_size(0)
+	, m_mmsg_headroom(0)
+	, m_mmsg_slots(0)
+	, m_mmsg_spill_size(0)
+	, m_dispatch_buf(0)
+	, m_dispatch_slot(-1)
+	, m_send_cork(0)
+	, m_v4_gso(false)
+#if TORRENT_USE_IPV6
+	, m_v6_gso(false)
+#endif
+	, m_gro(false)
+	, m_mmsg_unsupported(false)
+#endif
 #if TORRENT_USE_IPV6
 	, m_ipv6_sock(ios)
 #endif
@@ -74,6 +109,7 @@ udp_socket::udp_socket(asio::io_service& ios)
 #endif
 	, m_socks5_sock(ios)
 	, m_resolver(ios)
+	, m_rx_headroom(0)
 	, m_queue_packets(false)
 	, m_tunnel_packets(false)
 	, m_force_proxy(false)
@@ -102,6 +138,9 @@ udp_socket::udp_socket(asio::io_service& ios)
 udp_socket::~udp_socket()
 {
 	free(m_buf);
+#if TORRENT_USE_MMSG
+	free_receive_ring();
+#endif
 #if TORRENT_USE_IPV6
 	TORRENT_ASSERT_VAL(m_v6_outstanding == 0, m_v6_outstanding);
 #endif
@@ -207,36 +246,104 @@ void udp_socket::send(udp::endpoint const& ep, char const* p, int len
 
 	if (m_force_proxy) return;
 
+#if TORRENT_USE_MMSG
+	if (flags & dont_batch)
+	{
+		// keep the packets in the order they were sent
+		if (!flush_send())
+		{
+			ec = error::would_block;
+			return;
+		}
+	}
+	else if ((m_send_cork > 0 && !m_mmsg_unsupported) || !m_send_batch.empty())
+	{
+		// if the batch is full, or it's left over from a flush that
+		// would have blocked, try to make room for this packet
+		if (m_send_cork == 0 || int(m_send_batch.size()) >= mmsg_batch)
+			flush_send_batch();
+
+		if (!m_send_batch.empty() && (m_send_cork == 0
+			|| int(m_send_batch.size()) >= mmsg_batch))
+		{
+			// the socket is still blocked. Report it the same way
+			// send_to() would, to apply back-pressure on the sender
+			ec = error::would_block;
+			return;
+		}
+
+		if (m_send_cork > 0)
+		{
+			batched_packet bp;
 #if TORRENT_USE_IPV6
-	if (ep.address().is_v6() && m_ipv6_sock.is_open())
-		m_ipv6_sock.send_to(asio::buffer(p, len), ep, 0, ec);
-	else
+			bp.sock = (ep.address().is_v6() && m_ipv6_sock.is_open())
+				? &m_ipv6_sock : &m_ipv4_sock;
+#else
+			bp.sock = &m_ipv4_sock;
+#endif
+			bp.ep = ep;
+			bp.offset = int(m_send_batch_buf.size());
+			bp.len = len;
+			m_send_batch_buf.insert(m_send_batch_buf.end(), p, p + len);
+			m_send_batch.push_back(bp);
+			return;
+		}
+	}
 #endif
-		m_ipv4_sock.send_to(asio::buffer(p, len), ep, 0, ec);
+
+#if TORRENT_USE_IPV6
+	udp::socket* s = (ep.address().is_v6() && m_ipv6_sock.is_open())
+		? &m_ipv6_sock : &m_ipv4_sock;
+#else
+	udp::socket* s = &m_ipv4_sock;
+#endif
+	s->send_to(asio::buffer(p, len), ep, 0, ec);
 
 	if (ec == error::would_block || ec == error::try_again)
-	{
+		subscribe_writable(s);
+}
+
+bool udp_socket::flush_send()
+{
+#if TORRENT_USE_MMSG
+	if (!m_send_batch.empty()) flush_send_batch();
+	return m_send_batch.empty();
+#else
+	return true;
+#endif
+}
+
+void udp_socket::cork_send()
+{
+#if TORRENT_USE_MMSG
+	++m_send_cork;
+#endif
+}
+
+void udp_socket::uncork_send()
+{
+#if TORRENT_USE_MMSG
+	TORRENT_ASSERT(m_send_cork > 0);
+	if (--m_send_cork == 0) flush_send_batch();
+#endif
+}
+
+void udp_socket::subscribe_writable(udp::socket* s)
+{
 #if TORRENT_USE_IPV6
-		if (ep.address().is_v6() && m_ipv6_sock.is_open())
-		{
-			if (!m_v6_write_subscribed)
-			{
-				m_ipv6_sock.async_send(asio::null_buffers()
-					, boost::bind(&udp_socket::on_writable, this, _1, &m_ipv6_sock));
-				m_v6_write_subscribed = true;
-			}
-		}
-		else
+	if (s == &m_ipv6_sock)
+	{
+		if (m_v6_write_subscribed) return;
+		m_v6_write_subscribed = true;
+	}
+	else
 #endif
-		{
-			if (!m_v4_write_subscribed)
-			{
-				m_ipv4_sock.async_send(asio::null_buffers()
-					, boost::bind(&udp_socket::on_writable, this, _1, &m_ipv4_sock));
-				m_v4_write_subscribed = true;
-			}
-		}
+	{
+		if (m_v4_write_subscribed) return;
+		m_v4_write_subscribed = true;
 	}
+	s->async_send(asio::null_buffers()
+		, boost::bind(&udp_socket::on_writable, this, _1, s));
 }
 
 void udp_socket::on_writable(error_code const& ec, udp::socket* s)
@@ -248,9 +355,350 @@ void udp_socket::on_writable(error_code const& ec, udp::socket* s)
 #endif
 		m_v4_write_subscribed = false;
 
+#if TORRENT_USE_MMSG
+	// packets held back by a blocked sendmmsg() go out before
+	// anyone else gets to send
+	if (!m_send_batch.empty() && m_send_cork == 0)
+		flush_send_batch();
+#endif
+
 	call_writable_handler();
 }
 
+#if TORRENT_USE_MMSG
+namespace
+{
+	// the largest super-packet we hand to the kernel for segmentation,
+	// and the max number of segments in it
+	const int max_gso_size = 63 * 1024;
+	const int max_gso_segments = 64;
+
+	// the receive buffer size needed to hold a coalesced GRO packet,
+	// slot and spill buffer together
+	const int gro_slot_size = 65535;
+}
+
+void udp_socket::enable_offload(udp::socket* s)
+{
+	// UDP_SEGMENT is a per-packet control message, but the socket option
+	// is only known to kernels that support it. Use it to probe, since
+	// older kernels may silently ignore the control message and send a
+	// single huge datagram instead
+	int val = 0;
+	socklen_t len = sizeof(val);
+	gso_enabled(s) = ::getsockopt(s->native_handle(), SOL_UDP, UDP_SEGMENT
+		, &val, &len) == 0;
+
+	if (m_mmsg_unsupported) return;
+
+	val = 1;
+	if (::setsockopt(s->native_handle(), SOL_UDP, UDP_GRO
+		, &val, sizeof(val)) == 0)
+		m_gro = true;
+}
+
+bool& udp_socket::gso_enabled(udp::socket* s)
+{
+#if TORRENT_USE_IPV6
+	if (s == &m_ipv6_sock) return m_v6_gso;
+#endif
+	TORRENT_ASSERT(s == &m_ipv4_sock);
+	return m_v4_gso;
+}
+
+// called when we have to fall back to single packet reads, which can't
+// split up coalesced packets
+void udp_socket::disable_gro()
+{
+	if (!m_gro) return;
+
+	int val = 0;
+	::setsockopt(m_ipv4_sock.native_handle(), SOL_UDP, UDP_GRO
+		, &val, sizeof(val));
+#if TORRENT_USE_IPV6
+	::setsockopt(m_ipv6_sock.native_handle(), SOL_UDP, UDP_GRO
+		, &val, sizeof(val));
+#endif
+	m_gro = false;
+}
+
+void udp_socket::flush_send_batch()
+{
+	TORRENT_ASSERT(is_single_thread());
+
+	while (!m_send_batch.empty())
+	{
+		if (m_mmsg_unsupported)
+		{
+			// what's left from before we found out sendmmsg() isn't
+			// supported is sent one packet at a time
+			batched_packet const& bp = m_send_batch[0];
+			error_code ec;
+			bp.sock->send_to(asio::buffer(&m_send_batch_buf[bp.offset], bp.len)
+				, bp.ep, 0, ec);
+			if (ec == error::would_block || ec == error::try_again)
+			{
+				subscribe_writable(bp.sock);
+				return;
+			}
+			m_send_batch.erase(m_send_batch.begin());
+			continue;
+		}
+
+		// sendmmsg() sends to a single socket, so send the longest
+		// prefix of the batch bound for the same socket as the first
+		// packet
+		udp::socket* s = m_send_batch[0].sock;
+		bool& gso = gso_enabled(s);
+		mmsghdr hdr[mmsg_batch];
+		iovec iov[mmsg_batch];
+		char ctrl[mmsg_batch][CMSG_SPACE(sizeof(boost::uint16_t))];
+		// the number of packets in the send batch each message covers
+		int packets[mmsg_batch];
+		int num = 0;
+		int idx = 0;
+		for (; idx < int(m_send_batch.size()) && num < mmsg_batch; ++num)
+		{
+			batched_packet& bp = m_send_batch[idx];
+			if (bp.sock != s) break;
+
+			// the payloads are stored back-to-back, so a run of packets
+			// to the same endpoint is a single contiguous buffer. With GSO,
+			// every segment but the last one must be exactly the size of
+			// the first
+			int run = 1;
+			int size = bp.len;
+			if (gso)
+			{
+				while (idx + run < int(m_send_batch.size())
+					&& run < max_gso_segments)
+				{
+					batched_packet const& next = m_send_batch[idx + run];
+					if (next.sock != s || next.ep != bp.ep
+						|| next.len > bp.len
+						|| size + next.len > max_gso_size)
+						break;
+					TORRENT_ASSERT(next.offset == bp.offset + size);
+					size += next.len;
+					++run;
+					if (next.len < bp.len) break;
+				}
+			}
+
+			iov[num].iov_base = &m_send_batch_buf[bp.offset];
+			iov[num].iov_len = size;
+			std::memset(&hdr[num], 0, sizeof(hdr[num]));
+			hdr[num].msg_hdr.msg_name = bp.ep.data();
+			hdr[num].msg_hdr.msg_namelen = bp.ep.size();
+			hdr[num].msg_hdr.msg_iov = &iov[num];
+			hdr[num].msg_hdr.msg_iovlen = 1;
+			if (run > 1)
+			{
+				hdr[num].msg_hdr.msg_control = ctrl[num];
+				hdr[num].msg_hdr.msg_controllen = sizeof(ctrl[num]);
+				cmsghdr* cm = CMSG_FIRSTHDR(&hdr[num].msg_hdr);
+				cm->cmsg_level = SOL_UDP;
+				cm->cmsg_type = UDP_SEGMENT;
+				cm->cmsg_len = CMSG_LEN(sizeof(boost::uint16_t));
+				boost::uint16_t const seg = boost::uint16_t(bp.len);
+				std::memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+			}
+			packets[num] = run;
+			idx += run;
+		}
+
+		int sent = ::sendmmsg(s->native_handle(), hdr, num, MSG_DONTWAIT);
+		if (sent < 0)
+		{
+			int const err = errno;
+			if (err == EAGAIN || err == EWOULDBLOCK)
+			{
+				// keep the remaining packets until the socket
+				// becomes writable again
+				subscribe_writable(s);
+				return;
+			}
+			if (packets[0] > 1 && (err == EIO || err == EINVAL
+				|| err == ENOPROTOOPT || err == EOPNOTSUPP))
+			{
+				// the kernel or the device can't segment for us (EIO
+				// means there's no checksum offload). Fall back to
+				// plain packets and try again
+				gso = false;
+				continue;
+			}
+			if (err == ENOSYS || err == EOPNOTSUPP)
+			{
+				m_mmsg_unsupported = true;
+				disable_gro();
+				continue;
+			}
+			// the first message failed for some other reason. Drop it,
+			// just like the kernel would drop a datagram it couldn't
+			// deliver
+			sent = 1;
+		}
+		int erase = 0;
+		for (int i = 0; i < sent; ++i) erase += packets[i];
+		m_send_batch.erase(m_send_batch.begin(), m_send_batch.begin() + erase);
+	}
+	m_send_batch_buf.clear();
+}
+
+void udp_socket::free_receive_ring()
+{
+	for (std::vector<char*>::iterator i = m_mmsg_bufs.begin()
+		, end(m_mmsg_bufs.end()); i != end; ++i)
+		free(*i);
+	m_mmsg_bufs.clear();
+	for (std::vector<char*>::iterator i = m_mmsg_spill.begin()
+		, end(m_mmsg_spill.end()); i != end; ++i)
+		free(*i);
+	m_mmsg_spill.clear();
+}
+
+// receive as many datagrams as possible with recvmmsg() and dispatch
+// them. Returns false if the batched receive path isn't available, in
+// which case the caller falls back to receiving one packet at a time
+bool udp_socket::read_batch(udp::socket* s)
+{
+	for (;;)
+	{
+		int const slot_size = m_buf_size;
+		int const spill_size = m_gro
+			? (std::max)(gro_slot_size - m_buf_size, 0) : 0;
+		if (m_mmsg_slot_size != slot_size || m_mmsg_headroom != m_rx_headroom
+			|| m_mmsg_spill_size != spill_size)
+		{
+			// coalesced packets need a lot more room per slot. Use fewer
+			// of them to keep the ring size reasonable
+			int const slots = m_gro ? mmsg_batch / 4 : mmsg_batch;
+			free_receive_ring();
+			bool no_mem = false;
+			for (int i = 0; i < slots && !no_mem; ++i)
+			{
+				char* b = (char*)malloc(std::size_t(m_rx_headroom + slot_size));
+				if (b) m_mmsg_bufs.push_back(b);
+				char* spill = (b && spill_size > 0)
+					? (char*)malloc(std::size_t(slot_size + spill_size)) : 0;
+				if (spill) m_mmsg_spill.push_back(spill);
+				no_mem = b == 0 || (spill_size > 0 && spill == 0);
+			}
+			if (no_mem) free_receive_ring();
+			m_mmsg_slot_size = no_mem ? 0 : slot_size;
+			m_mmsg_headroom = no_mem ? 0 : m_rx_headroom;
+			m_mmsg_spill_size = no_mem ? 0 : spill_size;
+			m_mmsg_slots = no_mem ? 0 : slots;
+			if (no_mem)
+			{
+				disable_gro();
+				return false;
+			}
+		}
+
+		mmsghdr hdr[mmsg_batch];
+		iovec iov[mmsg_batch][2];
+		sockaddr_storage addr[mmsg_batch];
+		char ctrl[mmsg_batch][CMSG_SPACE(sizeof(int))];
+		for (int i = 0; i < m_mmsg_slots; ++i)
+		{
+			iov[i][0].iov_base = m_mmsg_bufs[i] + m_mmsg_headroom;
+			iov[i][0].iov_len = m_mmsg_slot_size;
+			std::memset(&hdr[i], 0, sizeof(hdr[i]));
+			hdr[i].msg_hdr.msg_name = &addr[i];
+			hdr[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+			hdr[i].msg_hdr.msg_iov = iov[i];
+			hdr[i].msg_hdr.msg_iovlen = 1;
+			if (m_mmsg_spill_size > 0)
+			{
+				iov[i][1].iov_base = m_mmsg_spill[i] + m_mmsg_slot_size;
+				iov[i][1].iov_len = m_mmsg_spill_size;
+				hdr[i].msg_hdr.msg_iovlen = 2;
+			}
+			if (m_gro)
+			{
+				hdr[i].msg_hdr.msg_control = ctrl[i];
+				hdr[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+			}
+		}
+
+		int const num = ::recvmmsg(s->native_handle(), hdr, m_mmsg_slots
+			, MSG_DONTWAIT, NULL);
+
+		if (num < 0)
+		{
+			error_code ec(errno, system_category());
+			if (ec == asio::error::would_block || ec == asio::error::try_again)
+				return true;
+			if (ec == asio::error::operation_not_supported
+				|| ec == error_code(ENOSYS, system_category()))
+			{
+				// don't try again for every read
+				m_mmsg_unsupported = true;
+				disable_gro();
+				return false;
+			}
+			udp::endpoint ep;
+			on_read_impl(s, ep, ec, 0, 0);
+			if (m_abort) return true;
+			continue;
+		}
+
+		for (int i = 0; i < num; ++i)
+		{
+			udp::endpoint ep;
+			std::memcpy(ep.data(), &addr[i], hdr[i].msg_hdr.msg_namelen);
+			ep.resize(hdr[i].msg_hdr.msg_namelen);
+			char const* buf = m_mmsg_bufs[i] + m_mmsg_headroom;
+			int const len = hdr[i].msg_len;
+
+			// a packet that ran over into the spill buffer is moved to
+			// the spill buffer entirely, to have it in one piece. That's
+			// only the case for coalesced packets (and ones larger than
+			// m_buf_size), the copy is small compared to the packet
+			bool const spilled = len > m_mmsg_slot_size;
+			if (spilled)
+			{
+				TORRENT_ASSERT(m_mmsg_spill_size > 0);
+				std::memcpy(m_mmsg_spill[i], buf, m_mmsg_slot_size);
+				buf = m_mmsg_spill[i];
+			}
+
+			// if the kernel coalesced several packets, it tells us the
+			// size of the segments
+			int seg = len;
+			for (cmsghdr* cm = m_gro ? CMSG_FIRSTHDR(&hdr[i].msg_hdr) : NULL;
+				cm != NULL; cm = CMSG_NXTHDR(&hdr[i].msg_hdr, cm))
+			{
+				if (cm->cmsg_level != SOL_UDP || cm->cmsg_type != UDP_GRO) continue;
+				int gso_size;
+				std::memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+				if (gso_size > 0) seg = gso_size;
+			}
+
+			// a packet that has its slot to itself may be handed over to
+			// an observer. See swap_receive_buffer()
+			if (seg >= len && !spilled)
+			{
+				m_dispatch_buf = buf;
+				m_dispatch_slot = i;
+			}
+			for (int offset = 0; offset < len; offset += seg)
+			{
+				on_read_impl(s, ep, error_code(), buf + offset
+					, (std::min)(seg, len - offset));
+			}
+			m_dispatch_buf = 0;
+			m_dispatch_slot = -1;
+		}
+		if (m_abort) return true;
+
+		// a short batch means the socket is drained
+		if (num < m_mmsg_slots) return true;
+	}
+}
+#endif
+
 // called whenever the socket is readable
 void udp_socket::on_read(error_code const& ec, udp::socket* s)
 {
@@ -279,6 +727,23 @@ void udp_socket::on_read(error_code const& ec, udp::socket* s)
 
 	CHECK_MAGIC;
 
+#if TORRENT_USE_MMSG
+	if (!m_mmsg_unsupported)
+	{
+		// hold back packets sent in response to the ones we receive, and
+		// send them all at once when we're done
+		cork_send();
+		if (read_batch(s))
+		{
+			call_drained_handler();
+			uncork_send();
+			setup_read(s);
+			return;
+		}
+		uncork_send();
+	}
+#endif
+
 	for (;;)
 	{
 		error_code ec;
@@ -300,7 +765,7 @@ void udp_socket::on_read(error_code const& ec, udp::socket* s)
 #endif
 
 		if (ec == asio::error::would_block || ec == asio::error::try_again) break;
-		on_read_impl(s, ep, ec, bytes_transferred);
+		on_read_impl(s, ep, ec, m_buf, bytes_transferred);
 	}
 	call_drained_handler();
 	setup_read(s);
@@ -418,7 +883,7 @@ void udp_socket::unsubscribe(udp_socket_observer* o)
 }
 
 void udp_socket::on_read_impl(udp::socket* s, udp::endpoint const& ep
-	, error_code const& e, std::size_t bytes_transferred)
+	, error_code const& e, char const* buf, std::size_t bytes_transferred)
 {
 	TORRENT_ASSERT(m_magic == 0x1337);
 	TORRENT_ASSERT(is_single_thread());
@@ -462,11 +927,11 @@ void udp_socket::on_read_impl(udp::socket* s, udp::endpoint const& ep
 		{
 			// if the source IP doesn't match the proxy's, ignore the packet
 			if (ep == m_udp_proxy_addr)
-				unwrap(e, m_buf, bytes_transferred);
+				unwrap(e, buf, bytes_transferred);
 		}
 		else if (!m_force_proxy) // block incoming packets that aren't coming via the proxy
 		{
-			call_handler(e, ep, m_buf, bytes_transferred);
+			call_handler(e, ep, buf, bytes_transferred);
 		}
 
 	} TORRENT_CATCH (std::exception&) {}
@@ -642,6 +1107,35 @@ void udp_socket::close()
 #endif
 }
 
+int udp_socket::receive_buffer_size() const
+{
+#if TORRENT_USE_MMSG
+	if (m_mmsg_slots == 0) return 0;
+	return m_mmsg_headroom + m_mmsg_slot_size;
+#else
+	return 0;
+#endif
+}
+
+char* udp_socket::swap_receive_buffer(char const* buf, char* replacement)
+{
+	TORRENT_ASSERT(is_single_thread());
+	TORRENT_ASSERT(replacement);
+#if TORRENT_USE_MMSG
+	if (buf == 0 || buf != m_dispatch_buf) return 0;
+	TORRENT_ASSERT(m_dispatch_slot >= 0 && m_dispatch_slot < m_mmsg_slots);
+	char* ret = m_mmsg_bufs[m_dispatch_slot];
+	m_mmsg_bufs[m_dispatch_slot] = replacement;
+	m_dispatch_buf = 0;
+	m_dispatch_slot = -1;
+	return ret;
+#else
+	(void)buf;
+	(void)replacement;
+	return 0;
+#endif
+}
+
 void udp_socket::set_buf_size(int s)
 {
 	TORRENT_ASSERT(is_single_thread());
@@ -729,6 +1223,9 @@ void udp_socket::bind(udp::endpoint const& ep, error_code& ec)
 		udp::socket::non_blocking_io ioc(true);
 		m_ipv4_sock.io_control(ioc, ec);
 		if (ec) return;
+#if TORRENT_USE_MMSG
+		enable_offload(&m_ipv4_sock);
+#endif
 		setup_read(&m_ipv4_sock);
 	}
 
@@ -748,6 +1245,9 @@ void udp_socket::bind(udp::endpoint const& ep, error_code& ec)
 		udp::socket::non_blocking_io ioc(true);
 		m_ipv6_sock.io_control(ioc, ec);
 		if (ec) return;
+#if TORRENT_USE_MMSG
+		enable_offload(&m_ipv6_sock);
+#endif
 		setup_read(&m_ipv6_sock);
 	}
 #endif
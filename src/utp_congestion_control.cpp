@@ -0,0 +1,492 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "libtorrent/utp_congestion_control.hpp"
+#include "libtorrent/settings_pack.hpp"
+#include "libtorrent/assert.hpp"
+
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace libtorrent
+{
+	void utp_congestion_control::status(utp_cc_status& st) const
+	{
+		std::memset(&st, 0, sizeof(st));
+	}
+
+	namespace
+	{
+		// true if the upper layer is pushing enough data down the socket to
+		// be limited by the cwnd. If this is not the case, we should not grow
+		// the cwnd.
+		bool cwnd_saturated(utp_cc_window const& w, utp_cc_ack const& ack)
+		{
+			return ack.bytes_in_flight + ack.acked_bytes + ack.mtu > (w.cwnd >> 16);
+		}
+
+		void add_to_cwnd(utp_cc_window& w, boost::int64_t gain)
+		{
+			// make sure we don't wrap the cwnd
+			if (gain >= (std::numeric_limits<boost::int64_t>::max)() - w.cwnd)
+				gain = (std::numeric_limits<boost::int64_t>::max)() - w.cwnd - 1;
+
+			// if gain + cwnd <= 0, set cwnd to 0
+			if (-gain >= w.cwnd) w.cwnd = 0;
+			else w.cwnd += gain;
+			TORRENT_ASSERT(w.cwnd >= 0);
+		}
+
+		// the delay based controller from BEP 29. It keeps the one-way
+		// queuing delay at the target delay, and yields to TCP
+		struct ledbat_cc : utp_congestion_control
+		{
+			virtual int type() const { return settings_pack::utp_ledbat; }
+
+			virtual void on_ack(utp_cc_window& w, utp_cc_ack const& ack)
+			{
+				// the portion of the in-flight bytes that were acked. This is
+				// used to make the gain factor be scaled by the rtt. The formula
+				// is applied once per rtt, or on every ACK skaled by the number
+				// of ACKs per rtt
+				TORRENT_ASSERT(ack.in_flight > 0);
+				TORRENT_ASSERT(ack.acked_bytes > 0);
+
+				int const target_delay = ack.target_delay;
+
+				// all of these are fixed points with 16 bits fraction portion
+				boost::int64_t window_factor = (boost::int64_t(ack.acked_bytes) << 16)
+					/ ack.in_flight;
+				boost::int64_t delay_factor = (boost::int64_t(target_delay - ack.delay) << 16)
+					/ target_delay;
+
+				if (ack.delay >= target_delay && w.slow_start)
+				{
+					w.ssthres = w.cwnd >> 16;
+					w.slow_start = false;
+				}
+
+				boost::int64_t linear_gain = (window_factor * delay_factor) >> 16;
+				linear_gain *= boost::int64_t(ack.gain_factor);
+
+				// if the user is not saturating the link (i.e. not filling the
+				// congestion window), don't adjust it at all.
+				if (!cwnd_saturated(w, ack)) return;
+
+				boost::int64_t scaled_gain = linear_gain;
+				if (w.slow_start)
+				{
+					// mimic TCP slow-start by adding the number of acked
+					// bytes to cwnd
+					boost::int64_t exponential_gain = boost::int64_t(ack.acked_bytes) << 16;
+					if (w.ssthres != 0 && ((w.cwnd + exponential_gain) >> 16) > w.ssthres)
+					{
+						// if we would exeed the slow start threshold by growing the
+						// cwnd exponentially, don't do it, and leave slow-start mode.
+						// This make us avoid causing more delay and/or packet loss by
+						// being too aggressive
+						w.slow_start = false;
+					}
+					else
+					{
+						scaled_gain = (std::max)(exponential_gain, linear_gain);
+					}
+				}
+
+				add_to_cwnd(w, scaled_gain);
+			}
+
+			virtual void on_loss(utp_cc_window& w, int mtu, int loss_multiplier
+				, time_point)
+			{
+				// if we happen to be in slow-start mode, we need to leave it
+				if (w.slow_start)
+				{
+					w.ssthres = w.cwnd >> 16;
+					w.slow_start = false;
+				}
+
+				w.cwnd = (std::max)(w.cwnd * loss_multiplier / 100
+					, boost::int64_t(mtu) << 16);
+			}
+		};
+
+		// a loss based controller, following CUBIC (RFC 8312). The window
+		// grows as a cubic function of the time since the last loss, centered
+		// around the window size where that loss happened. This fills high
+		// bandwidth-delay product links much faster than LEDBAT's linear
+		// growth, but it does not yield to other traffic.
+		struct cubic_cc : utp_congestion_control
+		{
+			// the multiplicative decrease factor and the scaling constant
+			// (in MSS per second cubed) recommended by the RFC
+			enum { beta_percent = 70 };
+			static double cubic_c() { return 0.4; }
+
+			cubic_cc()
+				: m_w_max(0)
+				, m_origin(0)
+				, m_k(0)
+				, m_w_est(0)
+				, m_epoch_start(min_time())
+			{}
+
+			virtual int type() const { return settings_pack::utp_cubic; }
+
+			virtual void on_ack(utp_cc_window& w, utp_cc_ack const& ack)
+			{
+				if (!cwnd_saturated(w, ack)) return;
+
+				if (w.slow_start)
+				{
+					if (w.ssthres == 0 || (w.cwnd >> 16) + ack.acked_bytes <= w.ssthres)
+					{
+						add_to_cwnd(w, boost::int64_t(ack.acked_bytes) << 16);
+						return;
+					}
+					w.slow_start = false;
+				}
+
+				double const cwnd = (std::max)(double(w.cwnd) / (1 << 16)
+					, double(ack.mtu));
+				double const mss = ack.mtu;
+
+				if (m_epoch_start == min_time())
+				{
+					// this is the first ACK since the last loss (or since we
+					// left slow-start)
+					m_epoch_start = ack.now;
+					if (cwnd < m_w_max)
+					{
+						m_k = std::pow((m_w_max - cwnd) / (cubic_c() * mss), 1.0 / 3.0);
+						m_origin = m_w_max;
+					}
+					else
+					{
+						m_k = 0;
+						m_origin = cwnd;
+					}
+					m_w_est = cwnd;
+				}
+
+				// where the cubic function will be one round-trip from now
+				double const t = total_microseconds(ack.now - m_epoch_start) / 1000000.0
+					+ ack.rtt / 1000000.0;
+				double const d = t - m_k;
+				double const w_cubic = m_origin + cubic_c() * mss * d * d * d;
+
+				// the window standard TCP would have had by now. In this
+				// region, grow at least as fast as it would
+				double const beta = beta_percent / 100.0;
+				m_w_est += 3.0 * (1.0 - beta) / (1.0 + beta) * mss * ack.acked_bytes / cwnd;
+
+				double const goal = (std::max)(w_cubic, m_w_est);
+				double inc;
+				if (goal > cwnd)
+				{
+					// grow by at most 50% per round-trip
+					inc = (std::min)((goal - cwnd) * ack.acked_bytes / cwnd
+						, ack.acked_bytes / 2.0);
+				}
+				else
+				{
+					inc = mss * ack.acked_bytes / (100.0 * cwnd);
+				}
+
+				add_to_cwnd(w, boost::int64_t(inc * (1 << 16)));
+			}
+
+			virtual void on_loss(utp_cc_window& w, int mtu, int, time_point)
+			{
+				double const cwnd = double(w.cwnd) / (1 << 16);
+				m_epoch_start = min_time();
+
+				// fast convergence. If we lost before reaching the previous
+				// maximum, another flow is probably competing for the link.
+				// Release some bandwidth to it
+				if (cwnd < m_w_max)
+					m_w_max = cwnd * (100 + beta_percent) / 200.0;
+				else
+					m_w_max = cwnd;
+
+				w.cwnd = (std::max)(w.cwnd * beta_percent / 100
+					, boost::int64_t(mtu) << 16);
+				w.ssthres = int(w.cwnd >> 16);
+				w.slow_start = false;
+			}
+
+			virtual void on_timeout(utp_cc_window&, time_point)
+			{
+				m_epoch_start = min_time();
+			}
+
+			virtual void status(utp_cc_status& st) const
+			{
+				utp_congestion_control::status(st);
+				st.w_max = int(m_w_max);
+			}
+
+		private:
+
+			// the window size (bytes) before the last loss
+			double m_w_max;
+
+			// the plateau of the cubic function in this epoch (bytes)
+			double m_origin;
+
+			// the time (seconds) from the start of the epoch until the window
+			// reaches m_origin again
+			double m_k;
+
+			// estimated standard TCP window (bytes)
+			double m_w_est;
+
+			// when the current congestion avoidance epoch started. min_time()
+			// means it hasn't started yet
+			time_point m_epoch_start;
+		};
+
+		// a rate based controller, modeled after BBR. It estimates the
+		// bottleneck bandwidth (the highest delivery rate over the last few
+		// round-trips) and the minimum round-trip time, and sizes the window
+		// to their product. Loss is not taken as a congestion signal, which
+		// makes it suitable for long-haul links with random loss.
+
+		// uTP doesn't pace its packets, so the window is the only lever.
+		// Instead of cycling the pacing rate, the window cycles around the
+		// estimated bandwidth-delay product to probe for more bandwidth, and
+		// then to drain the queue that built up doing so.
+		struct bbr_cc : utp_congestion_control
+		{
+			enum mode_t { startup, drain, probe_bw };
+
+			// the number of round-trips the bandwidth filter covers
+			enum { bw_window = 10 };
+
+			// the number of round-trips the bandwidth has to stay flat for
+			// the pipe to be considered full, when leaving startup
+			enum { full_bw_rounds = 3 };
+
+			// window gain (in percent of the BDP) for each phase in
+			// probe_bw mode. One round-trip each
+			static int cycle_gain(int i)
+			{
+				static const int gain[] = { 125, 75, 110, 110, 110, 110, 110, 110 };
+				return gain[i];
+			}
+			enum { num_cycle_phases = 8 };
+
+			bbr_cc()
+				: m_mode(startup)
+				, m_delivered(0)
+				, m_round_delivered(0)
+				, m_round_start(min_time())
+				, m_bw_cursor(0)
+				, m_min_rtt(0)
+				, m_min_rtt_stamp(min_time())
+				, m_full_bw(0)
+				, m_full_bw_count(0)
+				, m_cycle(0)
+				, m_round_saturated(false)
+			{
+				std::memset(m_bw, 0, sizeof(m_bw));
+			}
+
+			virtual int type() const { return settings_pack::utp_bbr; }
+
+			int btl_bw() const
+			{
+				return *std::max_element(m_bw, m_bw + bw_window);
+			}
+
+			int bdp() const
+			{
+				return int(boost::int64_t(btl_bw()) * m_min_rtt / 1000000);
+			}
+
+			virtual void on_ack(utp_cc_window& w, utp_cc_ack const& ack)
+			{
+				bool const saturated = cwnd_saturated(w, ack);
+				m_delivered += ack.acked_bytes;
+				m_round_saturated |= saturated;
+
+				// the minimum RTT estimate expires after 10 seconds, in case
+				// the path changed
+				if (ack.rtt > 0 && (m_min_rtt == 0 || ack.rtt <= m_min_rtt
+					|| ack.now - m_min_rtt_stamp > seconds(10)))
+				{
+					m_min_rtt = ack.rtt;
+					m_min_rtt_stamp = ack.now;
+				}
+
+				if (m_round_start == min_time())
+				{
+					m_round_start = ack.now;
+					m_round_delivered = m_delivered;
+				}
+				else if (m_min_rtt > 0
+					&& total_microseconds(ack.now - m_round_start) >= m_min_rtt)
+				{
+					end_round(ack.now);
+				}
+
+				int const bdp_bytes = bdp();
+				if (m_mode == drain && ack.bytes_in_flight <= bdp_bytes)
+				{
+					// the queue we built up during startup is drained
+					m_mode = probe_bw;
+					m_cycle = 2;
+				}
+
+				int const min_cwnd = 4 * ack.mtu;
+				if (m_mode == startup || bdp_bytes == 0)
+				{
+					// grow exponentially, like slow-start, until the delivery
+					// rate stops increasing
+					if (saturated) add_to_cwnd(w, boost::int64_t(ack.acked_bytes) << 16);
+				}
+				else
+				{
+					boost::int64_t target = m_mode == drain ? bdp_bytes
+						: boost::int64_t(bdp_bytes) * cycle_gain(m_cycle) / 100;
+					target = (std::max)(target, boost::int64_t(min_cwnd)) << 16;
+
+					// after a timeout, grow back up to the target by the number of
+					// bytes delivered (packet conservation). Otherwise track it
+					if (w.cwnd < target && saturated)
+						w.cwnd = (std::min)(w.cwnd + (boost::int64_t(ack.acked_bytes) << 16), target);
+					else if (w.cwnd > target)
+						w.cwnd = target;
+				}
+				w.slow_start = m_mode == startup;
+			}
+
+			virtual void on_loss(utp_cc_window& w, int, int, time_point)
+			{
+				// loss while still ramping up means we have filled the pipe
+				// (and the queue)
+				if (m_mode == startup) m_mode = drain;
+				w.slow_start = false;
+			}
+
+			virtual void status(utp_cc_status& st) const
+			{
+				utp_congestion_control::status(st);
+				st.mode = m_mode;
+				st.btl_bw = btl_bw();
+				st.min_rtt = m_min_rtt;
+				st.bdp = bdp();
+			}
+
+		private:
+
+			void end_round(time_point now)
+			{
+				boost::int64_t const elapsed = total_microseconds(now - m_round_start);
+				TORRENT_ASSERT(elapsed > 0);
+				int const rate = int((std::min)((m_delivered - m_round_delivered)
+					* 1000000 / elapsed, boost::int64_t((std::numeric_limits<int>::max)())));
+
+				// rounds where we weren't limited by the window don't tell us
+				// what the link is capable of, unless they were faster than
+				// what we already know
+				int const current = btl_bw();
+				m_bw_cursor = (m_bw_cursor + 1) % bw_window;
+				m_bw[m_bw_cursor] = (m_round_saturated || rate > current)
+					? rate : current;
+
+				m_round_start = now;
+				m_round_delivered = m_delivered;
+				m_round_saturated = false;
+
+				if (m_mode == startup)
+				{
+					int const bw = btl_bw();
+					if (bw >= boost::int64_t(m_full_bw) * 5 / 4)
+					{
+						m_full_bw = bw;
+						m_full_bw_count = 0;
+					}
+					else if (++m_full_bw_count >= full_bw_rounds)
+					{
+						m_mode = drain;
+					}
+				}
+				else if (m_mode == probe_bw)
+				{
+					m_cycle = (m_cycle + 1) % num_cycle_phases;
+				}
+			}
+
+			int m_mode;
+
+			// the total number of bytes acked, and the number acked when the
+			// current round started
+			boost::int64_t m_delivered;
+			boost::int64_t m_round_delivered;
+			time_point m_round_start;
+
+			// the delivery rate (bytes per second) of the last bw_window
+			// round-trips, a circular buffer
+			int m_bw[bw_window];
+			int m_bw_cursor;
+
+			// the lowest RTT we've seen (microseconds) and when
+			int m_min_rtt;
+			time_point m_min_rtt_stamp;
+
+			// the bandwidth when startup last saw it grow by 25%, and the
+			// number of rounds since then
+			int m_full_bw;
+			int m_full_bw_count;
+
+			// the current phase of probe_bw
+			int m_cycle;
+
+			// true if the window limited us at some point in this round
+			bool m_round_saturated;
+		};
+	}
+
+	utp_congestion_control* create_utp_congestion_control(int type)
+	{
+		switch (type)
+		{
+			case settings_pack::utp_cubic: return new cubic_cc;
+			case settings_pack::utp_bbr: return new bbr_cc;
+			default: return new ledbat_cc;
+		}
+	}
+}
+
@@ -0,0 +1,95 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "libtorrent/utp_scoreboard.hpp"
+#include "libtorrent/assert.hpp"
+
+#include <algorithm>
+
+namespace libtorrent
+{
+	void utp_scoreboard::insert(int seq, int first)
+	{
+		// the number of sequence numbers we need to cover
+		int const span = ((seq - first) & 0xffff) + 1;
+		if (span > capacity())
+		{
+			int new_capacity = (std::max)(capacity(), 64);
+			while (new_capacity < span) new_capacity *= 2;
+			TORRENT_ASSERT(new_capacity <= 0x10000);
+
+			std::vector<boost::uint32_t> bits(new_capacity / 32 * 2, 0);
+			int const new_mask = new_capacity - 1;
+
+			// move the bits of the sequence numbers that may still be set.
+			// They're all in [first, first + capacity)
+			for (int b = in_flight; b <= need_resend; ++b)
+			{
+				int const last = (first + capacity()) & 0xffff;
+				for (int i = find_next(bit_t(b), first, last); i != last
+					; i = find_next(bit_t(b), (i + 1) & 0xffff, last))
+				{
+					int const idx = i & new_mask;
+					bits[(idx >> 5) * 2 + b] |= boost::uint32_t(1) << (idx & 31);
+				}
+			}
+			m_bits.swap(bits);
+			m_mask = new_mask;
+		}
+
+		set(in_flight, seq);
+		clear(need_resend, seq);
+	}
+
+	int utp_scoreboard::find_next(bit_t b, int first, int last) const
+	{
+		if (m_mask < 0) return last;
+
+		int remaining = (last - first) & 0xffff;
+		TORRENT_ASSERT(remaining <= capacity());
+
+		int seq = first;
+		while (remaining > 0)
+		{
+			int const idx = seq & m_mask;
+			int const shift = idx & 31;
+			int const bits = (std::min)(32 - shift, remaining);
+			boost::uint32_t word = m_bits[(idx >> 5) * 2 + b] >> shift;
+			if (bits < 32) word &= (boost::uint32_t(1) << bits) - 1;
+			if (word) return (seq + lowest_bit(word)) & 0xffff;
+			seq = (seq + bits) & 0xffff;
+			remaining -= bits;
+		}
+		return last;
+	}
+}
+
@@ -52,6 +52,8 @@ namespace libtorrent
 		, incoming_utp_callback_t cb)
 		: m_sock(s)
 		, m_cb(cb)
+		, m_wheel_tick(0)
+		, m_wheel_epoch(clock_type::now())
 		, m_last_socket(0)
 		, m_new_connection(-1)
 		, m_sett(sett)
@@ -59,33 +61,363 @@ namespace libtorrent
 		, m_last_if_update(min_time())
 		, m_sock_buf_size(0)
 		, m_counters(cnt)
+		, m_rx_packet_size(0)
 		, m_ssl_context(ssl_context)
-	{}
+	{
+		// leave room for the packet bookkeeping in front of received
+		// packets, to be able to take over their buffers
+		m_sock.set_receive_headroom(utp_packet_headroom());
+	}
 
 	utp_socket_manager::~utp_socket_manager()
 	{
-		for (socket_map_t::iterator i = m_utp_sockets.begin()
-			, end(m_utp_sockets.end()); i != end; ++i)
+		for (int i = 0; i < m_utp_sockets.num_slots(); ++i)
+		{
+			utp_socket_impl* s = m_utp_sockets.slot(i);
+			if (s) delete_utp_impl(s);
+		}
+
+		for (std::vector<void*>::iterator i = m_small_packet_pool.begin()
+			, end(m_small_packet_pool.end()); i != end; ++i)
+			free(*i);
+		for (std::vector<void*>::iterator i = m_mtu_packet_pool.begin()
+			, end(m_mtu_packet_pool.end()); i != end; ++i)
+			free(*i);
+		for (std::vector<void*>::iterator i = m_rx_packet_pool.begin()
+			, end(m_rx_packet_pool.end()); i != end; ++i)
+			free(*i);
+	}
+
+	namespace
+	{
+		// the buffer sizes of the packet pool size classes, and the
+		// max number of buffers kept around in each free list. The MTU
+		// class has room for the packet bookkeeping on top of the payload
+		enum
+		{
+			small_packet_size = 256,
+			mtu_packet_size = TORRENT_ETHERNET_MTU + 128,
+			max_small_packets = 256,
+			max_mtu_packets = 1024,
+			max_rx_packets = 1024
+		};
+	}
+
+	void* utp_socket_manager::allocate_packet(int size)
+	{
+		std::vector<void*>* pool = NULL;
+		if (size <= small_packet_size)
+		{
+			pool = &m_small_packet_pool;
+			size = small_packet_size;
+		}
+		else if (size <= mtu_packet_size)
+		{
+			pool = &m_mtu_packet_pool;
+			size = mtu_packet_size;
+		}
+
+		if (pool && !pool->empty())
+		{
+			void* ret = pool->back();
+			pool->pop_back();
+			m_counters.inc_stats_counter(counters::utp_packet_pool_hits);
+			return ret;
+		}
+
+		m_counters.inc_stats_counter(counters::utp_packet_pool_misses);
+		return malloc(size);
+	}
+
+	void* utp_socket_manager::adopt_receive_buffer(char const* buf, int len, int& size)
+	{
+		size = m_sock.receive_buffer_size();
+
+		// the receive buffers are only worth holding on to when the packet
+		// fills a good part of it. They must also be distinguishable from
+		// the other size classes when released
+		if (size <= mtu_packet_size
+			|| size > 2 * (len + utp_packet_headroom()))
+			return NULL;
+
+		if (size != m_rx_packet_size)
+		{
+			for (std::vector<void*>::iterator i = m_rx_packet_pool.begin()
+				, end(m_rx_packet_pool.end()); i != end; ++i)
+				free(*i);
+			m_rx_packet_pool.clear();
+			m_rx_packet_size = size;
+		}
+
+		void* replacement;
+		if (!m_rx_packet_pool.empty())
+		{
+			replacement = m_rx_packet_pool.back();
+			m_rx_packet_pool.pop_back();
+		}
+		else
+		{
+			replacement = malloc(size);
+			if (replacement == NULL) return NULL;
+		}
+
+		void* ret = m_sock.swap_receive_buffer(buf, (char*)replacement);
+		if (ret == NULL)
+		{
+			m_rx_packet_pool.push_back(replacement);
+			return NULL;
+		}
+		m_counters.inc_stats_counter(counters::utp_zero_copy_packets_in);
+		return ret;
+	}
+
+	void utp_socket_manager::release_packet(void* p, int size)
+	{
+		if (p == NULL) return;
+
+		if (size == m_rx_packet_size)
+		{
+			if (int(m_rx_packet_pool.size()) < max_rx_packets)
+			{
+				m_rx_packet_pool.push_back(p);
+				return;
+			}
+		}
+		else if (size <= small_packet_size)
 		{
-			delete_utp_impl(i->second);
+			if (int(m_small_packet_pool.size()) < max_small_packets)
+			{
+				m_small_packet_pool.push_back(p);
+				return;
+			}
 		}
+		else if (size <= mtu_packet_size)
+		{
+			if (int(m_mtu_packet_pool.size()) < max_mtu_packets)
+			{
+				m_mtu_packet_pool.push_back(p);
+				return;
+			}
+		}
+		free(p);
+	}
+
+	namespace
+	{
+		// the number of slots in the timer wheel (must be a power of 2)
+		// and the time each slot covers
+		const int timer_wheel_slots = 1024;
+		const int timer_wheel_resolution = 100; // milliseconds
+	}
+
+	void utp_socket_manager::schedule_tick(utp_socket_impl* s, time_point t)
+	{
+		if (m_timer_wheel.empty()) m_timer_wheel.resize(timer_wheel_slots);
+
+		// round up, to not tick the socket before it's due
+		boost::int64_t tick = (total_milliseconds(t - m_wheel_epoch)
+			+ timer_wheel_resolution - 1) / timer_wheel_resolution;
+		if (tick < m_wheel_tick) tick = m_wheel_tick;
+		if (tick >= m_wheel_tick + timer_wheel_slots)
+			tick = m_wheel_tick + timer_wheel_slots - 1;
+
+		utp_timer_pos& pos = utp_timer(s);
+		if (pos.slot >= 0)
+		{
+			if (pos.tick <= tick) return;
+			unschedule_tick(s);
+		}
+
+		std::vector<utp_socket_impl*>& slot
+			= m_timer_wheel[tick & (timer_wheel_slots - 1)];
+		pos.slot = tick & (timer_wheel_slots - 1);
+		pos.index = int(slot.size());
+		pos.tick = tick;
+		slot.push_back(s);
+	}
+
+	void utp_socket_manager::unschedule_tick(utp_socket_impl* s)
+	{
+		utp_timer_pos& pos = utp_timer(s);
+		if (pos.slot < 0) return;
+
+		std::vector<utp_socket_impl*>& slot = m_timer_wheel[pos.slot];
+		TORRENT_ASSERT(slot[pos.index] == s);
+		utp_socket_impl* last = slot.back();
+		slot[pos.index] = last;
+		utp_timer(last).index = pos.index;
+		slot.pop_back();
+		pos.slot = -1;
 	}
 
 	void utp_socket_manager::tick(time_point now)
 	{
-		for (socket_map_t::iterator i = m_utp_sockets.begin()
-			, end(m_utp_sockets.end()); i != end;)
+		if (m_timer_wheel.empty()) return;
+
+		boost::int64_t const now_tick = total_milliseconds(now - m_wheel_epoch)
+			/ timer_wheel_resolution;
+
+		// if more than a whole revolution has passed, every slot is due
+		int num_slots = (std::min)(now_tick - m_wheel_tick + 1
+			, boost::int64_t(timer_wheel_slots));
+
+		std::vector<utp_socket_impl*> expired;
+		for (int n = 0; n < num_slots; ++n)
+		{
+			std::vector<utp_socket_impl*>& slot
+				= m_timer_wheel[(m_wheel_tick + n) & (timer_wheel_slots - 1)];
+			for (std::vector<utp_socket_impl*>::iterator i = slot.begin()
+				, end(slot.end()); i != end; ++i)
+				utp_timer(*i).slot = -1;
+			expired.insert(expired.end(), slot.begin(), slot.end());
+			slot.clear();
+		}
+		if (now_tick >= m_wheel_tick) m_wheel_tick = now_tick + 1;
+
+		for (std::vector<utp_socket_impl*>::iterator i = expired.begin()
+			, end(expired.end()); i != end; ++i)
 		{
-			if (should_delete(i->second))
+			utp_socket_impl* s = *i;
+			if (should_delete(s))
 			{
-				delete_utp_impl(i->second);
-				if (m_last_socket == i->second) m_last_socket = 0;
-				m_utp_sockets.erase(i++);
+				m_utp_sockets.erase(utp_remote_endpoint(s), utp_receive_id(s), s);
+				delete_utp_impl(s);
+				if (m_last_socket == s) m_last_socket = 0;
 				continue;
 			}
-			tick_utp_impl(i->second, now);
-			++i;
+			tick_utp_impl(s, now);
+
+			// sockets waiting for the client to pick up an error, or to be
+			// closed, don't need ticking. They are scheduled again when
+			// their state changes
+			time_point const next = utp_next_tick(s);
+			if (next != max_time()) schedule_tick(s, next);
+		}
+	}
+
+	namespace
+	{
+		// the max number of destination networks kept in the path MTU cache
+		enum { max_pmtu_cache_size = 2000 };
+
+		// hosts on the same network are very likely to be behind the same
+		// path MTU bottleneck. Map an address to its /24 (IPv4) or /48
+		// (IPv6) network, which is what the cache is keyed by
+		address pmtu_cache_key(address const& addr)
+		{
+#if TORRENT_USE_IPV6
+			if (addr.is_v6())
+			{
+				address_v6::bytes_type b = addr.to_v6().to_bytes();
+				std::fill(b.begin() + 6, b.end(), 0);
+				return address_v6(b);
+			}
+#endif
+			return address_v4(addr.to_v4().to_ulong() & 0xffffff00);
+		}
+	}
+
+	bool utp_socket_manager::pmtu_lookup(address const& addr, int& floor, int& ceiling)
+	{
+		if (m_sett.get_int(settings_pack::utp_pmtu_cache_expiry) <= 0) return false;
+
+		std::map<address, pmtu_entry>::iterator i = m_pmtu_cache.find(pmtu_cache_key(addr));
+		if (i == m_pmtu_cache.end()) return false;
+
+		time_point const now = aux::time_now();
+		bool const fresh_floor = i->second.floor > 0 && i->second.floor_expires >= now;
+		bool const fresh_ceiling = i->second.ceiling > 0 && i->second.ceiling_expires >= now;
+		if (!fresh_floor && !fresh_ceiling)
+		{
+			m_pmtu_cache.erase(i);
+			return false;
+		}
+
+		if (fresh_floor) floor = i->second.floor;
+		if (fresh_ceiling) ceiling = i->second.ceiling;
+		m_counters.inc_stats_counter(counters::utp_pmtu_cache_hits);
+		return true;
+	}
+
+	utp_socket_manager::pmtu_entry* utp_socket_manager::pmtu_entry_for(
+		address const& addr, time_point now)
+	{
+		address const key = pmtu_cache_key(addr);
+		std::map<address, pmtu_entry>::iterator i = m_pmtu_cache.find(key);
+
+		if (i == m_pmtu_cache.end())
+		{
+			if (m_pmtu_cache.size() >= max_pmtu_cache_size)
+			{
+				// make room by dropping stale entries. If they're all still
+				// fresh, don't cache this one
+				for (i = m_pmtu_cache.begin(); i != m_pmtu_cache.end();)
+				{
+					if (i->second.floor_expires < now
+						&& i->second.ceiling_expires < now)
+						m_pmtu_cache.erase(i++);
+					else ++i;
+				}
+				if (m_pmtu_cache.size() >= max_pmtu_cache_size) return 0;
+			}
+
+			pmtu_entry e;
+			e.floor = 0;
+			e.ceiling = 0;
+			e.floor_expires = min_time();
+			e.ceiling_expires = min_time();
+			i = m_pmtu_cache.insert(std::make_pair(key, e)).first;
 		}
+
+		pmtu_entry& e = i->second;
+		if (e.floor_expires < now) e.floor = 0;
+		if (e.ceiling_expires < now) e.ceiling = 0;
+		return &e;
+	}
+
+	void utp_socket_manager::pmtu_confirm_floor(address const& addr, int floor)
+	{
+		int const expiry = m_sett.get_int(settings_pack::utp_pmtu_cache_expiry);
+		if (expiry <= 0) return;
+
+		time_point const now = aux::time_now();
+		pmtu_entry* e = pmtu_entry_for(addr, now);
+		if (e == 0) return;
+
+		// a host on the network has already acked packets at least this
+		// large. Nothing new was learned, so the entry doesn't get any
+		// fresher either
+		if (floor <= e->floor) return;
+
+		e->floor = floor;
+		e->floor_expires = now + seconds(expiry);
+
+		// a packet this large made it through, so a lower ceiling some
+		// other socket inferred from a lost probe was wrong
+		if (e->ceiling > 0 && e->ceiling < floor) e->ceiling = 0;
+	}
+
+	void utp_socket_manager::pmtu_lower_ceiling(address const& addr, int ceiling)
+	{
+		int const expiry = m_sett.get_int(settings_pack::utp_pmtu_cache_expiry);
+		if (expiry <= 0) return;
+
+		time_point const now = aux::time_now();
+		pmtu_entry* e = pmtu_entry_for(addr, now);
+		if (e == 0) return;
+
+		if (e->ceiling > 0 && ceiling >= e->ceiling) return;
+
+		// another host on this network has acked larger packets. The lost
+		// probe says something about the path to this one host (or was
+		// just congestion), not about the network
+		if (ceiling < e->floor) return;
+
+		// a lost probe is only a hint that the packet was too big. It's
+		// not refreshed by later losses of the same size, so it decays and
+		// lets sockets probe the larger sizes again
+		e->ceiling = ceiling;
+		e->ceiling_expires = now + seconds(expiry);
 	}
 
 	void utp_socket_manager::mtu_for_dest(address const& addr, int& link_mtu, int& utp_mtu)
@@ -177,12 +509,22 @@ namespace libtorrent
 		if ((flags & dont_fragment) && len > TORRENT_DEBUG_MTU) return;
 #endif
 
+		// the don't fragment option is only set for the duration of this
+		// call, so the packet can't wait in a send batch. The packets that
+		// are already waiting have to go out first, without the option
+		if ((flags & utp_socket_manager::dont_fragment) && !m_sock.flush_send())
+		{
+			ec = asio::error::would_block;
+			return;
+		}
+
 #ifdef TORRENT_HAS_DONT_FRAGMENT
 		error_code tmp;
 		if (flags & utp_socket_manager::dont_fragment)
 			m_sock.set_option(libtorrent::dont_fragment(true), tmp);
 #endif
-		m_sock.send(ep, p, len, ec);
+		m_sock.send(ep, p, len, ec, (flags & utp_socket_manager::dont_fragment)
+			? udp_socket::dont_batch : 0);
 #ifdef TORRENT_HAS_DONT_FRAGMENT
 		if (flags & utp_socket_manager::dont_fragment)
 			m_sock.set_option(libtorrent::dont_fragment(false), tmp);
@@ -277,14 +619,12 @@ namespace libtorrent
 			return utp_incoming_packet(m_last_socket, p, size, ep, receive_time);
 		}
 
-		std::pair<socket_map_t::iterator, socket_map_t::iterator> r =
-			m_utp_sockets.equal_range(id);
-
-		for (; r.first != r.second; ++r.first)
+		utp_socket_impl* s = m_utp_sockets.find(ep, id);
+		if (s)
 		{
-			if (!utp_match(r.first->second, ep, id)) continue;
-			bool ret = utp_incoming_packet(r.first->second, p, size, ep, receive_time);
-			if (ret) m_last_socket = r.first->second;
+			TORRENT_ASSERT(utp_match(s, ep, id));
+			bool ret = utp_incoming_packet(s, p, size, ep, receive_time);
+			if (ret) m_last_socket = s;
 			return ret;
 		}
 
@@ -325,7 +665,7 @@ namespace libtorrent
 			TORRENT_ASSERT(str);
 			int link_mtu, utp_mtu;
 			mtu_for_dest(ep.address(), link_mtu, utp_mtu);
-			utp_init_mtu(str->get_impl(), link_mtu, utp_mtu);
+			utp_init_mtu(str->get_impl(), ep.address(), link_mtu, utp_mtu);
 			bool ret = utp_incoming_packet(str->get_impl(), p, size, ep, receive_time);
 			if (!ret) return false;
 			m_cb(c);
@@ -397,13 +737,21 @@ namespace libtorrent
 		m_drained_event.push_back(s);
 	}
 
-	void utp_socket_manager::remove_socket(boost::uint16_t id)
+	void utp_socket_manager::remove_socket(utp_socket_impl* s)
+	{
+		if (!m_utp_sockets.erase(utp_remote_endpoint(s), utp_receive_id(s), s))
+			return;
+		unschedule_tick(s);
+		delete_utp_impl(s);
+		if (m_last_socket == s) m_last_socket = 0;
+	}
+
+	void utp_socket_manager::socket_endpoint_changed(utp_socket_impl* s
+		, udp::endpoint const& old_ep)
 	{
-		socket_map_t::iterator i = m_utp_sockets.find(id);
-		if (i == m_utp_sockets.end()) return;
-		delete_utp_impl(i->second);
-		if (m_last_socket == i->second) m_last_socket = 0;
-		m_utp_sockets.erase(i);
+		boost::uint16_t const id = utp_receive_id(s);
+		if (!m_utp_sockets.erase(old_ep, id, s)) return;
+		m_utp_sockets.insert(utp_remote_endpoint(s), id, s);
 	}
 	
 	void utp_socket_manager::set_sock_buf(int size)
@@ -430,7 +778,7 @@ namespace libtorrent
 	void utp_socket_manager::inc_stats_counter(int counter, int delta)
 	{
 		TORRENT_ASSERT((counter >= counters::utp_packet_loss
-				&& counter <= counters::utp_redundant_pkts_in)
+				&& counter <= counters::utp_zero_copy_packets_in)
 			|| (counter >= counters::num_utp_idle
 				&& counter <= counters::num_utp_deleted));
 		m_counters.inc_stats_counter(counter, delta);
@@ -452,7 +800,8 @@ namespace libtorrent
 			recv_id = send_id - 1;
 		}
 		utp_socket_impl* impl = construct_utp_impl(recv_id, send_id, str, this);
-		m_utp_sockets.insert(std::make_pair(recv_id, impl));
+		m_utp_sockets.insert(utp_remote_endpoint(impl), recv_id, impl);
+		schedule_tick(impl, utp_next_tick(impl));
 		return impl;
 	}
 }
@@ -0,0 +1,171 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "libtorrent/utp_socket_map.hpp"
+#include "libtorrent/assert.hpp"
+
+namespace libtorrent
+{
+	utp_socket_map::utp_socket_map()
+		: m_size(0)
+		, m_erased(0)
+	{}
+
+	boost::uint32_t utp_socket_map::hash(udp::endpoint const& ep
+		, boost::uint16_t id)
+	{
+		boost::uint32_t h = 2166136261u;
+		address const a = ep.address();
+#if TORRENT_USE_IPV6
+		if (a.is_v6())
+		{
+			address_v6::bytes_type const b = a.to_v6().to_bytes();
+			for (int i = 0; i < int(b.size()); ++i)
+				h = (h ^ b[i]) * 16777619u;
+		}
+		else
+#endif
+		{
+			h = (h ^ boost::uint32_t(a.to_v4().to_ulong())) * 16777619u;
+		}
+		h = (h ^ ep.port()) * 16777619u;
+		h = (h ^ id) * 16777619u;
+		// the low bits pick the slot, mix the high bits into them
+		return h ^ (h >> 16);
+	}
+
+	utp_socket_impl* utp_socket_map::find(udp::endpoint const& ep
+		, boost::uint16_t id) const
+	{
+		if (m_size == 0) return NULL;
+
+		boost::uint32_t const h = hash(ep, id);
+		int const mask = int(m_slots.size()) - 1;
+		for (int i = h & mask;; i = (i + 1) & mask)
+		{
+			slot_t const& s = m_slots[i];
+			if (s.state == slot_t::empty_slot) return NULL;
+			if (s.state == slot_t::used_slot && s.hash == h
+				&& s.id == id && s.ep == ep)
+				return s.sock;
+		}
+	}
+
+	void utp_socket_map::insert(udp::endpoint const& ep
+		, boost::uint16_t id, utp_socket_impl* sock)
+	{
+		TORRENT_ASSERT(sock);
+
+		// keep the load factor, including tombstones, below 1/2. This
+		// keeps probe sequences short and guarantees there's always an
+		// empty slot to terminate them
+		if ((m_size + m_erased + 1) * 2 > int(m_slots.size()))
+		{
+			int capacity = 16;
+			while (capacity < (m_size + 1) * 4) capacity *= 2;
+			rehash(capacity);
+		}
+
+		boost::uint32_t const h = hash(ep, id);
+		int const mask = int(m_slots.size()) - 1;
+		int i = h & mask;
+		while (m_slots[i].state == slot_t::used_slot) i = (i + 1) & mask;
+
+		slot_t& s = m_slots[i];
+		if (s.state == slot_t::erased_slot) --m_erased;
+		s.ep = ep;
+		s.sock = sock;
+		s.hash = h;
+		s.id = id;
+		s.state = slot_t::used_slot;
+		++m_size;
+	}
+
+	bool utp_socket_map::erase(udp::endpoint const& ep
+		, boost::uint16_t id, utp_socket_impl* sock)
+	{
+		if (m_size == 0) return false;
+
+		boost::uint32_t const h = hash(ep, id);
+		int const mask = int(m_slots.size()) - 1;
+		for (int i = h & mask;; i = (i + 1) & mask)
+		{
+			slot_t const& s = m_slots[i];
+			if (s.state == slot_t::empty_slot) return false;
+			if (s.state == slot_t::used_slot && s.sock == sock)
+			{
+				TORRENT_ASSERT(s.id == id && s.ep == ep);
+				erase_slot(i);
+				return true;
+			}
+		}
+	}
+
+	void utp_socket_map::erase_slot(int i)
+	{
+		slot_t& s = m_slots[i];
+		TORRENT_ASSERT(s.state == slot_t::used_slot);
+		s.sock = NULL;
+		s.state = slot_t::erased_slot;
+		--m_size;
+		++m_erased;
+	}
+
+	void utp_socket_map::clear()
+	{
+		m_slots.clear();
+		m_size = 0;
+		m_erased = 0;
+	}
+
+	void utp_socket_map::rehash(int capacity)
+	{
+		TORRENT_ASSERT((capacity & (capacity - 1)) == 0);
+		TORRENT_ASSERT(capacity > m_size * 2);
+
+		std::vector<slot_t> old;
+		old.swap(m_slots);
+		m_slots.resize(capacity);
+		m_erased = 0;
+
+		int const mask = capacity - 1;
+		for (std::vector<slot_t>::iterator i = old.begin()
+			, end(old.end()); i != end; ++i)
+		{
+			if (i->state != slot_t::used_slot) continue;
+			int k = i->hash & mask;
+			while (m_slots[k].state == slot_t::used_slot) k = (k + 1) & mask;
+			m_slots[k] = *i;
+		}
+	}
+}
+
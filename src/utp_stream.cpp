@@ -40,8 +40,12 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/random.hpp"
 #include "libtorrent/invariant_check.hpp"
 #include "libtorrent/performance_counters.hpp"
+#include "libtorrent/utp_congestion_control.hpp"
+#include "libtorrent/utp_scoreboard.hpp"
 #include <boost/cstdint.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <limits>
+#include <cstddef> // for offsetof
 
 #define TORRENT_UTP_LOG 0
 #define TORRENT_VERBOSE_UTP_LOG 0
@@ -238,6 +242,7 @@ struct utp_socket_impl
 		, m_last_history_step(clock_type::now())
 		, m_cwnd(TORRENT_ETHERNET_MTU << 16)
 		, m_ssthres(0)
+		, m_cc(create_utp_congestion_control(sm->congestion_control()))
 		, m_buffered_incoming_bytes(0)
 		, m_reply_micro(0)
 		, m_adv_wnd(TORRENT_ETHERNET_MTU)
@@ -289,7 +294,7 @@ struct utp_socket_impl
 	~utp_socket_impl();
 
 	void tick(time_point now);
-	void init_mtu(int link_mtu, int utp_mtu);
+	void init_mtu(address const& remote, int link_mtu, int utp_mtu);
 	bool incoming_packet(boost::uint8_t const* buf, int size
 		, udp::endpoint const& ep, time_point receive_time);
 	void writable();
@@ -308,6 +313,7 @@ struct utp_socket_impl
 	// if it returns false, we can detach immediately
 	bool destroy();
 	void set_close_reason(boost::uint16_t code);
+	void set_congestion_control(int type);
 	void detach();
 	void send_syn();
 	void send_fin();
@@ -316,6 +322,23 @@ struct utp_socket_impl
 	void defer_ack();
 	void remove_sack_header(packet* p);
 
+	// allocate and free packets through the socket manager's
+	// packet pool. allocate is the size of the buffer following
+	// the packet struct
+	packet* acquire_packet(int allocate);
+	void release_packet(packet* p);
+
+	// returns a packet holding the received packet ph, whose payload
+	// starts at payload, in the udp socket's receive buffer. Returns NULL
+	// if the buffer can't be taken over, in which case the payload needs
+	// to be copied into a packet of its own
+	packet* adopt_packet(utp_header const* ph, boost::uint8_t const* payload
+		, int payload_size);
+
+	// the socket manager indexes sockets by their remote endpoint, so it
+	// must always be set through here
+	void set_remote_endpoint(udp::endpoint const& ep);
+
 	enum packet_flags_t { pkt_ack = 1, pkt_fin = 2 };
 	bool send_pkt(int flags = 0);
 	bool resend_packet(packet* p, bool fast_resend = false);
@@ -328,8 +351,12 @@ struct utp_socket_impl
 	void ack_packet(packet* p, time_point const& receive_time
 		, boost::uint32_t& min_rtt, boost::uint16_t seq_nr);
 	void write_sack(boost::uint8_t* buf, int size) const;
-	void incoming(boost::uint8_t const* buf, int size, packet* p, time_point now);
-	void do_ledbat(int acked_bytes, int delay, int in_flight);
+	void incoming(utp_header const* ph, boost::uint8_t const* buf, int size
+		, packet* p, time_point now);
+	void do_congestion_control(int acked_bytes, int delay, int in_flight
+		, int rtt, time_point now);
+	utp_cc_window cc_window() const;
+	void set_cc_window(utp_cc_window const& w);
 	int packet_timeout() const;
 	bool test_socket_state();
 	void maybe_trigger_receive_callback();
@@ -433,6 +460,11 @@ public:
 	packet_buffer m_inbuf;
 	packet_buffer m_outbuf;
 
+	// which of the packets in m_outbuf are in flight and which need to be
+	// resent, as bitmaps. This is kept in sync with m_outbuf and lets us
+	// scan for packets a word at a time
+	utp_scoreboard m_scoreboard;
+
 	// the time when the last packet we sent times out. Including re-sends.
 	// if we ever end up not having sent anything in one second (
 	// or one mean rtt + 2 average deviations, whichever is greater)
@@ -442,6 +474,9 @@ public:
 	// it can also happen if the other end sends an advertized window
 	// size less than one MSS.
 	time_point m_timeout;
+
+	// our position in the socket manager's timer wheel
+	utp_timer_pos m_timer_pos;
 	
 	// the last time we stepped the timestamp history
 	time_point m_last_history_step;
@@ -449,7 +484,7 @@ public:
 	// the max number of bytes in-flight. This is a fixed point
 	// value, to get the true number of bytes, shift right 16 bits
 	// the value is always >= 0, but the calculations performed on
-	// it in do_ledbat() are signed.
+	// it by the congestion controller are signed.
 	boost::int64_t m_cwnd;
 
 	timestamp_history m_delay_hist;
@@ -460,6 +495,10 @@ public:
 	// threshold to leave slow-start earlier next time, to avoid packet-loss
 	boost::int32_t m_ssthres;
 
+	// the congestion controller that adjusts m_cwnd, m_ssthres and
+	// m_slow_start. One of settings_pack::utp_congestion_control_t
+	boost::scoped_ptr<utp_congestion_control> m_cc;
+
 	// the number of bytes we have buffered in m_inbuf
 	boost::int32_t m_buffered_incoming_bytes;
 
@@ -707,9 +746,24 @@ void tick_utp_impl(utp_socket_impl* s, time_point now)
 	s->tick(now);
 }
 
-void utp_init_mtu(utp_socket_impl* s, int link_mtu, int utp_mtu)
+utp_timer_pos& utp_timer(utp_socket_impl* s)
+{
+	return s->m_timer_pos;
+}
+
+time_point utp_next_tick(utp_socket_impl* s)
+{
+	// in these states tick() doesn't do anything
+	if (s->m_state == utp_socket_impl::UTP_STATE_ERROR_WAIT
+		|| s->m_state == utp_socket_impl::UTP_STATE_DELETE)
+		return max_time();
+	return s->m_timeout;
+}
+
+void utp_init_mtu(utp_socket_impl* s, address const& remote
+	, int link_mtu, int utp_mtu)
 {
-	s->init_mtu(link_mtu, utp_mtu);
+	s->init_mtu(remote, link_mtu, utp_mtu);
 }
 
 bool utp_incoming_packet(utp_socket_impl* s, char const* p
@@ -739,6 +793,8 @@ void utp_writable(utp_socket_impl* s)
 {
 	TORRENT_ASSERT(s->m_stalled);
 	s->m_stalled = false;
+	// we may be ready to be deleted now
+	s->m_sm->schedule_tick(s, clock_type::now());
 	s->writable();
 }
 
@@ -779,6 +835,13 @@ void utp_socket_impl::update_mtu_limits()
 	m_mtu_seq = 0;
 }
 
+// received packets are turned into packet structs in place, see
+// adopt_packet(). This is the space it needs in front of the packet
+int utp_packet_headroom()
+{
+	return int(offsetof(packet, buf));
+}
+
 int utp_socket_state(utp_socket_impl const* s)
 {
 	return s->m_state;
@@ -813,6 +876,12 @@ void utp_stream::set_close_reason(boost::uint16_t code)
 	m_impl->set_close_reason(code);
 }
 
+void utp_stream::set_congestion_control(int type)
+{
+	if (!m_impl) return;
+	m_impl->set_congestion_control(type);
+}
+
 boost::uint16_t utp_stream::get_close_reason()
 {
 	return m_incoming_close_reason;
@@ -1080,7 +1149,7 @@ size_t utp_stream::read_some(bool clear_buffers)
 		// Consumed entire packet
 		if (p->header_size == p->size)
 		{
-			free(p);
+			m_impl->release_packet(p);
 			++pop_packets;
 			*i = 0;
 			++i;
@@ -1132,7 +1201,10 @@ void utp_stream::issue_write()
 	// try to write. send_pkt returns false if there's
 	// no more payload to send or if the congestion window
 	// is full and we can't send more packets right now
+	utp_socket_manager* sm = m_impl->m_sm;
+	sm->cork_send();
 	while (m_impl->send_pkt());
+	sm->uncork_send();
 
 	// if there was an error in send_pkt(), m_impl may be
 	// 0 at this point
@@ -1143,10 +1215,9 @@ void utp_stream::do_connect(tcp::endpoint const& ep)
 {
 	int link_mtu, utp_mtu;
 	m_impl->m_sm->mtu_for_dest(ep.address(), link_mtu, utp_mtu);
-	m_impl->init_mtu(link_mtu, utp_mtu);
+	m_impl->init_mtu(ep.address(), link_mtu, utp_mtu);
 	TORRENT_ASSERT(m_impl->m_connect_handler == false);
-	m_impl->m_remote_address = ep.address();
-	m_impl->m_port = ep.port();
+	m_impl->set_remote_endpoint(udp::endpoint(ep.address(), ep.port()));
 
 	m_impl->m_connect_handler = true;
 
@@ -1175,24 +1246,24 @@ utp_socket_impl::~utp_socket_impl()
 		+ m_inbuf.capacity()) & ACK_MASK);
 		i != end; i = (i + 1) & ACK_MASK)
 	{
-		void* p = m_inbuf.remove(i);
-		free(p);
+		packet* p = (packet*)m_inbuf.remove(i);
+		release_packet(p);
 	}
 	for (boost::uint16_t i = m_outbuf.cursor(), end((m_outbuf.cursor()
 		+ m_outbuf.capacity()) & ACK_MASK);
 		i != end; i = (i + 1) & ACK_MASK)
 	{
-		void* p = m_outbuf.remove(i);
-		free(p);
+		packet* p = (packet*)m_outbuf.remove(i);
+		release_packet(p);
 	}
 
 	for (std::vector<packet*>::iterator i = m_receive_buffer.begin()
 		, end = m_receive_buffer.end(); i != end; ++i)
 	{
-		free(*i);
+		release_packet(*i);
 	}
 
-	free(m_nagle_packet);
+	release_packet(m_nagle_packet);
 	m_nagle_packet = NULL;
 }
 
@@ -1310,6 +1381,8 @@ void utp_socket_impl::detach()
 
 	UTP_LOGV("%8p: detach()\n", this);
 	m_attached = false;
+	// we may be ready to be deleted now
+	m_sm->schedule_tick(this, clock_type::now());
 }
 
 void utp_socket_impl::send_syn()
@@ -1322,7 +1395,7 @@ void utp_socket_impl::send_syn()
 	m_ack_nr = 0;
 	m_fast_resend_seq_nr = m_seq_nr;
 
-	packet* p = (packet*)malloc(sizeof(packet) + sizeof(utp_header));
+	packet* p = acquire_packet(sizeof(utp_header));
 	p->size = sizeof(utp_header);
 	p->header_size = sizeof(utp_header);
 	p->num_transmissions = 0;
@@ -1371,7 +1444,7 @@ void utp_socket_impl::send_syn()
 	}
 	else if (ec)
 	{
-		free(p);
+		release_packet(p);
 		m_error = ec;
 		set_state(UTP_STATE_ERROR_WAIT);
 		test_socket_state();
@@ -1383,6 +1456,7 @@ void utp_socket_impl::send_syn()
 
 	TORRENT_ASSERT(!m_outbuf.at(m_seq_nr));
 	m_outbuf.insert(m_seq_nr, p);
+	m_scoreboard.insert(m_seq_nr, (m_acked_seq_nr + 1) & ACK_MASK);
 	TORRENT_ASSERT(h->seq_nr == m_seq_nr);
 	TORRENT_ASSERT(p->buf == (boost::uint8_t*)h);
 
@@ -1405,7 +1479,9 @@ void utp_socket_impl::writable()
 #endif
 	if (should_delete()) return;
 
+	m_sm->cork_send();
 	while(send_pkt());
+	m_sm->uncork_send();
 
 	maybe_trigger_send_callback();
 }
@@ -1504,48 +1580,49 @@ void utp_socket_impl::parse_sack(boost::uint16_t packet_ack, boost::uint8_t cons
 	// the sequence number of the last ACKed packet
 	int last_ack = packet_ack;
 
-	// for each byte
-	for (boost::uint8_t const* end = ptr + size; ptr != end; ++ptr)
+	// we haven't sent packets past m_seq_nr. If there are any more bits
+	// set, we have to ignore them anyway
+	int const num_bits = (std::min)(size * 8, (m_seq_nr - ack_nr) & ACK_MASK);
+
+	// the bitmask is little endian, bit 0 of the first byte is ack_nr. Load
+	// it 32 bits at a time and only visit the bits that are set
+	for (int base = 0; base < num_bits; base += 32)
 	{
-		unsigned char bitfield = unsigned(*ptr);
-		unsigned char mask = 1;
-		// for each bit
-		for (int i = 0; i < 8; ++i)
+		boost::uint32_t word = 0;
+		for (int i = 0; i < 4 && base / 8 + i < size; ++i)
+			word |= boost::uint32_t(ptr[base / 8 + i]) << (i * 8);
+		if (num_bits - base < 32)
+			word &= (boost::uint32_t(1) << (num_bits - base)) - 1;
+
+		while (word)
 		{
-			if (mask & bitfield)
-			{
-				last_ack = ack_nr;
-				if (m_fast_resend_seq_nr == ack_nr)
-					m_fast_resend_seq_nr = (m_fast_resend_seq_nr + 1) & ACK_MASK;
-
-				if (compare_less_wrap(m_fast_resend_seq_nr, ack_nr, ACK_MASK)) ++dups;
-				// this bit was set, ack_nr was received
-				packet* p = (packet*)m_outbuf.remove(ack_nr);
-				if (p)
-				{
-					*acked_bytes += p->size - p->header_size;
-					// each ACKed packet counts as a duplicate ack
-					UTP_LOGV("%8p: duplicate_acks:%u fast_resend_seq_nr:%u\n"
-						, this, m_duplicate_acks, m_fast_resend_seq_nr);
-					ack_packet(p, now, min_rtt, ack_nr);
-				}
-				else
-				{
-					// this packet might have been acked by a previous
-					// selective ack
-					maybe_inc_acked_seq_nr();
-				}
-			}
+			int const bit = utp_scoreboard::lowest_bit(word);
+			word &= word - 1;
+			int const seq = (ack_nr + base + bit) & ACK_MASK;
 
-			mask <<= 1;
-			ack_nr = (ack_nr + 1) & ACK_MASK;
+			last_ack = seq;
+			if (m_fast_resend_seq_nr == seq)
+				m_fast_resend_seq_nr = (m_fast_resend_seq_nr + 1) & ACK_MASK;
 
-			// we haven't sent packets past this point.
-			// if there are any more bits set, we have to
-			// ignore them anyway
-			if (ack_nr == m_seq_nr) break;
+			if (compare_less_wrap(m_fast_resend_seq_nr, seq, ACK_MASK)) ++dups;
+			// this bit was set, seq was received
+			packet* p = (packet*)m_outbuf.remove(seq);
+			if (p)
+			{
+				m_scoreboard.remove(seq);
+				*acked_bytes += p->size - p->header_size;
+				// each ACKed packet counts as a duplicate ack
+				UTP_LOGV("%8p: duplicate_acks:%u fast_resend_seq_nr:%u\n"
+					, this, m_duplicate_acks, m_fast_resend_seq_nr);
+				ack_packet(p, now, min_rtt, seq);
+			}
+			else
+			{
+				// this packet might have been acked by a previous
+				// selective ack
+				maybe_inc_acked_seq_nr();
+			}
 		}
-		if (ack_nr == m_seq_nr) break;
 	}
 
 	TORRENT_ASSERT(m_outbuf.at((m_acked_seq_nr + 1) & ACK_MASK) || ((m_seq_nr - m_acked_seq_nr) & ACK_MASK) <= 1);
@@ -1558,8 +1635,21 @@ void utp_socket_impl::parse_sack(boost::uint16_t packet_ack, boost::uint8_t cons
 		int num_resent = 0;
 		while (m_fast_resend_seq_nr != last_ack)
 		{
-			packet* p = (packet*)m_outbuf.at(m_fast_resend_seq_nr);
-			m_fast_resend_seq_nr = (m_fast_resend_seq_nr + 1) & ACK_MASK;
+			// skip straight to the next packet that hasn't been acked.
+			// There are none before m_acked_seq_nr
+			int first = m_fast_resend_seq_nr;
+			if (compare_less_wrap(first, (m_acked_seq_nr + 1) & ACK_MASK, ACK_MASK))
+				first = (m_acked_seq_nr + 1) & ACK_MASK;
+			int const seq = m_scoreboard.find_next(utp_scoreboard::in_flight
+				, first, last_ack);
+			if (seq == last_ack)
+			{
+				m_fast_resend_seq_nr = last_ack;
+				break;
+			}
+			packet* p = (packet*)m_outbuf.at(seq);
+			TORRENT_ASSERT(p);
+			m_fast_resend_seq_nr = (seq + 1) & ACK_MASK;
 			if (!p) continue;
 			++num_resent;
 			if (!resend_packet(p, true)) break;
@@ -1646,6 +1736,54 @@ void utp_socket_impl::defer_ack()
 	m_sm->defer_ack(this);
 }
 
+void utp_socket_impl::set_remote_endpoint(udp::endpoint const& ep)
+{
+	udp::endpoint const old_ep(m_remote_address, m_port);
+	if (ep == old_ep) return;
+	m_remote_address = ep.address();
+	m_port = ep.port();
+	m_sm->socket_endpoint_changed(this, old_ep);
+}
+
+packet* utp_socket_impl::acquire_packet(int const allocate)
+{
+	packet* p = (packet*)m_sm->allocate_packet(sizeof(packet) + allocate);
+	p->allocated = allocate;
+	return p;
+}
+
+void utp_socket_impl::release_packet(packet* p)
+{
+	if (p == NULL) return;
+	m_sm->release_packet(p, sizeof(packet) + p->allocated);
+}
+
+packet* utp_socket_impl::adopt_packet(utp_header const* ph
+	, boost::uint8_t const* payload, int const payload_size)
+{
+	int const header_size = int(payload - (boost::uint8_t const*)ph);
+	TORRENT_ASSERT(header_size >= 0);
+
+	int size;
+	packet* p = (packet*)m_sm->adopt_receive_buffer((char const*)ph
+		, header_size + payload_size, size);
+	if (p == NULL) return NULL;
+
+	TORRENT_ASSERT((void const*)p->buf == (void const*)ph);
+	TORRENT_ASSERT(size - int(sizeof(packet)) <= 0xffff);
+	p->allocated = size - sizeof(packet);
+	p->size = header_size + payload_size;
+	// the header is left in front of the payload
+	p->header_size = header_size;
+	p->num_transmissions = 0;
+#ifdef TORRENT_DEBUG
+	p->num_fast_resend = 0;
+#endif
+	p->need_resend = false;
+	p->mtu_probe = false;
+	return p;
+}
+
 void utp_socket_impl::remove_sack_header(packet* p)
 {
 	INVARIANT_CHECK;
@@ -1673,25 +1811,26 @@ void utp_socket_impl::remove_sack_header(packet* p)
 
 struct holder
 {
-	holder(char* buf = NULL): m_buf(buf) {}
-	~holder() { free(m_buf); }
+	holder(utp_socket_impl* s): m_sock(s), m_buf(NULL) {}
+	~holder() { m_sock->release_packet(m_buf); }
 
-	void reset(char* buf)
+	void reset(packet* buf)
 	{
-		free(m_buf);
+		m_sock->release_packet(m_buf);
 		m_buf = buf;
 	}
 
-	char* release()
+	packet* release()
 	{
-		char* ret = m_buf;
+		packet* ret = m_buf;
 		m_buf = NULL;
 		return ret;
 	}
 
 private:
 
-	char* m_buf;
+	utp_socket_impl* m_sock;
+	packet* m_buf;
 };
 
 // sends a packet, pulls data from the write buffer (if there's any)
@@ -1710,13 +1849,14 @@ bool utp_socket_impl::send_pkt(int flags)
 
 	// first see if we need to resend any packets
 
-	// TODO: this loop is not very efficient. It could be fixed by having
-	// a separate list of sequence numbers that need resending
-	for (int i = (m_acked_seq_nr + 1) & ACK_MASK; i != m_seq_nr; i = (i + 1) & ACK_MASK)
+	for (int i = m_scoreboard.find_next(utp_scoreboard::need_resend
+			, (m_acked_seq_nr + 1) & ACK_MASK, m_seq_nr); i != m_seq_nr
+		; i = m_scoreboard.find_next(utp_scoreboard::need_resend
+			, (i + 1) & ACK_MASK, m_seq_nr))
 	{
 		packet* p = (packet*)m_outbuf.at(i);
+		TORRENT_ASSERT(p && p->need_resend);
 		if (!p) continue;
-		if (!p->need_resend) continue;
 		if (!resend_packet(p))
 		{
 			// we couldn't resend the packet. It probably doesn't
@@ -1815,7 +1955,7 @@ bool utp_socket_impl::send_pkt(int flags)
 
 	// used to free the packet buffer in case we exit the
 	// function early
-	holder buf_holder;
+	holder buf_holder(this);
 
 	// payload size being zero means we're just sending
 	// an force. We should not pick up the nagle packet
@@ -1825,9 +1965,8 @@ bool utp_socket_impl::send_pkt(int flags)
 		// need to keep the packet around (in the outbuf)
 		if (payload_size) 
 		{
-			p = (packet*)malloc(sizeof(packet) + m_mtu);
-			p->allocated = m_mtu;
-			buf_holder.reset((char*)p);
+			p = acquire_packet(m_mtu);
+			buf_holder.reset(p);
 
 			m_sm->inc_stats_counter(counters::utp_payload_pkts_out);
 		}
@@ -2021,9 +2160,11 @@ bool utp_socket_impl::send_pkt(int flags)
 		// if we fail even though this is not a probe, we're screwed
 		// since we'd have to repacketize
 		TORRENT_ASSERT(p->mtu_probe);
+		m_sm->inc_stats_counter(counters::utp_pmtu_probe_failures);
 		m_mtu_ceiling = p->size - 1;
 		if (m_mtu_floor > m_mtu_ceiling) m_mtu_floor = m_mtu_ceiling;
 		update_mtu_limits();
+		m_sm->pmtu_lower_ceiling(m_remote_address, m_mtu_ceiling);
 		// resend the packet immediately without
 		// it being an MTU probe
 		p->mtu_probe = false;
@@ -2081,11 +2222,12 @@ bool utp_socket_impl::send_pkt(int flags)
 		// buffer of outgoing packets
 		buf_holder.release();
 		packet* old = (packet*)m_outbuf.insert(m_seq_nr, p);
+		m_scoreboard.insert(m_seq_nr, (m_acked_seq_nr + 1) & ACK_MASK);
 		if (old)
 		{
 			TORRENT_ASSERT(((utp_header*)old->buf)->seq_nr == m_seq_nr);
 			if (!old->need_resend) m_bytes_in_flight -= old->size - old->header_size;
-			free(old);
+			release_packet(old);
 		}
 		TORRENT_ASSERT(h->seq_nr == m_seq_nr);
 		m_seq_nr = (m_seq_nr + 1) & ACK_MASK;
@@ -2141,8 +2283,10 @@ bool utp_socket_impl::resend_packet(packet* p, bool fast_resend)
 		p->mtu_probe = false;
 		// we got multiple acks for the packet before our probe, assume
 		// it was dropped because it was too big
+		m_sm->inc_stats_counter(counters::utp_pmtu_probe_failures);
 		m_mtu_ceiling = p->size - 1;
 		update_mtu_limits();
+		m_sm->pmtu_lower_ceiling(m_remote_address, m_mtu_ceiling);
 	}
 
 	// we can only resend the packet if there's
@@ -2174,6 +2318,7 @@ bool utp_socket_impl::resend_packet(packet* p, bool fast_resend)
 #endif
 	p->need_resend = false;
 	utp_header* h = (utp_header*)p->buf;
+	m_scoreboard.clear(utp_scoreboard::need_resend, h->seq_nr);
 	// update packet header
 	h->timestamp_difference_microseconds = m_reply_micro;
 	p->send_time = clock_type::now();
@@ -2257,17 +2402,16 @@ void utp_socket_impl::experienced_loss(int seq_nr)
 	// less than or equal to. If we experience loss of the
 	// same packet again, ignore it.
 	if (compare_less_wrap(seq_nr, m_loss_seq_nr + 1, ACK_MASK)) return;
-	
-	// if we happen to be in slow-start mode, we need to leave it
-	if (m_slow_start)
+
+	// let the congestion controller cut the window size. LEDBAT cuts it
+	// by utp_loss_multiplier
+	utp_cc_window w = cc_window();
+	m_cc->on_loss(w, m_mtu, m_sm->loss_multiplier(), clock_type::now());
+	if (m_slow_start && !w.slow_start)
 	{
-		m_ssthres = m_cwnd >> 16;
-		m_slow_start = false;
 		UTP_LOGV("%8p: experienced loss, slow_start -> 0\n", this);
 	}
-
-	// cut window size in 2
-	m_cwnd = (std::max)(m_cwnd * m_sm->loss_multiplier() / 100, boost::int64_t(m_mtu << 16));
+	set_cc_window(w);
 	m_loss_seq_nr = m_seq_nr;
 	UTP_LOGV("%8p: Lost packet %d caused cwnd cut\n", this, seq_nr);
 
@@ -2284,30 +2428,38 @@ void utp_socket_impl::set_state(int s)
 	m_sm->inc_stats_counter(counters::num_utp_idle + m_state, -1);
 	m_state = s;
 	m_sm->inc_stats_counter(counters::num_utp_idle + m_state, 1);
+
+	// the socket manager only ticks sockets when their timeout expires.
+	// Changing state may make the socket ready to be deleted, or need
+	// ticking again after sitting in an error state
+	if (m_state >= UTP_STATE_ERROR_WAIT || m_state == UTP_STATE_NONE)
+		m_sm->schedule_tick(this, clock_type::now());
+	else
+		m_sm->schedule_tick(this, m_timeout);
 }
 
 void utp_socket_impl::maybe_inc_acked_seq_nr()
 {
 	INVARIANT_CHECK;
 
-	bool incremented = false;
-	// don't pass m_seq_nr, since we move into sequence
-	// numbers that haven't been sent yet, and aren't
-	// supposed to be in m_outbuf
-	// if the slot in m_outbuf is 0, it means the
-	// packet has been ACKed and removed from the send buffer
-	while (((m_acked_seq_nr + 1) & ACK_MASK) != m_seq_nr
-		&& m_outbuf.at((m_acked_seq_nr + 1) & ACK_MASK) == 0)
-	{
-		// increment the fast resend sequence number
-		if (m_fast_resend_seq_nr == m_acked_seq_nr)
-			m_fast_resend_seq_nr = (m_fast_resend_seq_nr + 1) & ACK_MASK;
+	// the first packet that's still in flight. Everything before it has
+	// been ACKed and removed from the send buffer. Don't pass m_seq_nr,
+	// since we move into sequence numbers that haven't been sent yet, and
+	// aren't supposed to be in m_outbuf
+	int const first = (m_acked_seq_nr + 1) & ACK_MASK;
+	int const next = m_scoreboard.find_next(utp_scoreboard::in_flight
+		, first, m_seq_nr);
+	if (next == first) return;
+	TORRENT_ASSERT(next == m_seq_nr || m_outbuf.at(next));
 
-		m_acked_seq_nr = (m_acked_seq_nr + 1) & ACK_MASK;
-		incremented = true;
-	}
+	int const new_acked_seq_nr = (next - 1) & ACK_MASK;
+
+	// increment the fast resend sequence number along with it
+	if (!compare_less_wrap(m_fast_resend_seq_nr, m_acked_seq_nr, ACK_MASK)
+		&& compare_less_wrap(m_fast_resend_seq_nr, new_acked_seq_nr, ACK_MASK))
+		m_fast_resend_seq_nr = new_acked_seq_nr;
 
-	if (!incremented) return;
+	m_acked_seq_nr = new_acked_seq_nr;
 
 	// update loss seq number if it's less than the packet
 	// that was just acked. If loss seq nr is greater, it suggests
@@ -2341,6 +2493,10 @@ void utp_socket_impl::ack_packet(packet* p, time_point const& receive_time
 		m_mtu_floor = (std::max)(m_mtu_floor, p->size);
 		if (m_mtu_ceiling < m_mtu_floor) m_mtu_ceiling = m_mtu_floor;
 		update_mtu_limits();
+		// let new sockets to the same network benefit from what we
+		// learned. Only sizes that were actually acked are cached, not
+		// the floor this socket may have started out with from the cache
+		m_sm->pmtu_confirm_floor(m_remote_address, p->size);
 	}
 
 	// increment the acked sequence number counter
@@ -2361,11 +2517,11 @@ void utp_socket_impl::ack_packet(packet* p, time_point const& receive_time
 
 	m_rtt.add_sample(rtt / 1000);
 	if (rtt < min_rtt) min_rtt = rtt;
-	free(p);
+	release_packet(p);
 }
 
-void utp_socket_impl::incoming(boost::uint8_t const* buf, int size, packet* p
-	, time_point /* now */)
+void utp_socket_impl::incoming(utp_header const* ph, boost::uint8_t const* buf
+	, int size, packet* p, time_point /* now */)
 {
 	INVARIANT_CHECK;
 
@@ -2399,17 +2555,20 @@ void utp_socket_impl::incoming(boost::uint8_t const* buf, int size, packet* p
 		if (size == 0)
 		{
 			TORRENT_ASSERT(p == 0 || p->header_size == p->size);
-			free(p);
+			release_packet(p);
 			return;
 		}
 	}
 
 	TORRENT_ASSERT(m_read_buffer_size == 0);
 
+	// if the packet is still in the udp socket's receive buffer, try to
+	// hang on to that buffer rather than copying the payload out of it
+	if (!p && ph) p = adopt_packet(ph, buf, size);
 	if (!p)
 	{
 		TORRENT_ASSERT(buf);
-		p = (packet*)malloc(sizeof(packet) + size);
+		p = acquire_packet(size);
 		p->size = size;
 		p->header_size = 0;
 		memcpy(p->buf, buf, size);
@@ -2486,7 +2645,7 @@ bool utp_socket_impl::consume_incoming_data(
 		}
 
 		// we received a packet in order
-		incoming(ptr, payload_size, 0, now);
+		incoming(ph, ptr, payload_size, 0, now);
 		m_ack_nr = (m_ack_nr + 1) & ACK_MASK;
 
 		// If this packet was previously in the reorder buffer
@@ -2505,7 +2664,7 @@ bool utp_socket_impl::consume_incoming_data(
 			if (!p) break;
 
 			m_buffered_incoming_bytes -= p->size - p->header_size;
-			incoming(0, p->size - p->header_size, p, now);
+			incoming(NULL, 0, p->size - p->header_size, p, now);
 
 			m_ack_nr = next_ack_nr;
 
@@ -2542,18 +2701,23 @@ bool utp_socket_impl::consume_incoming_data(
 			return true;
 		}
 
-		// we don't need to save the packet header, just the payload
-		packet* p = (packet*)malloc(sizeof(packet) + payload_size);
-		p->size = payload_size;
-		p->header_size = 0;
-		p->num_transmissions = 0;
+		// link the receive buffer the packet is in, if we can. Otherwise
+		// copy the payload, we don't need to save the packet header
+		packet* p = adopt_packet(ph, ptr, payload_size);
+		if (p == NULL)
+		{
+			p = acquire_packet(payload_size);
+			p->size = payload_size;
+			p->header_size = 0;
+			p->num_transmissions = 0;
 #ifdef TORRENT_DEBUG
-		p->num_fast_resend = 0;
+			p->num_fast_resend = 0;
 #endif
-		p->need_resend = false;
-		memcpy(p->buf, ptr, payload_size);
+			p->need_resend = false;
+			memcpy(p->buf, ptr, payload_size);
+		}
 		m_inbuf.insert(ph->seq_nr, p);
-		m_buffered_incoming_bytes += p->size;
+		m_buffered_incoming_bytes += p->size - p->header_size;
 
 		UTP_LOGV("%8p: out of order. insert inbuf: %d (%d) m_ack_nr: %d\n"
 			, this, int(ph->seq_nr), int(m_inbuf.size()), m_ack_nr);
@@ -2592,7 +2756,7 @@ bool utp_socket_impl::test_socket_state()
 	return false;
 }
 
-void utp_socket_impl::init_mtu(int link_mtu, int utp_mtu)
+void utp_socket_impl::init_mtu(address const& remote, int link_mtu, int utp_mtu)
 {
 	INVARIANT_CHECK;
 
@@ -2625,6 +2789,18 @@ void utp_socket_impl::init_mtu(int link_mtu, int utp_mtu)
 
 	if (m_mtu_floor > utp_mtu) m_mtu_floor = utp_mtu;
 
+	// if other sockets have already probed the path to this network,
+	// start out from what they found instead of from scratch. The
+	// cached range is only allowed to narrow the one from the interface
+	int floor = 0;
+	int ceiling = 0xffff;
+	if (m_sm->pmtu_lookup(remote, floor, ceiling))
+	{
+		m_mtu_ceiling = (std::max)(int(m_mtu_floor), (std::min)(ceiling, int(m_mtu_ceiling)));
+		m_mtu_floor = (std::min)(int(m_mtu_ceiling), (std::max)(floor, int(m_mtu_floor)));
+		m_mtu = (m_mtu_floor + m_mtu_ceiling) / 2;
+	}
+
 	// if the window size is smaller than one packet size
 	// set it to one
 	if ((m_cwnd >> 16) < m_mtu) m_cwnd = boost::int64_t(m_mtu) << 16;
@@ -2670,8 +2846,7 @@ bool utp_socket_impl::incoming_packet(boost::uint8_t const* buf, int size
 
 	if (m_state == UTP_STATE_NONE && ph->get_type() == ST_SYN)
 	{
-		m_remote_address = ep.address();
-		m_port = ep.port();
+		set_remote_endpoint(ep);
 	}
 
 	if (m_state != UTP_STATE_NONE && ph->get_type() == ST_SYN)
@@ -2816,6 +2991,8 @@ bool utp_socket_impl::incoming_packet(boost::uint8_t const* buf, int size
 	// this is a valid incoming packet, update the timeout timer
 	m_num_timeouts = 0;
 	m_timeout = receive_time + milliseconds(packet_timeout());
+	// this only has an effect if the timeout moved closer
+	m_sm->schedule_tick(this, m_timeout);
 	UTP_LOGV("%8p: updating timeout to: now + %d\n"
 		, this, packet_timeout());
 
@@ -2859,15 +3036,23 @@ bool utp_socket_impl::incoming_packet(boost::uint8_t const* buf, int size
 	if (m_state != UTP_STATE_NONE && compare_less_wrap(m_acked_seq_nr, ph->ack_nr, ACK_MASK))
 	{
 		int const next_ack_nr = ph->ack_nr;
-
-		for (int ack_nr = (m_acked_seq_nr + 1) & ACK_MASK;
-			ack_nr != ((next_ack_nr + 1) & ACK_MASK);
-			ack_nr = (ack_nr + 1) & ACK_MASK)
+		int const first = (m_acked_seq_nr + 1) & ACK_MASK;
+		int const end = (next_ack_nr + 1) & ACK_MASK;
+
+		// the fast resend sequence number is moved past every
+		// sequence number that was just acked
+		if (!compare_less_wrap(m_fast_resend_seq_nr, first, ACK_MASK)
+			&& compare_less_wrap(m_fast_resend_seq_nr, end, ACK_MASK))
+			m_fast_resend_seq_nr = end;
+
+		// only visit the packets that are still in the send buffer
+		for (int ack_nr = m_scoreboard.find_next(utp_scoreboard::in_flight, first, end);
+			ack_nr != end; ack_nr = m_scoreboard.find_next(utp_scoreboard::in_flight
+				, (ack_nr + 1) & ACK_MASK, end))
 		{
-			if (m_fast_resend_seq_nr == ack_nr)
-				m_fast_resend_seq_nr = (m_fast_resend_seq_nr + 1) & ACK_MASK;
 			packet* p = (packet*)m_outbuf.remove(ack_nr);
-
+			m_scoreboard.remove(ack_nr);
+			TORRENT_ASSERT(p);
 			if (!p) continue;
 
 			acked_bytes += p->size - p->header_size;
@@ -3012,8 +3197,7 @@ bool utp_socket_impl::incoming_packet(boost::uint8_t const* buf, int size
 				// we accept are SYN packets.
 				set_state(UTP_STATE_CONNECTED);
 
-				m_remote_address = ep.address();
-				m_port = ep.port();
+				set_remote_endpoint(ep);
 
 				error_code ec;
 				m_local_address = m_sm->local_endpoint(m_remote_address, ec).address();
@@ -3095,7 +3279,9 @@ bool utp_socket_impl::incoming_packet(boost::uint8_t const* buf, int size
 				// only use the minimum from the last 3 delay measurements
 				delay = *std::min_element(m_delay_sample_hist, m_delay_sample_hist + num_delay_hist);
 
-				do_ledbat(acked_bytes, delay, prev_bytes_in_flight);
+				do_congestion_control(acked_bytes, delay, prev_bytes_in_flight
+					, min_rtt == (std::numeric_limits<boost::uint32_t>::max)()
+					? 0 : int(min_rtt), receive_time);
 				m_send_delay = delay;
 			}
 
@@ -3158,6 +3344,9 @@ bool utp_socket_impl::incoming_packet(boost::uint8_t const* buf, int size
 				else
 					strcpy(our_delay_base, "-");
 
+				utp_cc_status cc;
+				m_cc->status(cc);
+
 				UTP_LOG("%8p: "
 					"actual_delay:%u "
 					"our_delay:%f "
@@ -3190,6 +3379,12 @@ bool utp_socket_impl::incoming_packet(boost::uint8_t const* buf, int size
 					"recv_buffer:%d "
 					"fast_resend_seq_nr:%d "
 					"ssthres:%d "
+					"cc:%d "
+					"cc_mode:%d "
+					"cc_wmax:%d "
+					"cc_btlbw:%d "
+					"cc_min_rtt:%d "
+					"cc_bdp:%d "
 					"\n"
 					, this
 					, sample
@@ -3222,7 +3417,13 @@ bool utp_socket_impl::incoming_packet(boost::uint8_t const* buf, int size
 					, m_write_buffer_size
 					, m_read_buffer_size
 					, m_fast_resend_seq_nr
-					, m_ssthres);
+					, m_ssthres
+					, m_cc->type()
+					, cc.mode
+					, cc.w_max
+					, cc.btl_bw
+					, cc.min_rtt / 1000
+					, cc.bdp);
 			}
 #endif
 
@@ -3327,103 +3528,73 @@ bool utp_socket_impl::incoming_packet(boost::uint8_t const* buf, int size
 	return false;
 }
 
-void utp_socket_impl::do_ledbat(int acked_bytes, int delay, int in_flight)
+utp_cc_window utp_socket_impl::cc_window() const
+{
+	utp_cc_window w;
+	w.cwnd = m_cwnd;
+	w.ssthres = m_ssthres;
+	w.slow_start = m_slow_start;
+	return w;
+}
+
+void utp_socket_impl::set_cc_window(utp_cc_window const& w)
+{
+	TORRENT_ASSERT(w.cwnd >= 0);
+	m_cwnd = w.cwnd;
+	m_ssthres = w.ssthres;
+	m_slow_start = w.slow_start;
+}
+
+void utp_socket_impl::set_congestion_control(int type)
+{
+	if (m_cc->type() == type) return;
+	UTP_LOGV("%8p: congestion control %d -> %d\n", this, m_cc->type(), type);
+	// the new controller starts out with the current window
+	m_cc.reset(create_utp_congestion_control(type));
+}
+
+void utp_socket_impl::do_congestion_control(int acked_bytes, int delay
+	, int in_flight, int rtt, time_point now)
 {
 	INVARIANT_CHECK;
 
-	// the portion of the in-flight bytes that were acked. This is used to make
-	// the gain factor be scaled by the rtt. The formula is applied once per
-	// rtt, or on every ACK skaled by the number of ACKs per rtt
 	TORRENT_ASSERT(in_flight > 0);
 	TORRENT_ASSERT(acked_bytes > 0);
 
 	int target_delay = m_sm->target_delay();
 
-	// true if the upper layer is pushing enough data down the socket to be
-	// limited by the cwnd. If this is not the case, we should not adjust cwnd.
-	bool cwnd_saturated = (m_bytes_in_flight + acked_bytes + m_mtu > (m_cwnd >> 16));
-
-	// all of these are fixed points with 16 bits fraction portion
-	boost::int64_t window_factor = (boost::int64_t(acked_bytes) << 16) / in_flight;
-	boost::int64_t delay_factor = (boost::int64_t(target_delay - delay) << 16) / target_delay;
-	boost::int64_t scaled_gain;
-  
 	if (delay >= target_delay)
-	{
-		if (m_slow_start)
-		{
-			UTP_LOGV("%8p: off_target: %d slow_start -> 0\n", this, target_delay - delay);
-			m_ssthres = m_cwnd >> 16;
-			m_slow_start = false;
-		}
-
 		m_sm->inc_stats_counter(counters::utp_samples_above_target);
-	}
 	else
-	{
 		m_sm->inc_stats_counter(counters::utp_samples_below_target);
-	}
 
-	boost::int64_t linear_gain = (window_factor * delay_factor) >> 16;
-	linear_gain *= boost::int64_t(m_sm->gain_factor());
-
-	// if the user is not saturating the link (i.e. not filling the
-	// congestion window), don't adjust it at all.
-	if (cwnd_saturated)
-	{
-		boost::int64_t exponential_gain = boost::int64_t(acked_bytes) << 16;
-		if (m_slow_start)
-		{
-			// mimic TCP slow-start by adding the number of acked
-			// bytes to cwnd
-			if (m_ssthres != 0 && ((m_cwnd + exponential_gain) >> 16) > m_ssthres)
-			{
-				// if we would exeed the slow start threshold by growing the cwnd
-				// exponentially, don't do it, and leave slow-start mode. This
-				// make us avoid causing more delay and/or packet loss by being too
-				// aggressive
-				m_slow_start = false;
-				scaled_gain = linear_gain;
-				UTP_LOGV("%8p: cwnd > ssthres (%d) slow_start -> 0\n", this, m_ssthres);
-			}
-			else
-			{
-				scaled_gain = (std::max)(exponential_gain, linear_gain);
-			}
-		}
-		else
-		{
-			scaled_gain = linear_gain;
-		}
-	}
-	else
-	{
-		scaled_gain = 0;
-	}
+	utp_cc_ack ack;
+	ack.now = now;
+	ack.acked_bytes = acked_bytes;
+	ack.in_flight = in_flight;
+	ack.bytes_in_flight = m_bytes_in_flight;
+	ack.delay = delay;
+	ack.rtt = rtt;
+	ack.mtu = m_mtu;
+	ack.target_delay = target_delay;
+	ack.gain_factor = m_sm->gain_factor();
 
-	// make sure we don't wrap the cwnd
-	if (scaled_gain >= (std::numeric_limits<boost::int64_t>::max)() - m_cwnd)
-		scaled_gain = (std::numeric_limits<boost::int64_t>::max)() - m_cwnd - 1;
+	utp_cc_window w = cc_window();
+	m_cc->on_ack(w, ack);
 
-	UTP_LOGV("%8p: do_ledbat delay:%d off_target: %d window_factor:%f target_factor:%f "
-		"scaled_gain:%f cwnd:%d slow_start:%d\n"
-		, this, delay, target_delay - delay, window_factor / float(1 << 16)
-		, delay_factor / float(1 << 16)
-		, scaled_gain / float(1 << 16), int(m_cwnd >> 16)
-		, int(m_slow_start));
+	UTP_LOGV("%8p: do_congestion_control cc:%d delay:%d off_target: %d "
+		"gain:%f cwnd:%d slow_start:%d\n"
+		, this, m_cc->type(), delay, target_delay - delay
+		, (w.cwnd - m_cwnd) / float(1 << 16), int(w.cwnd >> 16)
+		, int(w.slow_start));
 
-	// if scaled_gain + m_cwnd <= 0, set m_cwnd to 0
-	if (-scaled_gain >= m_cwnd)
+	if (m_slow_start && !w.slow_start)
 	{
-		m_cwnd = 0;
-	}
-	else
-	{
-		m_cwnd += scaled_gain;
-		TORRENT_ASSERT(m_cwnd > 0);
+		UTP_LOGV("%8p: cwnd:%d ssthres:%d slow_start -> 0\n"
+			, this, int(w.cwnd >> 16), w.ssthres);
 	}
 
-	TORRENT_ASSERT(m_cwnd >= 0);
+	set_cc_window(w);
 
 	int window_size_left = (std::min)(int(m_cwnd >> 16), int(m_adv_wnd)) - in_flight + acked_bytes;
 	if (window_size_left >= m_mtu)
@@ -3512,9 +3683,11 @@ void utp_socket_impl::tick(time_point now)
 			// we timed out, and the only outstanding packet
 			// we had was the probe. Assume it was dropped
 			// because it was too big
+			m_sm->inc_stats_counter(counters::utp_pmtu_probe_failures);
 			m_mtu_ceiling = m_mtu - 1;
 			if (m_mtu_floor > m_mtu_ceiling) m_mtu_floor = m_mtu_ceiling;
 			update_mtu_limits();
+			m_sm->pmtu_lower_ceiling(m_remote_address, m_mtu_ceiling);
 		}
 
 		if (m_bytes_in_flight == 0 && (m_cwnd >> 16) >= m_mtu)
@@ -3552,17 +3725,21 @@ void utp_socket_impl::tick(time_point now)
 		m_slow_start = true;
 		UTP_LOGV("%8p: timeout slow_start -> 1\n", this);
 
-		// we need to go one past m_seq_nr to cover the case
-		// where we just sent a SYN packet and then adjusted for
-		// the uTorrent sequence number reuse
-		for (int i = m_acked_seq_nr & ACK_MASK;
-			i != ((m_seq_nr + 1) & ACK_MASK);
-			i = (i + 1) & ACK_MASK)
+		utp_cc_window w = cc_window();
+		m_cc->on_timeout(w, now);
+		set_cc_window(w);
+
+		for (int i = m_scoreboard.find_next(utp_scoreboard::in_flight
+				, (m_acked_seq_nr + 1) & ACK_MASK, m_seq_nr); i != m_seq_nr
+			; i = m_scoreboard.find_next(utp_scoreboard::in_flight
+				, (i + 1) & ACK_MASK, m_seq_nr))
 		{
 			packet* p = (packet*)m_outbuf.at(i);
+			TORRENT_ASSERT(p);
 			if (!p) continue;
 			if (p->need_resend) continue;
 			p->need_resend = true;
+			m_scoreboard.set(utp_scoreboard::need_resend, i);
 			TORRENT_ASSERT(m_bytes_in_flight >= p->size - p->header_size);
 			m_bytes_in_flight -= p->size - p->header_size;
 			UTP_LOGV("%8p: Packet %d lost (timeout).\n", this, i);
@@ -3652,8 +3829,10 @@ void utp_socket_impl::check_invariant() const
 		{
 			TORRENT_ASSERT(p->mtu_probe);
 		}
+		TORRENT_ASSERT(m_scoreboard.test(utp_scoreboard::in_flight, i) == (p != NULL));
 		if (!p) continue;
 		TORRENT_ASSERT(((utp_header*)p->buf)->seq_nr == i);
+		TORRENT_ASSERT(m_scoreboard.test(utp_scoreboard::need_resend, i) == p->need_resend);
 	}
 
 	if (m_nagle_packet)
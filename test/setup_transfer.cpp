@@ -337,6 +337,54 @@ bool downloading_alert(libtorrent::alert const* a)
 	return true;
 }
 
+void do_handshake(stream_socket& s, sha1_hash const& ih, char* buffer
+	, char const* pid)
+{
+	char handshake[] = "\x13" "BitTorrent protocol\0\0\0\0\0\x10\0\x04"
+		"                    " // space for info-hash
+		"                    "; // space for peer-id
+	fprintf(stderr, "%s: ==> handshake\n", aux::time_now_string());
+	error_code ec;
+	std::memcpy(handshake + 28, ih.begin(), 20);
+	std::memcpy(handshake + 48, pid, 20);
+	libtorrent::asio::write(s, libtorrent::asio::buffer(handshake, sizeof(handshake) - 1)
+		, libtorrent::asio::transfer_all(), ec);
+	if (ec)
+	{
+		TEST_ERROR(ec.message());
+		return;
+	}
+
+	// read handshake
+	libtorrent::asio::read(s, libtorrent::asio::buffer(buffer, 68)
+		, libtorrent::asio::transfer_all(), ec);
+	if (ec)
+	{
+		TEST_ERROR(ec.message());
+		return;
+	}
+	fprintf(stderr, "%s: <== handshake\n", aux::time_now_string());
+
+	TEST_CHECK(buffer[0] == 19);
+	TEST_CHECK(std::memcmp(buffer + 1, "BitTorrent protocol", 19) == 0);
+
+	char* extensions = buffer + 20;
+	// check for fast extension support
+	TEST_CHECK(extensions[7] & 0x4);
+	
+#ifndef TORRENT_DISABLE_EXTENSIONS
+	// check for extension protocol support
+	TEST_CHECK(extensions[5] & 0x10);
+#endif
+	
+#ifndef TORRENT_DISABLE_DHT
+	// check for DHT support
+	TEST_CHECK(extensions[7] & 0x1);
+#endif
+	
+	TEST_CHECK(std::memcmp(buffer + 28, ih.begin(), 20) == 0);
+}
+
 void wait_for_downloading(lt::session& ses, char const* name)
 {
 	downloading_done = false;
@@ -34,6 +34,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #define SETUP_TRANSFER_HPP
 
 #include "libtorrent/session.hpp"
+#include "libtorrent/socket.hpp"
 #include <boost/tuple/tuple.hpp>
 #include "test.hpp"
 
@@ -75,6 +76,13 @@ EXPORT bool print_alerts(libtorrent::session& ses, char const* name
 	, bool (*)(libtorrent::alert const*) = 0
 	, bool no_output = false);
 
+// sends a BitTorrent handshake for ih over s, announcing the fast and
+// extension protocols, and reads and checks the handshake that comes back.
+// buffer must hold at least 68 bytes
+EXPORT void do_handshake(libtorrent::stream_socket& s
+	, libtorrent::sha1_hash const& ih, char* buffer
+	, char const* pid = "aaaaaaaaaaaaaaaaaaaa");
+
 EXPORT void wait_for_listen(libtorrent::session& ses, char const* name);
 EXPORT void wait_for_downloading(libtorrent::session& ses, char const* name);
 EXPORT void test_sleep(int millisec);
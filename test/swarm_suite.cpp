@@ -42,18 +42,42 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "setup_transfer.hpp"
 #include "swarm_suite.hpp"
 
+namespace
+{
+	int num_read_pieces = 0;
+	int num_deadline_misses = 0;
+
+	bool count_streaming_alerts(libtorrent::alert const* a)
+	{
+		using namespace libtorrent;
+		if (read_piece_alert const* rp = alert_cast<read_piece_alert>(a))
+		{
+			TEST_CHECK(!rp->ec);
+			if (!rp->ec) ++num_read_pieces;
+		}
+		else if (alert_cast<deadline_miss_alert>(a))
+		{
+			++num_deadline_misses;
+		}
+		return false;
+	}
+}
+
 void test_swarm(int flags)
 {
 	using namespace libtorrent;
 	namespace lt = libtorrent;
 
-	fprintf(stderr, "\n\n ==== TEST SWARM === %s%s%s%s%s%s ===\n\n\n"
+	fprintf(stderr, "\n\n ==== TEST SWARM === %s%s%s%s%s%s%s%s%s ===\n\n\n"
 		, (flags & super_seeding) ? "super-seeding ": ""
 		, (flags & strict_super_seeding) ? "strict-super-seeding ": ""
 		, (flags & seed_mode) ? "seed-mode ": ""
 		, (flags & time_critical) ? "time-critical ": ""
 		, (flags & suggest) ? "suggest ": ""
 		, (flags & explicit_cache) ? "explicit-cache ": ""
+		, (flags & batch_have) ? "batch-have ": ""
+		, (flags & streaming) ? "streaming ": ""
+		, (flags & missed_deadlines) ? "missed-deadlines ": ""
 		);
 
 	// in case the previous run was terminated
@@ -91,6 +115,9 @@ void test_swarm(int flags)
 	if (flags & explicit_cache)
 		pack.set_bool(settings_pack::explicit_read_cache, true);
 
+	if (flags & batch_have)
+		pack.set_bool(settings_pack::batch_have_messages, true);
+
 	if (flags & explicit_cache)
 	{
 		pack.set_bool(settings_pack::explicit_read_cache, true);
@@ -135,6 +162,25 @@ void test_swarm(int flags)
 		tor2.set_piece_deadline(8, 2000);
 	}
 
+	int num_pieces = tor2.torrent_file()->num_pieces();
+	num_read_pieces = 0;
+	num_deadline_misses = 0;
+	if (flags & streaming)
+	{
+		// simulate playback, where every piece is needed a second after the
+		// one before it. With missed_deadlines, every piece is needed right
+		// away, which can't be met at this download rate. Otherwise playback
+		// starts after a buffering time long enough to download the whole
+		// torrent several times over
+		int const start = (flags & missed_deadlines) ? 0 : 20000;
+		int const interval = (flags & missed_deadlines) ? 0 : 1000;
+		for (int i = 0; i < num_pieces; ++i)
+		{
+			tor2.set_piece_deadline(i, start + interval * i
+				, torrent_handle::alert_when_available);
+		}
+	}
+
 	float sum_dl_rate2 = 0.f;
 	float sum_dl_rate3 = 0.f;
 	int count_dl_rates2 = 0;
@@ -143,7 +189,7 @@ void test_swarm(int flags)
 	for (int i = 0; i < 80; ++i)
 	{
 		print_alerts(ses1, "ses1");
-		print_alerts(ses2, "ses2");
+		print_alerts(ses2, "ses2", false, false, false, &count_streaming_alerts);
 		print_alerts(ses3, "ses3");
 
 		torrent_status st1 = tor1.status();
@@ -169,13 +215,30 @@ void test_swarm(int flags)
 
 		print_ses_rate(i, &st1, &st2, &st3);
 
-		if (st2.is_seeding && st3.is_seeding) break;
+		if (st2.is_seeding && st3.is_seeding
+			&& (!(flags & streaming) || num_read_pieces == num_pieces)) break;
 		test_sleep(1000);
 	}
 
 	TEST_CHECK(tor2.status().is_seeding);
 	TEST_CHECK(tor3.status().is_seeding);
 
+	if (flags & streaming)
+	{
+		// every piece with a deadline is read back and posted once it's
+		// downloaded
+		TEST_EQUAL(num_read_pieces, num_pieces);
+		fprintf(stderr, "missed deadlines: %d\n", num_deadline_misses);
+		if (flags & missed_deadlines)
+		{
+			TEST_CHECK(num_deadline_misses > 0);
+		}
+		else
+		{
+			TEST_EQUAL(num_deadline_misses, 0);
+		}
+	}
+
 	float average2 = sum_dl_rate2 / float(count_dl_rates2);
 	float average3 = sum_dl_rate3 / float(count_dl_rates3);
 
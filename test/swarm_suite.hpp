@@ -39,7 +39,10 @@ enum test_flags_t
 	seed_mode = 4,
 	time_critical = 8,
 	suggest = 16,
-	explicit_cache = 32
+	explicit_cache = 32,
+	batch_have = 64,
+	streaming = 128,
+	missed_deadlines = 256
 };
 
 void EXPORT test_swarm(int flags = 0);
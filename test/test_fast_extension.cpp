@@ -40,7 +40,15 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/bdecode.hpp"
 #include "libtorrent/bencode.hpp"
 #include "libtorrent/entry.hpp"
+#include "libtorrent/settings_pack.hpp"
+#include "libtorrent/torrent_info.hpp"
+#include "libtorrent/session.hpp"
+#include "libtorrent/alert_types.hpp"
+#include "libtorrent/ip_filter.hpp"
 #include <cstring>
+#include <fstream>
+#include <set>
+#include <deque>
 #include <boost/bind.hpp>
 #include <iostream>
 
@@ -169,6 +177,21 @@ void send_suggest_piece(stream_socket& s, int piece)
 	if (ec) TEST_ERROR(ec.message());
 }
 
+void send_request(stream_socket& s, peer_request const& r)
+{
+	log("==> request %d %d %d", r.piece, r.start, r.length);
+	using namespace libtorrent::detail;
+	char msg[] = "\0\0\0\x0d\x06\0\0\0\0\0\0\0\0\0\0\0\0";
+	char* ptr = msg + 5;
+	write_int32(r.piece, ptr);
+	write_int32(r.start, ptr);
+	write_int32(r.length, ptr);
+	error_code ec;
+	libtorrent::asio::write(s, libtorrent::asio::buffer(msg, 17)
+		, libtorrent::asio::transfer_all(), ec);
+	if (ec) TEST_ERROR(ec.message());
+}
+
 void send_keepalive(stream_socket& s)
 {
 	log("==> keepalive");
@@ -189,6 +212,16 @@ void send_unchoke(stream_socket& s)
 	if (ec) TEST_ERROR(ec.message());
 }
 
+void send_interested(stream_socket& s)
+{
+	log("==> interested");
+	char msg[] = "\0\0\0\x01\x02";
+	error_code ec;
+	libtorrent::asio::write(s, libtorrent::asio::buffer(msg, 5)
+		, libtorrent::asio::transfer_all(), ec);
+	if (ec) TEST_ERROR(ec.message());
+}
+
 void send_have_all(stream_socket& s)
 {
 	log("==> have_all");
@@ -231,52 +264,6 @@ void send_bitfield(stream_socket& s, char const* bits)
 	if (ec) TEST_ERROR(ec.message());
 }
 
-void do_handshake(stream_socket& s, sha1_hash const& ih, char* buffer)
-{
-	char handshake[] = "\x13" "BitTorrent protocol\0\0\0\0\0\x10\0\x04"
-		"                    " // space for info-hash
-		"aaaaaaaaaaaaaaaaaaaa"; // peer-id
-	log("==> handshake");
-	error_code ec;
-	std::memcpy(handshake + 28, ih.begin(), 20);
-	libtorrent::asio::write(s, libtorrent::asio::buffer(handshake, sizeof(handshake) - 1)
-		, libtorrent::asio::transfer_all(), ec);
-	if (ec)
-	{
-		TEST_ERROR(ec.message());
-		return;
-	}
-
-	// read handshake
-	libtorrent::asio::read(s, libtorrent::asio::buffer(buffer, 68)
-		, libtorrent::asio::transfer_all(), ec);
-	if (ec)
-	{
-		TEST_ERROR(ec.message());
-		return;
-	}
-	log("<== handshake");
-
-	TEST_CHECK(buffer[0] == 19);
-	TEST_CHECK(std::memcmp(buffer + 1, "BitTorrent protocol", 19) == 0);
-
-	char* extensions = buffer + 20;
-	// check for fast extension support
-	TEST_CHECK(extensions[7] & 0x4);
-	
-#ifndef TORRENT_DISABLE_EXTENSIONS
-	// check for extension protocol support
-	TEST_CHECK(extensions[5] & 0x10);
-#endif
-	
-#ifndef TORRENT_DISABLE_DHT
-	// check for DHT support
-	TEST_CHECK(extensions[7] & 0x1);
-#endif
-	
-	TEST_CHECK(std::memcmp(buffer + 28, ih.begin(), 20) == 0);
-}
-
 void send_extension_handshake(stream_socket& s, entry const& e)
 {
 	std::vector<char> buf;
@@ -621,6 +608,66 @@ void test_multiple_have_all()
 	print_session_log(*ses);
 }
 
+// sends a run of HAVE messages in a single write, to make sure the batched
+// parsing of them doesn't lose or misattribute any
+void test_have_run()
+{
+	using namespace libtorrent::detail;
+
+	std::cerr << "\n === test have run ===\n" << std::endl;
+
+	sha1_hash ih;
+	torrent_handle th;
+	boost::shared_ptr<lt::session> ses;
+	io_service ios;
+	stream_socket s(ios);
+	boost::shared_ptr<torrent_info> ti = setup_peer(s, ih, ses, &th);
+
+	char recv_buffer[1000];
+	do_handshake(s, ih, recv_buffer);
+	print_session_log(*ses);
+	send_have_none(s);
+
+	// every other piece, followed by a keepalive and a message that's
+	// only partially sent
+	char msg[200];
+	char* ptr = msg;
+	int num_haves = 0;
+	for (int i = 0; i < ti->num_pieces(); i += 2)
+	{
+		write_uint32(5, ptr);
+		write_uint8(4, ptr);
+		write_uint32(i, ptr);
+		++num_haves;
+	}
+	write_uint32(0, ptr);
+	write_uint32(5, ptr);
+	write_uint8(4, ptr);
+	log("==> %d have messages", num_haves);
+
+	error_code ec;
+	libtorrent::asio::write(s, libtorrent::asio::buffer(msg, ptr - msg)
+		, libtorrent::asio::transfer_all(), ec);
+	if (ec) TEST_ERROR(ec.message());
+
+	test_sleep(500);
+	print_session_log(*ses);
+
+	std::vector<peer_info> pi;
+	th.get_peer_info(pi);
+
+	TEST_EQUAL(pi.size(), 1);
+	if (pi.size() != 1) return;
+
+	TEST_EQUAL(pi[0].pieces.count(), num_haves);
+	for (int i = 0; i < ti->num_pieces(); ++i)
+		TEST_EQUAL(pi[0].pieces[i], (i % 2) == 0);
+
+	s.close();
+	test_sleep(500);
+	print_session_log(*ses);
+}
+
 // makes sure that pieces that are lost are not requested
 void test_dont_have()
 {
@@ -720,6 +767,636 @@ void test_dont_have()
 	print_session_log(*ses);
 }
 
+void send_piece(stream_socket& s, peer_request const& r, bool corrupt)
+{
+	using namespace libtorrent::detail;
+
+	log("==> piece %d %d%s", r.piece, r.start, corrupt ? " (corrupt)" : "");
+	std::vector<char> msg(13 + r.length);
+	char* ptr = &msg[0];
+	write_uint32(9 + r.length, ptr);
+	write_uint8(7, ptr);
+	write_int32(r.piece, ptr);
+	write_int32(r.start, ptr);
+	// the same payload create_torrent() hashed
+	for (int i = 0; i < r.length; ++i)
+		*ptr++ = corrupt ? 0 : ((r.start + i) % 26) + 'A';
+
+	// the peer may be banned for the corrupt piece, don't mind errors
+	error_code ec;
+	libtorrent::asio::write(s, libtorrent::asio::buffer(&msg[0], msg.size())
+		, libtorrent::asio::transfer_all(), ec);
+}
+
+// reads requests until all blocks of a piece have been asked for, and returns
+// that piece. Requests already in the map count too
+int read_piece_requests(stream_socket& s
+	, std::map<int, std::vector<peer_request> >& requests, int piece_size)
+{
+	using namespace libtorrent::detail;
+
+	for (std::map<int, std::vector<peer_request> >::iterator i = requests.begin();
+		i != requests.end(); ++i)
+	{
+		if (int(i->second.size()) * i->second[0].length == piece_size)
+			return i->first;
+	}
+
+	char recv_buffer[1000];
+	for (int i = 0; i < 100; ++i)
+	{
+		int len = read_message(s, recv_buffer, sizeof(recv_buffer));
+		print_message(recv_buffer, len);
+		if (len != 13 || recv_buffer[0] != 6) continue;
+		char const* ptr = recv_buffer + 1;
+		peer_request r;
+		r.piece = read_int32(ptr);
+		r.start = read_int32(ptr);
+		r.length = read_int32(ptr);
+		std::vector<peer_request>& reqs = requests[r.piece];
+		reqs.push_back(r);
+		if (int(reqs.size()) * r.length == piece_size)
+			return r.piece;
+	}
+	return -1;
+}
+
+// a piece that's announced predictively while HAVE messages are batched,
+// and then fails the hash check, must not end up as a HAVE at the peer. The
+// DONT_HAVE used to be written right away, and the batched HAVE after it
+void test_predictive_have_batched()
+{
+	using namespace libtorrent::detail;
+
+	std::cerr << "\n === test predictive have batched ===\n" << std::endl;
+
+	const int piece_size = 32 * 1024;
+	boost::shared_ptr<torrent_info> ti = ::create_torrent(NULL, piece_size, 13);
+	lt::session ses(fingerprint("LT", 0, 1, 0, 0)
+		, std::make_pair(48900, 49000), "0.0.0.0", session::add_default_plugins
+		, alert::all_categories);
+
+	settings_pack pack;
+	pack.set_bool(settings_pack::batch_have_messages, true);
+	pack.set_int(settings_pack::predictive_piece_announce, 100000);
+	pack.set_bool(settings_pack::allow_multiple_connections_per_ip, true);
+	ses.apply_settings(pack);
+
+	error_code ec;
+	add_torrent_params p;
+	p.flags &= ~add_torrent_params::flag_paused;
+	p.flags &= ~add_torrent_params::flag_auto_managed;
+	p.ti = ti;
+	p.save_path = "./tmp1_predictive";
+	remove_all("./tmp1_predictive", ec);
+	ec.clear();
+	ses.add_torrent(p, ec);
+	wait_for_downloading(ses, "ses");
+
+	tcp::endpoint ep(address::from_string("127.0.0.1", ec), ses.listen_port());
+	io_service ios;
+	char recv_buffer[1000];
+
+	// the observer doesn't have anything. It's the one receiving the
+	// predictive HAVE and possibly the DONT_HAVE
+	stream_socket observer(ios);
+	observer.connect(ep, ec);
+	if (ec) TEST_ERROR(ec.message());
+	do_handshake(observer, ti->info_hash(), recv_buffer, "bbbbbbbbbbbbbbbbbbbb");
+	entry extensions;
+	extensions["m"]["lt_donthave"] = 7;
+	send_extension_handshake(observer, extensions);
+	send_have_none(observer);
+
+	// the seed sends the data, and corrupts the second block of a piece
+	stream_socket seed(ios);
+	seed.connect(ep, ec);
+	if (ec) TEST_ERROR(ec.message());
+	do_handshake(seed, ti->info_hash(), recv_buffer);
+	send_have_all(seed);
+	send_unchoke(seed);
+	print_session_log(ses);
+
+	// collect requests until all blocks of a piece have been asked for
+	std::map<int, std::vector<peer_request> > requests;
+	int complete = read_piece_requests(seed, requests, piece_size);
+	TEST_CHECK(complete >= 0);
+	if (complete < 0) return;
+
+	// download one piece, and let the session measure the rate, to have
+	// the next one predicted
+	for (int i = 0; i < int(requests[complete].size()); ++i)
+		send_piece(seed, requests[complete][i], false);
+	requests.erase(complete);
+	test_sleep(1500);
+	print_session_log(ses);
+
+	complete = read_piece_requests(seed, requests, piece_size);
+	TEST_CHECK(complete >= 0);
+	if (complete < 0) return;
+
+	int const failed = complete;
+	std::vector<peer_request> const& reqs = requests[failed];
+	for (int i = 0; i < int(reqs.size()); ++i)
+	{
+		send_piece(seed, reqs[i], i == int(reqs.size()) - 1);
+		test_sleep(100);
+	}
+
+	// give it time to flush any batched HAVE
+	test_sleep(2500);
+	print_session_log(ses);
+
+	int num_have = 0;
+	int num_dont_have = 0;
+	bool peer_thinks_we_have = false;
+	while (observer.available(ec) > 0 && !ec)
+	{
+		int len = read_message(observer, recv_buffer, sizeof(recv_buffer));
+		print_message(recv_buffer, len);
+		char const* ptr = recv_buffer + 1;
+		if (len == 5 && recv_buffer[0] == 4)
+		{
+			if (read_int32(ptr) != failed) continue;
+			++num_have;
+			peer_thinks_we_have = true;
+		}
+		else if (len == 6 && recv_buffer[0] == 20 && recv_buffer[1] == 7)
+		{
+			ptr = recv_buffer + 2;
+			if (read_int32(ptr) != failed) continue;
+			++num_dont_have;
+			TEST_CHECK(peer_thinks_we_have);
+			peer_thinks_we_have = false;
+		}
+	}
+
+	// a DONT_HAVE is only expected if the HAVE was flushed before the
+	// piece failed
+	TEST_CHECK(!peer_thinks_we_have);
+	TEST_EQUAL(num_have, num_dont_have);
+}
+
+// reads whatever messages the peer has sent within timeout milliseconds, and
+// returns the requests (id) or cancels among them
+std::vector<peer_request> read_block_messages(stream_socket& s, int id
+	, int timeout)
+{
+	using namespace libtorrent::detail;
+
+	std::vector<peer_request> ret;
+	char recv_buffer[1000];
+	error_code ec;
+	for (int i = 0; i < timeout / 100; ++i)
+	{
+		test_sleep(100);
+		while (s.available(ec) > 0 && !ec)
+		{
+			int len = read_message(s, recv_buffer, sizeof(recv_buffer));
+			print_message(recv_buffer, len);
+			if (len != 13 || recv_buffer[0] != id) continue;
+			char const* ptr = recv_buffer + 1;
+			peer_request r;
+			r.piece = read_int32(ptr);
+			r.start = read_int32(ptr);
+			r.length = read_int32(ptr);
+			ret.push_back(r);
+		}
+	}
+	return ret;
+}
+
+// in end-game mode, an idle peer only requests a block that's already
+// requested from another peer when it's expected to deliver it sooner. When
+// it does, the other peer is sent a CANCEL as soon as the block arrives.
+// Neither peer has sent us any data, so both are expected to deliver at the
+// same (fallback) rate. The idle peer is faster only if the one holding the
+// block has more requests outstanding, which is the case when the piece has
+// two blocks
+void test_end_game_duplicates(bool slow_holder)
+{
+	using namespace libtorrent::detail;
+
+	std::cerr << "\n === test end-game duplicates (slow holder: "
+		<< slow_holder << ") ===\n" << std::endl;
+
+	const int piece_size = (slow_holder ? 2 : 1) * 16 * 1024;
+	boost::shared_ptr<torrent_info> ti = ::create_torrent(NULL, piece_size, 1);
+	lt::session ses(fingerprint("LT", 0, 1, 0, 0)
+		, std::make_pair(48900, 49000), "0.0.0.0", session::add_default_plugins
+		, alert::all_categories);
+
+	settings_pack pack;
+	pack.set_bool(settings_pack::allow_multiple_connections_per_ip, true);
+	ses.apply_settings(pack);
+
+	error_code ec;
+	add_torrent_params p;
+	p.flags &= ~add_torrent_params::flag_paused;
+	p.flags &= ~add_torrent_params::flag_auto_managed;
+	p.ti = ti;
+	p.save_path = "./tmp1_end_game";
+	remove_all("./tmp1_end_game", ec);
+	ec.clear();
+	ses.add_torrent(p, ec);
+	wait_for_downloading(ses, "ses");
+
+	tcp::endpoint ep(address::from_string("127.0.0.1", ec), ses.listen_port());
+	io_service ios;
+	char recv_buffer[1000];
+
+	// the holder is asked for every block of the only piece, and never
+	// sends any of them
+	stream_socket holder(ios);
+	holder.connect(ep, ec);
+	if (ec) TEST_ERROR(ec.message());
+	do_handshake(holder, ti->info_hash(), recv_buffer);
+	send_have_all(holder);
+	send_unchoke(holder);
+
+	std::map<int, std::vector<peer_request> > requests;
+	TEST_EQUAL(read_piece_requests(holder, requests, piece_size), 0);
+
+	// everything is requested, the idle peer can only be asked for busy
+	// blocks
+	stream_socket idle(ios);
+	idle.connect(ep, ec);
+	if (ec) TEST_ERROR(ec.message());
+	do_handshake(idle, ti->info_hash(), recv_buffer, "bbbbbbbbbbbbbbbbbbbb");
+	send_have_all(idle);
+	send_unchoke(idle);
+
+	std::vector<peer_request> dup = read_block_messages(idle, 6, 2000);
+	print_session_log(ses);
+
+	if (slow_holder)
+	{
+		TEST_EQUAL(dup.size(), 1);
+		if (dup.size() == 1)
+		{
+			send_piece(idle, dup[0], false);
+			std::vector<peer_request> cancels = read_block_messages(holder, 8, 2000);
+			TEST_EQUAL(cancels.size(), 1);
+			if (cancels.size() == 1) TEST_CHECK(cancels[0] == dup[0]);
+		}
+	}
+	else
+	{
+		TEST_EQUAL(dup.size(), 0);
+	}
+
+	int const requests_idx = find_metric_idx("picker.end_game_duplicate_requests");
+	int const declined_idx = find_metric_idx("picker.end_game_duplicates_declined");
+	int const cancelled_idx = find_metric_idx("ses.cancelled_duplicate_bytes");
+	TEST_CHECK(requests_idx >= 0);
+	TEST_CHECK(declined_idx >= 0);
+	TEST_CHECK(cancelled_idx >= 0);
+
+	print_session_log(ses);
+	ses.post_session_stats();
+	alert const* a = wait_for_alert(ses, session_stats_alert::alert_type, "ses");
+	session_stats_alert const* ss = alert_cast<session_stats_alert>(a);
+	TEST_CHECK(ss);
+	if (ss == NULL || requests_idx < 0 || declined_idx < 0 || cancelled_idx < 0)
+		return;
+
+	if (slow_holder)
+	{
+		// once the idle peer has delivered a block it may be asked for the
+		// holder's other one too. Only the block cancelled at the holder
+		// counts, not the copy the idle peer delivered
+		TEST_CHECK(ss->values[requests_idx] >= 1);
+		TEST_EQUAL(ss->values[cancelled_idx], 16 * 1024);
+	}
+	else
+	{
+		TEST_EQUAL(ss->values[requests_idx], 0);
+		TEST_CHECK(ss->values[declined_idx] > 0);
+		TEST_EQUAL(ss->values[cancelled_idx], 0);
+	}
+}
+
+// reads the messages the peer has sent so far, and records the pieces it
+// suggested and allowed fast
+void read_suggestions(stream_socket& s, std::vector<int>& suggested
+	, std::set<int>& allowed_fast)
+{
+	using namespace libtorrent::detail;
+
+	char recv_buffer[1000];
+	error_code ec;
+	while (s.available(ec) > 0 && !ec)
+	{
+		int len = read_message(s, recv_buffer, sizeof(recv_buffer));
+		print_message(recv_buffer, len);
+		if (len != 5) continue;
+		char const* ptr = recv_buffer + 1;
+		int const piece = read_int32(ptr);
+		if (recv_buffer[0] == 0x0d) suggested.push_back(piece);
+		else if (recv_buffer[0] == 0x11) allowed_fast.insert(piece);
+	}
+}
+
+// in suggest_read_cache mode a choked peer is also allowed to request the
+// hottest cached pieces, on top of its BEP 6 allowed fast set. With
+// allowed_fast_set_size at 1, it's allowed one piece that way, the one
+// that's hottest at the first suggestion refresh. A piece that's even hotter
+// at the next refresh is still suggested, but not allowed fast.
+// With a cache of a single block, reading the second piece evicts the first
+// one. The first piece is then withdrawn from the set, which makes room for
+// the second, and the first piece isn't served anymore
+void test_cached_allowed_fast(bool evict)
+{
+	std::cerr << "\n === test cached allowed fast (evict: " << evict
+		<< ") ===\n" << std::endl;
+
+	error_code ec;
+	remove_all("./tmp1_cached_fast", ec);
+	create_directory("./tmp1_cached_fast", ec);
+	std::ofstream file(combine_path("./tmp1_cached_fast", "temporary").c_str());
+	boost::shared_ptr<torrent_info> ti = ::create_torrent(&file, 16 * 1024, 8, false);
+	file.close();
+
+	lt::session ses(fingerprint("LT", 0, 1, 0, 0)
+		, std::make_pair(48900, 49000), "0.0.0.0", session::add_default_plugins
+		, alert::all_categories);
+
+	settings_pack pack;
+	pack.set_int(settings_pack::suggest_mode, settings_pack::suggest_read_cache);
+	pack.set_int(settings_pack::allowed_fast_set_size, 1);
+	// the peer must stay choked
+	pack.set_int(settings_pack::unchoke_slots_limit, 0);
+	if (evict) pack.set_int(settings_pack::cache_size, 1);
+	ses.apply_settings(pack);
+
+	// apply the global rule to the local peer too, it would ignore the
+	// unchoke slots otherwise
+	ip_filter f;
+	f.add_rule(address_v4::from_string("0.0.0.0")
+		, address_v4::from_string("255.255.255.255")
+		, 1 << lt::session::global_peer_class_id);
+	ses.set_peer_class_filter(f);
+
+	// seed mode skips the check, which would leave every piece in the cache
+	add_torrent_params p;
+	p.flags &= ~add_torrent_params::flag_paused;
+	p.flags &= ~add_torrent_params::flag_auto_managed;
+	p.flags |= add_torrent_params::flag_seed_mode;
+	p.ti = ti;
+	p.save_path = "./tmp1_cached_fast";
+	torrent_handle h = ses.add_torrent(p, ec);
+	TEST_CHECK(h.status().is_seeding);
+
+	tcp::endpoint ep(address::from_string("127.0.0.1", ec), ses.listen_port());
+	io_service ios;
+	stream_socket s(ios);
+	s.connect(ep, ec);
+	if (ec) TEST_ERROR(ec.message());
+	char recv_buffer[1000];
+	do_handshake(s, ti->info_hash(), recv_buffer);
+	send_have_none(s);
+	send_interested(s);
+
+	std::vector<int> suggested;
+	std::set<int> allowed_fast;
+	test_sleep(1000);
+	read_suggestions(s, suggested, allowed_fast);
+	// the BEP 6 set
+	TEST_EQUAL(allowed_fast.size(), 1);
+
+	// read two pieces we haven't allowed, one at a time. Each is the most
+	// recently used piece in the cache, i.e. the hottest, at the suggestion
+	// refresh that follows
+	int first_piece = -1;
+	for (int step = 0; step < 2; ++step)
+	{
+		int piece = 0;
+		while (allowed_fast.count(piece)
+			|| std::count(suggested.begin(), suggested.end(), piece))
+			++piece;
+		TEST_CHECK(piece < ti->num_pieces());
+		if (piece >= ti->num_pieces()) break;
+
+		h.read_piece(piece);
+		TEST_CHECK(wait_for_alert(ses, read_piece_alert::alert_type, "ses"));
+
+		// suggestions are refreshed every 10 seconds
+		for (int i = 0; i < 150
+			&& std::count(suggested.begin(), suggested.end(), piece) == 0; ++i)
+		{
+			test_sleep(100);
+			read_suggestions(s, suggested, allowed_fast);
+		}
+		TEST_EQUAL(std::count(suggested.begin(), suggested.end(), piece), 1);
+
+		// the allowed fast messages follow the suggestions
+		test_sleep(500);
+		read_suggestions(s, suggested, allowed_fast);
+
+		if (step == 0)
+		{
+			// the first refresh fills the peer's allowed fast set up to its
+			// cap of twice allowed_fast_set_size
+			TEST_EQUAL(allowed_fast.size(), 2);
+			TEST_EQUAL(allowed_fast.count(piece), 1);
+			first_piece = piece;
+		}
+		else if (evict)
+		{
+			// the first piece is gone from the cache, so the second one
+			// takes its place
+			TEST_EQUAL(allowed_fast.size(), 3);
+			TEST_EQUAL(allowed_fast.count(piece), 1);
+		}
+		else
+		{
+			// after that, even the hottest piece isn't allowed
+			TEST_EQUAL(allowed_fast.size(), 2);
+			TEST_EQUAL(allowed_fast.count(piece), 0);
+		}
+	}
+
+	if (evict && first_piece >= 0)
+	{
+		// we're still choked, and the evicted piece isn't allowed anymore
+		peer_request r;
+		r.piece = first_piece;
+		r.start = 0;
+		r.length = 16 * 1024;
+		send_request(s, r);
+
+		// a choked peer requesting a piece it's not allowed is rejected and
+		// disconnected. The reject may not make it out before the
+		// connection is closed, but the piece must never be sent
+		int msg = -1;
+		while (msg != 0x7 && msg != 0x10)
+		{
+			using namespace libtorrent::detail;
+			error_code ec;
+			libtorrent::asio::read(s, libtorrent::asio::buffer(recv_buffer, 4)
+				, libtorrent::asio::transfer_all(), ec);
+			if (ec) break;
+			char* ptr = recv_buffer;
+			int const len = read_int32(ptr);
+			if (len > int(sizeof(recv_buffer))) break;
+			libtorrent::asio::read(s, libtorrent::asio::buffer(recv_buffer, len)
+				, libtorrent::asio::transfer_all(), ec);
+			if (ec) break;
+			print_message(recv_buffer, len);
+			if (len > 0) msg = recv_buffer[0];
+		}
+		TEST_CHECK(msg != 0x7);
+	}
+	print_session_log(ses);
+}
+
+// plays a seed behind a link with rtt milliseconds of latency. Every request
+// is served rtt milliseconds after it arrives, at no more than rate bytes per
+// second (0 means unlimited), until duration milliseconds have passed.
+// Returns the most requests the peer had outstanding at any one time
+int serve_with_latency(stream_socket& s, int rtt, int rate, int duration)
+{
+	using namespace libtorrent::detail;
+
+	std::deque<std::pair<time_point, peer_request> > pending;
+	int max_outstanding = 0;
+	char recv_buffer[1000];
+	error_code ec;
+	time_point const end = clock_type::now() + milliseconds(duration);
+	time_point next_send = clock_type::now();
+	while (clock_type::now() < end)
+	{
+		while (s.available(ec) > 0 && !ec)
+		{
+			int len = read_message(s, recv_buffer, sizeof(recv_buffer));
+			if (len != 13 || recv_buffer[0] != 0x6) continue;
+			char const* ptr = recv_buffer + 1;
+			peer_request r;
+			r.piece = read_int32(ptr);
+			r.start = read_int32(ptr);
+			r.length = read_int32(ptr);
+			pending.push_back(std::make_pair(clock_type::now()
+				+ milliseconds(rtt), r));
+		}
+		if (ec)
+		{
+			TEST_ERROR(ec.message());
+			break;
+		}
+		max_outstanding = (std::max)(max_outstanding, int(pending.size()));
+
+		time_point const now = clock_type::now();
+		while (!pending.empty() && pending.front().first <= now
+			&& (rate == 0 || next_send <= now))
+		{
+			peer_request const& r = pending.front().second;
+			send_piece(s, r, false);
+			if (rate > 0)
+			{
+				next_send = (std::max)(next_send, now - milliseconds(100))
+					+ microseconds(boost::int64_t(r.length) * 1000000 / rate);
+			}
+			pending.pop_front();
+		}
+		test_sleep(2);
+	}
+	return max_outstanding;
+}
+
+// with bdp_request_queue, the request queue for a peer with a lot of latency
+// settles at around twice the bandwidth-delay product (rate * RTT / 16 kiB),
+// which is enough to keep it saturated. Sizing it by request_queue_time asks
+// for several times that. Either way, it's capped by max_out_request_queue
+void test_bdp_request_queue(bool bdp, int rate, int max_queue)
+{
+	std::cerr << "\n === test bdp request queue (bdp: " << bdp
+		<< " rate: " << rate << " max queue: " << max_queue << ") ===\n"
+		<< std::endl;
+
+	const int rtt = 500;
+	const int block_size = 16 * 1024;
+	boost::shared_ptr<torrent_info> ti = ::create_torrent(NULL, 64 * 1024, 128);
+	lt::session ses(fingerprint("LT", 0, 1, 0, 0)
+		, std::make_pair(48900, 49000), "0.0.0.0", session::add_default_plugins
+		, alert::error_notification | alert::status_notification);
+
+	settings_pack pack;
+	pack.set_bool(settings_pack::bdp_request_queue, bdp);
+	pack.set_int(settings_pack::max_out_request_queue, max_queue);
+	ses.apply_settings(pack);
+
+	error_code ec;
+	add_torrent_params p;
+	p.flags &= ~add_torrent_params::flag_paused;
+	p.flags &= ~add_torrent_params::flag_auto_managed;
+	p.ti = ti;
+	p.save_path = "./tmp1_bdp";
+	remove_all("./tmp1_bdp", ec);
+	ec.clear();
+	torrent_handle h = ses.add_torrent(p, ec);
+	wait_for_downloading(ses, "ses");
+
+	// wait_for_downloading() gives up after half a second without alerts.
+	// An incoming peer is rejected while the files are still being checked
+	for (int i = 0; i < 200
+		&& h.status().state != torrent_status::downloading; ++i)
+		test_sleep(50);
+	TEST_EQUAL(h.status().state, torrent_status::downloading);
+
+	io_service ios;
+	stream_socket s(ios);
+	s.connect(tcp::endpoint(address::from_string("127.0.0.1", ec)
+		, ses.listen_port()), ec);
+	if (ec) TEST_ERROR(ec.message());
+	char recv_buffer[1000];
+	do_handshake(s, ti->info_hash(), recv_buffer);
+	send_have_all(s);
+	send_unchoke(s);
+
+	// the queue follows the download rate, which is averaged over about 5
+	// seconds. It takes a few of those to settle
+	int const max_outstanding = serve_with_latency(s, rtt, rate, 20000);
+	print_session_log(ses);
+
+	std::vector<peer_info> peers;
+	h.get_peer_info(peers);
+	TEST_EQUAL(peers.size(), 1);
+	if (peers.size() != 1) return;
+	peer_info const& pi = peers[0];
+
+	log("rate: %d bdp: %d target queue: %d queue: %d max outstanding: %d"
+		, pi.payload_down_speed, pi.estimated_bdp, pi.target_dl_queue_length
+		, pi.download_queue_length, max_outstanding);
+
+	TEST_CHECK(max_outstanding <= max_queue);
+	TEST_CHECK(pi.target_dl_queue_length <= max_queue);
+
+	if (rate == 0)
+	{
+		// nothing but the latency limits the download. The queue keeps
+		// growing until it hits the cap
+		TEST_EQUAL(pi.target_dl_queue_length, max_queue);
+		TEST_EQUAL(max_outstanding, max_queue);
+		return;
+	}
+
+	int const bdp_blocks = int(boost::int64_t(rate) * rtt / 1000 / block_size);
+	if (bdp)
+	{
+		TEST_CHECK(pi.estimated_bdp >= rate * rtt / 1000 / 2);
+		TEST_CHECK(pi.estimated_bdp <= rate * rtt / 1000 * 3);
+		TEST_CHECK(pi.target_dl_queue_length >= bdp_blocks);
+		TEST_CHECK(pi.target_dl_queue_length <= bdp_blocks * 4);
+	}
+	else
+	{
+		TEST_CHECK(pi.target_dl_queue_length > bdp_blocks * 4);
+	}
+
+	// the peer is kept saturated either way
+	TEST_CHECK(pi.payload_down_speed >= rate * 3 / 4);
+}
+
 // TEST metadata extension messages and edge cases
 
 // this tests sending a request for a metadata piece that's too high. This is
@@ -785,7 +1462,16 @@ int test_main()
 	test_respect_suggest();
 	test_multiple_bitfields();
 	test_multiple_have_all();
+	test_have_run();
 	test_dont_have();
+	test_predictive_have_batched();
+	test_end_game_duplicates(false);
+	test_end_game_duplicates(true);
+	test_cached_allowed_fast(false);
+	test_cached_allowed_fast(true);
+	test_bdp_request_queue(true, 128 * 1024, 500);
+	test_bdp_request_queue(false, 128 * 1024, 500);
+	test_bdp_request_queue(true, 0, 8);
 	test_invalid_metadata_requests();
 
 	return 0;
@@ -37,6 +37,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/pe_crypto.hpp"
 #include "libtorrent/session.hpp"
 #include "libtorrent/random.hpp"
+#include "libtorrent/time.hpp"
+#include "libtorrent/hex.hpp"
 
 #include "setup_transfer.hpp"
 #include "test.hpp"
@@ -71,7 +73,8 @@ void display_settings(libtorrent::settings_pack const& s)
 void test_transfer(libtorrent::settings_pack::enc_policy policy
 	, int timeout
 	, libtorrent::settings_pack::enc_level level = libtorrent::settings_pack::pe_both
-	, bool pref_rc4 = false)
+	, bool pref_rc4 = false
+	, int network_threads = 0)
 {
 	using namespace libtorrent;
 	namespace lt = libtorrent;
@@ -86,6 +89,13 @@ void test_transfer(libtorrent::settings_pack::enc_policy policy
 	lt::session ses2(fingerprint("LT", 0, 1, 0, 0), std::make_pair(49800, 50000), "0.0.0.0", 0);
 	settings_pack s;
 	
+	s.set_int(settings_pack::network_threads, network_threads);
+	if (network_threads > 0)
+	{
+		// uTP sockets are not driven by the network threads
+		s.set_bool(settings_pack::enable_outgoing_utp, false);
+		s.set_bool(settings_pack::enable_incoming_utp, false);
+	}
 	s.set_int(settings_pack::out_enc_policy, settings_pack::pe_enabled);
 	s.set_int(settings_pack::in_enc_policy, settings_pack::pe_enabled);
 	s.set_int(settings_pack::allowed_enc_level, settings_pack::pe_both);
@@ -190,6 +200,54 @@ void test_enc_handler(libtorrent::crypto_plugin* a, libtorrent::crypto_plugin* b
 	}
 }
 
+void test_rc4_vector(char const* key, char const* plaintext, char const* hex)
+{
+	using namespace libtorrent;
+
+	int len = strlen(plaintext);
+	std::vector<char> expected(len);
+	from_hex(hex, len * 2, &expected[0]);
+
+	rc4 state;
+	rc4_init((unsigned char const*)key, strlen(key), &state);
+	std::vector<char> buf(plaintext, plaintext + len);
+	rc4_encrypt((unsigned char*)&buf[0], len, &state);
+	TEST_CHECK(buf == expected);
+}
+
+void test_rc4_throughput()
+{
+	using namespace libtorrent;
+
+#ifdef TORRENT_USE_VALGRIND
+	const int repcount = 2;
+#else
+	const int repcount = 64;
+#endif
+	const int buf_len = 1024 * 1024;
+
+	sha1_hash key = hasher("bench_key", 9).final();
+	rc4_handler rc4;
+	rc4.set_outgoing_key(&key[0], 20);
+
+	// mimic a chained_buffer's send iovec of 16 kiB blocks
+	std::vector<char> buf(buf_len);
+	std::generate(buf.begin(), buf.end(), &std::rand);
+	std::vector<boost::asio::mutable_buffer> iovec;
+
+	time_point start = clock_type::now();
+	for (int rep = 0; rep < repcount; ++rep)
+	{
+		for (int i = 0; i < buf_len; i += 0x4000)
+			iovec.push_back(boost::asio::mutable_buffer(&buf[i], 0x4000));
+		TEST_EQUAL(rc4.encrypt(iovec), buf_len);
+		TEST_CHECK(iovec.empty());
+	}
+	boost::int64_t us = total_microseconds(clock_type::now() - start);
+	fprintf(stderr, "RC4 throughput: %.1f MB/s\n"
+		, double(repcount) * buf_len / (std::max)(us, boost::int64_t(1)));
+}
+
 #endif
 
 int test_main()
@@ -231,6 +289,14 @@ int test_main()
 	rc42.set_incoming_key(&test1_key[0], 20);
 	rc42.set_outgoing_key(&test2_key[0], 20);
 	test_enc_handler(&rc41, &rc42);
+
+	// known-answer tests. The lengths exercise both the word-at-a-time
+	// path and the byte-wise tail of rc4_encrypt()
+	test_rc4_vector("Key", "Plaintext", "bbf316e8d940af0ad3");
+	test_rc4_vector("Wiki", "pedia", "1021bf0420");
+	test_rc4_vector("Secret", "Attack at dawn", "45a01f645fc35b383552544b9bf5");
+
+	test_rc4_throughput();
 	
 #ifdef TORRENT_USE_VALGRIND
 	const int timeout = 10;
@@ -249,6 +315,9 @@ int test_main()
 	test_transfer(settings_pack::pe_enabled, timeout, settings_pack::pe_rc4);
 	test_transfer(settings_pack::pe_enabled, timeout, settings_pack::pe_both, false);
 	test_transfer(settings_pack::pe_enabled, timeout, settings_pack::pe_both, true);
+
+	// with network threads, RC4 is applied by the socket jobs
+	test_transfer(settings_pack::pe_forced, timeout, settings_pack::pe_rc4, false, 2);
 #else
 	fprintf(stderr, "PE test not run because it's disabled\n");
 #endif
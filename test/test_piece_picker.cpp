@@ -1427,6 +1427,43 @@ int test_main()
 	print_availability(p);
 	TEST_CHECK(verify_availability(p, "1132123201220322"));
 
+// ========================================================
+
+	// test have run
+	print_title("test have run");
+	{
+		// a short run is applied one piece at a time
+		p = setup_picker("1111111111111111", "                ", "", "");
+		pick_pieces(p, "****************", 1, blocks_per_piece, 0);
+		std::vector<int> run;
+		run.push_back(1);
+		run.push_back(3);
+		run.push_back(14);
+		p->inc_refcount(run, &tmp8);
+		TEST_CHECK(verify_availability(p, "1212111111111121"));
+
+		// a long one marks its pieces dirty, and they're moved by the next pick
+		const int num_pieces = 1000;
+		p.reset(new piece_picker);
+		p->init(blocks_per_piece, blocks_per_piece, num_pieces);
+		bitfield all(num_pieces, true);
+		p->inc_refcount(all, &tmp0);
+		picked.clear();
+		p->pick_pieces(all, picked, 1, 0, 0, options, empty_vector, 20, pc);
+
+		run.clear();
+		for (int i = 0; i < num_pieces; ++i)
+			if (i != 7) run.push_back(i);
+		p->inc_refcount(run, &tmp1);
+		for (int i = 0; i < num_pieces; ++i)
+			TEST_EQUAL(p->get_availability(i), i == 7 ? 1 : 2);
+
+		picked.clear();
+		p->pick_pieces(all, picked, 1, 0, 0, options, empty_vector, 20, pc);
+		TEST_EQUAL(picked.size(), 1);
+		if (!picked.empty()) TEST_EQUAL(picked[0].piece_index, 7);
+	}
+
 // ========================================================
 
 	// test seed optimizaton
@@ -1858,6 +1895,395 @@ int test_main()
 	for (int i = 0; i < picked.size(); ++i)
 		TEST_EQUAL(picked[0].piece_index, 4);
 
+// ========================================================
+
+	// on large torrents, the pieces a peer has that we want are found a word
+	// at a time. Make sure the rarest (and most common) ones are still picked
+	print_title("test rarest first large torrent");
+
+	{
+		static torrent_peer* peers[9] = { &tmp0, &tmp1, &tmp2
+			, &tmp3, &tmp4, &tmp5, &tmp6, &tmp7, &tmp8 };
+		const int num_pieces = 5000;
+		p.reset(new piece_picker);
+		p->init(blocks_per_piece, blocks_per_piece, num_pieces);
+		for (int i = 0; i < num_pieces; ++i)
+		{
+			const int avail = 1 + (i * 7919) % 9;
+			for (int j = 0; j < avail; ++j) p->inc_refcount(i, peers[j]);
+		}
+
+		// a peer with just a few of the pieces
+		bitfield sparse(num_pieces, false);
+		for (int i = 3; i < num_pieces; i += 125) sparse.set_bit(i);
+
+		// pieces we have, or don't want, are never picked, even though
+		// these are among the rarest ones
+		p->we_have(3 + 125 * 3);
+		p->set_piece_priority(3 + 125 * 12, 0);
+
+		bitfield dense(num_pieces, true);
+		bitfield* bitfields[] = { &sparse, &dense };
+		for (int k = 0; k < 2; ++k)
+		{
+			bitfield const& have = *bitfields[k];
+			int min_avail = 100;
+			int max_avail = 0;
+			for (int i = 0; i < num_pieces; ++i)
+			{
+				if (!have[i] || p->have_piece(i) || p->piece_priority(i) == 0)
+					continue;
+				min_avail = (std::min)(min_avail, p->get_availability(i));
+				max_avail = (std::max)(max_avail, p->get_availability(i));
+			}
+
+			picked.clear();
+			p->pick_pieces(have, picked, 1, 0, 0, options
+				, empty_vector, 20, pc);
+			TEST_EQUAL(picked.size(), 1);
+			if (picked.empty()) continue;
+			TEST_CHECK(have[picked[0].piece_index]);
+			TEST_CHECK(!p->have_piece(picked[0].piece_index));
+			TEST_CHECK(p->piece_priority(picked[0].piece_index) > 0);
+			TEST_EQUAL(p->get_availability(picked[0].piece_index), min_avail);
+
+			picked.clear();
+			p->pick_pieces(have, picked, 1, 0, 0, options | piece_picker::reverse
+				, empty_vector, 20, pc);
+			TEST_EQUAL(picked.size(), 1);
+			if (picked.empty()) continue;
+			TEST_CHECK(have[picked[0].piece_index]);
+			TEST_EQUAL(p->get_availability(picked[0].piece_index), max_avail);
+		}
+	}
+
+	print_title("test incremental piece list update");
+
+	{
+		const int num_pieces = 3000;
+		p.reset(new piece_picker);
+		p->init(blocks_per_piece, blocks_per_piece, num_pieces);
+		for (int i = 0; i < num_pieces; ++i)
+		{
+			p->inc_refcount(i, &tmp0);
+			if (i % 5 == 0) p->inc_refcount(i, &tmp1);
+		}
+		bitfield all(num_pieces, true);
+		picked.clear();
+		p->pick_pieces(all, picked, 1, 0, 0, options, empty_vector, 20, pc);
+
+		for (int round = 0; round < 10; ++round)
+		{
+			// a bitfield with too many pieces to update them one at a time
+			// makes the piece list dirty. The changes made while it's dirty
+			// are then applied by the next pick, by moving just the pieces
+			// that changed
+			bitfield some(num_pieces, false);
+			for (int i = (round / 2) % 30; i < num_pieces; i += 30) some.set_bit(i);
+			if (round & 1) p->dec_refcount(some, &tmp2);
+			else p->inc_refcount(some, &tmp2);
+
+			int const piece = (round * 37) % num_pieces;
+			p->inc_refcount(piece, &tmp3);
+			p->dec_refcount((piece + 1) % num_pieces, &tmp0);
+			p->set_piece_priority((piece + 2) % num_pieces, round & 1 ? 1 : 0);
+			p->mark_as_downloading(piece_block((piece + 3) % num_pieces, 0), &tmp4);
+			if (round & 1) p->we_dont_have((piece - 37 + 4 + num_pieces) % num_pieces);
+			else p->we_have((piece + 4) % num_pieces);
+
+			// picking every block returns the pieces in the order of the
+			// piece list, rarest first
+			picked.clear();
+			p->pick_pieces(all, picked, num_pieces * blocks_per_piece, 0, 0
+				, options, empty_vector, 20, pc);
+
+			std::set<int> seen;
+			int num_pickable = 0;
+			int prev_avail = 0;
+			for (int i = 0; i < num_pieces; ++i)
+			{
+				if (!p->have_piece(i) && p->piece_priority(i) == 4
+					&& p->get_availability(i) > 0) ++num_pickable;
+			}
+			for (std::vector<piece_block>::iterator i = picked.begin()
+				, end(picked.end()); i != end; ++i)
+			{
+				if (!seen.insert(i->piece_index).second) continue;
+				TEST_CHECK(!p->have_piece(i->piece_index));
+				TEST_CHECK(p->piece_priority(i->piece_index) > 0);
+				if (p->piece_priority(i->piece_index) != 4) continue;
+				int const avail = p->get_availability(i->piece_index);
+				TEST_CHECK(avail >= prev_avail);
+				prev_avail = avail;
+			}
+			int num_picked_normal = 0;
+			for (std::set<int>::iterator i = seen.begin(); i != seen.end(); ++i)
+				if (p->piece_priority(*i) == 4) ++num_picked_normal;
+			TEST_EQUAL(num_picked_normal, num_pickable);
+		}
+	}
+
+	print_title("test compact");
+
+	{
+		const int num_pieces = 1000;
+		p.reset(new piece_picker);
+		p->init(blocks_per_piece, blocks_per_piece, num_pieces);
+		bitfield all(num_pieces, true);
+		p->inc_refcount(all, &tmp0);
+		for (int i = 0; i < 100; ++i)
+			p->mark_as_downloading(piece_block(i, 0), &tmp1);
+
+		// compacting while downloading doesn't free anything
+		int const downloading_size = p->memory_usage();
+		p->compact();
+		TEST_EQUAL(p->memory_usage(), downloading_size);
+		TEST_CHECK(!p->is_compact());
+
+		for (int i = 0; i < num_pieces; ++i) p->we_have(i);
+		TEST_CHECK(p->is_seeding());
+		p->compact();
+		TEST_CHECK(p->is_compact());
+
+		// all that's left is one bit per piece
+		piece_picker empty;
+		TEST_CHECK(p->memory_usage() - empty.memory_usage() <= num_pieces / 8 + 8);
+		TEST_EQUAL(p->num_pieces(), num_pieces);
+		TEST_CHECK(p->is_seeding());
+		TEST_CHECK(p->have_piece(10));
+		TEST_EQUAL(p->piece_priority(10), 4);
+		TEST_EQUAL(p->get_availability(10), 1);
+
+		// peers coming and going don't expand it
+		bitfield one(num_pieces, false);
+		one.set_bit(10);
+		p->inc_refcount(all, &tmp1);
+		p->inc_refcount(one, &tmp2);
+		p->inc_refcount(10, &tmp3);
+		p->dec_refcount(all, &tmp1);
+		TEST_CHECK(p->is_compact());
+		TEST_EQUAL(p->get_availability(10), 1);
+
+		// losing a piece brings back the full picker. Availability starts
+		// over, the peers are added back
+		p->we_dont_have(10);
+		TEST_CHECK(!p->is_compact());
+		TEST_CHECK(!p->have_piece(10));
+		TEST_CHECK(p->have_piece(11));
+		TEST_EQUAL(p->num_have(), num_pieces - 1);
+		TEST_EQUAL(p->get_availability(10), 0);
+		p->inc_refcount(all, &tmp0);
+		picked.clear();
+		p->pick_pieces(all, picked, 1, 0, 0, options, empty_vector, 20, pc);
+		TEST_EQUAL(picked.size(), 1);
+		if (!picked.empty()) TEST_EQUAL(picked[0].piece_index, 10);
+		TEST_CHECK(p->mark_as_downloading(piece_block(10, 0), &tmp1));
+		TEST_CHECK(p->is_downloading(10));
+	}
+
+	{
+		// a finished download, every other piece filtered
+		const int num_pieces = 100;
+		p.reset(new piece_picker);
+		p->init(blocks_per_piece, blocks_per_piece, num_pieces);
+		bitfield all(num_pieces, true);
+		p->inc_refcount(all, &tmp0);
+		for (int i = 0; i < num_pieces; ++i)
+		{
+			if (i & 1) p->set_piece_priority(i, 0);
+			else p->we_have(i);
+		}
+		TEST_CHECK(p->is_finished());
+		TEST_CHECK(!p->is_seeding());
+
+		// availability is kept when asked for
+		p->compact(true);
+		TEST_CHECK(!p->is_compact());
+
+		p->compact();
+		TEST_CHECK(p->is_compact());
+		TEST_CHECK(p->is_finished());
+		TEST_EQUAL(p->piece_priority(2), 4);
+		TEST_EQUAL(p->piece_priority(3), 0);
+		TEST_EQUAL(p->num_filtered(), num_pieces / 2);
+		TEST_CHECK(!p->set_piece_priority(3, 0));
+		TEST_CHECK(p->is_compact());
+
+		// wanting a piece again brings back the full picker
+		TEST_CHECK(p->set_piece_priority(3, 4));
+		TEST_CHECK(!p->is_compact());
+		TEST_CHECK(!p->is_finished());
+		TEST_EQUAL(p->piece_priority(3), 4);
+		TEST_EQUAL(p->piece_priority(5), 0);
+		TEST_EQUAL(p->num_filtered(), num_pieces / 2 - 1);
+		p->inc_refcount(all, &tmp0);
+		picked.clear();
+		p->pick_pieces(all, picked, blocks_per_piece * 2, 0, 0, options
+			, empty_vector, 20, pc);
+		TEST_EQUAL(int(picked.size()), blocks_per_piece);
+		for (int i = 0; i < int(picked.size()); ++i)
+			TEST_EQUAL(picked[i].piece_index, 3);
+
+		// pieces at other priorities can't be represented by the bitfield
+		p->we_have(3);
+		p->set_piece_priority(2, 7);
+		p->compact();
+		TEST_CHECK(!p->is_compact());
+	}
+
+// ========================================================
+
+	print_title("test downloading piece lookup");
+
+	{
+		// start downloading pieces out of order and move them through the
+		// different download states, making sure every piece can still be
+		// found in the right state
+		const int num_pieces = 1000;
+		p.reset(new piece_picker);
+		p->init(blocks_per_piece, blocks_per_piece, num_pieces);
+		bitfield all(num_pieces, true);
+		p->inc_refcount(all, &tmp0);
+
+		for (int i = 0; i < 200; ++i)
+			p->mark_as_downloading(piece_block((i * 7) % 200, 0), &tmp1);
+
+		for (int i = 0; i < 200; i += 3)
+		{
+			p->mark_as_writing(piece_block(i, 0), &tmp1);
+			for (int j = 0; j < blocks_per_piece; ++j)
+				p->mark_as_finished(piece_block(i, j), &tmp1);
+		}
+		for (int i = 1; i < 200; i += 3)
+		{
+			for (int j = 1; j < blocks_per_piece; ++j)
+				p->mark_as_downloading(piece_block(i, j), &tmp1);
+		}
+		for (int i = 2; i < 200; i += 6)
+			p->abort_download(piece_block(i, 0), &tmp1);
+
+		TEST_EQUAL(p->get_download_queue_size(), 200 - 200 / 6);
+
+		for (int i = 0; i < num_pieces; ++i)
+		{
+			piece_picker::downloading_piece st;
+			p->piece_info(i, st);
+			TEST_EQUAL(st.index, i);
+			if (i >= 200 || i % 6 == 2)
+			{
+				TEST_EQUAL(st.requested + st.finished + st.writing, 0);
+			}
+			else if (i % 3 == 0)
+			{
+				TEST_EQUAL(st.finished, blocks_per_piece);
+			}
+			else if (i % 3 == 1)
+			{
+				TEST_EQUAL(st.requested, blocks_per_piece);
+			}
+			else
+			{
+				TEST_EQUAL(st.requested, 1);
+			}
+		}
+
+		// without rarest first, partial pieces are still picked in piece
+		// order
+		picked.clear();
+		p->pick_pieces(all, picked, 1, 0, 0, piece_picker::prioritize_partials
+			, empty_vector, 20, pc);
+		TEST_EQUAL(picked.size(), 1);
+		if (!picked.empty()) TEST_CHECK(picked[0] == piece_block(5, 1));
+
+		// the download queue is reported in piece order within each
+		// download state. Only the boundaries between states go backwards
+		std::vector<piece_picker::downloading_piece> q = p->get_download_queue();
+		int descents = 0;
+		for (int i = 1; i < int(q.size()); ++i)
+			if (q[i].index < q[i - 1].index) ++descents;
+		TEST_CHECK(descents <= 3);
+
+		for (int i = 0; i < 200; i += 3)
+			p->we_have(i);
+		TEST_EQUAL(p->get_download_queue_size(), 200 - 200 / 6 - 67);
+	}
+
+// ========================================================
+
+	print_title("test prefer adjacent pieces");
+
+	{
+		// with every piece equally rare, the piece next to the one
+		// we're downloading is picked, on the side that's as rare as the
+		// rest (501 is less rare)
+		const int num_pieces = 1000;
+		p.reset(new piece_picker);
+		p->init(blocks_per_piece, blocks_per_piece, num_pieces);
+		bitfield all(num_pieces, true);
+		p->inc_refcount(all, &tmp0);
+		p->inc_refcount(501, &tmp2);
+		for (int j = 0; j < blocks_per_piece; ++j)
+			p->mark_as_downloading(piece_block(500, j), &tmp1);
+
+		counters adjacent_pc;
+		picked.clear();
+		p->pick_pieces(all, picked, blocks_per_piece, 0, &tmp3
+			, options | piece_picker::prefer_adjacent, empty_vector, 20
+			, adjacent_pc);
+		TEST_EQUAL(int(picked.size()), blocks_per_piece);
+		TEST_CHECK(verify_pick(p, picked));
+		if (!picked.empty()) TEST_EQUAL(picked[0].piece_index, 499);
+		TEST_EQUAL(adjacent_pc[counters::piece_picker_adjacent_picks], 1);
+
+		// the piece we're downloading next to has to be at least as rare as
+		// the rarest one the peer has
+		p->inc_refcount(499, &tmp2);
+		bitfield some(num_pieces, false);
+		some.set_bit(100);
+		some.set_bit(499);
+		some.set_bit(501);
+		picked.clear();
+		p->pick_pieces(some, picked, 1, 0, &tmp3
+			, options | piece_picker::prefer_adjacent, empty_vector, 20
+			, adjacent_pc);
+		TEST_EQUAL(picked.size(), 1);
+		if (!picked.empty()) TEST_EQUAL(picked[0].piece_index, 100);
+	}
+
+	{
+		// piece 4 has all its blocks written, and is waiting for the hash
+		// check. The pieces next to it are picked before the equally rare
+		// ones, whatever order the picker has shuffled them into. Without
+		// prefer_adjacent, pieces further away are picked too
+		int other_picks = 0;
+		for (int i = 0; i < 20; ++i)
+		{
+			p = setup_picker("1111111111", "          ", "", "    f     ");
+			picked = pick_pieces(p, "**********", 1, 0, 0
+				, options | piece_picker::prefer_adjacent, empty_vector);
+			TEST_EQUAL(picked.size(), 1);
+			if (!picked.empty()) TEST_CHECK(picked[0].piece_index == 3
+				|| picked[0].piece_index == 5);
+
+			picked = pick_pieces(p, "**********", 1, 0, 0, options, empty_vector);
+			TEST_EQUAL(picked.size(), 1);
+			if (!picked.empty() && picked[0].piece_index != 3
+				&& picked[0].piece_index != 5)
+				++other_picks;
+		}
+		TEST_CHECK(other_picks > 0);
+
+		// rarity still comes first, with or without prefer_adjacent
+		p = setup_picker("2222222212", "          ", "", "    f     ");
+		picked = pick_pieces(p, "**********", 1, 0, 0, options, empty_vector);
+		TEST_EQUAL(picked.size(), 1);
+		if (!picked.empty()) TEST_EQUAL(picked[0].piece_index, 8);
+		picked = pick_pieces(p, "**********", 1, 0, 0
+			, options | piece_picker::prefer_adjacent, empty_vector);
+		TEST_EQUAL(picked.size(), 1);
+		if (!picked.empty()) TEST_EQUAL(picked[0].piece_index, 8);
+	}
+
 	return 0;
 }
 
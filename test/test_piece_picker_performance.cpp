@@ -0,0 +1,166 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include "libtorrent/piece_picker.hpp"
+#include "libtorrent/bitfield.hpp"
+#include "libtorrent/performance_counters.hpp"
+#include "libtorrent/random.hpp"
+#include "libtorrent/time.hpp"
+
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace libtorrent;
+
+// measures the time it takes to pick pieces (rarest first) on a large
+// torrent, for peers with different portions of the pieces. Half of the
+// pieces are already downloaded and the rest of the swarm has about half of
+// the pieces each. It also measures picking from peers that connect and
+// disconnect in between, where most of the time is spent bringing the piece
+// list up to date with the changed availability.
+
+namespace
+{
+	void random_bitfield(bitfield& bits, int size, int permille)
+	{
+		bits.resize(size, false);
+		for (int k = 0; k < size; ++k)
+			if (int(libtorrent::random() % 1000) < permille) bits.set_bit(k);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	int num_pieces = 100000;
+	int num_peers = 50;
+	if (argc > 1) num_pieces = atoi(argv[1]);
+	if (argc > 2) num_peers = atoi(argv[2]);
+
+	if (argc > 3 || num_pieces <= 0 || num_pieces > piece_picker::max_pieces
+		|| num_peers <= 0)
+	{
+		fputs("usage: piece_picker_benchmark [num-pieces [num-peers]]\n", stderr);
+		return 1;
+	}
+
+	const int blocks_per_piece = 16;
+	const int num_pickers = 50;
+	const int rounds = 20;
+	const std::vector<int> empty_vector;
+
+	piece_picker p;
+	p.init(blocks_per_piece, blocks_per_piece, num_pieces);
+	for (int i = 0; i < num_pieces; ++i)
+		if (libtorrent::random() & 1) p.we_have(i);
+
+	// the peer pointers are only used as identities
+	std::vector<char> peer_ids(num_peers + num_pickers);
+
+	std::vector<bitfield> swarm(num_peers);
+	for (int i = 0; i < num_peers; ++i)
+	{
+		random_bitfield(swarm[i], num_pieces, 500);
+		p.inc_refcount(swarm[i], &peer_ids[i]);
+	}
+
+	// in tenths of a percent
+	const int densities[] = { 1, 10, 100, 500, 1000 };
+	for (int d = 0; d < int(sizeof(densities) / sizeof(densities[0])); ++d)
+	{
+		std::vector<bitfield> pickers(num_pickers);
+		for (int i = 0; i < num_pickers; ++i)
+		{
+			random_bitfield(pickers[i], num_pieces, densities[d]);
+			p.inc_refcount(pickers[i], &peer_ids[num_peers + i]);
+		}
+
+		counters pc;
+		std::vector<piece_block> picked;
+		int num_picked = 0;
+		time_point start = clock_type::now();
+		for (int r = 0; r < rounds; ++r)
+		{
+			for (int i = 0; i < num_pickers; ++i)
+			{
+				picked.clear();
+				p.pick_pieces(pickers[i], picked, blocks_per_piece, 0, 0
+					, piece_picker::rarest_first, empty_vector, num_peers, pc);
+				num_picked += int(picked.size());
+			}
+		}
+		time_point stop = clock_type::now();
+
+		const int num_picks = rounds * num_pickers;
+		fprintf(stderr, "peers with %5.1f%% of pieces: %7d ns per pick "
+			"(%d pieces visited, %d blocks picked per pick)\n"
+			, densities[d] / 10.f
+			, int(total_microseconds(stop - start) * 1000 / num_picks)
+			, int(pc[counters::piece_picker_rare_loops] / num_picks)
+			, num_picked / num_picks);
+
+		for (int i = 0; i < num_pickers; ++i)
+			p.dec_refcount(pickers[i], &peer_ids[num_peers + i]);
+	}
+
+	for (int d = 0; d < int(sizeof(densities) / sizeof(densities[0])); ++d)
+	{
+		std::vector<bitfield> pickers(num_pickers);
+		for (int i = 0; i < num_pickers; ++i)
+			random_bitfield(pickers[i], num_pieces, densities[d]);
+
+		counters pc;
+		std::vector<piece_block> picked;
+		time_point start = clock_type::now();
+		for (int r = 0; r < rounds; ++r)
+		{
+			for (int i = 0; i < num_pickers; ++i)
+			{
+				void* peer = &peer_ids[num_peers + i];
+				p.inc_refcount(pickers[i], peer);
+				picked.clear();
+				p.pick_pieces(pickers[i], picked, blocks_per_piece, 0, 0
+					, piece_picker::rarest_first, empty_vector, num_peers, pc);
+				p.dec_refcount(pickers[i], peer);
+			}
+		}
+		time_point stop = clock_type::now();
+
+		fprintf(stderr, "peers with %5.1f%% of pieces connecting: %7d ns per pick\n"
+			, densities[d] / 10.f
+			, int(total_microseconds(stop - start) * 1000 / (rounds * num_pickers)));
+	}
+
+	return 0;
+}
+
@@ -35,6 +35,13 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/torrent_info.hpp"
 #include "libtorrent/random.hpp"
 #include "libtorrent/create_torrent.hpp"
+#include "libtorrent/alert_types.hpp"
+#include "libtorrent/settings_pack.hpp"
+#include "libtorrent/socket.hpp"
+#include "libtorrent/io.hpp"
+#include "libtorrent/extensions.hpp"
+#include "libtorrent/peer_connection.hpp"
+#include "libtorrent/piece_picker.hpp"
 
 #include <boost/make_shared.hpp>
 
@@ -65,7 +72,8 @@ boost::shared_ptr<torrent_info> generate_torrent()
 	return boost::make_shared<torrent_info>(&buf[0], buf.size());
 }
 
-std::vector<char> generate_resume_data(torrent_info* ti)
+std::vector<char> generate_resume_data(torrent_info* ti
+	, std::string const& availability = std::string())
 {
 	entry rd;
 
@@ -74,6 +82,7 @@ std::vector<char> generate_resume_data(torrent_info* ti)
 	rd["info-hash"] = ti->info_hash().to_string();
 	rd["blocks per piece"] = (std::max)(1, ti->piece_length() / 0x4000);
 	rd["pieces"] = std::string(ti->num_pieces(), '\0');
+	if (!availability.empty()) rd["availability"] = availability;
 
 	rd["total_uploaded"] = 1337;
 	rd["total_downloaded"] = 1338;
@@ -175,6 +184,190 @@ void default_tests(torrent_status const& s)
 	TEST_EQUAL(s.completed_time, 1348);
 }
 
+void test_availability()
+{
+	settings_pack pack;
+	pack.set_int(settings_pack::alert_mask, alert::all_categories);
+	libtorrent::session ses(pack);
+
+	boost::shared_ptr<torrent_info> ti = generate_torrent();
+
+	// piece i was seen on i peers last session
+	std::string avail;
+	for (int i = 0; i < ti->num_pieces(); ++i) avail += char(i);
+
+	add_torrent_params p;
+	p.ti = ti;
+	p.save_path = ".";
+	std::vector<char> rd = generate_resume_data(ti.get(), avail);
+	p.resume_data.swap(rd);
+
+	torrent_handle h = ses.add_torrent(p);
+	TEST_CHECK(wait_for_alert(ses, torrent_checked_alert::alert_type));
+
+	// the virtual peers from the resume data are not reported
+	std::vector<int> piece_avail;
+	h.piece_availability(piece_avail);
+	TEST_EQUAL(int(piece_avail.size()), ti->num_pieces());
+	for (int i = 0; i < int(piece_avail.size()); ++i)
+		TEST_EQUAL(piece_avail[i], 0);
+
+	// but they are saved, since no peer has replaced them yet
+	h.save_resume_data();
+	alert const* a = wait_for_alert(ses, save_resume_data_alert::alert_type);
+	TEST_CHECK(a);
+	if (a == NULL) return;
+	entry const& e = *alert_cast<save_resume_data_alert>(a)->resume_data;
+	entry const* saved = e.find_key("availability");
+	TEST_CHECK(saved);
+	if (saved) TEST_EQUAL(saved->string(), avail);
+}
+
+// connects to the session as a peer supporting the fast extension, and sends
+// the handshake followed by msg (the bitfield or have-all)
+void connect_peer(stream_socket& s, libtorrent::session& ses, sha1_hash const& ih
+	, char const* pid, char const* msg, int len)
+{
+	error_code ec;
+	s.connect(tcp::endpoint(address::from_string("127.0.0.1", ec)
+		, ses.listen_port()), ec);
+	if (ec) TEST_ERROR(ec.message());
+
+	char handshake[68];
+	do_handshake(s, ih, handshake, pid);
+	libtorrent::asio::write(s, libtorrent::asio::buffer(msg, len)
+		, libtorrent::asio::transfer_all(), ec);
+	if (ec) TEST_ERROR(ec.message());
+}
+
+// waits for the real availability of piece to reach the expected value
+void wait_for_availability(torrent_handle h, int piece, int expected)
+{
+	std::vector<int> avail;
+	for (int i = 0; i < 50; ++i)
+	{
+		h.piece_availability(avail);
+		if (int(avail.size()) > piece && avail[piece] == expected) return;
+		test_sleep(100);
+	}
+	TEST_ERROR("timeout waiting for piece availability");
+}
+
+std::string saved_availability(libtorrent::session& ses, torrent_handle h)
+{
+	h.save_resume_data();
+	alert const* a = wait_for_alert(ses, save_resume_data_alert::alert_type);
+	TEST_CHECK(a);
+	if (a == NULL) return std::string();
+	entry const& e = *alert_cast<save_resume_data_alert>(a)->resume_data;
+	entry const* saved = e.find_key("availability");
+	TEST_CHECK(saved);
+	return saved ? saved->string() : std::string();
+}
+
+#ifndef TORRENT_DISABLE_EXTENSIONS
+// peers only pick pieces rarest-first when it's set in their picker options
+struct rarest_first_plugin : torrent_plugin
+{
+	virtual boost::shared_ptr<peer_plugin> new_connection(peer_connection* pc)
+	{
+		pc->picker_options(piece_picker::rarest_first);
+		return boost::shared_ptr<peer_plugin>();
+	}
+};
+
+boost::shared_ptr<torrent_plugin> create_rarest_first_plugin(torrent*, void*)
+{
+	return boost::make_shared<rarest_first_plugin>();
+}
+#endif
+
+void test_availability_decay()
+{
+	settings_pack pack;
+	pack.set_int(settings_pack::alert_mask, alert::all_categories);
+	pack.set_bool(settings_pack::allow_multiple_connections_per_ip, true);
+	// pick pieces by rarity from the start
+	pack.set_int(settings_pack::initial_picker_threshold, 0);
+	libtorrent::session ses(pack);
+
+	boost::shared_ptr<torrent_info> ti = generate_torrent();
+	TEST_EQUAL(ti->num_pieces(), 10);
+
+	// more than 10 peers were seen, so the counts are scaled down to 10
+	// levels (rounding up). Piece 3 is the rarest, then piece 7
+	int const seen[] = { 40, 40, 40, 1, 40, 40, 40, 20, 40, 40 };
+	std::string avail;
+	for (int i = 0; i < 10; ++i) avail += char(seen[i]);
+
+	add_torrent_params p;
+	p.ti = ti;
+	p.save_path = ".";
+	p.flags &= ~add_torrent_params::flag_paused;
+	p.flags &= ~add_torrent_params::flag_auto_managed;
+#ifndef TORRENT_DISABLE_EXTENSIONS
+	p.extensions.push_back(&create_rarest_first_plugin);
+#endif
+	std::vector<char> rd = generate_resume_data(ti.get(), avail);
+	p.resume_data.swap(rd);
+
+	torrent_handle h = ses.add_torrent(p);
+	TEST_CHECK(wait_for_alert(ses, torrent_checked_alert::alert_type));
+
+	TEST_EQUAL(saved_availability(ses, h)
+		, std::string("\x0a\x0a\x0a\x01\x0a\x0a\x0a\x05\x0a\x0a", 10));
+
+	// a have-all removes the top level of virtual peers, and adds itself
+	io_service ios;
+	stream_socket seed(ios);
+	connect_peer(seed, ses, ti->info_hash(), "aaaaaaaaaaaaaaaaaaaa"
+		, "\0\0\0\x01\x0e", 5);
+	wait_for_availability(h, 0, 1);
+	TEST_EQUAL(saved_availability(ses, h)
+		, std::string("\x0a\x0a\x0a\x02\x0a\x0a\x0a\x06\x0a\x0a", 10));
+
+	// so does a bitfield, here for pieces 0 and 1
+	stream_socket peer(ios);
+	connect_peer(peer, ses, ti->info_hash(), "bbbbbbbbbbbbbbbbbbbb"
+		, "\0\0\0\x03\x05\xc0\0", 7);
+	wait_for_availability(h, 0, 2);
+	TEST_EQUAL(saved_availability(ses, h)
+		, std::string("\x0a\x0a\x09\x02\x09\x09\x09\x06\x09\x09", 10));
+
+	// the distributed copies only count the real peers
+	torrent_status st = h.status(torrent_handle::query_distributed_copies);
+	TEST_EQUAL(st.distributed_full_copies, 1);
+	TEST_EQUAL(st.distributed_fraction, 200);
+
+#ifndef TORRENT_DISABLE_EXTENSIONS
+	// once the seed unchokes us, the rarest piece is requested first
+	error_code ec;
+	libtorrent::asio::write(seed, libtorrent::asio::buffer("\0\0\0\x01\x01", 5)
+		, libtorrent::asio::transfer_all(), ec);
+	if (ec) TEST_ERROR(ec.message());
+
+	char buf[1000];
+	int requested = -1;
+	for (int i = 0; i < 20 && requested == -1 && !ec; ++i)
+	{
+		libtorrent::asio::read(seed, libtorrent::asio::buffer(buf, 4)
+			, libtorrent::asio::transfer_all(), ec);
+		if (ec) break;
+		char const* ptr = buf;
+		int const len = detail::read_int32(ptr);
+		TEST_CHECK(len >= 0 && len <= int(sizeof(buf)));
+		if (len < 0 || len > int(sizeof(buf))) break;
+		libtorrent::asio::read(seed, libtorrent::asio::buffer(buf, len)
+			, libtorrent::asio::transfer_all(), ec);
+		if (ec || len != 13 || buf[0] != 6) continue;
+		ptr = buf + 1;
+		requested = detail::read_int32(ptr);
+	}
+	if (ec) TEST_ERROR(ec.message());
+	TEST_EQUAL(requested, 3);
+#endif
+}
+
 int test_main()
 {
 	torrent_status s;
@@ -337,6 +530,9 @@ int test_main()
 	TEST_EQUAL(s.connections_limit, 1345);
 	TEST_EQUAL(s.uploads_limit, 1346);
 
+	test_availability();
+	test_availability_decay();
+
 	// TODO: test all other resume flags here too. This would require returning
 	// more than just the torrent_status from test_resume_flags. Also http seeds
 	// and trackers for instance
@@ -45,6 +45,9 @@ int test_main()
 	// test explicit cache
 	test_swarm(suggest | explicit_cache);
 
+	// with HAVE messages held back until the next tick
+	test_swarm(batch_have);
+
 	return 0;
 }
 
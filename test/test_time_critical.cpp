@@ -37,6 +37,14 @@ int test_main()
 	// with time critical pieces
 	test_swarm(time_critical);
 
+	// with every piece time critical, simulating streaming playback. The
+	// deadlines are generous, none of them may be reported as missed
+	test_swarm(streaming);
+
+	// streaming with deadlines that can't be met. They have to be
+	// reported with deadline_miss_alert
+	test_swarm(streaming | missed_deadlines);
+
 	return 0;
 }
 
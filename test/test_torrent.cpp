@@ -38,6 +38,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/alert_types.hpp"
 #include "libtorrent/thread.hpp"
 #include "libtorrent/torrent.hpp"
+#include "libtorrent/disk_io_thread.hpp" // for cached_piece_info
 #include <boost/tuple/tuple.hpp>
 #include <boost/make_shared.hpp>
 #include <iostream>
@@ -265,7 +266,60 @@ int test_main()
 		}
 	}
 
-	return 0;
-}
+	{
+		// test the hottest_cached_pieces function, which picks the pieces to
+		// suggest (and offer as allowed fast) from the read cache. Pieces
+		// that have been read again since they were cached rank first, then
+		// the ones with the most blocks cached, then the most recently used
+		time_point const now = clock_type::now();
+
+		// piece, frequently used, blocks in cache, seconds since last use
+		int const cache[][4] = {
+			{ 0, 0, 4, 1 },
+			{ 1, 0, 4, 5 },
+			{ 2, 0, 1, 0 },
+			{ 3, 1, 1, 9 },
+			{ 4, 0, 2, 0 },
+			{ 5, 1, 2, 9 },
+			{ 6, 0, 0, 0 },
+		};
+
+		std::vector<cached_piece_info> pieces;
+		for (int i = 0; i < int(sizeof(cache) / sizeof(cache[0])); ++i)
+		{
+			cached_piece_info info;
+			info.storage = NULL;
+			info.piece = cache[i][0];
+			info.frequently_used = cache[i][1];
+			info.blocks.resize(4, false);
+			for (int b = 0; b < cache[i][2]; ++b) info.blocks[b] = true;
+			info.last_use = now - seconds(cache[i][3]);
+			info.kind = cached_piece_info::read_cache;
+			info.next_to_hash = 0;
+			info.need_readback = false;
+			pieces.push_back(info);
+		}
+
+		// the hottest half, rounded up
+		std::vector<int> hot = hottest_cached_pieces(pieces);
+		TEST_EQUAL(hot.size(), 4);
+		if (hot.size() == 4)
+		{
+			TEST_EQUAL(hot[0], 5);
+			TEST_EQUAL(hot[1], 3);
+			TEST_EQUAL(hot[2], 0);
+			TEST_EQUAL(hot[3], 1);
+		}
+
+		// a single cached piece is still suggested
+		pieces.resize(1);
+		hot = hottest_cached_pieces(pieces);
+		TEST_EQUAL(hot.size(), 1);
+		if (hot.size() == 1) TEST_EQUAL(hot[0], 0);
 
+		pieces.clear();
+		TEST_CHECK(hottest_cached_pieces(pieces).empty());
+	}
 
+	return 0;
+}
@@ -38,6 +38,11 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/thread.hpp"
 #include "libtorrent/time.hpp"
 #include "libtorrent/file.hpp"
+#include "libtorrent/udp_socket.hpp"
+#include "libtorrent/utp_socket_manager.hpp"
+#include "libtorrent/utp_stream.hpp"
+#include "libtorrent/performance_counters.hpp"
+#include "libtorrent/aux_/session_settings.hpp"
 #include <boost/tuple/tuple.hpp>
 #include <boost/bind.hpp>
 
@@ -50,8 +55,13 @@ using namespace libtorrent;
 namespace lt = libtorrent;
 using boost::tuples::ignore;
 
-void test_transfer()
+// the seed uses the congestion controller cc, either set as the session
+// default or on the global peer class
+void test_transfer(int cc, bool use_peer_class)
 {
+	fprintf(stderr, "\n=== congestion control: %d peer class: %d ===\n"
+		, cc, int(use_peer_class));
+
 	// in case the previous run was terminated
 	error_code ec;
 	remove_all("./tmp1_utp", ec);
@@ -76,8 +86,18 @@ void test_transfer()
 	pack.set_bool(settings_pack::prefer_udp_trackers, false);
 	pack.set_bool(settings_pack::utp_dynamic_sock_buf, true);
 	pack.set_int(settings_pack::min_reconnect_time, 1);
-	ses1.apply_settings(pack);
 	ses2.apply_settings(pack);
+	if (use_peer_class)
+	{
+		peer_class_info pci = ses1.get_peer_class(lt::session::global_peer_class_id);
+		pci.utp_congestion_control = cc;
+		ses1.set_peer_class(lt::session::global_peer_class_id, pci);
+	}
+	else
+	{
+		pack.set_int(settings_pack::utp_congestion_control, cc);
+	}
+	ses1.apply_settings(pack);
 
 	torrent_handle tor1;
 	torrent_handle tor2;
@@ -95,6 +115,12 @@ void test_transfer()
 	boost::tie(tor1, tor2, ignore) = setup_transfer(&ses1, &ses2, 0
 		, true, false, true, "_utp", 0, &t, false, &atp);
 
+	// checking the downloader's resume data takes about as long as the first
+	// poll below, wait for it to finish so that every poll sees a transfer
+	for (int i = 0; i < 100
+		&& tor2.status().state == torrent_status::checking_resume_data; ++i)
+		test_sleep(50);
+
 #ifdef TORRENT_USE_VALGRIND
 	const int timeout = 12;
 #else
@@ -123,16 +149,332 @@ void test_transfer()
 	TEST_CHECK(tor1.status().is_finished);
 	TEST_CHECK(tor2.status().is_finished);
 
+	// the seed's packet buffers should have been recycled
+	int const hits_idx = find_metric_idx("utp.utp_packet_pool_hits");
+	TEST_CHECK(hits_idx >= 0);
+	ses1.post_session_stats();
+	alert const* a = wait_for_alert(ses1, session_stats_alert::alert_type, "ses1");
+	session_stats_alert const* ss = alert_cast<session_stats_alert>(a);
+	TEST_CHECK(ss);
+	if (ss && hits_idx >= 0) TEST_CHECK(ss->values[hits_idx] > 0);
+
+	TEST_CHECK(find_metric_idx("utp.utp_zero_copy_packets_in") >= 0);
+
 	// this allows shutting down the sessions in parallel
 	p1 = ses1.abort();
 	p2 = ses2.abort();
 }
 
+void incoming_utp(boost::shared_ptr<socket_type> const&) {}
+
+// path MTUs learned by sockets are shared across the destination network
+void test_pmtu_cache()
+{
+	io_service ios;
+	udp_socket sock(ios);
+	aux::session_settings sett;
+	counters cnt;
+	utp_socket_manager sm(sett, sock, cnt, NULL, &incoming_utp);
+
+	int floor = 0;
+	int ceiling = 0;
+	TEST_CHECK(!sm.pmtu_lookup(address_v4::from_string("10.0.0.1"), floor, ceiling));
+	TEST_EQUAL(cnt[counters::utp_pmtu_cache_hits], 0);
+
+	sm.pmtu_confirm_floor(address_v4::from_string("10.0.0.1"), 1200);
+	sm.pmtu_lower_ceiling(address_v4::from_string("10.0.0.1"), 1400);
+
+	// another host on the same /24 hits the cache
+	TEST_CHECK(sm.pmtu_lookup(address_v4::from_string("10.0.0.200"), floor, ceiling));
+	TEST_EQUAL(floor, 1200);
+	TEST_EQUAL(ceiling, 1400);
+	TEST_EQUAL(cnt[counters::utp_pmtu_cache_hits], 1);
+
+	// but one on a different network doesn't
+	TEST_CHECK(!sm.pmtu_lookup(address_v4::from_string("10.0.1.1"), floor, ceiling));
+
+	// observations from other hosts on the network are merged, they don't
+	// replace each other. A smaller floor and a larger ceiling don't tell
+	// us anything new
+	sm.pmtu_confirm_floor(address_v4::from_string("10.0.0.7"), 1100);
+	sm.pmtu_lower_ceiling(address_v4::from_string("10.0.0.7"), 1450);
+	TEST_CHECK(sm.pmtu_lookup(address_v4::from_string("10.0.0.1"), floor, ceiling));
+	TEST_EQUAL(floor, 1200);
+	TEST_EQUAL(ceiling, 1400);
+
+	// a lost probe below what another host has acked isn't cached
+	sm.pmtu_lower_ceiling(address_v4::from_string("10.0.0.7"), 1150);
+	TEST_CHECK(sm.pmtu_lookup(address_v4::from_string("10.0.0.1"), floor, ceiling));
+	TEST_EQUAL(ceiling, 1400);
+
+	sm.pmtu_lower_ceiling(address_v4::from_string("10.0.0.7"), 1300);
+	TEST_CHECK(sm.pmtu_lookup(address_v4::from_string("10.0.0.1"), floor, ceiling));
+	TEST_EQUAL(floor, 1200);
+	TEST_EQUAL(ceiling, 1300);
+
+	// an acked packet above the ceiling proves the ceiling wrong
+	sm.pmtu_confirm_floor(address_v4::from_string("10.0.0.9"), 1350);
+	floor = 0;
+	ceiling = 0xffff;
+	TEST_CHECK(sm.pmtu_lookup(address_v4::from_string("10.0.0.1"), floor, ceiling));
+	TEST_EQUAL(floor, 1350);
+	TEST_EQUAL(ceiling, 0xffff);
+
+	// a ceiling on its own is cached too, but leaves the floor alone
+	sm.pmtu_lower_ceiling(address_v4::from_string("10.0.2.1"), 1000);
+	floor = 0;
+	ceiling = 0xffff;
+	TEST_CHECK(sm.pmtu_lookup(address_v4::from_string("10.0.2.1"), floor, ceiling));
+	TEST_EQUAL(floor, 0);
+	TEST_EQUAL(ceiling, 1000);
+
+#if TORRENT_USE_IPV6
+	sm.pmtu_confirm_floor(address_v6::from_string("2001:db8:1::1"), 1200);
+	sm.pmtu_lower_ceiling(address_v6::from_string("2001:db8:1::1"), 1232);
+	TEST_CHECK(sm.pmtu_lookup(address_v6::from_string("2001:db8:1:ffff::2"), floor, ceiling));
+	TEST_EQUAL(ceiling, 1232);
+	TEST_CHECK(!sm.pmtu_lookup(address_v6::from_string("2001:db8:2::1"), floor, ceiling));
+#endif
+
+	// with an expiry of 0, the cache is disabled
+	sett.set_int(settings_pack::utp_pmtu_cache_expiry, 0);
+	TEST_CHECK(!sm.pmtu_lookup(address_v4::from_string("10.0.0.1"), floor, ceiling));
+}
+
+#if TORRENT_USE_MMSG
+namespace libtorrent
+{
+	struct udp_socket_test
+	{
+		static bool gro(udp_socket& s) { return s.m_gro; }
+		static void disable_gro(udp_socket& s) { s.disable_gro(); }
+	};
+}
+
+namespace
+{
+	// takes over the receive buffer of the first packet it's passed,
+	// the way utp_stream does for packets it has to buffer
+	struct adopt_observer : udp_socket_observer
+	{
+		adopt_observer(utp_socket_manager& sm)
+			: m_sm(sm), packets(0), intact(true), adopted(0), size(0) {}
+
+		virtual bool incoming_packet(error_code const& ec
+			, udp::endpoint const&, char const* buf, int len)
+		{
+			if (ec) return false;
+			++packets;
+			for (int i = 0; i < len; ++i)
+				if (buf[i] != char(i)) intact = false;
+			lengths.push_back(len);
+			if (adopted == 0)
+			{
+				adopted = m_sm.adopt_receive_buffer(buf, len, size);
+				if (adopted)
+					TEST_CHECK((char*)adopted + utp_packet_headroom() == buf);
+			}
+			return true;
+		}
+
+		utp_socket_manager& m_sm;
+		int packets;
+		bool intact;
+		std::vector<int> lengths;
+		void* adopted;
+		int size;
+	};
+}
+
+// with recvmmsg(), every packet is received into a buffer of its own. A
+// normal sized packet is taken over instead of copied, with GRO enabled
+// too. With GRO, the slots are still sized for a single packet, coalesced
+// packets run over into a spill buffer and are put back together there
+void test_adopt_receive_buffer(bool gro)
+{
+	fprintf(stderr, "\n=== adopt receive buffer gro: %d ===\n", int(gro));
+
+	io_service ios;
+	udp_socket sock(ios);
+	aux::session_settings sett;
+	counters cnt;
+	utp_socket_manager sm(sett, sock, cnt, NULL, &incoming_utp);
+	adopt_observer obs(sm);
+	sock.subscribe(&obs);
+
+	error_code ec;
+	sock.bind(udp::endpoint(address_v4::loopback(), 0), ec);
+	TEST_CHECK(!ec);
+	if (!gro) udp_socket_test::disable_gro(sock);
+	if (gro && !udp_socket_test::gro(sock))
+	{
+		fprintf(stderr, "UDP_GRO not supported, skipping\n");
+		sock.close();
+		ios.poll(ec);
+		return;
+	}
+
+	// local_port() is the port we asked for, which is 0
+	udp::endpoint const ep(address_v4::loopback()
+		, sock.local_endpoint(ec).port());
+	TEST_CHECK(!ec);
+	char payload[4000];
+	for (int i = 0; i < int(sizeof(payload)); ++i) payload[i] = char(i);
+
+	// a small packet isn't worth the buffer it's in, the MTU sized one is
+	// taken over. A packet larger than a slot only fits with GRO
+	sock.send(ep, payload, 100, ec);
+	TEST_CHECK(!ec);
+	sock.send(ep, payload, 1400, ec);
+	TEST_CHECK(!ec);
+	if (gro)
+	{
+		sock.send(ep, payload, 4000, ec);
+		TEST_CHECK(!ec);
+	}
+	int const num_packets = gro ? 3 : 2;
+	for (int i = 0; i < 200 && obs.packets < num_packets; ++i)
+	{
+		ios.poll(ec);
+		ios.reset();
+		if (obs.packets < num_packets) test_sleep(10);
+	}
+	TEST_EQUAL(obs.packets, num_packets);
+	TEST_CHECK(obs.intact);
+	if (int(obs.lengths.size()) == num_packets)
+	{
+		TEST_EQUAL(obs.lengths[0], 100);
+		TEST_EQUAL(obs.lengths[1], 1400);
+		if (gro) TEST_EQUAL(obs.lengths[2], 4000);
+	}
+
+	TEST_CHECK(obs.adopted != NULL);
+	TEST_EQUAL(obs.size, sock.receive_buffer_size());
+	TEST_EQUAL(cnt[counters::utp_zero_copy_packets_in], 1);
+	sm.release_packet(obs.adopted, obs.size);
+
+	sock.unsubscribe(&obs);
+	sock.close();
+	for (int i = 0; i < 10; ++i)
+	{
+		ios.poll(ec);
+		ios.reset();
+	}
+}
+#endif
+
+namespace libtorrent
+{
+	struct utp_socket_manager_test
+	{
+		static void unschedule_tick(utp_socket_manager& sm, utp_socket_impl* s)
+		{ sm.unschedule_tick(s); }
+	};
+}
+
+// sockets are filed in the timer wheel by the 100 ms tick they're due at.
+// The offsets below are in the middle of a tick, to not depend on exactly
+// when the socket manager's wheel epoch was taken
+void test_timer_wheel()
+{
+	io_service ios;
+	udp_socket sock(ios);
+	aux::session_settings sett;
+	counters cnt;
+	utp_socket_manager sm(sett, sock, cnt, NULL, &incoming_utp);
+	time_point const t0 = clock_type::now();
+
+	// the sockets are never connected, so nothing ever calls back into
+	// their stream. It just has to be set
+	int stream;
+	utp_socket_impl* a = construct_utp_impl(1, 2, &stream, &sm);
+	utp_socket_impl* b = construct_utp_impl(3, 4, &stream, &sm);
+	utp_socket_impl* c = construct_utp_impl(5, 6, &stream, &sm);
+
+	// schedule
+	sm.schedule_tick(a, t0 + milliseconds(1050));
+	sm.schedule_tick(b, t0 + milliseconds(1050));
+	TEST_EQUAL(utp_timer(a).slot, 11);
+	TEST_EQUAL(utp_timer(a).index, 0);
+	TEST_EQUAL(utp_timer(b).slot, 11);
+	TEST_EQUAL(utp_timer(b).index, 1);
+
+	// a later deadline doesn't move a socket, an earlier one does
+	sm.schedule_tick(b, t0 + milliseconds(5050));
+	TEST_EQUAL(utp_timer(b).tick, 11);
+	sm.schedule_tick(b, t0 + milliseconds(550));
+	TEST_EQUAL(utp_timer(b).slot, 6);
+	TEST_EQUAL(utp_timer(b).index, 0);
+
+	// cancel
+	sm.schedule_tick(c, t0 + milliseconds(1050));
+	TEST_EQUAL(utp_timer(c).index, 1);
+	utp_socket_manager_test::unschedule_tick(sm, a);
+	TEST_EQUAL(utp_timer(a).slot, -1);
+	// the last socket in the slot takes the cancelled one's place
+	TEST_EQUAL(utp_timer(c).slot, 11);
+	TEST_EQUAL(utp_timer(c).index, 0);
+	utp_socket_manager_test::unschedule_tick(sm, a);
+	TEST_EQUAL(utp_timer(c).index, 0);
+
+	// a deadline more than a revolution away is filed in the last slot
+	sm.schedule_tick(a, t0 + seconds(1000));
+	TEST_EQUAL(utp_timer(a).tick, 1023);
+	TEST_EQUAL(utp_timer(a).slot, 1023);
+
+	// expire. The sockets haven't timed out yet, so ticking them just
+	// files them again at their timeout
+	sm.tick(t0 + milliseconds(650));
+	TEST_CHECK(utp_timer(b).slot != 6);
+	TEST_CHECK(utp_timer(b).tick > 6);
+	TEST_EQUAL(utp_timer(c).tick, 11);
+	TEST_EQUAL(utp_timer(a).tick, 1023);
+
+	// a deadline in the past is due on the next tick
+	utp_socket_manager_test::unschedule_tick(sm, b);
+	sm.schedule_tick(b, t0 - seconds(10));
+	TEST_EQUAL(utp_timer(b).tick, 7);
+
+	// wrap around. Once more than a whole revolution has passed, the wheel
+	// ticks keep counting and map onto the slots modulo their number
+	utp_socket_manager_test::unschedule_tick(sm, a);
+	utp_socket_manager_test::unschedule_tick(sm, b);
+	utp_socket_manager_test::unschedule_tick(sm, c);
+	sm.tick(t0 + milliseconds(150050));
+	sm.schedule_tick(a, t0 + milliseconds(150550));
+	TEST_EQUAL(utp_timer(a).tick, 1506);
+	TEST_EQUAL(utp_timer(a).slot, 1506 - 1024);
+	sm.schedule_tick(b, t0);
+	TEST_EQUAL(utp_timer(b).tick, 1501);
+	TEST_EQUAL(utp_timer(b).slot, 1501 - 1024);
+	// the last slot of this revolution is the one before the current tick's
+	sm.schedule_tick(c, t0 + seconds(1000));
+	TEST_EQUAL(utp_timer(c).tick, 1501 + 1023);
+	TEST_EQUAL(utp_timer(c).slot, 1501 + 1023 - 2048);
+
+	utp_socket_impl* sockets[] = { a, b, c };
+	for (int i = 0; i < 3; ++i)
+	{
+		detach_utp_impl(sockets[i]);
+		utp_socket_manager_test::unschedule_tick(sm, sockets[i]);
+		delete_utp_impl(sockets[i]);
+	}
+}
+
 int test_main()
 {
 	using namespace libtorrent;
 
-	test_transfer();
+	test_pmtu_cache();
+	test_timer_wheel();
+#if TORRENT_USE_MMSG
+	test_adopt_receive_buffer(false);
+	test_adopt_receive_buffer(true);
+#endif
+
+	test_transfer(settings_pack::utp_ledbat, false);
+	test_transfer(settings_pack::utp_cubic, false);
+	test_transfer(settings_pack::utp_bbr, true);
 	
 	error_code ec;
 	remove_all("./tmp1_utp", ec);
@@ -0,0 +1,248 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "test.hpp"
+#include "libtorrent/utp_congestion_control.hpp"
+#include "libtorrent/settings_pack.hpp"
+#include "libtorrent/random.hpp"
+#include "libtorrent/time.hpp"
+#include <boost/scoped_ptr.hpp>
+#include <queue>
+#include <vector>
+
+using namespace libtorrent;
+
+namespace
+{
+	// an emulated bottleneck link with a drop-tail queue. Packets are
+	// serialized at the link rate and arrive after the propagation delay.
+	// ACKs travel back over an uncongested path with the same delay
+	struct link_config
+	{
+		// bytes per second
+		int rate;
+		// one-way propagation delay, in microseconds
+		int delay;
+		// the capacity of the queue in front of the link, in bytes
+		int queue_size;
+		// random loss, in packets per million
+		int loss_ppm;
+	};
+
+	struct sim_result
+	{
+		// the percentage of the link capacity used in the second half of
+		// the simulation, once the controller has settled
+		int utilization;
+		// the average queuing delay (in milliseconds) in the second half
+		int queue_delay;
+	};
+
+	struct event
+	{
+		boost::int64_t time;
+		int size;
+		int queue_delay;
+		boost::int64_t send_time;
+		int seq;
+		bool lost;
+		bool operator<(event const& e) const { return time > e.time; }
+	};
+
+	char const* cc_name(int type)
+	{
+		static char const* names[] = { "ledbat", "cubic", "bbr" };
+		return names[type];
+	}
+
+	sim_result simulate(int type, link_config const& l, int duration)
+	{
+		const int mtu = 1400;
+		boost::scoped_ptr<utp_congestion_control> cc(create_utp_congestion_control(type));
+		TEST_EQUAL(cc->type(), type);
+
+		utp_cc_window w;
+		w.cwnd = boost::int64_t(mtu) << 16;
+		w.ssthres = 0;
+		w.slow_start = true;
+
+		time_point const epoch = clock_type::now();
+		boost::int64_t const end = boost::int64_t(duration) * 1000000;
+		boost::int64_t const half = end / 2;
+
+		// in-flight packets, ordered by the time their ACK (or the loss
+		// detection) reaches the sender
+		std::priority_queue<event> events;
+		boost::int64_t now = 0;
+		boost::int64_t link_free = 0;
+		int in_flight = 0;
+		int seq = 0;
+		int loss_seq = 0;
+
+		boost::int64_t delivered = 0;
+		boost::int64_t queue_delay_sum = 0;
+		boost::int64_t num_samples = 0;
+
+		while (now < end)
+		{
+			// the sender always has data to send
+			while (in_flight + mtu <= (w.cwnd >> 16))
+			{
+				event e;
+				e.size = mtu;
+				e.send_time = now;
+				e.seq = seq++;
+
+				boost::int64_t const start = (std::max)(now, link_free);
+				boost::int64_t const backlog = (start - now) * l.rate / 1000000;
+				e.queue_delay = int(start - now);
+				e.lost = backlog + mtu > l.queue_size
+					|| int(libtorrent::random() % 1000000) < l.loss_ppm;
+				if (backlog + mtu <= l.queue_size)
+					link_free = start + boost::int64_t(mtu) * 1000000 / l.rate;
+
+				// we notice a lost packet about when its ACK would have come
+				e.time = (e.lost ? start : link_free) + 2 * l.delay;
+				in_flight += mtu;
+				events.push(e);
+			}
+
+			if (events.empty())
+			{
+				// the window is smaller than one packet. This is what a
+				// uTP socket does when it times out
+				now += 1000000;
+				w.cwnd = boost::int64_t(mtu) << 16;
+				w.slow_start = true;
+				cc->on_timeout(w, epoch + microseconds(now));
+				continue;
+			}
+
+			event e = events.top();
+			events.pop();
+			now = e.time;
+			int const prev_in_flight = in_flight;
+			in_flight -= e.size;
+
+			if (e.lost)
+			{
+				// only react to one loss per round-trip
+				if (e.seq >= loss_seq)
+				{
+					cc->on_loss(w, mtu, 50, epoch + microseconds(now));
+					loss_seq = seq;
+				}
+				continue;
+			}
+
+			if (now >= half)
+			{
+				delivered += e.size;
+				queue_delay_sum += e.queue_delay;
+				++num_samples;
+			}
+
+			utp_cc_ack ack;
+			ack.now = epoch + microseconds(now);
+			ack.acked_bytes = e.size;
+			ack.in_flight = prev_in_flight;
+			ack.bytes_in_flight = in_flight;
+			ack.delay = e.queue_delay;
+			ack.rtt = int(now - e.send_time);
+			ack.mtu = mtu;
+			ack.target_delay = 100000;
+			ack.gain_factor = 3000;
+			cc->on_ack(w, ack);
+		}
+
+		sim_result ret;
+		ret.utilization = int(delivered * 100 / (boost::int64_t(l.rate) * (end - half) / 1000000));
+		ret.queue_delay = num_samples ? int(queue_delay_sum / num_samples / 1000) : 0;
+
+		utp_cc_status st;
+		cc->status(st);
+		fprintf(stderr, "%-7s rate: %d kB/s rtt: %d ms queue: %d kB loss: %d ppm"
+			" -> utilization: %d%% queue delay: %d ms cwnd: %d kB"
+			" (w_max: %d btl_bw: %d min_rtt: %d bdp: %d)\n"
+			, cc_name(type), l.rate / 1000, l.delay * 2 / 1000, l.queue_size / 1000
+			, l.loss_ppm, ret.utilization, ret.queue_delay, int(w.cwnd >> 16) / 1000
+			, st.w_max, st.btl_bw, st.min_rtt, st.bdp);
+		return ret;
+	}
+}
+
+int test_main()
+{
+	// a long-haul link between datacenters. 100 Mbit/s, 80 ms round-trip
+	// and a queue of a quarter of the bandwidth-delay product
+	link_config fat = { 12500000, 40000, 250000, 0 };
+
+	// the same link with a small amount of random (non-congestion) loss
+	link_config lossy = fat;
+	lossy.loss_ppm = 100;
+
+	// a slow access link with a deep buffer
+	link_config bloated = { 125000, 10000, 250000, 0 };
+
+	sim_result r[3][3];
+	for (int cc = settings_pack::utp_ledbat; cc <= settings_pack::utp_bbr; ++cc)
+	{
+		r[cc][0] = simulate(cc, fat, 30);
+		r[cc][1] = simulate(cc, lossy, 30);
+		r[cc][2] = simulate(cc, bloated, 30);
+	}
+
+	sim_result const* ledbat = r[settings_pack::utp_ledbat];
+	sim_result const* cubic = r[settings_pack::utp_cubic];
+	sim_result const* bbr = r[settings_pack::utp_bbr];
+
+	// on the high bandwidth-delay product link, the loss and rate based
+	// controllers fill the pipe
+	TEST_CHECK(cubic[0].utilization >= 90);
+	TEST_CHECK(bbr[0].utilization >= 90);
+	TEST_CHECK(cubic[0].utilization >= ledbat[0].utilization);
+
+	// BBR doesn't take random loss as a signal of congestion
+	TEST_CHECK(bbr[1].utilization >= 80);
+	TEST_CHECK(bbr[1].utilization > ledbat[1].utilization);
+	TEST_CHECK(bbr[1].utilization > cubic[1].utilization);
+
+	// LEDBAT keeps the delay it adds at the target delay, while CUBIC
+	// fills the buffer. BBR keeps the queue short as well
+	TEST_CHECK(ledbat[2].utilization >= 90);
+	TEST_CHECK(ledbat[2].queue_delay <= 150);
+	TEST_CHECK(cubic[2].queue_delay > ledbat[2].queue_delay);
+	TEST_CHECK(bbr[2].queue_delay < cubic[2].queue_delay);
+
+	return 0;
+}
+
@@ -0,0 +1,152 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "test.hpp"
+#include "libtorrent/utp_scoreboard.hpp"
+#include "libtorrent/time.hpp"
+#include <vector>
+
+using namespace libtorrent;
+
+namespace
+{
+	// returns the set bits in [first, last) by scanning the scoreboard
+	std::vector<int> scan(utp_scoreboard const& sb, utp_scoreboard::bit_t b
+		, int first, int last)
+	{
+		std::vector<int> ret;
+		for (int i = sb.find_next(b, first, last); i != last
+			; i = sb.find_next(b, (i + 1) & 0xffff, last))
+			ret.push_back(i);
+		return ret;
+	}
+}
+
+int test_main()
+{
+	{
+		utp_scoreboard sb;
+		TEST_EQUAL(sb.find_next(utp_scoreboard::in_flight, 10, 20), 20);
+		TEST_CHECK(!sb.test(utp_scoreboard::in_flight, 10));
+
+		for (int i = 10; i < 20; ++i) sb.insert(i, 10);
+		TEST_EQUAL(sb.capacity(), 64);
+		TEST_EQUAL(sb.find_next(utp_scoreboard::in_flight, 10, 20), 10);
+		TEST_EQUAL(sb.find_next(utp_scoreboard::need_resend, 10, 20), 20);
+
+		sb.remove(10);
+		sb.remove(11);
+		sb.remove(15);
+		TEST_EQUAL(sb.find_next(utp_scoreboard::in_flight, 10, 20), 12);
+		TEST_EQUAL(sb.find_next(utp_scoreboard::in_flight, 15, 20), 16);
+
+		sb.set(utp_scoreboard::need_resend, 18);
+		TEST_CHECK(sb.test(utp_scoreboard::need_resend, 18));
+		TEST_CHECK(sb.test(utp_scoreboard::in_flight, 18));
+		TEST_EQUAL(sb.find_next(utp_scoreboard::need_resend, 12, 20), 18);
+		TEST_EQUAL(sb.find_next(utp_scoreboard::need_resend, 12, 18), 18);
+		sb.clear(utp_scoreboard::need_resend, 18);
+		TEST_EQUAL(sb.find_next(utp_scoreboard::need_resend, 12, 20), 20);
+	}
+
+	{
+		// sequence numbers wrap around at 16 bits, and the bitmap grows
+		// while keeping the bits that are set
+		utp_scoreboard sb;
+		int const first = 0xffff - 100;
+		for (int i = 0; i < 1000; ++i)
+		{
+			int const seq = (first + i) & 0xffff;
+			sb.insert(seq, first);
+			if (i % 3 == 0) sb.set(utp_scoreboard::need_resend, seq);
+		}
+		TEST_EQUAL(sb.capacity(), 1024);
+
+		int const last = (first + 1000) & 0xffff;
+		std::vector<int> in_flight = scan(sb, utp_scoreboard::in_flight, first, last);
+		TEST_EQUAL(in_flight.size(), 1000);
+		std::vector<int> resend = scan(sb, utp_scoreboard::need_resend, first, last);
+		TEST_EQUAL(resend.size(), 334);
+		TEST_EQUAL(resend[1], (first + 3) & 0xffff);
+		TEST_EQUAL(resend[40], (first + 120) & 0xffff);
+
+		// ack everything but every 100th packet, and insert more, past
+		// the previous capacity
+		for (int i = 0; i < 1000; ++i)
+			if (i % 100) sb.remove((first + i) & 0xffff);
+		for (int i = 1000; i < 1500; ++i)
+			sb.insert((first + i) & 0xffff, first);
+		TEST_EQUAL(sb.capacity(), 2048);
+
+		in_flight = scan(sb, utp_scoreboard::in_flight, first, (first + 1500) & 0xffff);
+		TEST_EQUAL(in_flight.size(), 10 + 500);
+		TEST_EQUAL(in_flight[1], (first + 100) & 0xffff);
+		TEST_EQUAL(in_flight[10], (first + 1000) & 0xffff);
+		resend = scan(sb, utp_scoreboard::need_resend, first, (first + 1500) & 0xffff);
+		// 0, 300, 600 and 900 are the multiples of both 3 and 100
+		TEST_EQUAL(resend.size(), 4);
+	}
+
+	{
+		// microbenchmark of finding the few packets that need resending in
+		// a large window, compared to looking at every sequence number
+		const int window = 4096;
+		utp_scoreboard sb;
+		std::vector<bool> need_resend(window, false);
+		for (int i = 0; i < window; ++i) sb.insert(i, 0);
+		for (int i = 0; i < window; i += 257)
+		{
+			sb.set(utp_scoreboard::need_resend, i);
+			need_resend[i] = true;
+		}
+
+		const int rounds = 1000;
+		int found_linear = 0;
+		time_point start = clock_type::now();
+		for (int r = 0; r < rounds; ++r)
+			for (int i = 0; i < window; ++i)
+				found_linear += need_resend[(i + r) & (window - 1)] ? 1 : 0;
+		time_point mid = clock_type::now();
+		int found = 0;
+		for (int r = 0; r < rounds; ++r)
+			found += int(scan(sb, utp_scoreboard::need_resend, 0, window).size());
+		time_point stop = clock_type::now();
+
+		fprintf(stderr, "scan %d packets: linear: %d ns scoreboard: %d ns\n"
+			, window, int(total_microseconds(mid - start) * 1000 / rounds)
+			, int(total_microseconds(stop - mid) * 1000 / rounds));
+		TEST_EQUAL(found_linear, found);
+	}
+
+	return 0;
+}
+
@@ -0,0 +1,191 @@
+/*
+
+Copyright (c) 2015, Arvid Norberg.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "test.hpp"
+#include "libtorrent/utp_socket_map.hpp"
+#include "libtorrent/time.hpp"
+#include "libtorrent/random.hpp"
+#include <map>
+#include <vector>
+
+using namespace libtorrent;
+
+namespace
+{
+	// the map never dereferences the socket pointers
+	utp_socket_impl* fake_socket(int i)
+	{ return reinterpret_cast<utp_socket_impl*>(std::size_t(i + 1) * 8); }
+
+	udp::endpoint ep(int i)
+	{
+		return udp::endpoint(address_v4((10 << 24) | (i & 0xffffff))
+			, 1024 + (i % 50000));
+	}
+
+	// the socket lookup in utp_socket_manager::incoming_packet() before the
+	// hash table was introduced. Sockets were indexed by receive ID only,
+	// and the endpoint compared for every socket with that ID
+	struct multimap_lookup
+	{
+		struct entry { udp::endpoint ep; utp_socket_impl* sock; };
+		typedef std::multimap<boost::uint16_t, entry> map_t;
+		map_t m;
+
+		void insert(udp::endpoint const& e, boost::uint16_t id, utp_socket_impl* s)
+		{
+			entry en = { e, s };
+			m.insert(std::make_pair(id, en));
+		}
+
+		utp_socket_impl* find(udp::endpoint const& e, boost::uint16_t id) const
+		{
+			std::pair<map_t::const_iterator, map_t::const_iterator> r = m.equal_range(id);
+			for (; r.first != r.second; ++r.first)
+				if (r.first->second.ep == e) return r.first->second.sock;
+			return NULL;
+		}
+	};
+
+	template <class Map>
+	int benchmark(Map const& m, std::vector<std::pair<udp::endpoint, boost::uint16_t> > const& keys
+		, char const* name)
+	{
+		const int rounds = 20;
+		int found = 0;
+		time_point start = clock_type::now();
+		for (int r = 0; r < rounds; ++r)
+		{
+			for (int i = 0; i < int(keys.size()); ++i)
+				found += m.find(keys[i].first, keys[i].second) != NULL;
+		}
+		time_point stop = clock_type::now();
+		fprintf(stderr, "%-10s %d sockets: %4d ns per packet\n", name, int(keys.size())
+			, int(total_microseconds(stop - start) * 1000 / (rounds * keys.size())));
+		return found / rounds;
+	}
+}
+
+int test_main()
+{
+	{
+		utp_socket_map m;
+		TEST_CHECK(m.empty());
+		TEST_CHECK(m.find(ep(1), 1) == NULL);
+
+		// same ID, different endpoints
+		m.insert(ep(1), 10, fake_socket(1));
+		m.insert(ep(2), 10, fake_socket(2));
+		// same endpoint, different IDs
+		m.insert(ep(1), 11, fake_socket(3));
+		TEST_EQUAL(m.size(), 3);
+
+		TEST_CHECK(m.find(ep(1), 10) == fake_socket(1));
+		TEST_CHECK(m.find(ep(2), 10) == fake_socket(2));
+		TEST_CHECK(m.find(ep(1), 11) == fake_socket(3));
+		TEST_CHECK(m.find(ep(2), 11) == NULL);
+
+		TEST_CHECK(m.erase(ep(1), 10, fake_socket(1)));
+		TEST_CHECK(!m.erase(ep(1), 10, fake_socket(1)));
+		TEST_CHECK(m.find(ep(1), 10) == NULL);
+		TEST_CHECK(m.find(ep(2), 10) == fake_socket(2));
+		TEST_EQUAL(m.size(), 2);
+
+		// sockets that haven't connected yet share the unspecified endpoint
+		m.insert(udp::endpoint(), 10, fake_socket(4));
+		m.insert(udp::endpoint(), 10, fake_socket(5));
+		TEST_CHECK(m.erase(udp::endpoint(), 10, fake_socket(5)));
+		TEST_CHECK(m.find(udp::endpoint(), 10) == fake_socket(4));
+	}
+
+	{
+		// grow the table, erase every other socket while iterating over
+		// the slots, and make sure the rest can still be found
+		utp_socket_map m;
+		const int num = 5000;
+		for (int i = 0; i < num; ++i)
+			m.insert(ep(i), boost::uint16_t(i & 0xff), fake_socket(i));
+		TEST_EQUAL(m.size(), num);
+
+		int erased = 0;
+		for (int i = 0; i < m.num_slots(); ++i)
+		{
+			utp_socket_impl* s = m.slot(i);
+			if (s == NULL) continue;
+			int const idx = int(reinterpret_cast<std::size_t>(s) / 8) - 1;
+			if (idx & 1) continue;
+			m.erase_slot(i);
+			++erased;
+		}
+		TEST_EQUAL(erased, num / 2);
+		TEST_EQUAL(m.size(), num - erased);
+
+		int errors = 0;
+		for (int i = 0; i < num; ++i)
+		{
+			utp_socket_impl* s = m.find(ep(i), boost::uint16_t(i & 0xff));
+			if (s != ((i & 1) ? fake_socket(i) : NULL)) ++errors;
+		}
+		TEST_EQUAL(errors, 0);
+
+		// inserting after erasing reuses tombstones and rehashes
+		for (int i = num; i < num * 2; ++i)
+			m.insert(ep(i), boost::uint16_t(i & 0xff), fake_socket(i));
+		TEST_CHECK(m.find(ep(num * 2 - 1), boost::uint16_t((num * 2 - 1) & 0xff))
+			== fake_socket(num * 2 - 1));
+		TEST_CHECK(m.find(ep(1), 1) == fake_socket(1));
+	}
+
+	// microbenchmark of incoming packet dispatch. Every packet is looked
+	// up by its source endpoint and connection ID. With random IDs, many
+	// thousands of sockets make the 16 bit IDs collide
+	for (int num = 1000; num <= 50000; num *= 7)
+	{
+		utp_socket_map m;
+		multimap_lookup mm;
+		std::vector<std::pair<udp::endpoint, boost::uint16_t> > keys;
+		for (int i = 0; i < num; ++i)
+		{
+			boost::uint16_t const id = libtorrent::random() & 0xffff;
+			m.insert(ep(i), id, fake_socket(i));
+			mm.insert(ep(i), id, fake_socket(i));
+			keys.push_back(std::make_pair(ep(i), id));
+		}
+		// packets arrive in arbitrary order
+		std::random_shuffle(keys.begin(), keys.end());
+
+		TEST_EQUAL(benchmark(mm, keys, "multimap"), num);
+		TEST_EQUAL(benchmark(m, keys, "hash"), num);
+	}
+
+	return 0;
+}
+
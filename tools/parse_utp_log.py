@@ -78,7 +78,13 @@ metrics = {
 	'their_actual_delay':['their actual delay (us)', 'x1y1', delay_samples],
 	'actual_delay':['actual_delay (us)', 'x1y1', delay_samples],
 	'send_buffer':['send buffer size (B)', 'x1y1', 'lines'],
-	'recv_buffer':['receive buffer size (B)', 'x1y1', 'lines']
+	'recv_buffer':['receive buffer size (B)', 'x1y1', 'lines'],
+
+	'cc_mode':['congestion controller mode', 'x1y2', 'steps'],
+	'cc_wmax':['cubic W_max (B)', 'x1y1', 'steps'],
+	'cc_btlbw':['bbr bottleneck bandwidth (B/s)', 'x1y1', 'steps'],
+	'cc_min_rtt':['bbr min rtt (ms)', 'x1y2', 'steps'],
+	'cc_bdp':['bbr bandwidth-delay product (B)', 'x1y1', 'steps']
 }
 
 histogram_quantization = 1
@@ -245,6 +251,12 @@ plot = [
 		'title': 'our_delay_base',
 		'y1': 'Time (us)',
 		'y2': ''
+	},
+	{
+		'data': ['max_window', 'cur_window', 'ssthres', 'cc_wmax', 'cc_bdp', 'rtt', 'cc_min_rtt'],
+		'title': 'congestion-control',
+		'y1': 'Bytes',
+		'y2': 'Time (ms)'
 	}
 ]
 